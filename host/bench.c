@@ -0,0 +1,310 @@
+/*
+	This code is in the Public Domain (or CC0 licensed, at your option.)
+
+	Unless required by applicable law or agreed to in writing, this
+	software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+	CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <getopt.h>
+#include <unistd.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_err.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "mqtt_client.h"
+
+#include "mqtt.h"
+#include "frame.h"
+#include "bulk.h"
+#include "harness.h"
+
+static const char *TAG = "BENCH";
+
+/*
+ * End-to-end benchmark of the bridge on the host.
+ * The bridge tasks run unchanged on the host port, with the simulated bus
+ * or a SocketCAN interface on one side and a local broker on the other.
+ * Each test frame carries its sequence number in the first 4 data bytes,
+ * so the other side finds the time it was sent.
+ *
+ * up:   frame on the bus -> twai_task -> mqtt_pub_task -> broker -> bench subscriber
+ * down: bench publisher -> broker -> mqtt_sub_task -> twai_tx_task -> frame on the bus
+ *
+ * With -k a second publisher keeps the bulk topic busy during the run,
+ * and the down latency is also given for each TX priority class.
+ */
+
+typedef struct {
+	const char *name;
+	uint32_t sent;
+	uint32_t refused;		// not accepted by the driver receive queue
+	volatile uint32_t received;
+	volatile bool warm;
+	int64_t first_sent;
+	volatile int64_t last_received;
+	int64_t *sent_at;		// per sequence number
+	int64_t *latency;		// per sequence number, -1 until received
+} DIRECTION_t;
+
+static DIRECTION_t direction[2] = {
+	{ .name = "up (CAN to MQTT)" },
+	{ .name = "down (MQTT to CAN)" },
+};
+static uint32_t nframes = 10000;
+
+// Bulk load, in messages of BULK_MESSAGE_FRAMES records
+#define	BULK_MESSAGE_FRAMES	64
+#define	BULK_CANID		0x7FF
+static double bulk_rate;
+static volatile bool bulk_running;
+static uint32_t bulk_published;
+
+static void on_frame(int dir, uint32_t sequence)
+{
+	DIRECTION_t *d = &direction[dir];
+	int64_t now = esp_timer_get_time();
+	if (sequence == HARNESS_WARMUP) {
+		d->warm = true;
+		return;
+	}
+	if (sequence >= nframes || d->sent_at[sequence] == 0) return;
+	// QoS 1 may deliver a frame twice
+	if (d->latency[sequence] >= 0) return;
+	d->latency[sequence] = now - d->sent_at[sequence];
+	d->last_received = now;
+	d->received++;
+}
+
+// Sends one frame into the bridge, false when the bridge refused it
+static bool send_frame(esp_mqtt_client_handle_t client, int dir, uint32_t sequence, bool wait)
+{
+	uint8_t data[8];
+	harness_fill_data(data, sequence);
+	if (dir == HARNESS_UP) {
+		TOPIC_t *row = &publish[sequence % npublish];
+		// Without a rate limit the generator waits for room, like a bus at full load
+		while (harness_inject(row->canid, row->frame, data) == false) {
+			if (wait == false) return false;
+			usleep(20);
+		}
+		return true;
+	}
+
+	char topic[128];
+	harness_command_topic(&subscribe[sequence % nsubscribe], topic, sizeof(topic));
+	return (esp_mqtt_client_publish(client, topic, (char *)data, sizeof(data), 0, 0) >= 0);
+}
+
+static bool send_warmup(void *arg, int dir, uint32_t sequence)
+{
+	return send_frame(arg, dir, sequence, false);
+}
+
+static int compare_latency(const void *a, const void *b)
+{
+	int64_t latency1 = *(const int64_t *)a;
+	int64_t latency2 = *(const int64_t *)b;
+	return (latency1 > latency2) - (latency1 < latency2);
+}
+
+static void bulk_load_task(void *pvParameters)
+{
+	esp_mqtt_client_handle_t client = pvParameters;
+	static uint8_t message[BULK_MESSAGE_FRAMES * (BULK_HEADER_LEN + 8)];
+	int len = 0;
+	for (int i=0;i<BULK_MESSAGE_FRAMES;i++) {
+		uint8_t *record = &message[len];
+		record[0] = (BULK_CANID >> 24) & 0xFF;
+		record[1] = (BULK_CANID >> 16) & 0xFF;
+		record[2] = (BULK_CANID >> 8) & 0xFF;
+		record[3] = BULK_CANID & 0xFF;
+		record[4] = 0;
+		record[5] = 8;
+		memset(&record[BULK_HEADER_LEN], i, 8);
+		len += BULK_HEADER_LEN + 8;
+	}
+	int64_t due = esp_timer_get_time();
+	while (bulk_running) {
+		int64_t wait = due - esp_timer_get_time();
+		if (wait > 0) usleep(wait);
+		if (esp_mqtt_client_publish(client, CONFIG_BULK_TOPIC, (char *)message, len, 0, 0) >= 0) {
+			bulk_published += BULK_MESSAGE_FRAMES;
+		}
+		due += (int64_t)(BULK_MESSAGE_FRAMES / bulk_rate * 1000000.0);
+	}
+	vTaskDelete(NULL);
+}
+
+static void print_percentiles(const char *label, int64_t *sorted, uint32_t count)
+{
+	qsort(sorted, count, sizeof(int64_t), compare_latency);
+	printf("  %slatency us p50=%"PRId64" p90=%"PRId64" p99=%"PRId64" max=%"PRId64"\n", label,
+		sorted[count * 50 / 100], sorted[count * 90 / 100], sorted[count * 99 / 100], sorted[count - 1]);
+}
+
+// Down latency of the rows of each TX priority class
+static void report_classes(DIRECTION_t *dir)
+{
+	int64_t *sorted = malloc(sizeof(int64_t) * (dir->received + 1));
+	configASSERT( sorted );
+	for (int priority=0;priority<TX_PRIORITY_CLASSES;priority++) {
+		uint32_t count = 0;
+		for (uint32_t i=0;i<nframes;i++) {
+			if (dir->latency[i] < 0 || count >= dir->received) continue;
+			if (subscribe[i % nsubscribe].priority == priority) sorted[count++] = dir->latency[i];
+		}
+		if (count == 0) continue;
+		char label[32];
+		snprintf(label, sizeof(label), "class %d frames=%"PRIu32" ", priority, count);
+		print_percentiles(label, sorted, count);
+	}
+	free(sorted);
+	for (int priority=0;priority<TX_PRIORITY_CLASSES;priority++) {
+		TX_STATS_t stats;
+		twai_tx_get_stats(priority, &stats);
+		printf("  class %d queue sent=%"PRIu32" dropped=%"PRIu32" promoted=%"PRIu32" wait avg=%"PRIu64"us max=%"PRIu32"us\n",
+			priority, stats.sent, stats.dropped, stats.promoted,
+			stats.sent ? stats.total_wait_us / stats.sent : 0, stats.max_wait_us);
+	}
+}
+
+static void report(DIRECTION_t *dir)
+{
+	printf("%s\n", dir->name);
+	if (dir->sent == 0) {
+		printf("  no frames sent\n");
+		return;
+	}
+	int64_t *sorted = malloc(sizeof(int64_t) * (dir->received + 1));
+	configASSERT( sorted );
+	uint32_t count = 0;
+	for (uint32_t i=0;i<nframes;i++) {
+		if (dir->latency[i] >= 0 && count < dir->received) sorted[count++] = dir->latency[i];
+	}
+	double elapsed = (dir->last_received - dir->first_sent) / 1000000.0;
+	uint32_t lost = dir->sent - count;
+	printf("  sent=%"PRIu32" received=%"PRIu32" lost=%"PRIu32" (refused by driver queue=%"PRIu32") drop rate=%.3f%%\n",
+		dir->sent, count, lost, dir->refused, 100.0 * lost / dir->sent);
+	if (count != 0) {
+		printf("  throughput=%.1f frames/s\n", count / elapsed);
+		print_percentiles("", sorted, count);
+	}
+	free(sorted);
+}
+
+static void usage(const char *program)
+{
+	printf("usage: %s [options]\n", program);
+	harness_usage();
+	printf("  -m MODE    up, down or both (default both)\n");
+	printf("  -n COUNT   frames per direction (default 10000)\n");
+	printf("  -r RATE    frames per second per direction, 0 sends as fast as the bridge accepts (default 1000)\n");
+	printf("  -B BURST   frames sent back to back, at the same average rate (default 1)\n");
+	printf("  -k RATE    bulk frames per second published on the bulk topic during the run (default 0)\n");
+}
+
+int main(int argc, char *argv[])
+{
+	char *mode = "both";
+	double rate = 1000;
+	uint32_t burst = 1;
+	esp_log_level_set("*", ESP_LOG_WARN);
+
+	int opt;
+	while ((opt = getopt(argc, argv, HARNESS_OPTIONS "m:n:r:B:k:h")) != -1) {
+		if (harness_option(opt, optarg)) continue;
+		switch (opt) {
+			case 'm': mode = optarg; break;
+			case 'n': nframes = strtoul(optarg, NULL, 10); break;
+			case 'r': rate = atof(optarg); break;
+			case 'B': burst = strtoul(optarg, NULL, 10); break;
+			case 'k': bulk_rate = atof(optarg); break;
+			default: usage(argv[0]); return 1;
+		}
+	}
+	bool up = (strcmp(mode, "up") == 0 || strcmp(mode, "both") == 0);
+	bool down = (strcmp(mode, "down") == 0 || strcmp(mode, "both") == 0);
+	if ((up == false && down == false) || nframes == 0 || burst == 0 || bulk_rate < 0) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	for (int dir=0;dir<2;dir++) {
+		direction[dir].sent_at = calloc(nframes, sizeof(int64_t));
+		direction[dir].latency = malloc(nframes * sizeof(int64_t));
+		configASSERT( direction[dir].sent_at && direction[dir].latency );
+		for (uint32_t i=0;i<nframes;i++) direction[dir].latency[i] = -1;
+	}
+
+	harness_receive_frames(on_frame);
+	esp_mqtt_client_handle_t client = harness_start(NULL);
+	if (client == NULL) return 1;
+	for (int dir=0;dir<2;dir++) {
+		if ((dir == HARNESS_UP && up == false) || (dir == HARNESS_DOWN && down == false)) continue;
+		if (harness_warmup(send_warmup, client, dir, &direction[dir].warm) == false) {
+			ESP_LOGE(TAG, "The bridge did not pass a frame %s", direction[dir].name);
+			return 1;
+		}
+	}
+
+	printf("can2mqtt rows=%d mqtt2can rows=%d mode=%s frames=%"PRIu32" rate=%.0f/s burst=%"PRIu32" bulk=%.0f/s\n",
+		npublish, nsubscribe, mode, nframes, rate, burst, bulk_rate);
+	if (bulk_rate > 0) {
+		bulk_running = true;
+		xTaskCreate(bulk_load_task, "bulk_load", 1024*4, client, 2, NULL);
+	}
+
+	// Bursts start on a fixed schedule, so a slow bridge does not lower the offered load
+	int64_t start = esp_timer_get_time();
+	for (uint32_t sequence=0;sequence<nframes;sequence++) {
+		if (rate > 0 && sequence % burst == 0) {
+			int64_t due = start + (int64_t)(sequence / rate * 1000000.0);
+			int64_t wait = due - esp_timer_get_time();
+			if (wait > 0) usleep(wait);
+		}
+		for (int dir=0;dir<2;dir++) {
+			if ((dir == HARNESS_UP && up == false) || (dir == HARNESS_DOWN && down == false)) continue;
+			DIRECTION_t *d = &direction[dir];
+			int64_t now = esp_timer_get_time();
+			if (d->sent == 0) d->first_sent = now;
+			d->sent_at[sequence] = now;
+			d->sent++;
+			if (send_frame(client, dir, sequence, rate <= 0) == false) {
+				d->sent_at[sequence] = 0;
+				d->refused++;
+			}
+		}
+	}
+	bulk_running = false;
+
+	// Wait until every frame is out or nothing has arrived for a second
+	int64_t idle_since = esp_timer_get_time();
+	uint32_t last_total = 0;
+	while (esp_timer_get_time() - idle_since < 1000000) {
+		uint32_t total = direction[HARNESS_UP].received + direction[HARNESS_DOWN].received;
+		uint32_t expected = direction[HARNESS_UP].sent - direction[HARNESS_UP].refused
+			+ direction[HARNESS_DOWN].sent - direction[HARNESS_DOWN].refused;
+		if (total == expected) break;
+		if (total != last_total) {
+			last_total = total;
+			idle_since = esp_timer_get_time();
+		}
+		usleep(10000);
+	}
+
+	if (up) report(&direction[HARNESS_UP]);
+	if (down) {
+		report(&direction[HARNESS_DOWN]);
+		report_classes(&direction[HARNESS_DOWN]);
+	}
+	if (bulk_rate > 0) printf("bulk frames published=%"PRIu32"\n", bulk_published);
+	esp_mqtt_client_stop(client);
+	return 0;
+}
@@ -0,0 +1,126 @@
+/*
+	This code is in the Public Domain (or CC0 licensed, at your option.)
+
+	Unless required by applicable law or agreed to in writing, this
+	software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+	CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <getopt.h>
+
+#include "esp_timer.h"
+
+#include "mqtt.h"
+#include "payload.h"
+
+/*
+ * Cost per frame of each payload encoding of can2mqtt.csv.
+ * The encoders run alone, without the bridge tasks and the broker,
+ * for an empty, a classic and a 64-byte CAN FD frame.
+ * json(printf) builds the same JSON record with snprintf for comparison.
+ */
+
+static uint32_t nframes = 1000000;
+
+// Keeps the compiler from dropping the encoder calls
+static volatile uint32_t sink;
+
+static void fill_record(MQTT_t *mqttBuf, int16_t data_len)
+{
+	memset(mqttBuf, 0, sizeof(MQTT_t));
+	mqttBuf->topic_type = PUBLISH;
+	mqttBuf->canid = 0x18FEF100;
+	mqttBuf->timestamp = 123456789012;
+	mqttBuf->data_len = data_len;
+	for (int i=0;i<data_len;i++) mqttBuf->data[i] = i * 37;
+}
+
+static int encode_printf(const MQTT_t *mqttBuf, char *buf)
+{
+	char hex[CANFD_MAX_DATA_LEN * 2 + 1];
+	for (int i=0;i<mqttBuf->data_len;i++) sprintf(&hex[i*2], "%02X", (uint8_t)mqttBuf->data[i]);
+	hex[mqttBuf->data_len * 2] = 0;
+	return snprintf(buf, PAYLOAD_MAX_LEN, "{\"id\":%"PRIu32",\"dlc\":%d,\"data\":\"%s\",\"ts\":%"PRId64"}",
+		mqttBuf->canid, mqttBuf->data_len, hex, mqttBuf->timestamp);
+}
+
+// Nanoseconds per frame, the record changes a little every frame like a live signal
+static double measure(int encoding, MQTT_t *mqttBuf, int *len)
+{
+	static char buf[PAYLOAD_MAX_LEN];
+	uint32_t total = 0;
+	int64_t start = esp_timer_get_time();
+	for (uint32_t i=0;i<nframes;i++) {
+		mqttBuf->timestamp += 997;
+		if (mqttBuf->data_len != 0) mqttBuf->data[0] = i;
+		if (encoding < 0) {
+			total += encode_printf(mqttBuf, buf);
+		} else {
+			total += payload_encode(encoding, mqttBuf, buf);
+		}
+		total += buf[0];
+	}
+	int64_t elapsed = esp_timer_get_time() - start;
+	sink = total;
+	*len = (encoding < 0) ? encode_printf(mqttBuf, buf) : payload_encode(encoding, mqttBuf, buf);
+	return (double)elapsed * 1000 / nframes;
+}
+
+static void print_sample(int encoding, MQTT_t *mqttBuf)
+{
+	char buf[PAYLOAD_MAX_LEN];
+	int len = payload_encode(encoding, mqttBuf, buf);
+	printf("  %-12s", payload_name(encoding));
+	if (encoding == PAYLOAD_HEX || encoding == PAYLOAD_JSON) {
+		printf("%.*s\n", len, buf);
+		return;
+	}
+	for (int i=0;i<len;i++) printf("%02x", (uint8_t)buf[i]);
+	printf("\n");
+}
+
+static void usage(const char *program)
+{
+	printf("usage: %s [options]\n", program);
+	printf("  -n COUNT   frames encoded per encoding and length (default %"PRIu32")\n", nframes);
+}
+
+int main(int argc, char *argv[])
+{
+	int opt;
+	while ((opt = getopt(argc, argv, "n:h")) != -1) {
+		switch (opt) {
+			case 'n': nframes = strtoul(optarg, NULL, 10); break;
+			default: usage(argv[0]); return 1;
+		}
+	}
+	if (nframes == 0) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	static const int16_t lengths[] = { 0, CAN_MAX_DATA_LEN, CANFD_MAX_DATA_LEN };
+	MQTT_t mqttBuf;
+	fill_record(&mqttBuf, CAN_MAX_DATA_LEN);
+	printf("payload of an 8-byte frame\n");
+	for (int encoding=0;encoding<PAYLOAD_ENCODINGS;encoding++) print_sample(encoding, &mqttBuf);
+
+	printf("\n%-14s", "encoding");
+	for (int j=0;j<sizeof(lengths)/sizeof(lengths[0]);j++) printf("  %2d bytes ns/frame (len)", lengths[j]);
+	printf("\n");
+	for (int encoding=-1;encoding<PAYLOAD_ENCODINGS;encoding++) {
+		printf("%-14s", (encoding < 0) ? "json(printf)" : payload_name(encoding));
+		for (int j=0;j<sizeof(lengths)/sizeof(lengths[0]);j++) {
+			fill_record(&mqttBuf, lengths[j]);
+			int len;
+			double ns = measure(encoding, &mqttBuf, &len);
+			printf("  %16.1f (%3d)", ns, len);
+		}
+		printf("\n");
+	}
+	return 0;
+}
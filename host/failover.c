@@ -0,0 +1,306 @@
+/*
+	This code is in the Public Domain (or CC0 licensed, at your option.)
+
+	Unless required by applicable law or agreed to in writing, this
+	software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+	CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_err.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "mqtt_client.h"
+
+#include "mqtt.h"
+#include "frame.h"
+#include "harness.h"
+
+static const char *TAG = "FAILOVER";
+
+/*
+ * Failover time of the bridge between two brokers.
+ * The bridge reaches the first broker (-b/-P) through a TCP proxy in this
+ * process and the second one (-F) directly. After the warmup the proxy drops
+ * every connection and refuses new ones, as a broker that went down would.
+ * Frames flow in both directions all along, each with a sequence number, so
+ * the run shows how long each direction was cut off and what was lost or
+ * delivered twice. The harness clients are connected to both brokers directly.
+ */
+
+typedef struct {
+	const char *name;
+	double rate;
+	volatile bool warm;
+	uint32_t sequence;	// frames sent
+	uint8_t *count;		// deliveries of each sequence number
+	int64_t *sent_at;
+	uint32_t first_after_cut;	// sequence number of the first frame sent after the cut
+	int64_t back_at;	// time the first frame sent after the cut was delivered
+	int64_t last_at;	// time of the last delivery
+	int64_t max_gap;	// longest time without a delivery after the cut
+} DIRECTION_t;
+
+static DIRECTION_t direction[2] = {
+	{ .name = "up" },
+	{ .name = "down" },
+};
+static uint32_t capacity;
+
+static volatile bool cut;
+static volatile int64_t cut_at;
+static int proxy_port = 18830;
+static char upstream_host[128];
+static int upstream_port;
+
+static void on_frame(int index, uint32_t sequence)
+{
+	DIRECTION_t *dir = &direction[index];
+	if (sequence == HARNESS_WARMUP) {
+		dir->warm = true;
+		return;
+	}
+	if (sequence >= capacity) return;
+	int64_t now = esp_timer_get_time();
+	__atomic_fetch_add(&dir->count[sequence], 1, __ATOMIC_RELAXED);
+	// The MQTT port and the simulated bus each deliver from one task per direction
+	if (cut && dir->last_at != 0 && now - dir->last_at > dir->max_gap) dir->max_gap = now - dir->last_at;
+	dir->last_at = now;
+	if (cut && dir->back_at == 0 && sequence >= dir->first_after_cut) dir->back_at = now;
+}
+
+// Commands go to both brokers, the bridge takes them from the one it is subscribed on
+static bool send_frame(void *arg, int dir, uint32_t sequence)
+{
+	esp_mqtt_client_handle_t *clients = arg;
+	uint8_t data[8];
+	harness_fill_data(data, sequence);
+	if (dir == HARNESS_UP) {
+		TOPIC_t *row = &publish[sequence % npublish];
+		return harness_inject(row->canid, row->frame, data);
+	}
+	char topic[128];
+	harness_command_topic(&subscribe[0], topic, sizeof(topic));
+	bool sent = false;
+	for (int i=0;i<2;i++) {
+		if (esp_mqtt_client_publish(clients[i], topic, (char *)data, sizeof(data), 1, 0) >= 0) sent = true;
+	}
+	return sent;
+}
+
+static void send_next(esp_mqtt_client_handle_t *clients, DIRECTION_t *dir, int index)
+{
+	if (dir->sequence >= capacity) return;
+	uint32_t sequence = dir->sequence++;
+	dir->sent_at[sequence] = esp_timer_get_time();
+	send_frame(clients, index, sequence);
+}
+
+// Relays one connection until either side closes it or the proxy is cut
+static void relay_task(void *pvParameters)
+{
+	int down = (int)(intptr_t)pvParameters;
+	int up = socket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(upstream_port) };
+	inet_pton(AF_INET, upstream_host, &addr.sin_addr);
+	if (up < 0 || connect(up, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+		ESP_LOGE(TAG, "connect %s:%d Fail %s", upstream_host, upstream_port, strerror(errno));
+		close(down);
+		if (up >= 0) close(up);
+		vTaskDelete(NULL);
+	}
+	struct pollfd fds[2] = {
+		{ .fd = down, .events = POLLIN },
+		{ .fd = up, .events = POLLIN },
+	};
+	uint8_t buffer[4096];
+	while (cut == false) {
+		if (poll(fds, 2, 10) < 0) break;
+		bool closed = false;
+		for (int i=0;i<2;i++) {
+			if ((fds[i].revents & (POLLIN | POLLHUP | POLLERR)) == 0) continue;
+			ssize_t length = recv(fds[i].fd, buffer, sizeof(buffer), 0);
+			if (length <= 0 || send(fds[1-i].fd, buffer, length, MSG_NOSIGNAL) != length) closed = true;
+		}
+		if (closed) break;
+	}
+	close(down);
+	close(up);
+	vTaskDelete(NULL);
+}
+
+static void proxy_task(void *pvParameters)
+{
+	int sock = (int)(intptr_t)pvParameters;
+	struct pollfd fds = { .fd = sock, .events = POLLIN };
+	while (cut == false) {
+		if (poll(&fds, 1, 10) <= 0) continue;
+		int down = accept(sock, NULL, NULL);
+		if (down < 0) continue;
+		xTaskCreate(relay_task, "relay", 1024*4, (void *)(intptr_t)down, 5, NULL);
+	}
+	// New connections are refused from now on
+	close(sock);
+	vTaskDelete(NULL);
+}
+
+static bool proxy_start(void)
+{
+	int sock = socket(AF_INET, SOCK_STREAM, 0);
+	int on = 1;
+	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(proxy_port), .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(sock, 4) != 0) {
+		ESP_LOGE(TAG, "proxy port %d Fail %s", proxy_port, strerror(errno));
+		close(sock);
+		return false;
+	}
+	xTaskCreate(proxy_task, "proxy", 1024*4, (void *)(intptr_t)sock, 5, NULL);
+	return true;
+}
+
+static void report(DIRECTION_t *dir)
+{
+	uint32_t received = 0;
+	uint32_t lost = 0;
+	uint32_t duplicated = 0;
+	uint32_t lost_before = 0;
+	for (uint32_t i=0;i<dir->sequence;i++) {
+		uint8_t count = dir->count[i];
+		if (count != 0) received++;
+		if (count > 1) duplicated += count - 1;
+		if (count == 0) {
+			lost++;
+			if (dir->sent_at[i] < cut_at) lost_before++;
+		}
+	}
+	printf("%-4s sent=%"PRIu32" received=%"PRIu32" lost=%"PRIu32" (%"PRIu32" sent before the cut) duplicated=%"PRIu32"\n",
+		dir->name, dir->sequence, received, lost, lost_before, duplicated);
+	if (dir->back_at == 0) {
+		printf("     no frame sent after the cut came back\n");
+	} else {
+		printf("     first frame sent after the cut came back %"PRId64" ms after the cut, longest gap %"PRId64" ms\n",
+			(dir->back_at - cut_at) / 1000, dir->max_gap / 1000);
+	}
+}
+
+static void usage(const char *program)
+{
+	printf("usage: %s -F HOST[:PORT] [options]\n", program);
+	harness_usage();
+	printf("  -u RATE    CAN to MQTT frames per second (default 200)\n");
+	printf("  -d RATE    MQTT to CAN messages per second (default 50)\n");
+	printf("  -c SECONDS time of the cut after the warmup (default 5)\n");
+	printf("  -t SECONDS length of the run (default 15)\n");
+	printf("  -x PORT    port of the proxy in front of the first broker (default 18830)\n");
+}
+
+int main(int argc, char *argv[])
+{
+	double cut_s = 5;
+	double seconds = 15;
+	direction[HARNESS_UP].rate = 200;
+	direction[HARNESS_DOWN].rate = 50;
+	esp_log_level_set("*", ESP_LOG_WARN);
+
+	int opt;
+	while ((opt = getopt(argc, argv, HARNESS_OPTIONS "u:d:c:t:x:h")) != -1) {
+		if (harness_option(opt, optarg)) continue;
+		switch (opt) {
+			case 'u': direction[HARNESS_UP].rate = atof(optarg); break;
+			case 'd': direction[HARNESS_DOWN].rate = atof(optarg); break;
+			case 'c': cut_s = atof(optarg); break;
+			case 't': seconds = atof(optarg); break;
+			case 'x': proxy_port = atoi(optarg); break;
+			default: usage(argv[0]); return 1;
+		}
+	}
+	if (strlen(host_mqtt_failover) == 0 || strchr(host_mqtt_failover, ',') != NULL
+		|| direction[HARNESS_UP].rate <= 0 || direction[HARNESS_DOWN].rate <= 0 || cut_s <= 0 || seconds <= cut_s) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	// The harness talks to the brokers, the bridge to the proxy and the failover broker
+	snprintf(upstream_host, sizeof(upstream_host), "%s", host_mqtt_broker);
+	upstream_port = host_mqtt_port;
+	char failover_host[128];
+	snprintf(failover_host, sizeof(failover_host), "%s", host_mqtt_failover);
+	int failover_port = 1883;
+	char *colon = strchr(failover_host, ':');
+	if (colon != NULL) {
+		*colon = 0;
+		failover_port = atoi(colon + 1);
+	}
+	if (proxy_start() == false) return 1;
+	snprintf(host_mqtt_broker, 128, "127.0.0.1");
+	host_mqtt_port = proxy_port;
+
+	// Enough for the whole run
+	capacity = (uint32_t)((direction[HARNESS_UP].rate + direction[HARNESS_DOWN].rate) * seconds) + 1000;
+	for (int dir=0;dir<2;dir++) {
+		direction[dir].count = calloc(capacity, sizeof(uint8_t));
+		direction[dir].sent_at = calloc(capacity, sizeof(int64_t));
+		configASSERT( direction[dir].count && direction[dir].sent_at );
+	}
+
+	harness_receive_frames(on_frame);
+	if (harness_start_bridge(NULL) != ESP_OK) return 1;
+	esp_mqtt_client_handle_t clients[2];
+	clients[0] = harness_connect(upstream_host, upstream_port);
+	clients[1] = harness_connect(failover_host, failover_port);
+	if (clients[0] == NULL || clients[1] == NULL) return 1;
+	for (int dir=0;dir<2;dir++) {
+		if (harness_warmup(send_frame, clients, dir, &direction[dir].warm) == false) {
+			ESP_LOGE(TAG, "The bridge did not pass a frame %s", direction[dir].name);
+			return 1;
+		}
+	}
+
+	printf("brokers %s:%d (through proxy port %d) and %s:%d up=%.0f/s down=%.0f/s cut at %.0fs\n",
+		upstream_host, upstream_port, proxy_port, failover_host, failover_port,
+		direction[HARNESS_UP].rate, direction[HARNESS_DOWN].rate, cut_s);
+
+	int64_t start = esp_timer_get_time();
+	int64_t cut_due = start + (int64_t)(cut_s * 1000000.0);
+	int64_t end = start + (int64_t)(seconds * 1000000.0);
+	int64_t due[2] = { start, start };
+	while (1) {
+		int64_t now = esp_timer_get_time();
+		if (now >= end) break;
+		if (cut == false && now >= cut_due) {
+			for (int dir=0;dir<2;dir++) direction[dir].first_after_cut = direction[dir].sequence;
+			cut_at = now;
+			cut = true;
+			printf("[%5.1fs] proxy cut\n", (now - start) / 1000000.0);
+		}
+		int64_t next = now + 1000;
+		for (int dir=0;dir<2;dir++) {
+			while (due[dir] <= now) {
+				send_next(clients, &direction[dir], dir);
+				due[dir] += (int64_t)(1000000.0 / direction[dir].rate);
+			}
+			if (due[dir] < next) next = due[dir];
+		}
+		int64_t wait = next - esp_timer_get_time();
+		if (wait > 50) usleep(wait);
+	}
+
+	// QoS 1 messages still in flight come back
+	vTaskDelay(pdMS_TO_TICKS(2000));
+	for (int dir=0;dir<2;dir++) report(&direction[dir]);
+	return 0;
+}
@@ -0,0 +1,279 @@
+/*
+	This code is in the Public Domain (or CC0 licensed, at your option.)
+
+	Unless required by applicable law or agreed to in writing, this
+	software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+	CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/event_groups.h"
+#include "esp_err.h"
+#include "esp_log.h"
+#include "mqtt_client.h"
+#include "twai_sim.h"
+
+#include "mqtt.h"
+#include "frame.h"
+#include "arena.h"
+#include "broker.h"
+#include "harness.h"
+#if CONFIG_ISOTP_ENABLE
+#include "isotp.h"
+extern ISOTP_t *isotp;
+extern int16_t nisotp;
+#endif
+#if CONFIG_BULK_ENABLE
+#include "bulk.h"
+#endif
+
+static const char *TAG = "HARNESS";
+
+// Used by mqtt_pub.c and mqtt_sub.c through sdkconfig.h
+char host_mqtt_broker[128] = "127.0.0.1";
+int host_mqtt_port = 1883;
+char host_mqtt_failover[256] = "";
+
+TOPIC_t *publish;
+int16_t npublish;
+TOPIC_t *subscribe;
+int16_t nsubscribe;
+
+esp_err_t build_table(TOPIC_t **topics, char *file, int16_t *ntopic, bool allow_wildcard);
+void mqtt_pub_task(void *pvParameters);
+void mqtt_sub_task(void *pvParameters);
+void twai_task(void *pvParameters);
+
+static char *publish_file = "csv/can2mqtt.csv";
+static char *subscribe_file = "csv/mqtt2can.csv";
+static char *isotp_file = "csv/isotp.csv";
+static char *ifname = NULL;
+
+static harness_data_callback_t data_callback;
+static harness_frame_callback_t frame_callback;
+static EventGroupHandle_t s_harness_event_group;
+#define HARNESS_CONNECTED_BIT BIT0
+
+// mDNS is not used on the host, NAME.local is looked up as NAME
+esp_err_t query_mdns_host(const char * host_name, char *ip)
+{
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	struct addrinfo *result;
+	if (getaddrinfo(host_name, NULL, &hints, &result) != 0) return ESP_ERR_NOT_FOUND;
+	inet_ntop(AF_INET, &((struct sockaddr_in *)result->ai_addr)->sin_addr, ip, INET_ADDRSTRLEN);
+	freeaddrinfo(result);
+	return ESP_OK;
+}
+
+bool harness_option(int opt, const char *arg)
+{
+	switch (opt) {
+		case 'p': publish_file = (char *)arg; break;
+		case 's': subscribe_file = (char *)arg; break;
+		case 'T': isotp_file = (char *)arg; break;
+		case 'b': snprintf(host_mqtt_broker, sizeof(host_mqtt_broker), "%s", arg); break;
+		case 'P': host_mqtt_port = atoi(arg); break;
+		case 'F': snprintf(host_mqtt_failover, sizeof(host_mqtt_failover), "%s", arg); break;
+		case 'i': ifname = (char *)arg; break;
+		case 'C': twai_sim_set_bitrate(strtoul(arg, NULL, 10)); break;
+		case 'v': esp_log_level_set("*", (esp_log_level < ESP_LOG_INFO) ? ESP_LOG_INFO : ESP_LOG_DEBUG); break;
+		default: return false;
+	}
+	return true;
+}
+
+void harness_usage(void)
+{
+	printf("  -p FILE    can2mqtt.csv (default csv/can2mqtt.csv)\n");
+	printf("  -s FILE    mqtt2can.csv (default csv/mqtt2can.csv)\n");
+	printf("  -T FILE    isotp.csv (default csv/isotp.csv)\n");
+	printf("  -b HOST    broker (default 127.0.0.1)\n");
+	printf("  -P PORT    broker port (default 1883)\n");
+	printf("  -F LIST    failover brokers host[:port],... (default none)\n");
+	printf("  -i IFNAME  SocketCAN interface such as vcan0 instead of the simulated bus\n");
+	printf("  -C BITRATE frames transmitted on the simulated bus take their time at this bit rate (default none)\n");
+	printf("  -v         log the bridge at info level, -v -v at debug level\n");
+}
+
+static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_t event_id, void *event_data)
+{
+	esp_mqtt_event_handle_t event = event_data;
+	switch (event->event_id) {
+		case MQTT_EVENT_CONNECTED:
+			ESP_LOGI(TAG, "MQTT_EVENT_CONNECTED");
+			for(int index=0;index<npublish;index++) {
+				esp_mqtt_client_subscribe(event->client, publish[index].topic, 0);
+			}
+#if CONFIG_ISOTP_ENABLE
+			for(int index=0;index<nisotp;index++) {
+				esp_mqtt_client_subscribe(event->client, isotp[index].rx_topic, 0);
+			}
+#endif
+			xEventGroupSetBits(s_harness_event_group, HARNESS_CONNECTED_BIT);
+			break;
+		case MQTT_EVENT_DISCONNECTED:
+			ESP_LOGI(TAG, "MQTT_EVENT_DISCONNECTED");
+			xEventGroupClearBits(s_harness_event_group, HARNESS_CONNECTED_BIT);
+			break;
+		case MQTT_EVENT_DATA:
+			if (data_callback != NULL) data_callback(event->topic, event->topic_len, (uint8_t *)event->data, event->data_len);
+			break;
+		default:
+			break;
+	}
+}
+
+static void frame_received(int dir, const uint8_t *data, int data_len)
+{
+	if (data_len < 8) return;
+	if (((uint32_t)data[4] << 24 | data[5] << 16 | data[6] << 8 | data[7]) != HARNESS_MAGIC) return;
+	frame_callback(dir, (uint32_t)data[0] << 24 | data[1] << 16 | data[2] << 8 | data[3]);
+}
+
+// Frames the bridge transmitted on the bus
+static void frame_transmitted(const twai_message_t *message)
+{
+	if (message->rtr) return;
+	frame_received(HARNESS_DOWN, message->data, message->data_length_code);
+}
+
+static void frame_published(const char *topic, int topic_len, const uint8_t *data, int data_len)
+{
+	frame_received(HARNESS_UP, data, data_len);
+}
+
+void harness_receive_frames(harness_frame_callback_t callback)
+{
+	frame_callback = callback;
+	twai_sim_set_tx_callback(frame_transmitted);
+}
+
+void harness_fill_data(uint8_t *data, uint32_t sequence)
+{
+	data[0] = sequence >> 24;
+	data[1] = sequence >> 16;
+	data[2] = sequence >> 8;
+	data[3] = sequence;
+	data[4] = (HARNESS_MAGIC >> 24) & 0xFF;
+	data[5] = (HARNESS_MAGIC >> 16) & 0xFF;
+	data[6] = (HARNESS_MAGIC >> 8) & 0xFF;
+	data[7] = HARNESS_MAGIC & 0xFF;
+}
+
+bool harness_inject(uint32_t canid, uint8_t extd, const uint8_t *data)
+{
+	twai_message_t message;
+	memset(&message, 0, sizeof(message));
+	message.identifier = canid;
+	message.extd = extd;
+	message.data_length_code = 8;
+	memcpy(message.data, data, 8);
+	return twai_sim_inject(&message);
+}
+
+void harness_command_topic(const TOPIC_t *row, char *topic, size_t size)
+{
+	if (row->wildcard < 0) {
+		snprintf(topic, size, "%s", row->topic);
+	} else {
+		uint32_t canid = (row->nrange != 0) ? row->range[0].low : 0x100;
+		snprintf(topic, size, "%.*s%"PRIx32"%s", row->wildcard, row->topic, canid, &row->topic[row->wildcard+1]);
+	}
+}
+
+bool harness_warmup(harness_send_t send, void *arg, int dir, volatile bool *warm)
+{
+	for (int retry=0;retry<100;retry++) {
+		send(arg, dir, HARNESS_WARMUP);
+		vTaskDelay(pdMS_TO_TICKS(100));
+		if (*warm) return true;
+	}
+	return false;
+}
+
+esp_err_t harness_start_bridge(harness_data_callback_t on_data)
+{
+	if (arena_init(CONFIG_ARENA_SIZE) != ESP_OK) return ESP_FAIL;
+	frame_queue_create();
+	if (build_table(&publish, publish_file, &npublish, false) != ESP_OK || npublish == 0) {
+		ESP_LOGE(TAG, "build publish table fail %s", publish_file);
+		return ESP_FAIL;
+	}
+	if (build_table(&subscribe, subscribe_file, &nsubscribe, true) != ESP_OK || nsubscribe == 0) {
+		ESP_LOGE(TAG, "build subscribe table fail %s", subscribe_file);
+		return ESP_FAIL;
+	}
+#if CONFIG_ISOTP_ENABLE
+	if (build_isotp_table(&isotp, isotp_file, &nisotp) != ESP_OK) {
+		ESP_LOGE(TAG, "build isotp table fail %s", isotp_file);
+		return ESP_FAIL;
+	}
+	isotp_init();
+#endif
+#if CONFIG_BULK_ENABLE
+	bulk_init();
+#endif
+	if (ifname != NULL && twai_sim_open(ifname) != ESP_OK) return ESP_FAIL;
+	if (broker_init() != ESP_OK) return ESP_FAIL;
+
+	// Same tasks as app_main
+	xTaskCreate(mqtt_pub_task, "mqtt_pub", 1024*4, NULL, 2, NULL);
+	xTaskCreate(mqtt_sub_task, "mqtt_sub", 1024*4, NULL, 2, NULL);
+	xTaskCreate(twai_task, "twai_rx", 1024*6, NULL, 2, NULL);
+#if CONFIG_ISOTP_ENABLE
+	xTaskCreate(isotp_task, "isotp", 1024*4, NULL, 3, NULL);
+#endif
+#if CONFIG_BULK_ENABLE
+	xTaskCreate(bulk_task, "bulk", 1024*3, NULL, 1, NULL);
+#endif
+
+	data_callback = (on_data != NULL) ? on_data : frame_published;
+	s_harness_event_group = xEventGroupCreate();
+	configASSERT( s_harness_event_group );
+	return ESP_OK;
+}
+
+// The other side of the bridge, one client per broker
+esp_mqtt_client_handle_t harness_connect(const char *host, int port)
+{
+	static int nclient;
+	char uri[160];
+	char client_id[32];
+	snprintf(uri, sizeof(uri), "mqtt://%s:%d", host, port);
+	snprintf(client_id, sizeof(client_id), "harness-%d-%d", getpid(), nclient++);
+	esp_mqtt_client_config_t mqtt_cfg = {
+		.broker.address.uri = uri,
+		.credentials.client_id = client_id,
+	};
+	xEventGroupClearBits(s_harness_event_group, HARNESS_CONNECTED_BIT);
+	esp_mqtt_client_handle_t client = esp_mqtt_client_init(&mqtt_cfg);
+	if (client == NULL) return NULL;
+	esp_mqtt_client_register_event(client, ESP_EVENT_ANY_ID, mqtt_event_handler, NULL);
+	esp_mqtt_client_start(client);
+	if ((xEventGroupWaitBits(s_harness_event_group, HARNESS_CONNECTED_BIT, false, true, pdMS_TO_TICKS(10000)) & HARNESS_CONNECTED_BIT) == 0) {
+		ESP_LOGE(TAG, "Failed to connect to %s", uri);
+		return NULL;
+	}
+	return client;
+}
+
+esp_mqtt_client_handle_t harness_start(harness_data_callback_t on_data)
+{
+	if (harness_start_bridge(on_data) != ESP_OK) return NULL;
+	esp_mqtt_client_handle_t client = harness_connect(host_mqtt_broker, host_mqtt_port);
+	if (client == NULL) return NULL;
+	ESP_LOGI(TAG, "can2mqtt rows=%d mqtt2can rows=%d bus=%s", npublish, nsubscribe, ifname ? ifname : "simulated");
+	arena_report("start");
+	return client;
+}
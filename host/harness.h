@@ -0,0 +1,59 @@
+#ifndef HARNESS_H_
+#define HARNESS_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "mqtt_client.h"
+#include "mqtt.h"
+
+// Tables of main.c
+extern TOPIC_t *publish;
+extern int16_t npublish;
+extern TOPIC_t *subscribe;
+extern int16_t nsubscribe;
+
+// A message on one of the can2mqtt topics, seen from the broker side
+typedef void (*harness_data_callback_t)(const char *topic, int topic_len, const uint8_t *data, int data_len);
+
+// Common options, returns true when the option was taken
+bool harness_option(int opt, const char *arg);
+#define	HARNESS_OPTIONS	"p:s:T:b:P:F:i:C:v"
+void harness_usage(void);
+
+/*
+ * Build the tables, start the bridge tasks like app_main and connect a second client
+ * that subscribes to every can2mqtt topic. Returns NULL when the broker is not reachable.
+ */
+esp_mqtt_client_handle_t harness_start(harness_data_callback_t on_data);
+
+// The two halves of harness_start, for tools that put the bridge on another broker
+esp_err_t harness_start_bridge(harness_data_callback_t on_data);
+esp_mqtt_client_handle_t harness_connect(const char *host, int port);
+
+/*
+ * Test frames of bridge_bench, bridge_soak and bridge_failover:
+ * the sequence number in data bytes 0..3 and HARNESS_MAGIC in bytes 4..7.
+ */
+#define	HARNESS_UP	0	// CAN to MQTT
+#define	HARNESS_DOWN	1	// MQTT to CAN
+#define	HARNESS_MAGIC	0xA55AA55A
+// Sequence number of the frames sent until the bridge is up
+#define	HARNESS_WARMUP	0xFFFFFFFF
+
+// A test frame that came out of the bridge, from the bus or from the broker
+typedef void (*harness_frame_callback_t)(int dir, uint32_t sequence);
+// Sends one test frame into the bridge, false when the bridge refused it
+typedef bool (*harness_send_t)(void *arg, int dir, uint32_t sequence);
+
+// Before harness_start, which is then given NULL as on_data
+void harness_receive_frames(harness_frame_callback_t callback);
+void harness_fill_data(uint8_t *data, uint32_t sequence);
+// Puts a classic 8-byte frame on the bus, false when the receive queue of the driver is full
+bool harness_inject(uint32_t canid, uint8_t extd, const uint8_t *data);
+// Topic of a mqtt2can row, with the lowest allowed CAN ID in place of a + level
+void harness_command_topic(const TOPIC_t *row, char *topic, size_t size);
+// Sends HARNESS_WARMUP frames until the callback has set warm
+bool harness_warmup(harness_send_t send, void *arg, int dir, volatile bool *warm);
+
+#endif /* HARNESS_H_ */
@@ -0,0 +1,397 @@
+/*
+	This code is in the Public Domain (or CC0 licensed, at your option.)
+
+	Unless required by applicable law or agreed to in writing, this
+	software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+	CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <getopt.h>
+#include <unistd.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "esp_err.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "mqtt_client.h"
+#include "twai_sim.h"
+
+#include "mqtt.h"
+#include "isotp.h"
+#include "harness.h"
+
+static const char *TAG = "ISOTP_ECU";
+
+/*
+ * ISO-TP sessions of the bridge against a simulated ECU on the bus.
+ * Every round publishes one request on the request topic of each session of isotp.csv
+ * at the same time. The ECU answers each request with a multi-frame response,
+ * sending its flow control with the block size and STmin of -B and -S and keeping the
+ * flow control of the bridge for the response. It checks the gap between the
+ * consecutive frames of the bridge against its STmin.
+ */
+
+extern ISOTP_t *isotp;
+extern int16_t nisotp;
+
+#define	PCI_SF	0x00
+#define	PCI_FF	0x10
+#define	PCI_CF	0x20
+#define	PCI_FC	0x30
+
+#define	FC_CTS	0
+
+// The finest step of STmin, a frame queued on time may leave the TX task this much earlier than the one before
+#define	STMIN_JITTER_US	100
+
+// A frame the bridge transmitted, with the time it left the TX task
+typedef struct {
+	int64_t at;
+	uint32_t canid;
+	uint8_t data[8];
+} BUS_FRAME_t;
+
+typedef struct {
+	// Request from the bridge
+	uint8_t request[ISOTP_MAX_PDU_LEN];
+	uint16_t request_len;
+	uint16_t request_pos;
+	uint8_t request_sn;
+	uint8_t block_count;	// consecutive frames left in this block
+	int64_t last_cf_at;	// 0 right after a flow control
+
+	// Response to the bridge
+	uint8_t response[ISOTP_MAX_PDU_LEN];
+	uint16_t response_len;
+	uint16_t response_pos;	// 0 is idle
+	uint8_t response_sn;
+	bool response_wait_fc;
+	uint8_t response_bs;
+	uint8_t response_bs_count;
+	uint32_t response_stmin_us;
+	int64_t response_due;
+
+	// Tester side
+	int64_t published_at;
+	volatile bool answered;
+	bool ok;
+} ECU_SESSION_t;
+
+static ECU_SESSION_t *sessions;
+static QueueHandle_t xQueueBus;
+
+static uint16_t request_len = 64;
+static uint16_t response_len = 200;
+static uint8_t ecu_block_size = 8;
+static uint8_t ecu_stmin = 2;
+
+// Checked against the STmin of the ECU
+static uint32_t cf_gaps;
+static uint32_t stmin_violations;
+static int64_t min_gap = INT64_MAX;
+static uint32_t protocol_errors;
+
+static uint32_t stmin_to_us(uint8_t stmin)
+{
+	if (stmin <= 0x7F) return stmin * 1000;
+	if (stmin >= 0xF1 && stmin <= 0xF9) return (stmin - 0xF0) * 100;
+	return 0x7F * 1000;
+}
+
+// Runs in the TX task of the bridge
+static void frame_transmitted(const twai_message_t *message)
+{
+	BUS_FRAME_t frame;
+	frame.at = esp_timer_get_time();
+	frame.canid = message->identifier;
+	memcpy(frame.data, message->data, 8);
+	if (xQueueSend(xQueueBus, &frame, 0) != pdPASS) {
+		ESP_LOGW(TAG, "bus queue full");
+	}
+}
+
+// The ECU answers on the CAN ID the bridge receives
+static void ecu_send(int index, uint8_t *frame, int len)
+{
+	memset(&frame[len], ISOTP_PADDING, 8 - len);
+	while (harness_inject(isotp[index].rx_id, isotp[index].extd, frame) == false) {
+		vTaskDelay(1);
+	}
+}
+
+static void send_flow_control(int index)
+{
+	uint8_t frame[8];
+	frame[0] = PCI_FC | FC_CTS;
+	frame[1] = ecu_block_size;
+	frame[2] = ecu_stmin;
+	ecu_send(index, frame, 3);
+	sessions[index].block_count = ecu_block_size;
+	sessions[index].last_cf_at = 0;
+}
+
+// Positive response of the service in the first byte, then a pattern the tester can check
+static void build_response(ECU_SESSION_t *session)
+{
+	session->response[0] = session->request[0] + 0x40;
+	for (int i=1;i<response_len;i++) session->response[i] = session->request[i % session->request_len] ^ i;
+	session->response_len = response_len;
+}
+
+static void start_response(int index)
+{
+	ECU_SESSION_t *session = &sessions[index];
+	build_response(session);
+	uint8_t frame[8];
+	if (session->response_len <= 7) {
+		frame[0] = PCI_SF | session->response_len;
+		memcpy(&frame[1], session->response, session->response_len);
+		ecu_send(index, frame, 1 + session->response_len);
+		return;
+	}
+	frame[0] = PCI_FF | (session->response_len >> 8);
+	frame[1] = session->response_len & 0xFF;
+	memcpy(&frame[2], session->response, 6);
+	ecu_send(index, frame, 8);
+	session->response_pos = 6;
+	session->response_sn = 1;
+	session->response_wait_fc = true;
+}
+
+static void continue_response(int index, int64_t now)
+{
+	ECU_SESSION_t *session = &sessions[index];
+	while (session->response_pos != 0 && session->response_wait_fc == false && now >= session->response_due) {
+		uint8_t frame[8];
+		int len = session->response_len - session->response_pos;
+		if (len > 7) len = 7;
+		frame[0] = PCI_CF | session->response_sn;
+		memcpy(&frame[1], &session->response[session->response_pos], len);
+		ecu_send(index, frame, 1 + len);
+		session->response_pos += len;
+		session->response_sn = (session->response_sn + 1) & 0x0F;
+		session->response_due = now + session->response_stmin_us;
+		if (session->response_pos >= session->response_len) {
+			session->response_pos = 0;
+		} else if (session->response_bs != 0 && ++session->response_bs_count >= session->response_bs) {
+			session->response_wait_fc = true;
+		}
+	}
+}
+
+static void on_bridge_frame(int index, const BUS_FRAME_t *bus)
+{
+	ECU_SESSION_t *session = &sessions[index];
+	const uint8_t *data = bus->data;
+	switch (data[0] & 0xF0) {
+		case PCI_SF:
+			session->request_len = data[0] & 0x0F;
+			memcpy(session->request, &data[1], session->request_len);
+			start_response(index);
+			break;
+		case PCI_FF:
+			session->request_len = ((data[0] & 0x0F) << 8) | data[1];
+			memcpy(session->request, &data[2], 6);
+			session->request_pos = 6;
+			session->request_sn = 1;
+			send_flow_control(index);
+			break;
+		case PCI_CF:
+			if (session->request_pos == 0 || (data[0] & 0x0F) != session->request_sn) {
+				protocol_errors++;
+				session->request_pos = 0;
+				break;
+			}
+			if (session->last_cf_at != 0) {
+				int64_t gap = bus->at - session->last_cf_at;
+				cf_gaps++;
+				if (gap < min_gap) min_gap = gap;
+				if (gap + STMIN_JITTER_US < stmin_to_us(ecu_stmin)) stmin_violations++;
+			}
+			session->last_cf_at = bus->at;
+			int len = session->request_len - session->request_pos;
+			if (len > 7) len = 7;
+			memcpy(&session->request[session->request_pos], &data[1], len);
+			session->request_pos += len;
+			session->request_sn = (session->request_sn + 1) & 0x0F;
+			if (session->request_pos >= session->request_len) {
+				session->request_pos = 0;
+				start_response(index);
+			} else if (ecu_block_size != 0 && --session->block_count == 0) {
+				send_flow_control(index);
+			}
+			break;
+		case PCI_FC:
+			if (session->response_wait_fc == false) {
+				protocol_errors++;
+				break;
+			}
+			if ((data[0] & 0x0F) != FC_CTS) break;
+			session->response_bs = data[1];
+			session->response_bs_count = 0;
+			session->response_stmin_us = stmin_to_us(data[2]);
+			session->response_due = bus->at;
+			session->response_wait_fc = false;
+			break;
+		default:
+			protocol_errors++;
+			break;
+	}
+}
+
+static void ecu_task(void *pvParameters)
+{
+	BUS_FRAME_t bus;
+	while (1) {
+		if (xQueueReceive(xQueueBus, &bus, 1) == pdPASS) {
+			for (int index=0;index<nisotp;index++) {
+				if (isotp[index].tx_id == bus.canid) on_bridge_frame(index, &bus);
+			}
+		}
+		int64_t now = esp_timer_get_time();
+		for (int index=0;index<nisotp;index++) continue_response(index, now);
+	}
+}
+
+// Responses published by the bridge
+static void on_data(const char *topic, int topic_len, const uint8_t *data, int data_len)
+{
+	for (int index=0;index<nisotp;index++) {
+		if (isotp[index].rx_topic_len != topic_len || strncmp(isotp[index].rx_topic, topic, topic_len) != 0) continue;
+		ECU_SESSION_t *session = &sessions[index];
+		session->ok = (data_len == session->response_len && memcmp(data, session->response, data_len) == 0);
+		session->published_at = esp_timer_get_time() - session->published_at;
+		session->answered = true;
+		return;
+	}
+}
+
+// Publishes one request per session at once, true when every session answered within timeout
+static bool run_round(esp_mqtt_client_handle_t client, uint32_t round, TickType_t timeout)
+{
+	static uint8_t request[ISOTP_MAX_PDU_LEN];
+	for (int index=0;index<nisotp;index++) {
+		ECU_SESSION_t *session = &sessions[index];
+		// Read data by identifier with a different payload every round
+		request[0] = 0x22;
+		for (int i=1;i<request_len;i++) request[i] = round + index + i;
+		session->answered = false;
+		session->published_at = esp_timer_get_time();
+		esp_mqtt_client_publish(client, isotp[index].tx_topic, (char *)request, request_len, 0, 0);
+	}
+	TickType_t until = xTaskGetTickCount() + timeout;
+	while (1) {
+		bool all = true;
+		for (int index=0;index<nisotp;index++) all &= sessions[index].answered;
+		if (all) return true;
+		if ((int32_t)(xTaskGetTickCount() - until) >= 0) return false;
+		usleep(200);
+	}
+}
+
+static int compare_latency(const void *a, const void *b)
+{
+	int64_t x = *(const int64_t *)a;
+	int64_t y = *(const int64_t *)b;
+	return (x > y) - (x < y);
+}
+
+static void usage(const char *program)
+{
+	printf("usage: %s [options]\n", program);
+	harness_usage();
+	printf("  -n COUNT   rounds, each with one request per session (default 100)\n");
+	printf("  -q LENGTH  request PDU length (default 64)\n");
+	printf("  -l LENGTH  response PDU length (default 200)\n");
+	printf("  -B SIZE    block size in the flow control of the ECU (default 8)\n");
+	printf("  -S STMIN   STmin byte in the flow control of the ECU (default 2)\n");
+}
+
+int main(int argc, char *argv[])
+{
+	uint32_t rounds = 100;
+	esp_log_level_set("*", ESP_LOG_WARN);
+
+	int opt;
+	while ((opt = getopt(argc, argv, HARNESS_OPTIONS "n:q:l:B:S:h")) != -1) {
+		if (harness_option(opt, optarg)) continue;
+		switch (opt) {
+			case 'n': rounds = strtoul(optarg, NULL, 10); break;
+			case 'q': request_len = atoi(optarg); break;
+			case 'l': response_len = atoi(optarg); break;
+			case 'B': ecu_block_size = strtoul(optarg, NULL, 0); break;
+			case 'S': ecu_stmin = strtoul(optarg, NULL, 0); break;
+			default: usage(argv[0]); return 1;
+		}
+	}
+	if (rounds == 0 || request_len == 0 || request_len > ISOTP_MAX_PDU_LEN || response_len == 0 || response_len > ISOTP_MAX_PDU_LEN) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	xQueueBus = xQueueCreate(256, sizeof(BUS_FRAME_t));
+	configASSERT( xQueueBus );
+	twai_sim_set_tx_callback(frame_transmitted);
+	esp_mqtt_client_handle_t client = harness_start(on_data);
+	if (client == NULL) return 1;
+	if (nisotp == 0) {
+		ESP_LOGE(TAG, "no ISO-TP session");
+		return 1;
+	}
+	sessions = calloc(nisotp, sizeof(ECU_SESSION_t));
+	int64_t *latency = malloc(rounds * nisotp * sizeof(int64_t));
+	configASSERT( sessions && latency );
+	xTaskCreate(ecu_task, "ecu", 1024*4, NULL, 2, NULL);
+
+	printf("sessions=%d rounds=%"PRIu32" request=%d bytes response=%d bytes ECU BS=%d STmin=0x%02x\n",
+		nisotp, rounds, request_len, response_len, ecu_block_size, ecu_stmin);
+
+	// Until the bridge has subscribed to the request topics
+	bool warm = false;
+	for (int retry=0;retry<5 && warm==false;retry++) warm = run_round(client, 0, pdMS_TO_TICKS(ISOTP_TIMEOUT_MS));
+	if (warm == false) {
+		ESP_LOGE(TAG, "The bridge did not answer a request");
+		return 1;
+	}
+	cf_gaps = 0;
+	stmin_violations = 0;
+	min_gap = INT64_MAX;
+
+	uint32_t answered = 0;
+	uint32_t wrong = 0;
+	uint32_t lost = 0;
+	int64_t start = esp_timer_get_time();
+	for (uint32_t round=0;round<rounds;round++) {
+		// Twice the ISO-TP timeout of the bridge, then the round is given up
+		run_round(client, round, pdMS_TO_TICKS(ISOTP_TIMEOUT_MS * 2));
+		for (int index=0;index<nisotp;index++) {
+			ECU_SESSION_t *session = &sessions[index];
+			if (session->answered == false) {
+				lost++;
+			} else if (session->ok == false) {
+				wrong++;
+			} else {
+				latency[answered++] = session->published_at;
+			}
+		}
+	}
+	double elapsed = (esp_timer_get_time() - start) / 1000000.0;
+
+	printf("requests=%"PRIu32" answered=%"PRIu32" wrong=%"PRIu32" lost=%"PRIu32" protocol errors=%"PRIu32" in %.1fs\n",
+		rounds * nisotp, answered, wrong, lost, protocol_errors, elapsed);
+	if (answered != 0) {
+		qsort(latency, answered, sizeof(int64_t), compare_latency);
+		printf("request to response p50=%.2fms p90=%.2fms p99=%.2fms max=%.2fms\n",
+			latency[answered / 2] / 1000.0, latency[answered * 90 / 100] / 1000.0,
+			latency[answered * 99 / 100] / 1000.0, latency[answered - 1] / 1000.0);
+	}
+	printf("consecutive frames of the bridge: gaps=%"PRIu32" below STmin=%"PRIu32" shortest gap=%.3fms (STmin %.3fms)\n",
+		cf_gaps, stmin_violations, (cf_gaps != 0) ? min_gap / 1000.0 : 0.0, stmin_to_us(ecu_stmin) / 1000.0);
+	return (answered == rounds * nisotp && stmin_violations == 0) ? 0 : 1;
+}
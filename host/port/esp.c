@@ -0,0 +1,80 @@
+/*
+	This code is in the Public Domain (or CC0 licensed, at your option.)
+
+	Unless required by applicable law or agreed to in writing, this
+	software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+	CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <malloc.h>
+
+#include "esp_err.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "esp_mac.h"
+
+esp_log_level_t esp_log_level = ESP_LOG_INFO;
+
+const char *esp_err_to_name(esp_err_t code)
+{
+	switch (code) {
+		case ESP_OK: return "ESP_OK";
+		case ESP_FAIL: return "ESP_FAIL";
+		case ESP_ERR_NO_MEM: return "ESP_ERR_NO_MEM";
+		case ESP_ERR_INVALID_ARG: return "ESP_ERR_INVALID_ARG";
+		case ESP_ERR_INVALID_STATE: return "ESP_ERR_INVALID_STATE";
+		case ESP_ERR_INVALID_SIZE: return "ESP_ERR_INVALID_SIZE";
+		case ESP_ERR_NOT_FOUND: return "ESP_ERR_NOT_FOUND";
+		case ESP_ERR_NOT_SUPPORTED: return "ESP_ERR_NOT_SUPPORTED";
+		case ESP_ERR_TIMEOUT: return "ESP_ERR_TIMEOUT";
+	}
+	return "UNKNOWN ERROR";
+}
+
+void esp_log_level_set(const char *tag, esp_log_level_t level)
+{
+	esp_log_level = level;
+}
+
+void esp_log_buffer_hex(const char *tag, const void *buffer, size_t length)
+{
+	const uint8_t *bytes = buffer;
+	printf("D (%s)", tag);
+	for (size_t i=0;i<length;i++) printf(" %02x", bytes[i]);
+	printf("\n");
+}
+
+esp_err_t esp_base_mac_addr_get(uint8_t *mac)
+{
+	static const uint8_t host_mac[6] = {0x02, 0x00, 0x00, 0x00, 0x00, 0x01};
+	memcpy(mac, host_mac, sizeof(host_mac));
+	return ESP_OK;
+}
+
+/*
+ * malloc takes memory from the system as it needs it, so free is the memory
+ * malloc holds without handing it out, and largest is its top chunk.
+ * The minimum is the lowest free seen by these calls, not a true low-water mark.
+ */
+static size_t heap_minimum_free = SIZE_MAX;
+
+size_t heap_caps_get_free_size(uint32_t caps)
+{
+	size_t free_size = mallinfo2().fordblks;
+	if (free_size < heap_minimum_free) heap_minimum_free = free_size;
+	return free_size;
+}
+
+size_t heap_caps_get_minimum_free_size(uint32_t caps)
+{
+	heap_caps_get_free_size(caps);
+	return heap_minimum_free;
+}
+
+size_t heap_caps_get_largest_free_block(uint32_t caps)
+{
+	return mallinfo2().keepcost;
+}
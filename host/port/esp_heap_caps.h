@@ -0,0 +1,17 @@
+#ifndef HOST_ESP_HEAP_CAPS_H_
+#define HOST_ESP_HEAP_CAPS_H_
+
+#include <stdlib.h>
+#include <stdint.h>
+
+// One heap on the host, the capabilities are ignored and the figures are those of glibc malloc
+#define	MALLOC_CAP_8BIT		(1 << 2)
+#define	MALLOC_CAP_SPIRAM	(1 << 10)
+#define	MALLOC_CAP_INTERNAL	(1 << 11)
+
+#define	heap_caps_malloc(size, caps)	malloc(size)
+size_t heap_caps_get_free_size(uint32_t caps);
+size_t heap_caps_get_minimum_free_size(uint32_t caps);
+size_t heap_caps_get_largest_free_block(uint32_t caps);
+
+#endif /* HOST_ESP_HEAP_CAPS_H_ */
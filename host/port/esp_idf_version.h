@@ -0,0 +1,11 @@
+#ifndef HOST_ESP_IDF_VERSION_H_
+#define HOST_ESP_IDF_VERSION_H_
+
+// The host port follows the V5.1 API, the legacy TWAI driver and esp_mqtt_client_subscribe_multiple
+#define	ESP_IDF_VERSION_VAL(major, minor, patch)	((major << 16) | (minor << 8) | (patch))
+#define	ESP_IDF_VERSION_MAJOR	5
+#define	ESP_IDF_VERSION_MINOR	1
+#define	ESP_IDF_VERSION_PATCH	0
+#define	ESP_IDF_VERSION		ESP_IDF_VERSION_VAL(ESP_IDF_VERSION_MAJOR, ESP_IDF_VERSION_MINOR, ESP_IDF_VERSION_PATCH)
+
+#endif /* HOST_ESP_IDF_VERSION_H_ */
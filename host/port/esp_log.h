@@ -0,0 +1,37 @@
+#ifndef HOST_ESP_LOG_H_
+#define HOST_ESP_LOG_H_
+
+#include <stdio.h>
+#include <stddef.h>
+
+typedef enum {
+	ESP_LOG_NONE,
+	ESP_LOG_ERROR,
+	ESP_LOG_WARN,
+	ESP_LOG_INFO,
+	ESP_LOG_DEBUG,
+	ESP_LOG_VERBOSE
+} esp_log_level_t;
+
+// One level for every tag, set with esp_log_level_set("*", level)
+extern esp_log_level_t esp_log_level;
+void esp_log_level_set(const char *tag, esp_log_level_t level);
+void esp_log_buffer_hex(const char *tag, const void *buffer, size_t length);
+
+#define	ESP_LOG_LEVEL(level, letter, tag, format, ...) do {			\
+		if (esp_log_level >= level) {					\
+			printf(letter " (%s) " format "\n", tag, ##__VA_ARGS__);	\
+		}								\
+	} while(0)
+
+#define	ESP_LOGE(tag, format, ...)	ESP_LOG_LEVEL(ESP_LOG_ERROR, "E", tag, format, ##__VA_ARGS__)
+#define	ESP_LOGW(tag, format, ...)	ESP_LOG_LEVEL(ESP_LOG_WARN, "W", tag, format, ##__VA_ARGS__)
+#define	ESP_LOGI(tag, format, ...)	ESP_LOG_LEVEL(ESP_LOG_INFO, "I", tag, format, ##__VA_ARGS__)
+#define	ESP_LOGD(tag, format, ...)	ESP_LOG_LEVEL(ESP_LOG_DEBUG, "D", tag, format, ##__VA_ARGS__)
+#define	ESP_LOGV(tag, format, ...)	ESP_LOG_LEVEL(ESP_LOG_VERBOSE, "V", tag, format, ##__VA_ARGS__)
+
+#define	ESP_LOG_BUFFER_HEX_LEVEL(tag, buffer, length, level) do {		\
+		if (esp_log_level >= level) esp_log_buffer_hex(tag, buffer, length);	\
+	} while(0)
+
+#endif /* HOST_ESP_LOG_H_ */
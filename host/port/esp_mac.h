@@ -0,0 +1,10 @@
+#ifndef HOST_ESP_MAC_H_
+#define HOST_ESP_MAC_H_
+
+#include <stdint.h>
+#include "esp_err.h"
+
+// A fixed locally administered address, so the client IDs stay the same between runs
+esp_err_t esp_base_mac_addr_get(uint8_t *mac);
+
+#endif /* HOST_ESP_MAC_H_ */
@@ -0,0 +1,496 @@
+/*
+	This code is in the Public Domain (or CC0 licensed, at your option.)
+
+	Unless required by applicable law or agreed to in writing, this
+	software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+	CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/event_groups.h"
+#include "freertos/message_buffer.h"
+#include "esp_timer.h"
+
+/*
+ * Every object is a mutex and a condition variable on CLOCK_MONOTONIC.
+ * Task priorities are ignored, the host scheduler runs the tasks in parallel.
+ */
+
+typedef struct {
+	TaskFunction_t code;
+	void *parameters;
+} TASK_START_t;
+
+static void *task_entry(void *arg)
+{
+	TASK_START_t start = *(TASK_START_t *)arg;
+	free(arg);
+	start.code(start.parameters);
+	return NULL;
+}
+
+static void sync_init(pthread_mutex_t *mutex, pthread_cond_t *cond)
+{
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(cond, &attr);
+	pthread_condattr_destroy(&attr);
+	pthread_mutex_init(mutex, NULL);
+}
+
+static struct timespec deadline(TickType_t ticks)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	ts.tv_sec += ticks / 1000;
+	ts.tv_nsec += (long)(ticks % 1000) * 1000000L;
+	if (ts.tv_nsec >= 1000000000L) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000L;
+	}
+	return ts;
+}
+
+// Wait for the condition with the mutex held, false on timeout
+static bool sync_wait(pthread_cond_t *cond, pthread_mutex_t *mutex, const struct timespec *until, TickType_t ticks)
+{
+	if (ticks == 0) return false;
+	if (ticks == portMAX_DELAY) {
+		pthread_cond_wait(cond, mutex);
+		return true;
+	}
+	return (pthread_cond_timedwait(cond, mutex, until) != ETIMEDOUT);
+}
+
+int64_t esp_timer_get_time(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/*
+ * Every timer has its own thread that sleeps until the timer is due,
+ * the callback runs in that thread like in the esp_timer task.
+ */
+struct esp_timer {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	esp_timer_cb_t callback;
+	void *arg;
+	bool armed;
+	int64_t due;
+	uint64_t period;
+};
+
+static void *timer_entry(void *arg)
+{
+	esp_timer_handle_t timer = arg;
+	pthread_mutex_lock(&timer->mutex);
+	while (true) {
+		if (timer->armed == false) {
+			pthread_cond_wait(&timer->cond, &timer->mutex);
+			continue;
+		}
+		struct timespec until = {
+			.tv_sec = timer->due / 1000000LL,
+			.tv_nsec = (timer->due % 1000000LL) * 1000,
+		};
+		if (pthread_cond_timedwait(&timer->cond, &timer->mutex, &until) != ETIMEDOUT) continue;
+		if (timer->armed == false || esp_timer_get_time() < timer->due) continue;
+		if (timer->period != 0) {
+			timer->due += timer->period;
+		} else {
+			timer->armed = false;
+		}
+		pthread_mutex_unlock(&timer->mutex);
+		timer->callback(timer->arg);
+		pthread_mutex_lock(&timer->mutex);
+	}
+	return NULL;
+}
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t *create_args, esp_timer_handle_t *out_handle)
+{
+	esp_timer_handle_t timer = calloc(1, sizeof(struct esp_timer));
+	if (timer == NULL) return ESP_ERR_NO_MEM;
+	timer->callback = create_args->callback;
+	timer->arg = create_args->arg;
+	sync_init(&timer->mutex, &timer->cond);
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, timer_entry, timer) != 0) {
+		free(timer);
+		return ESP_ERR_NO_MEM;
+	}
+	pthread_detach(thread);
+	*out_handle = timer;
+	return ESP_OK;
+}
+
+static esp_err_t timer_start(esp_timer_handle_t timer, uint64_t timeout_us, uint64_t period)
+{
+	pthread_mutex_lock(&timer->mutex);
+	if (timer->armed) {
+		pthread_mutex_unlock(&timer->mutex);
+		return ESP_ERR_INVALID_STATE;
+	}
+	timer->armed = true;
+	timer->due = esp_timer_get_time() + timeout_us;
+	timer->period = period;
+	pthread_cond_signal(&timer->cond);
+	pthread_mutex_unlock(&timer->mutex);
+	return ESP_OK;
+}
+
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us)
+{
+	return timer_start(timer, timeout_us, 0);
+}
+
+esp_err_t esp_timer_start_periodic(esp_timer_handle_t timer, uint64_t period)
+{
+	return timer_start(timer, period, period);
+}
+
+esp_err_t esp_timer_stop(esp_timer_handle_t timer)
+{
+	pthread_mutex_lock(&timer->mutex);
+	bool armed = timer->armed;
+	timer->armed = false;
+	pthread_cond_signal(&timer->cond);
+	pthread_mutex_unlock(&timer->mutex);
+	return armed ? ESP_OK : ESP_ERR_INVALID_STATE;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t pxTaskCode, const char *pcName, uint32_t usStackDepth, void *pvParameters, UBaseType_t uxPriority, TaskHandle_t *pxCreatedTask)
+{
+	TASK_START_t *start = malloc(sizeof(TASK_START_t));
+	if (start == NULL) return pdFAIL;
+	start->code = pxTaskCode;
+	start->parameters = pvParameters;
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, task_entry, start) != 0) {
+		free(start);
+		return pdFAIL;
+	}
+	pthread_detach(thread);
+	if (pxCreatedTask != NULL) *pxCreatedTask = (TaskHandle_t)thread;
+	return pdPASS;
+}
+
+void vTaskDelete(TaskHandle_t xTaskToDelete)
+{
+	if (xTaskToDelete == NULL) pthread_exit(NULL);
+	pthread_cancel((pthread_t)xTaskToDelete);
+}
+
+void vTaskDelay(TickType_t xTicksToDelay)
+{
+	usleep((useconds_t)xTicksToDelay * 1000);
+}
+
+TickType_t xTaskGetTickCount(void)
+{
+	return (TickType_t)(esp_timer_get_time() / 1000);
+}
+
+struct host_queue {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	UBaseType_t length;
+	UBaseType_t item_size;
+	UBaseType_t head;
+	UBaseType_t count;
+	uint8_t *items;
+};
+
+QueueHandle_t xQueueCreate(UBaseType_t uxQueueLength, UBaseType_t uxItemSize)
+{
+	QueueHandle_t queue = calloc(1, sizeof(struct host_queue));
+	if (queue == NULL) return NULL;
+	queue->items = malloc(uxQueueLength * uxItemSize);
+	if (queue->items == NULL) {
+		free(queue);
+		return NULL;
+	}
+	queue->length = uxQueueLength;
+	queue->item_size = uxItemSize;
+	sync_init(&queue->mutex, &queue->cond);
+	return queue;
+}
+
+BaseType_t xQueueSend(QueueHandle_t xQueue, const void *pvItemToQueue, TickType_t xTicksToWait)
+{
+	struct timespec until = deadline(xTicksToWait);
+	pthread_mutex_lock(&xQueue->mutex);
+	while (xQueue->count == xQueue->length) {
+		if (sync_wait(&xQueue->cond, &xQueue->mutex, &until, xTicksToWait) == false) {
+			pthread_mutex_unlock(&xQueue->mutex);
+			return pdFAIL;
+		}
+	}
+	UBaseType_t tail = (xQueue->head + xQueue->count) % xQueue->length;
+	memcpy(&xQueue->items[tail * xQueue->item_size], pvItemToQueue, xQueue->item_size);
+	xQueue->count++;
+	pthread_cond_broadcast(&xQueue->cond);
+	pthread_mutex_unlock(&xQueue->mutex);
+	return pdPASS;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t xQueue, void *pvBuffer, TickType_t xTicksToWait)
+{
+	struct timespec until = deadline(xTicksToWait);
+	pthread_mutex_lock(&xQueue->mutex);
+	while (xQueue->count == 0) {
+		if (sync_wait(&xQueue->cond, &xQueue->mutex, &until, xTicksToWait) == false) {
+			pthread_mutex_unlock(&xQueue->mutex);
+			return pdFAIL;
+		}
+	}
+	memcpy(pvBuffer, &xQueue->items[xQueue->head * xQueue->item_size], xQueue->item_size);
+	xQueue->head = (xQueue->head + 1) % xQueue->length;
+	xQueue->count--;
+	pthread_cond_broadcast(&xQueue->cond);
+	pthread_mutex_unlock(&xQueue->mutex);
+	return pdPASS;
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t xQueue)
+{
+	pthread_mutex_lock(&xQueue->mutex);
+	UBaseType_t count = xQueue->count;
+	pthread_mutex_unlock(&xQueue->mutex);
+	return count;
+}
+
+struct host_semaphore {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	UBaseType_t count;
+	UBaseType_t max_count;
+};
+
+SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t uxMaxCount, UBaseType_t uxInitialCount)
+{
+	SemaphoreHandle_t semaphore = calloc(1, sizeof(struct host_semaphore));
+	if (semaphore == NULL) return NULL;
+	semaphore->count = uxInitialCount;
+	semaphore->max_count = uxMaxCount;
+	sync_init(&semaphore->mutex, &semaphore->cond);
+	return semaphore;
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void)
+{
+	return xSemaphoreCreateCounting(1, 1);
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t xSemaphore, TickType_t xTicksToWait)
+{
+	struct timespec until = deadline(xTicksToWait);
+	pthread_mutex_lock(&xSemaphore->mutex);
+	while (xSemaphore->count == 0) {
+		if (sync_wait(&xSemaphore->cond, &xSemaphore->mutex, &until, xTicksToWait) == false) {
+			pthread_mutex_unlock(&xSemaphore->mutex);
+			return pdFALSE;
+		}
+	}
+	xSemaphore->count--;
+	pthread_mutex_unlock(&xSemaphore->mutex);
+	return pdTRUE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t xSemaphore)
+{
+	pthread_mutex_lock(&xSemaphore->mutex);
+	if (xSemaphore->count == xSemaphore->max_count) {
+		pthread_mutex_unlock(&xSemaphore->mutex);
+		return pdFALSE;
+	}
+	xSemaphore->count++;
+	pthread_cond_signal(&xSemaphore->cond);
+	pthread_mutex_unlock(&xSemaphore->mutex);
+	return pdTRUE;
+}
+
+struct host_event_group {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	EventBits_t bits;
+};
+
+EventGroupHandle_t xEventGroupCreate(void)
+{
+	EventGroupHandle_t group = calloc(1, sizeof(struct host_event_group));
+	if (group == NULL) return NULL;
+	sync_init(&group->mutex, &group->cond);
+	return group;
+}
+
+void vEventGroupDelete(EventGroupHandle_t xEventGroup)
+{
+	pthread_cond_destroy(&xEventGroup->cond);
+	pthread_mutex_destroy(&xEventGroup->mutex);
+	free(xEventGroup);
+}
+
+EventBits_t xEventGroupSetBits(EventGroupHandle_t xEventGroup, const EventBits_t uxBitsToSet)
+{
+	pthread_mutex_lock(&xEventGroup->mutex);
+	xEventGroup->bits |= uxBitsToSet;
+	EventBits_t bits = xEventGroup->bits;
+	pthread_cond_broadcast(&xEventGroup->cond);
+	pthread_mutex_unlock(&xEventGroup->mutex);
+	return bits;
+}
+
+EventBits_t xEventGroupClearBits(EventGroupHandle_t xEventGroup, const EventBits_t uxBitsToClear)
+{
+	pthread_mutex_lock(&xEventGroup->mutex);
+	EventBits_t bits = xEventGroup->bits;
+	xEventGroup->bits &= ~uxBitsToClear;
+	pthread_mutex_unlock(&xEventGroup->mutex);
+	return bits;
+}
+
+EventBits_t xEventGroupGetBits(EventGroupHandle_t xEventGroup)
+{
+	pthread_mutex_lock(&xEventGroup->mutex);
+	EventBits_t bits = xEventGroup->bits;
+	pthread_mutex_unlock(&xEventGroup->mutex);
+	return bits;
+}
+
+EventBits_t xEventGroupWaitBits(EventGroupHandle_t xEventGroup, const EventBits_t uxBitsToWaitFor, const BaseType_t xClearOnExit, const BaseType_t xWaitForAllBits, TickType_t xTicksToWait)
+{
+	struct timespec until = deadline(xTicksToWait);
+	pthread_mutex_lock(&xEventGroup->mutex);
+	while (1) {
+		EventBits_t match = xEventGroup->bits & uxBitsToWaitFor;
+		if (xWaitForAllBits ? (match == uxBitsToWaitFor) : (match != 0)) break;
+		if (sync_wait(&xEventGroup->cond, &xEventGroup->mutex, &until, xTicksToWait) == false) break;
+	}
+	EventBits_t bits = xEventGroup->bits;
+	EventBits_t match = bits & uxBitsToWaitFor;
+	if (xClearOnExit && (xWaitForAllBits ? (match == uxBitsToWaitFor) : (match != 0))) {
+		xEventGroup->bits &= ~uxBitsToWaitFor;
+	}
+	pthread_mutex_unlock(&xEventGroup->mutex);
+	return bits;
+}
+
+struct host_message_buffer {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	size_t size;
+	size_t head;
+	size_t used;
+	uint8_t *buffer;
+};
+
+static void ring_write(MessageBufferHandle_t xMessageBuffer, const void *data, size_t length)
+{
+	size_t tail = (xMessageBuffer->head + xMessageBuffer->used) % xMessageBuffer->size;
+	size_t first = xMessageBuffer->size - tail;
+	if (first > length) first = length;
+	memcpy(&xMessageBuffer->buffer[tail], data, first);
+	memcpy(xMessageBuffer->buffer, (const uint8_t *)data + first, length - first);
+	xMessageBuffer->used += length;
+}
+
+static void ring_read(MessageBufferHandle_t xMessageBuffer, void *data, size_t length)
+{
+	size_t first = xMessageBuffer->size - xMessageBuffer->head;
+	if (first > length) first = length;
+	memcpy(data, &xMessageBuffer->buffer[xMessageBuffer->head], first);
+	memcpy((uint8_t *)data + first, xMessageBuffer->buffer, length - first);
+	xMessageBuffer->head = (xMessageBuffer->head + length) % xMessageBuffer->size;
+	xMessageBuffer->used -= length;
+}
+
+MessageBufferHandle_t xMessageBufferCreate(size_t xBufferSizeBytes)
+{
+	MessageBufferHandle_t xMessageBuffer = calloc(1, sizeof(struct host_message_buffer));
+	if (xMessageBuffer == NULL) return NULL;
+	xMessageBuffer->buffer = malloc(xBufferSizeBytes);
+	if (xMessageBuffer->buffer == NULL) {
+		free(xMessageBuffer);
+		return NULL;
+	}
+	xMessageBuffer->size = xBufferSizeBytes;
+	sync_init(&xMessageBuffer->mutex, &xMessageBuffer->cond);
+	return xMessageBuffer;
+}
+
+size_t xMessageBufferSend(MessageBufferHandle_t xMessageBuffer, const void *pvTxData, size_t xDataLengthBytes, TickType_t xTicksToWait)
+{
+	size_t required = sizeof(size_t) + xDataLengthBytes;
+	if (required > xMessageBuffer->size) return 0;
+	struct timespec until = deadline(xTicksToWait);
+	pthread_mutex_lock(&xMessageBuffer->mutex);
+	while (xMessageBuffer->size - xMessageBuffer->used < required) {
+		if (sync_wait(&xMessageBuffer->cond, &xMessageBuffer->mutex, &until, xTicksToWait) == false) {
+			pthread_mutex_unlock(&xMessageBuffer->mutex);
+			return 0;
+		}
+	}
+	ring_write(xMessageBuffer, &xDataLengthBytes, sizeof(size_t));
+	ring_write(xMessageBuffer, pvTxData, xDataLengthBytes);
+	pthread_cond_broadcast(&xMessageBuffer->cond);
+	pthread_mutex_unlock(&xMessageBuffer->mutex);
+	return xDataLengthBytes;
+}
+
+size_t xMessageBufferReceive(MessageBufferHandle_t xMessageBuffer, void *pvRxData, size_t xBufferLengthBytes, TickType_t xTicksToWait)
+{
+	struct timespec until = deadline(xTicksToWait);
+	pthread_mutex_lock(&xMessageBuffer->mutex);
+	while (xMessageBuffer->used == 0) {
+		if (sync_wait(&xMessageBuffer->cond, &xMessageBuffer->mutex, &until, xTicksToWait) == false) {
+			pthread_mutex_unlock(&xMessageBuffer->mutex);
+			return 0;
+		}
+	}
+	// A message longer than the buffer stays queued, like FreeRTOS
+	size_t length;
+	size_t head = xMessageBuffer->head;
+	ring_read(xMessageBuffer, &length, sizeof(size_t));
+	if (length > xBufferLengthBytes) {
+		xMessageBuffer->head = head;
+		xMessageBuffer->used += sizeof(size_t);
+		pthread_mutex_unlock(&xMessageBuffer->mutex);
+		return 0;
+	}
+	ring_read(xMessageBuffer, pvRxData, length);
+	pthread_cond_broadcast(&xMessageBuffer->cond);
+	pthread_mutex_unlock(&xMessageBuffer->mutex);
+	return length;
+}
+
+size_t xMessageBufferSpacesAvailable(MessageBufferHandle_t xMessageBuffer)
+{
+	pthread_mutex_lock(&xMessageBuffer->mutex);
+	size_t space = xMessageBuffer->size - xMessageBuffer->used;
+	pthread_mutex_unlock(&xMessageBuffer->mutex);
+	return space;
+}
+
+BaseType_t xMessageBufferIsEmpty(MessageBufferHandle_t xMessageBuffer)
+{
+	pthread_mutex_lock(&xMessageBuffer->mutex);
+	bool empty = (xMessageBuffer->used == 0);
+	pthread_mutex_unlock(&xMessageBuffer->mutex);
+	return empty ? pdTRUE : pdFALSE;
+}
@@ -0,0 +1,54 @@
+#ifndef HOST_FREERTOS_H_
+#define HOST_FREERTOS_H_
+
+/*
+ * FreeRTOS API used by the bridge, implemented with POSIX threads.
+ * One tick is one millisecond.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef uint32_t TickType_t;
+// Stack depths are in bytes like on ESP-IDF
+typedef uint8_t StackType_t;
+
+/*
+ * Storage of the static create functions.
+ * The host objects are allocated on the heap, so only the type names are needed.
+ */
+typedef struct { uint8_t unused; } StaticTask_t;
+typedef struct { uint8_t unused; } StaticQueue_t;
+typedef struct { uint8_t unused; } StaticSemaphore_t;
+typedef struct { uint8_t unused; } StaticEventGroup_t;
+typedef struct { uint8_t unused; } StaticMessageBuffer_t;
+
+#define	pdPASS			1
+#define	pdFAIL			0
+#define	pdTRUE			1
+#define	pdFALSE			0
+#define	portMAX_DELAY		((TickType_t)0xFFFFFFFF)
+#define	configTICK_RATE_HZ	1000
+#define	portTICK_PERIOD_MS	1
+#define	pdMS_TO_TICKS(ms)	((TickType_t)(ms))
+#define	pdTICKS_TO_MS(ticks)	((uint32_t)(ticks))
+#define	configASSERT(x)		assert(x)
+
+#define	BIT0	0x00000001
+#define	BIT1	0x00000002
+#define	BIT2	0x00000004
+#define	BIT3	0x00000008
+#define	BIT4	0x00000010
+#define	BIT5	0x00000020
+#define	BIT6	0x00000040
+#define	BIT7	0x00000080
+
+#define	IRAM_ATTR
+
+#endif /* HOST_FREERTOS_H_ */
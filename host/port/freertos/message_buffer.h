@@ -0,0 +1,19 @@
+#ifndef HOST_MESSAGE_BUFFER_H_
+#define HOST_MESSAGE_BUFFER_H_
+
+#include "freertos/FreeRTOS.h"
+
+// Each message takes its length plus a size_t header, like FreeRTOS
+typedef struct host_message_buffer * MessageBufferHandle_t;
+
+MessageBufferHandle_t xMessageBufferCreate(size_t xBufferSizeBytes);
+static inline MessageBufferHandle_t xMessageBufferCreateStatic(size_t xBufferSizeBytes, uint8_t *pucMessageBufferStorageArea, StaticMessageBuffer_t *pxStaticMessageBuffer)
+{
+	return xMessageBufferCreate(xBufferSizeBytes);
+}
+size_t xMessageBufferSend(MessageBufferHandle_t xMessageBuffer, const void *pvTxData, size_t xDataLengthBytes, TickType_t xTicksToWait);
+size_t xMessageBufferReceive(MessageBufferHandle_t xMessageBuffer, void *pvRxData, size_t xBufferLengthBytes, TickType_t xTicksToWait);
+size_t xMessageBufferSpacesAvailable(MessageBufferHandle_t xMessageBuffer);
+BaseType_t xMessageBufferIsEmpty(MessageBufferHandle_t xMessageBuffer);
+
+#endif /* HOST_MESSAGE_BUFFER_H_ */
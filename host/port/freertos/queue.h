@@ -0,0 +1,17 @@
+#ifndef HOST_QUEUE_H_
+#define HOST_QUEUE_H_
+
+#include "freertos/FreeRTOS.h"
+
+typedef struct host_queue * QueueHandle_t;
+
+QueueHandle_t xQueueCreate(UBaseType_t uxQueueLength, UBaseType_t uxItemSize);
+static inline QueueHandle_t xQueueCreateStatic(UBaseType_t uxQueueLength, UBaseType_t uxItemSize, uint8_t *pucQueueStorage, StaticQueue_t *pxQueueBuffer)
+{
+	return xQueueCreate(uxQueueLength, uxItemSize);
+}
+BaseType_t xQueueSend(QueueHandle_t xQueue, const void *pvItemToQueue, TickType_t xTicksToWait);
+BaseType_t xQueueReceive(QueueHandle_t xQueue, void *pvBuffer, TickType_t xTicksToWait);
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t xQueue);
+
+#endif /* HOST_QUEUE_H_ */
@@ -0,0 +1,89 @@
+#ifndef HOST_MQTT_CLIENT_H_
+#define HOST_MQTT_CLIENT_H_
+
+/*
+ * esp_mqtt client API over a plain MQTT 3.1.1 TCP connection.
+ * Only mqtt:// URIs are supported, the packets are sent from the calling task
+ * and received by one task per client, which also raises the events.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "esp_event.h"
+
+typedef struct esp_mqtt_client * esp_mqtt_client_handle_t;
+
+typedef enum {
+	MQTT_EVENT_ANY = -1,
+	MQTT_EVENT_ERROR = 0,
+	MQTT_EVENT_CONNECTED,
+	MQTT_EVENT_DISCONNECTED,
+	MQTT_EVENT_SUBSCRIBED,
+	MQTT_EVENT_UNSUBSCRIBED,
+	MQTT_EVENT_PUBLISHED,
+	MQTT_EVENT_DATA,
+	MQTT_EVENT_BEFORE_CONNECT,
+	MQTT_EVENT_DELETED,
+} esp_mqtt_event_id_t;
+
+typedef struct esp_mqtt_event_t {
+	esp_mqtt_event_id_t event_id;
+	esp_mqtt_client_handle_t client;
+	char *data;
+	int data_len;
+	int total_data_len;
+	int current_data_offset;
+	char *topic;
+	int topic_len;
+	int msg_id;
+	int session_present;
+	bool retain;
+	int qos;
+	bool dup;
+} esp_mqtt_event_t;
+
+typedef esp_mqtt_event_t *esp_mqtt_event_handle_t;
+
+typedef struct {
+	const char *filter;
+	int qos;
+} esp_mqtt_topic_t;
+
+typedef struct {
+	struct {
+		struct {
+			const char *uri;
+		} address;
+		struct {
+			const char *certificate;
+		} verification;
+	} broker;
+	struct {
+		const char *username;
+		const char *client_id;
+		struct {
+			const char *password;
+		} authentication;
+	} credentials;
+	struct {
+		int keepalive;
+		bool disable_clean_session;
+	} session;
+	struct {
+		int reconnect_timeout_ms;
+	} network;
+} esp_mqtt_client_config_t;
+
+esp_mqtt_client_handle_t esp_mqtt_client_init(const esp_mqtt_client_config_t *config);
+esp_err_t esp_mqtt_client_register_event(esp_mqtt_client_handle_t client, int32_t event, esp_event_handler_t event_handler, void *event_handler_arg);
+esp_err_t esp_mqtt_client_start(esp_mqtt_client_handle_t client);
+esp_err_t esp_mqtt_client_stop(esp_mqtt_client_handle_t client);
+esp_err_t esp_mqtt_client_set_uri(esp_mqtt_client_handle_t client, const char *uri);
+esp_err_t esp_mqtt_client_disconnect(esp_mqtt_client_handle_t client);
+esp_err_t esp_mqtt_client_reconnect(esp_mqtt_client_handle_t client);
+int esp_mqtt_client_publish(esp_mqtt_client_handle_t client, const char *topic, const char *data, int len, int qos, int retain);
+int esp_mqtt_client_subscribe(esp_mqtt_client_handle_t client, const char *topic, int qos);
+int esp_mqtt_client_subscribe_multiple(esp_mqtt_client_handle_t client, const esp_mqtt_topic_t *topic_list, int size);
+
+#endif /* HOST_MQTT_CLIENT_H_ */
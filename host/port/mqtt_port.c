@@ -0,0 +1,484 @@
+/*
+	This code is in the Public Domain (or CC0 licensed, at your option.)
+
+	Unless required by applicable law or agreed to in writing, this
+	software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+	CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "mqtt_client.h"
+
+static const char *TAG = "MQTT_PORT";
+
+// MQTT 3.1.1 control packet types
+#define	MQTT_CONNECT		0x10
+#define	MQTT_CONNACK		0x20
+#define	MQTT_PUBLISH		0x30
+#define	MQTT_PUBACK		0x40
+#define	MQTT_SUBSCRIBE		0x82
+#define	MQTT_SUBACK		0x90
+#define	MQTT_PINGREQ		0xC0
+#define	MQTT_PINGRESP		0xD0
+#define	MQTT_DISCONNECT		0xE0
+
+#define	MQTT_KEEPALIVE_S	120
+#define	MQTT_RECONNECT_MS	10000
+
+struct esp_mqtt_client {
+	char host[128];
+	char port[8];
+	char client_id[64];
+	char *username;
+	char *password;
+	bool clean_session;
+	int keepalive_s;
+	int reconnect_ms;
+	esp_event_handler_t handler;
+	void *handler_args;
+
+	int sock;
+	volatile bool running;
+	volatile bool connected;
+	volatile bool reconnect;	// cuts the reconnect delay short
+	pthread_mutex_t send_lock;	// also held while an event is dispatched
+	uint16_t msg_id;
+	int64_t last_send;
+	uint8_t *rx_buffer;
+	size_t rx_size;
+};
+
+// Like esp_mqtt, the handler runs with the API lock held, so lock order bugs show up on the host
+static void raise_event(esp_mqtt_client_handle_t client, esp_mqtt_event_t *event)
+{
+	event->client = client;
+	pthread_mutex_lock(&client->send_lock);
+	if (client->handler != NULL) client->handler(client->handler_args, "MQTT_EVENTS", event->event_id, event);
+	pthread_mutex_unlock(&client->send_lock);
+}
+
+static bool send_all(esp_mqtt_client_handle_t client, const uint8_t *data, size_t length)
+{
+	while (length > 0) {
+		ssize_t sent = send(client->sock, data, length, MSG_NOSIGNAL);
+		if (sent <= 0) return false;
+		data += sent;
+		length -= sent;
+	}
+	client->last_send = esp_timer_get_time();
+	return true;
+}
+
+static bool recv_all(int sock, uint8_t *data, size_t length)
+{
+	while (length > 0) {
+		ssize_t received = recv(sock, data, length, 0);
+		if (received <= 0) return false;
+		data += received;
+		length -= received;
+	}
+	return true;
+}
+
+// Fixed header, returns its length
+static int put_header(uint8_t *buf, uint8_t type, size_t remaining)
+{
+	int len = 0;
+	buf[len++] = type;
+	do {
+		uint8_t digit = remaining % 128;
+		remaining /= 128;
+		if (remaining > 0) digit |= 0x80;
+		buf[len++] = digit;
+	} while (remaining > 0);
+	return len;
+}
+
+static int put_string(uint8_t *buf, const char *str, size_t str_len)
+{
+	buf[0] = str_len >> 8;
+	buf[1] = str_len & 0xFF;
+	memcpy(&buf[2], str, str_len);
+	return 2 + str_len;
+}
+
+static uint16_t next_msg_id(esp_mqtt_client_handle_t client)
+{
+	client->msg_id++;
+	if (client->msg_id == 0) client->msg_id = 1;
+	return client->msg_id;
+}
+
+static bool send_packet(esp_mqtt_client_handle_t client, const uint8_t *packet, size_t length)
+{
+	pthread_mutex_lock(&client->send_lock);
+	bool ret = client->sock >= 0 && send_all(client, packet, length);
+	pthread_mutex_unlock(&client->send_lock);
+	return ret;
+}
+
+// Parse host and port of a mqtt:// URI
+static bool parse_uri(esp_mqtt_client_handle_t client, const char *uri)
+{
+	if (uri == NULL || strncmp(uri, "mqtt://", 7) != 0) {
+		ESP_LOGE(TAG, "Only mqtt:// is supported [%s]", uri ? uri : "");
+		return false;
+	}
+	const char *host = uri + 7;
+	const char *colon = strrchr(host, ':');
+	size_t host_len = colon ? (size_t)(colon - host) : strlen(host);
+	if (host_len >= sizeof(client->host)) host_len = sizeof(client->host) - 1;
+	memcpy(client->host, host, host_len);
+	client->host[host_len] = 0;
+	snprintf(client->port, sizeof(client->port), "%s", colon ? colon + 1 : "1883");
+	return true;
+}
+
+static bool mqtt_connect(esp_mqtt_client_handle_t client)
+{
+	// esp_mqtt_client_set_uri may change them from another task
+	char host[128];
+	char port[8];
+	pthread_mutex_lock(&client->send_lock);
+	strcpy(host, client->host);
+	strcpy(port, client->port);
+	client->reconnect = false;
+	pthread_mutex_unlock(&client->send_lock);
+
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	struct addrinfo *result;
+	if (getaddrinfo(host, port, &hints, &result) != 0) {
+		ESP_LOGE(TAG, "getaddrinfo %s Fail", host);
+		return false;
+	}
+	int sock = -1;
+	for (struct addrinfo *ai=result;ai!=NULL;ai=ai->ai_next) {
+		sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (sock < 0) continue;
+		if (connect(sock, ai->ai_addr, ai->ai_addrlen) == 0) break;
+		close(sock);
+		sock = -1;
+	}
+	freeaddrinfo(result);
+	if (sock < 0) {
+		ESP_LOGE(TAG, "connect %s:%s Fail %s", host, port, strerror(errno));
+		return false;
+	}
+	// Frames are small, do not hold them back for coalescing
+	int on = 1;
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+	uint8_t packet[512];
+	uint8_t body[500];
+	int len = 0;
+	len += put_string(&body[len], "MQTT", 4);
+	body[len++] = 4;	// protocol level 3.1.1
+	uint8_t flags = client->clean_session ? 0x02 : 0x00;
+	if (client->username != NULL) flags |= 0x80;
+	if (client->password != NULL) flags |= 0x40;
+	body[len++] = flags;
+	body[len++] = client->keepalive_s >> 8;
+	body[len++] = client->keepalive_s & 0xFF;
+	len += put_string(&body[len], client->client_id, strlen(client->client_id));
+	if (client->username != NULL) len += put_string(&body[len], client->username, strlen(client->username));
+	if (client->password != NULL) len += put_string(&body[len], client->password, strlen(client->password));
+	int header_len = put_header(packet, MQTT_CONNECT, len);
+	memcpy(&packet[header_len], body, len);
+
+	pthread_mutex_lock(&client->send_lock);
+	client->sock = sock;
+	bool ret = send_all(client, packet, header_len + len);
+	pthread_mutex_unlock(&client->send_lock);
+	return ret;
+}
+
+static void mqtt_close(esp_mqtt_client_handle_t client)
+{
+	pthread_mutex_lock(&client->send_lock);
+	if (client->sock >= 0) close(client->sock);
+	client->sock = -1;
+	pthread_mutex_unlock(&client->send_lock);
+	if (client->connected) {
+		client->connected = false;
+		esp_mqtt_event_t event = { .event_id = MQTT_EVENT_DISCONNECTED };
+		raise_event(client, &event);
+	}
+}
+
+static void handle_packet(esp_mqtt_client_handle_t client, uint8_t type, uint8_t *body, size_t length)
+{
+	esp_mqtt_event_t event;
+	memset(&event, 0, sizeof(event));
+	switch (type & 0xF0) {
+		case MQTT_CONNACK:
+			if (length < 2 || body[1] != 0) {
+				ESP_LOGE(TAG, "connection refused %d", (length < 2) ? -1 : body[1]);
+				return;
+			}
+			client->connected = true;
+			event.event_id = MQTT_EVENT_CONNECTED;
+			event.session_present = body[0] & 0x01;
+			raise_event(client, &event);
+			break;
+		case MQTT_PUBLISH: {
+			if (length < 2) return;
+			int qos = (type >> 1) & 0x03;
+			size_t topic_len = (body[0] << 8) | body[1];
+			size_t offset = 2 + topic_len;
+			if (qos > 0) offset += 2;
+			if (offset > length) return;
+			event.event_id = MQTT_EVENT_DATA;
+			event.topic = (char *)&body[2];
+			event.topic_len = topic_len;
+			event.data = (char *)&body[offset];
+			event.data_len = length - offset;
+			event.total_data_len = event.data_len;
+			event.current_data_offset = 0;
+			event.qos = qos;
+			event.retain = type & 0x01;
+			if (qos > 0) event.msg_id = (body[2 + topic_len] << 8) | body[3 + topic_len];
+			raise_event(client, &event);
+			if (qos == 1) {
+				uint8_t puback[4] = {MQTT_PUBACK, 2, event.msg_id >> 8, event.msg_id & 0xFF};
+				send_packet(client, puback, sizeof(puback));
+			}
+			break;
+		}
+		case MQTT_PUBACK:
+			if (length < 2) return;
+			event.event_id = MQTT_EVENT_PUBLISHED;
+			event.msg_id = (body[0] << 8) | body[1];
+			raise_event(client, &event);
+			break;
+		case MQTT_SUBACK:
+			if (length < 2) return;
+			event.event_id = MQTT_EVENT_SUBSCRIBED;
+			event.msg_id = (body[0] << 8) | body[1];
+			raise_event(client, &event);
+			break;
+		case MQTT_PINGRESP:
+			break;
+		default:
+			ESP_LOGW(TAG, "Unexpected packet 0x%02x", type);
+			break;
+	}
+}
+
+// Read one packet, false when the connection is lost
+static bool read_packet(esp_mqtt_client_handle_t client)
+{
+	uint8_t type;
+	if (recv_all(client->sock, &type, 1) == false) return false;
+	size_t length = 0;
+	for (int shift=0;shift<28;shift+=7) {
+		uint8_t digit;
+		if (recv_all(client->sock, &digit, 1) == false) return false;
+		length |= (size_t)(digit & 0x7F) << shift;
+		if ((digit & 0x80) == 0) break;
+	}
+	if (length > client->rx_size) {
+		uint8_t *buffer = realloc(client->rx_buffer, length);
+		if (buffer == NULL) return false;
+		client->rx_buffer = buffer;
+		client->rx_size = length;
+	}
+	if (recv_all(client->sock, client->rx_buffer, length) == false) return false;
+	handle_packet(client, type, client->rx_buffer, length);
+	return true;
+}
+
+// Wait before the next connect, esp_mqtt_client_reconnect ends the wait
+static void reconnect_wait(esp_mqtt_client_handle_t client)
+{
+	for (int waited=0;waited<client->reconnect_ms;waited+=10) {
+		if (client->running == false || client->reconnect) break;
+		vTaskDelay(pdMS_TO_TICKS(10));
+	}
+}
+
+static void mqtt_task(void *pvParameters)
+{
+	esp_mqtt_client_handle_t client = pvParameters;
+	while (client->running) {
+		if (mqtt_connect(client) == false) {
+			mqtt_close(client);
+			reconnect_wait(client);
+			continue;
+		}
+		while (client->running) {
+			struct pollfd fds = { .fd = client->sock, .events = POLLIN };
+			int ready = poll(&fds, 1, 1000);
+			if (ready < 0) break;
+			if (ready > 0 && read_packet(client) == false) break;
+			int64_t idle_us = esp_timer_get_time() - client->last_send;
+			if (idle_us >= client->keepalive_s * 1000000LL / 2) {
+				uint8_t ping[2] = {MQTT_PINGREQ, 0};
+				if (send_packet(client, ping, sizeof(ping)) == false) break;
+			}
+		}
+		if (client->running) ESP_LOGW(TAG, "connection closed");
+		mqtt_close(client);
+		reconnect_wait(client);
+	}
+	vTaskDelete(NULL);
+}
+
+esp_mqtt_client_handle_t esp_mqtt_client_init(const esp_mqtt_client_config_t *config)
+{
+	esp_mqtt_client_handle_t client = calloc(1, sizeof(struct esp_mqtt_client));
+	if (client == NULL) return NULL;
+	if (parse_uri(client, config->broker.address.uri) == false) {
+		free(client);
+		return NULL;
+	}
+	if (config->credentials.client_id != NULL) {
+		snprintf(client->client_id, sizeof(client->client_id), "%s", config->credentials.client_id);
+	}
+	if (config->credentials.username != NULL) client->username = strdup(config->credentials.username);
+	if (config->credentials.authentication.password != NULL) client->password = strdup(config->credentials.authentication.password);
+	client->clean_session = !config->session.disable_clean_session;
+	client->keepalive_s = config->session.keepalive ? config->session.keepalive : MQTT_KEEPALIVE_S;
+	client->reconnect_ms = config->network.reconnect_timeout_ms ? config->network.reconnect_timeout_ms : MQTT_RECONNECT_MS;
+	client->sock = -1;
+	// Recursive like the API lock of esp_mqtt, a handler may publish
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&client->send_lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+	return client;
+}
+
+esp_err_t esp_mqtt_client_register_event(esp_mqtt_client_handle_t client, int32_t event, esp_event_handler_t event_handler, void *event_handler_arg)
+{
+	if (client == NULL) return ESP_ERR_INVALID_ARG;
+	client->handler = event_handler;
+	client->handler_args = event_handler_arg;
+	return ESP_OK;
+}
+
+esp_err_t esp_mqtt_client_start(esp_mqtt_client_handle_t client)
+{
+	if (client == NULL) return ESP_ERR_INVALID_ARG;
+	if (client->running) return ESP_FAIL;
+	client->running = true;
+	if (xTaskCreate(mqtt_task, "mqtt_task", 1024*6, client, 5, NULL) != pdPASS) {
+		client->running = false;
+		return ESP_FAIL;
+	}
+	return ESP_OK;
+}
+
+esp_err_t esp_mqtt_client_stop(esp_mqtt_client_handle_t client)
+{
+	if (client == NULL) return ESP_ERR_INVALID_ARG;
+	client->running = false;
+	uint8_t disconnect[2] = {MQTT_DISCONNECT, 0};
+	send_packet(client, disconnect, sizeof(disconnect));
+	pthread_mutex_lock(&client->send_lock);
+	if (client->sock >= 0) shutdown(client->sock, SHUT_RDWR);
+	pthread_mutex_unlock(&client->send_lock);
+	return ESP_OK;
+}
+
+// Used on the next connect
+esp_err_t esp_mqtt_client_set_uri(esp_mqtt_client_handle_t client, const char *uri)
+{
+	if (client == NULL) return ESP_ERR_INVALID_ARG;
+	pthread_mutex_lock(&client->send_lock);
+	bool ret = parse_uri(client, uri);
+	pthread_mutex_unlock(&client->send_lock);
+	return ret ? ESP_OK : ESP_FAIL;
+}
+
+esp_err_t esp_mqtt_client_disconnect(esp_mqtt_client_handle_t client)
+{
+	if (client == NULL) return ESP_ERR_INVALID_ARG;
+	uint8_t disconnect[2] = {MQTT_DISCONNECT, 0};
+	send_packet(client, disconnect, sizeof(disconnect));
+	pthread_mutex_lock(&client->send_lock);
+	if (client->sock >= 0) shutdown(client->sock, SHUT_RDWR);
+	pthread_mutex_unlock(&client->send_lock);
+	return ESP_OK;
+}
+
+esp_err_t esp_mqtt_client_reconnect(esp_mqtt_client_handle_t client)
+{
+	if (client == NULL) return ESP_ERR_INVALID_ARG;
+	client->reconnect = true;
+	return ESP_OK;
+}
+
+int esp_mqtt_client_publish(esp_mqtt_client_handle_t client, const char *topic, const char *data, int len, int qos, int retain)
+{
+	if (client == NULL || client->connected == false) return -1;
+	if (len == 0 && data != NULL) len = strlen(data);
+	size_t topic_len = strlen(topic);
+	size_t remaining = 2 + topic_len + (qos > 0 ? 2 : 0) + len;
+	uint8_t stack_packet[256];
+	uint8_t *packet = stack_packet;
+	if (remaining + 5 > sizeof(stack_packet)) {
+		packet = malloc(remaining + 5);
+		if (packet == NULL) return -1;
+	}
+	pthread_mutex_lock(&client->send_lock);
+	int msg_id = (qos > 0) ? next_msg_id(client) : 0;
+	int offset = put_header(packet, MQTT_PUBLISH | (qos << 1) | (retain ? 1 : 0), remaining);
+	offset += put_string(&packet[offset], topic, topic_len);
+	if (qos > 0) {
+		packet[offset++] = msg_id >> 8;
+		packet[offset++] = msg_id & 0xFF;
+	}
+	if (len > 0) memcpy(&packet[offset], data, len);
+	offset += len;
+	bool ret = client->sock >= 0 && send_all(client, packet, offset);
+	pthread_mutex_unlock(&client->send_lock);
+	if (packet != stack_packet) free(packet);
+	return ret ? msg_id : -1;
+}
+
+int esp_mqtt_client_subscribe_multiple(esp_mqtt_client_handle_t client, const esp_mqtt_topic_t *topic_list, int size)
+{
+	if (client == NULL || client->connected == false) return -1;
+	size_t remaining = 2;
+	for (int i=0;i<size;i++) remaining += 2 + strlen(topic_list[i].filter) + 1;
+	uint8_t *packet = malloc(remaining + 5);
+	if (packet == NULL) return -1;
+	pthread_mutex_lock(&client->send_lock);
+	int msg_id = next_msg_id(client);
+	int offset = put_header(packet, MQTT_SUBSCRIBE, remaining);
+	packet[offset++] = msg_id >> 8;
+	packet[offset++] = msg_id & 0xFF;
+	for (int i=0;i<size;i++) {
+		offset += put_string(&packet[offset], topic_list[i].filter, strlen(topic_list[i].filter));
+		packet[offset++] = topic_list[i].qos;
+	}
+	bool ret = client->sock >= 0 && send_all(client, packet, offset);
+	pthread_mutex_unlock(&client->send_lock);
+	free(packet);
+	return ret ? msg_id : -1;
+}
+
+int esp_mqtt_client_subscribe(esp_mqtt_client_handle_t client, const char *topic, int qos)
+{
+	esp_mqtt_topic_t topic_list = { .filter = topic, .qos = qos };
+	return esp_mqtt_client_subscribe_multiple(client, &topic_list, 1);
+}
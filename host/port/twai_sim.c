@@ -0,0 +1,262 @@
+/*
+	This code is in the Public Domain (or CC0 licensed, at your option.)
+
+	Unless required by applicable law or agreed to in writing, this
+	software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+	CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <linux/can.h>
+#include <linux/can/raw.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "twai_sim.h"
+
+static const char *TAG = "TWAI_SIM";
+
+/*
+ * The receive queue has the length of the driver configuration, so a bridge
+ * that cannot keep up loses frames the same way as on the chip.
+ * With SocketCAN the bridge owns one socket and the test side a second one,
+ * so frames written by either side are received by the other.
+ */
+static QueueHandle_t rx_queue;
+static twai_state_t state = TWAI_STATE_STOPPED;
+static twai_sim_tx_callback_t tx_callback;
+static volatile uint32_t rx_missed_count;
+
+// With a bit rate, a transmitted frame holds the simulated bus for its length
+static uint32_t bitrate;
+static int64_t bus_free_at;
+
+static char can_ifname[IFNAMSIZ];
+static int driver_socket = -1;
+static int peer_socket = -1;
+
+static int can_socket(const char *ifname)
+{
+	int sock = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+	if (sock < 0) return -1;
+	struct ifreq ifr;
+	memset(&ifr, 0, sizeof(ifr));
+	strncpy(ifr.ifr_name, ifname, IFNAMSIZ - 1);
+	struct sockaddr_can addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.can_family = AF_CAN;
+	if (ioctl(sock, SIOCGIFINDEX, &ifr) < 0) {
+		close(sock);
+		return -1;
+	}
+	addr.can_ifindex = ifr.ifr_ifindex;
+	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+static void to_can_frame(const twai_message_t *message, struct can_frame *frame)
+{
+	memset(frame, 0, sizeof(struct can_frame));
+	frame->can_id = message->identifier;
+	if (message->extd) frame->can_id |= CAN_EFF_FLAG;
+	if (message->rtr) frame->can_id |= CAN_RTR_FLAG;
+	frame->can_dlc = (message->data_length_code > CAN_MAX_DLEN) ? CAN_MAX_DLEN : message->data_length_code;
+	memcpy(frame->data, message->data, frame->can_dlc);
+}
+
+static void from_can_frame(const struct can_frame *frame, twai_message_t *message)
+{
+	memset(message, 0, sizeof(twai_message_t));
+	message->extd = (frame->can_id & CAN_EFF_FLAG) ? 1 : 0;
+	message->rtr = (frame->can_id & CAN_RTR_FLAG) ? 1 : 0;
+	message->identifier = frame->can_id & (message->extd ? CAN_EFF_MASK : CAN_SFF_MASK);
+	message->data_length_code = frame->can_dlc;
+	memcpy(message->data, frame->data, frame->can_dlc);
+}
+
+static bool rx_queue_put(const twai_message_t *message)
+{
+	if (state != TWAI_STATE_RUNNING || xQueueSend(rx_queue, message, 0) != pdPASS) {
+		rx_missed_count++;
+		return false;
+	}
+	return true;
+}
+
+// Frames from the interface into the receive queue of the driver
+static void driver_reader_task(void *pvParameters)
+{
+	struct can_frame frame;
+	while (read(driver_socket, &frame, sizeof(frame)) == sizeof(frame)) {
+		if (frame.can_id & CAN_ERR_FLAG) continue;
+		twai_message_t message;
+		from_can_frame(&frame, &message);
+		rx_queue_put(&message);
+	}
+	ESP_LOGE(TAG, "read %s Fail %s", can_ifname, strerror(errno));
+	vTaskDelete(NULL);
+}
+
+// Frames the bridge transmitted, seen from the test side of the interface
+static void peer_reader_task(void *pvParameters)
+{
+	struct can_frame frame;
+	while (read(peer_socket, &frame, sizeof(frame)) == sizeof(frame)) {
+		if (frame.can_id & CAN_ERR_FLAG) continue;
+		twai_message_t message;
+		from_can_frame(&frame, &message);
+		if (tx_callback != NULL) tx_callback(&message);
+	}
+	ESP_LOGE(TAG, "read %s Fail %s", can_ifname, strerror(errno));
+	vTaskDelete(NULL);
+}
+
+esp_err_t twai_sim_open(const char *ifname)
+{
+	strncpy(can_ifname, ifname, IFNAMSIZ - 1);
+	driver_socket = can_socket(ifname);
+	peer_socket = can_socket(ifname);
+	if (driver_socket < 0 || peer_socket < 0) {
+		ESP_LOGE(TAG, "Failed to open %s %s", ifname, strerror(errno));
+		return ESP_FAIL;
+	}
+	ESP_LOGI(TAG, "Using SocketCAN interface %s", ifname);
+	return ESP_OK;
+}
+
+void twai_sim_set_tx_callback(twai_sim_tx_callback_t callback)
+{
+	tx_callback = callback;
+}
+
+void twai_sim_set_bitrate(uint32_t bits_per_second)
+{
+	bitrate = bits_per_second;
+}
+
+// Bits of a data frame without stuffing, with the 3 bits of intermission
+static uint32_t frame_bits(const twai_message_t *message)
+{
+	uint32_t bits = message->extd ? 67 : 47;
+	if (message->rtr == 0) bits += 8 * message->data_length_code;
+	return bits;
+}
+
+// Only the TX task of the bridge transmits, so the bus needs no lock
+static void bus_occupy(const twai_message_t *message)
+{
+	int64_t now = esp_timer_get_time();
+	if (bus_free_at < now) bus_free_at = now;
+	bus_free_at += (int64_t)frame_bits(message) * 1000000 / bitrate;
+	int64_t wait = bus_free_at - esp_timer_get_time();
+	if (wait > 0) usleep(wait);
+}
+
+bool twai_sim_inject(const twai_message_t *message)
+{
+	if (peer_socket >= 0) {
+		struct can_frame frame;
+		to_can_frame(message, &frame);
+		return (write(peer_socket, &frame, sizeof(frame)) == sizeof(frame));
+	}
+	return rx_queue_put(message);
+}
+
+bool twai_sim_running(void)
+{
+	return (state == TWAI_STATE_RUNNING);
+}
+
+esp_err_t twai_driver_install(const twai_general_config_t *g_config, const twai_timing_config_t *t_config, const twai_filter_config_t *f_config)
+{
+	if (rx_queue != NULL) return ESP_ERR_INVALID_STATE;
+	rx_queue = xQueueCreate(g_config->rx_queue_len, sizeof(twai_message_t));
+	if (rx_queue == NULL) return ESP_ERR_NO_MEM;
+	if (driver_socket >= 0) {
+		xTaskCreate(driver_reader_task, "can_rx", 1024*2, NULL, 5, NULL);
+		xTaskCreate(peer_reader_task, "can_peer", 1024*2, NULL, 5, NULL);
+	}
+	return ESP_OK;
+}
+
+esp_err_t twai_driver_uninstall(void)
+{
+	if (state != TWAI_STATE_STOPPED) return ESP_ERR_INVALID_STATE;
+	return ESP_OK;
+}
+
+esp_err_t twai_start(void)
+{
+	if (rx_queue == NULL || state == TWAI_STATE_RUNNING) return ESP_ERR_INVALID_STATE;
+	state = TWAI_STATE_RUNNING;
+	return ESP_OK;
+}
+
+esp_err_t twai_stop(void)
+{
+	if (state != TWAI_STATE_RUNNING) return ESP_ERR_INVALID_STATE;
+	state = TWAI_STATE_STOPPED;
+	return ESP_OK;
+}
+
+esp_err_t twai_transmit(const twai_message_t *message, TickType_t ticks_to_wait)
+{
+	if (state != TWAI_STATE_RUNNING) return ESP_ERR_INVALID_STATE;
+	if (message->data_length_code > TWAI_FRAME_MAX_DLC) return ESP_ERR_INVALID_ARG;
+	if (driver_socket >= 0) {
+		struct can_frame frame;
+		to_can_frame(message, &frame);
+		if (write(driver_socket, &frame, sizeof(frame)) != sizeof(frame)) return ESP_FAIL;
+	} else {
+		if (bitrate != 0) bus_occupy(message);
+		if (tx_callback != NULL) tx_callback(message);
+	}
+	return ESP_OK;
+}
+
+esp_err_t twai_receive(twai_message_t *message, TickType_t ticks_to_wait)
+{
+	if (rx_queue == NULL) return ESP_ERR_INVALID_STATE;
+	if (xQueueReceive(rx_queue, message, ticks_to_wait) != pdPASS) return ESP_ERR_TIMEOUT;
+	return ESP_OK;
+}
+
+// The simulated bus has no errors, so there are never alerts
+esp_err_t twai_read_alerts(uint32_t *alerts, TickType_t ticks_to_wait)
+{
+	*alerts = 0;
+	if (ticks_to_wait != 0) vTaskDelay(ticks_to_wait);
+	return ESP_ERR_TIMEOUT;
+}
+
+esp_err_t twai_reconfigure_alerts(uint32_t alerts_enabled, uint32_t *current_alerts)
+{
+	if (current_alerts != NULL) *current_alerts = 0;
+	return ESP_OK;
+}
+
+esp_err_t twai_initiate_recovery(void)
+{
+	return ESP_ERR_INVALID_STATE;
+}
+
+esp_err_t twai_get_status_info(twai_status_info_t *status_info)
+{
+	memset(status_info, 0, sizeof(twai_status_info_t));
+	status_info->state = state;
+	if (rx_queue != NULL) status_info->msgs_to_rx = uxQueueMessagesWaiting(rx_queue);
+	status_info->rx_missed_count = rx_missed_count;
+	return ESP_OK;
+}
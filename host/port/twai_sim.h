@@ -0,0 +1,19 @@
+#ifndef TWAI_SIM_H_
+#define TWAI_SIM_H_
+
+#include <stdbool.h>
+#include "driver/twai.h"
+
+// Called for every frame the bridge transmits on the simulated bus
+typedef void (*twai_sim_tx_callback_t)(const twai_message_t *message);
+
+// Use a SocketCAN interface such as vcan0 instead of the simulated bus, before twai_driver_install
+esp_err_t twai_sim_open(const char *ifname);
+void twai_sim_set_tx_callback(twai_sim_tx_callback_t callback);
+// Transmitted frames take their time on the simulated bus at this rate, 0 is no time
+void twai_sim_set_bitrate(uint32_t bits_per_second);
+// Put a frame on the simulated bus, false when the receive queue of the driver is full
+bool twai_sim_inject(const twai_message_t *message);
+bool twai_sim_running(void);
+
+#endif /* TWAI_SIM_H_ */
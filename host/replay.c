@@ -0,0 +1,399 @@
+/*
+	This code is in the Public Domain (or CC0 licensed, at your option.)
+
+	Unless required by applicable law or agreed to in writing, this
+	software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+	CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <getopt.h>
+#include <unistd.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_err.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "mqtt_client.h"
+#include "twai_sim.h"
+
+#include "mqtt.h"
+#include "frame.h"
+#include "harness.h"
+
+static const char *TAG = "REPLAY";
+
+/*
+ * Replay of a candump log into the receive path of the bridge.
+ * Every frame whose CAN ID is in can2mqtt.csv is expected on its topic with the same data.
+ * The bridge keeps the order of the frames, so a received message is matched with
+ * the oldest frame of that topic with the same data that has not been received yet.
+ */
+
+// A frame this many frames of the same topic behind a received one is counted as lost
+#define	MATCH_WINDOW	256
+
+#define	STATE_PENDING	0	// not injected yet
+#define	STATE_INJECTED	1
+#define	STATE_REFUSED	2	// receive queue of the driver was full
+#define	STATE_RECEIVED	3
+
+typedef struct {
+	int64_t time_us;	// time stamp of the log
+	uint32_t canid;
+	uint8_t extd;
+	uint8_t rtr;
+	uint8_t dlc;
+	uint8_t state;
+	uint8_t data[8];
+	int16_t row;		// can2mqtt row, -1 when the frame is not published
+	uint32_t position;	// index among the frames of the same row
+	int32_t next;		// next frame of the same row, -1 at the end
+	int64_t sent_at;
+	int32_t latency_us;
+} REPLAY_FRAME_t;
+
+static REPLAY_FRAME_t *frames;
+static uint32_t nframes;
+static uint32_t skipped_lines;
+
+typedef struct {
+	int32_t first;		// first frame not received or refused yet
+	int32_t last;
+	uint32_t expected;
+	uint32_t received;
+} ROW_t;
+
+static ROW_t *rows;
+
+static volatile bool warm;
+static volatile bool replaying;
+static volatile uint32_t received;
+static volatile uint32_t reordered;
+static volatile uint32_t unexpected;
+static volatile int64_t last_received;
+static int32_t max_index;
+
+static int8_t hex_digit(char c)
+{
+	if (c >= '0' && c <= '9') return c - '0';
+	if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+	return -1;
+}
+
+/*
+ * One line of candump -l
+ * (1436509052.249713) can0 123#11223344
+ * (1436509052.249713) can0 12345678#R
+ * CAN FD (##) and error frames are skipped, the legacy driver only receives classic frames.
+ */
+static bool parse_line(char *line, REPLAY_FRAME_t *frame)
+{
+	char *sp = line;
+	if (*sp++ != '(') return false;
+	char *end;
+	int64_t sec = strtoll(sp, &end, 10);
+	if (end == sp || *end != '.') return false;
+	sp = end + 1;
+	int64_t usec = strtoll(sp, &end, 10);
+	int digits = end - sp;
+	if (digits == 0 || *end != ')') return false;
+	for (;digits<6;digits++) usec *= 10;
+	for (;digits>6;digits--) usec /= 10;
+	frame->time_us = sec * 1000000LL + usec;
+
+	// Interface name
+	sp = end + 1;
+	while (*sp == ' ') sp++;
+	while (*sp != ' ' && *sp != 0) sp++;
+	while (*sp == ' ') sp++;
+
+	char *hash = strchr(sp, '#');
+	if (hash == NULL || hash[1] == '#') return false;
+	int id_len = hash - sp;
+	if (id_len != 3 && id_len != 8) return false;
+	frame->canid = strtoul(sp, &end, 16);
+	if (end != hash) return false;
+	frame->extd = (id_len == 8);
+	if (frame->extd && frame->canid > 0x1FFFFFFF) return false;
+
+	sp = hash + 1;
+	frame->rtr = 0;
+	frame->dlc = 0;
+	memset(frame->data, 0, sizeof(frame->data));
+	if (*sp == 'R') {
+		frame->rtr = 1;
+		if (hex_digit(sp[1]) >= 0 && hex_digit(sp[1]) <= 8) frame->dlc = hex_digit(sp[1]);
+		return true;
+	}
+	while (hex_digit(sp[0]) >= 0 && hex_digit(sp[1]) >= 0) {
+		if (frame->dlc == 8) return false;
+		frame->data[frame->dlc++] = hex_digit(sp[0]) << 4 | hex_digit(sp[1]);
+		sp += 2;
+		if (*sp == '.') sp++;
+	}
+	return true;
+}
+
+static int16_t find_row(uint32_t canid, uint8_t extd)
+{
+	for(int index=0;index<npublish;index++) {
+		if (publish[index].frame != extd) continue;
+		if (publish[index].fdf != 0) continue;
+		if (publish[index].canid == canid) return index;
+	}
+	return -1;
+}
+
+static esp_err_t load_log(const char *file, uint32_t limit)
+{
+	FILE* f = fopen(file, "r");
+	if (f == NULL) {
+		ESP_LOGE(TAG, "Failed to open %s", file);
+		return ESP_FAIL;
+	}
+	uint32_t size = 4096;
+	frames = malloc(size * sizeof(REPLAY_FRAME_t));
+	rows = calloc(npublish, sizeof(ROW_t));
+	if (frames == NULL || rows == NULL) return ESP_ERR_NO_MEM;
+	for(int index=0;index<npublish;index++) {
+		rows[index].first = -1;
+		rows[index].last = -1;
+	}
+
+	char line[256];
+	while (fgets(line, sizeof(line), f) != NULL) {
+		char* pos = strchr(line, '\n');
+		if (pos) *pos = '\0';
+		if (strlen(line) == 0) continue;
+		if (nframes == size) {
+			size *= 2;
+			REPLAY_FRAME_t *resized = realloc(frames, size * sizeof(REPLAY_FRAME_t));
+			if (resized == NULL) return ESP_ERR_NO_MEM;
+			frames = resized;
+		}
+		REPLAY_FRAME_t *frame = &frames[nframes];
+		if (parse_line(line, frame) == false) {
+			ESP_LOGD(TAG, "skip [%s]", line);
+			skipped_lines++;
+			continue;
+		}
+		frame->state = STATE_PENDING;
+		frame->next = -1;
+		frame->latency_us = -1;
+		frame->row = find_row(frame->canid, frame->extd);
+		if (frame->row >= 0) {
+			ROW_t *row = &rows[frame->row];
+			if (row->last >= 0) frames[row->last].next = nframes;
+			if (row->first < 0) row->first = nframes;
+			row->last = nframes;
+			frame->position = row->expected++;
+		}
+		nframes++;
+		if (limit != 0 && nframes == limit) break;
+	}
+	fclose(f);
+	return ESP_OK;
+}
+
+static void on_data(const char *topic, int topic_len, const uint8_t *data, int data_len)
+{
+	int64_t now = esp_timer_get_time();
+	if (replaying == false) {
+		warm = true;
+		return;
+	}
+	int16_t index;
+	for(index=0;index<npublish;index++) {
+		if (publish[index].topic_len == topic_len && strncmp(publish[index].topic, topic, topic_len) == 0) break;
+	}
+	if (index == npublish) return;
+	ROW_t *row = &rows[index];
+
+	// Only frames that have been injected can come back
+	int32_t match = -1;
+	int32_t candidate = row->first;
+	while (candidate >= 0 && frames[candidate].state != STATE_PENDING) {
+		REPLAY_FRAME_t *frame = &frames[candidate];
+		if (frame->state == STATE_INJECTED) {
+			int16_t len = frame->rtr ? 0 : frame->dlc;
+			if (len == data_len && memcmp(frame->data, data, len) == 0) {
+				match = candidate;
+				break;
+			}
+		}
+		candidate = frame->next;
+	}
+	if (match < 0) {
+		unexpected++;
+		return;
+	}
+	REPLAY_FRAME_t *frame = &frames[match];
+	frame->state = STATE_RECEIVED;
+	frame->latency_us = now - frame->sent_at;
+	if (match < max_index) {
+		reordered++;
+	} else {
+		max_index = match;
+	}
+	row->received++;
+	received++;
+	last_received = now;
+	// Skip the frames that are done or too old to arrive out of order
+	while (row->first >= 0) {
+		REPLAY_FRAME_t *first = &frames[row->first];
+		if (first->state < STATE_REFUSED && first->position + MATCH_WINDOW > frame->position) break;
+		row->first = first->next;
+	}
+}
+
+static bool inject(REPLAY_FRAME_t *frame, bool wait)
+{
+	twai_message_t message;
+	memset(&message, 0, sizeof(message));
+	message.identifier = frame->canid;
+	message.extd = frame->extd;
+	message.rtr = frame->rtr;
+	message.data_length_code = frame->dlc;
+	memcpy(message.data, frame->data, frame->dlc);
+	// The state is set first, the frame may come back before twai_sim_inject returns
+	frame->sent_at = esp_timer_get_time();
+	frame->state = STATE_INJECTED;
+	while (twai_sim_inject(&message) == false) {
+		if (wait == false) {
+			frame->state = STATE_REFUSED;
+			return false;
+		}
+		usleep(20);
+	}
+	return true;
+}
+
+static int compare_latency(const void *a, const void *b)
+{
+	int32_t latency1 = *(const int32_t *)a;
+	int32_t latency2 = *(const int32_t *)b;
+	return (latency1 > latency2) - (latency1 < latency2);
+}
+
+static void usage(const char *program)
+{
+	printf("usage: %s [options] FILE.log\n", program);
+	harness_usage();
+	printf("  -x SPEED   1 plays at the original timing, 10 ten times faster, 0 as fast as the bridge accepts (default 1)\n");
+	printf("  -n COUNT   replay only the first COUNT frames of the log\n");
+}
+
+int main(int argc, char *argv[])
+{
+	double speed = 1;
+	uint32_t limit = 0;
+	esp_log_level_set("*", ESP_LOG_WARN);
+
+	int opt;
+	while ((opt = getopt(argc, argv, HARNESS_OPTIONS "x:n:h")) != -1) {
+		if (harness_option(opt, optarg)) continue;
+		switch (opt) {
+			case 'x': speed = atof(optarg); break;
+			case 'n': limit = strtoul(optarg, NULL, 10); break;
+			default: usage(argv[0]); return 1;
+		}
+	}
+	if (optind != argc - 1 || speed < 0) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	esp_mqtt_client_handle_t client = harness_start(on_data);
+	if (client == NULL) return 1;
+	if (load_log(argv[optind], limit) != ESP_OK) return 1;
+	if (nframes == 0) {
+		ESP_LOGE(TAG, "No frames in %s", argv[optind]);
+		return 1;
+	}
+	uint32_t expected = 0;
+	for(int index=0;index<npublish;index++) expected += rows[index].expected;
+	if (expected == 0) {
+		ESP_LOGE(TAG, "No frame of the log is in can2mqtt.csv");
+		return 1;
+	}
+
+	// Wait until the bridge publishes, with a frame the replay expects anyway
+	for (int retry=0;retry<100 && warm==false;retry++) {
+		for (uint32_t i=0;i<nframes;i++) {
+			if (frames[i].row < 0) continue;
+			REPLAY_FRAME_t frame = frames[i];
+			inject(&frame, false);
+			break;
+		}
+		vTaskDelay(pdMS_TO_TICKS(100));
+	}
+	if (warm == false) {
+		ESP_LOGE(TAG, "The bridge did not publish a frame");
+		return 1;
+	}
+	vTaskDelay(pdMS_TO_TICKS(500));
+	replaying = true;
+
+	double trace_s = (frames[nframes-1].time_us - frames[0].time_us) / 1000000.0;
+	printf("log=%s frames=%"PRIu32" published=%"PRIu32" skipped lines=%"PRIu32" duration=%.3fs\n",
+		argv[optind], nframes, expected, skipped_lines, trace_s);
+
+	int64_t start = esp_timer_get_time();
+	uint32_t refused = 0;
+	for (uint32_t i=0;i<nframes;i++) {
+		if (speed > 0) {
+			int64_t due = start + (int64_t)((frames[i].time_us - frames[0].time_us) / speed);
+			int64_t wait = due - esp_timer_get_time();
+			if (wait > 0) usleep(wait);
+		}
+		if (inject(&frames[i], speed == 0) == false) refused++;
+	}
+	double replay_s = (esp_timer_get_time() - start) / 1000000.0;
+
+	// Wait until every published frame is in or nothing has arrived for a second
+	int64_t idle_since = esp_timer_get_time();
+	uint32_t last_count = 0;
+	while (esp_timer_get_time() - idle_since < 1000000) {
+		if (received + unexpected == last_count) {
+			usleep(10000);
+			continue;
+		}
+		last_count = received + unexpected;
+		idle_since = esp_timer_get_time();
+	}
+	replaying = false;
+
+	uint32_t refused_expected = 0;
+	int32_t *latency = malloc(sizeof(int32_t) * (received + 1));
+	configASSERT( latency );
+	uint32_t count = 0;
+	for (uint32_t i=0;i<nframes;i++) {
+		if (frames[i].row < 0) continue;
+		if (frames[i].state == STATE_REFUSED) refused_expected++;
+		if (frames[i].state == STATE_RECEIVED && count < received) latency[count++] = frames[i].latency_us;
+	}
+	qsort(latency, count, sizeof(int32_t), compare_latency);
+	uint32_t lost = expected - count;
+
+	printf("replay duration=%.3fs (%.2fx) refused by driver queue=%"PRIu32"\n", replay_s, replay_s > 0 ? trace_s / replay_s : 0, refused);
+	printf("expected=%"PRIu32" received=%"PRIu32" lost=%"PRIu32" (refused=%"PRIu32") drop rate=%.3f%% reordered=%"PRIu32" unexpected=%"PRIu32"\n",
+		expected, count, lost, refused_expected, 100.0 * lost / expected, reordered, unexpected);
+	if (count != 0) {
+		printf("throughput=%.1f frames/s\n", count / ((last_received - start) / 1000000.0));
+		printf("latency us p50=%"PRId32" p90=%"PRId32" p99=%"PRId32" max=%"PRId32"\n",
+			latency[count * 50 / 100], latency[count * 90 / 100], latency[count * 99 / 100], latency[count - 1]);
+	}
+	for(int index=0;index<npublish;index++) {
+		if (rows[index].received == rows[index].expected) continue;
+		printf("  %s expected=%"PRIu32" received=%"PRIu32"\n", publish[index].topic, rows[index].expected, rows[index].received);
+	}
+	free(latency);
+	esp_mqtt_client_stop(client);
+	return (lost == 0 && unexpected == 0) ? 0 : 2;
+}
@@ -0,0 +1,46 @@
+#ifndef HOST_SDKCONFIG_H_
+#define HOST_SDKCONFIG_H_
+
+/*
+ * Configuration of the host build, the defaults of Kconfig.projbuild.
+ * Included before every source file by CMakeLists.txt.
+ */
+
+#define	CONFIG_CAN_BITRATE_500		1
+#define	CONFIG_TWAI_BITRATE		500000
+#define	CONFIG_CTX_GPIO			21
+#define	CONFIG_CRX_GPIO			22
+
+// The broker is given on the command line of bridge_bench
+extern char host_mqtt_broker[];
+extern int host_mqtt_port;
+extern char host_mqtt_failover[];
+#define	CONFIG_MQTT_TRANSPORT_OVER_TCP	1
+#define	CONFIG_MQTT_BROKER		host_mqtt_broker
+#define	CONFIG_MQTT_PORT_TCP		host_mqtt_port
+#define	CONFIG_MQTT_RECONNECT_MS	1000
+#define	CONFIG_MQTT_RESOLVE_TTL		300
+// The failover list is empty unless -F is given
+#define	CONFIG_MQTT_FAILOVER_ENABLE	1
+#define	CONFIG_MQTT_BROKER_FAILOVER	host_mqtt_failover
+#define	CONFIG_MQTT_FAILOVER_MS		3000
+#define	CONFIG_MQTT_BROKER_STANDBY	1
+#define	CONFIG_MQTT_INFLIGHT		32
+
+#define	CONFIG_TX_STARVATION_LIMIT	16
+#define	CONFIG_BUS_STATUS_TOPIC		"/can/status/bus"
+#define	CONFIG_BUS_BACKOFF_MIN_MS	100
+#define	CONFIG_BUS_BACKOFF_MAX_MS	10000
+#define	CONFIG_ARENA_SIZE		65536
+
+#define	CONFIG_BULK_ENABLE		1
+#define	CONFIG_BULK_TOPIC		"/can/bulk"
+#define	CONFIG_BULK_STATUS_TOPIC	"/can/status/bulk"
+
+// Sessions are read from the file given with -T
+#define	CONFIG_ISOTP_ENABLE		1
+#define	CONFIG_ISOTP_BUFFERS		4
+#define	CONFIG_ISOTP_BLOCK_SIZE		0
+#define	CONFIG_ISOTP_STMIN		0
+
+#endif /* HOST_SDKCONFIG_H_ */
@@ -0,0 +1,472 @@
+/*
+	This code is in the Public Domain (or CC0 licensed, at your option.)
+
+	Unless required by applicable law or agreed to in writing, this
+	software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+	CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <signal.h>
+#include <math.h>
+#include <malloc.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_err.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "mqtt_client.h"
+
+#include "mqtt.h"
+#include "frame.h"
+#include "harness.h"
+#include "arena.h"
+
+static const char *TAG = "SOAK";
+
+/*
+ * Load generator for long runs of the host build.
+ * Unlike bridge_bench it keeps no per-frame history, so it runs for hours:
+ * the send time of a sequence number is kept in a ring until the frame comes back
+ * or LOSS_TIMEOUT_US passes, and latencies go to histograms.
+ * With -R the rate of each direction goes up every interval until the bridge
+ * stops keeping up, which gives the saturation point of that direction.
+ */
+
+// A frame that has not come back after this time is lost
+#define	LOSS_TIMEOUT_US	5000000
+
+// Send times in flight per direction, enough for LOSS_TIMEOUT_US at 400k frames/s
+#define	RING_SIZE	(1 << 21)
+
+// 16 buckets per power of two, about 6% resolution
+#define	HIST_SUB	16
+#define	HIST_BUCKETS	(HIST_SUB + (32 - 4) * HIST_SUB)
+
+typedef struct {
+	uint32_t sequence;
+	int64_t sent_at;	// 0 once received or lost
+} SLOT_t;
+
+typedef struct {
+	uint64_t sent;
+	uint64_t refused;	// not accepted by the driver receive queue or the MQTT client
+	uint64_t received;
+	uint64_t lost;
+	uint32_t histogram[HIST_BUCKETS];
+} STATS_t;
+
+typedef struct {
+	const char *name;
+	double rate;		// frames per second, 0 when the direction is off
+	double ramp_rate;	// last rate that kept up in ramp mode
+	bool saturated;
+	volatile bool warm;
+	uint32_t sequence;	// next sequence number
+	uint32_t sweep;		// oldest sequence number that may still come back
+	int64_t due;
+	SLOT_t *ring;
+	STATS_t interval;
+	STATS_t total;
+} DIRECTION_t;
+
+static DIRECTION_t direction[2] = {
+	{ .name = "up" },
+	{ .name = "down" },
+};
+
+static volatile sig_atomic_t stop;
+
+// Cumulative distribution over the rows of one table
+static double *cdf[2];
+
+// CAN IDs that are in no can2mqtt row, sent as background traffic the bridge filters out
+#define	NOISE_IDS	32
+static uint32_t noise_id[NOISE_IDS];
+static int nnoise;
+
+static uint32_t random_state = 1;
+
+static uint32_t random_next(void)
+{
+	// xorshift32, the same load on every run
+	uint32_t x = random_state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	random_state = x;
+	return x;
+}
+
+static double random_unit(void)
+{
+	return (random_next() >> 8) / 16777216.0;
+}
+
+// Row i gets weight 1/(i+1)^skew, 0 is uniform
+static double *build_cdf(int16_t rows, double skew)
+{
+	double *table = malloc(rows * sizeof(double));
+	configASSERT( table );
+	double sum = 0;
+	for (int i=0;i<rows;i++) {
+		sum += 1.0 / pow(i + 1, skew);
+		table[i] = sum;
+	}
+	for (int i=0;i<rows;i++) table[i] /= sum;
+	return table;
+}
+
+static int16_t pick_row(int dir, int16_t rows)
+{
+	double u = random_unit();
+	int16_t low = 0;
+	int16_t high = rows - 1;
+	while (low < high) {
+		int16_t mid = (low + high) / 2;
+		if (cdf[dir][mid] < u) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+	return low;
+}
+
+static void build_noise(void)
+{
+	for (uint32_t canid=0x7FF;canid>0 && nnoise<NOISE_IDS;canid--) {
+		bool used = false;
+		for(int index=0;index<npublish;index++) {
+			if (publish[index].frame == 0 && publish[index].canid == canid) used = true;
+		}
+		if (used == false) noise_id[nnoise++] = canid;
+	}
+}
+
+static int histogram_bucket(int64_t us)
+{
+	if (us < HIST_SUB) return (us < 0) ? 0 : us;
+	if (us > UINT32_MAX) us = UINT32_MAX;
+	int power = 31 - __builtin_clz((uint32_t)us);
+	int sub = (us >> (power - 4)) & (HIST_SUB - 1);
+	return HIST_SUB + (power - 4) * HIST_SUB + sub;
+}
+
+// Lower bound of a bucket
+static int64_t histogram_value(int bucket)
+{
+	if (bucket < HIST_SUB) return bucket;
+	int power = (bucket - HIST_SUB) / HIST_SUB + 4;
+	int sub = (bucket - HIST_SUB) % HIST_SUB;
+	return ((int64_t)(HIST_SUB + sub)) << (power - 4);
+}
+
+static int64_t histogram_percentile(const uint32_t *histogram, uint64_t count, int permille)
+{
+	uint64_t rank = count * permille / 1000;
+	uint64_t seen = 0;
+	for (int bucket=0;bucket<HIST_BUCKETS;bucket++) {
+		seen += histogram[bucket];
+		if (seen > rank) return histogram_value(bucket);
+	}
+	return histogram_value(HIST_BUCKETS - 1);
+}
+
+static int64_t histogram_max(const uint32_t *histogram)
+{
+	for (int bucket=HIST_BUCKETS-1;bucket>=0;bucket--) {
+		if (histogram[bucket] != 0) return histogram_value(bucket);
+	}
+	return 0;
+}
+
+static void on_frame(int dir, uint32_t sequence)
+{
+	DIRECTION_t *d = &direction[dir];
+	int64_t now = esp_timer_get_time();
+	if (sequence == HARNESS_WARMUP) {
+		d->warm = true;
+		return;
+	}
+	SLOT_t *slot = &d->ring[sequence % RING_SIZE];
+	if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != sequence) return;
+	// Taken once, a second delivery of QoS 1 or a frame already counted as lost finds 0
+	int64_t sent_at = __atomic_exchange_n(&slot->sent_at, 0, __ATOMIC_ACQ_REL);
+	if (sent_at == 0) return;
+	int bucket = histogram_bucket(now - sent_at);
+	__atomic_fetch_add(&d->interval.histogram[bucket], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&d->interval.received, 1, __ATOMIC_RELAXED);
+}
+
+// Sends one frame into the bridge, false when the bridge refused it
+static bool send_frame(void *arg, int dir, uint32_t sequence)
+{
+	uint8_t data[8];
+	harness_fill_data(data, sequence);
+	if (dir == HARNESS_UP) {
+		TOPIC_t *row = &publish[pick_row(dir, npublish)];
+		return harness_inject(row->canid, row->frame, data);
+	}
+
+	char topic[128];
+	harness_command_topic(&subscribe[pick_row(dir, nsubscribe)], topic, sizeof(topic));
+	return (esp_mqtt_client_publish(arg, topic, (char *)data, sizeof(data), 0, 0) >= 0);
+}
+
+static void send_next(esp_mqtt_client_handle_t client, DIRECTION_t *dir, int index)
+{
+	// The oldest send time is overwritten, it counts as lost
+	if (dir->sequence - dir->sweep >= RING_SIZE) {
+		SLOT_t *slot = &dir->ring[dir->sweep % RING_SIZE];
+		if (__atomic_exchange_n(&slot->sent_at, 0, __ATOMIC_ACQ_REL) != 0) dir->interval.lost++;
+		dir->sweep++;
+	}
+	uint32_t sequence = dir->sequence++;
+	SLOT_t *slot = &dir->ring[sequence % RING_SIZE];
+	__atomic_store_n(&slot->sent_at, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&slot->sequence, sequence, __ATOMIC_RELEASE);
+	__atomic_store_n(&slot->sent_at, esp_timer_get_time(), __ATOMIC_RELEASE);
+	dir->interval.sent++;
+	if (send_frame(client, index, sequence) == false) {
+		if (__atomic_exchange_n(&slot->sent_at, 0, __ATOMIC_ACQ_REL) != 0) dir->interval.refused++;
+	}
+}
+
+// Counts the frames that did not come back in time
+static void sweep(DIRECTION_t *dir, int64_t now)
+{
+	while (dir->sweep != dir->sequence) {
+		SLOT_t *slot = &dir->ring[dir->sweep % RING_SIZE];
+		int64_t sent_at = __atomic_load_n(&slot->sent_at, __ATOMIC_ACQUIRE);
+		if (sent_at != 0 && now - sent_at < LOSS_TIMEOUT_US) break;
+		if (sent_at != 0 && __atomic_compare_exchange_n(&slot->sent_at, &sent_at, 0, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			dir->interval.lost++;
+		}
+		dir->sweep++;
+	}
+}
+
+// Moves the interval counters to the total, returns a copy of the interval
+static STATS_t collect(DIRECTION_t *dir)
+{
+	STATS_t interval;
+	interval.sent = dir->interval.sent;
+	interval.refused = dir->interval.refused;
+	interval.lost = dir->interval.lost;
+	interval.received = __atomic_exchange_n(&dir->interval.received, 0, __ATOMIC_RELAXED);
+	for (int bucket=0;bucket<HIST_BUCKETS;bucket++) {
+		interval.histogram[bucket] = __atomic_exchange_n(&dir->interval.histogram[bucket], 0, __ATOMIC_RELAXED);
+		dir->total.histogram[bucket] += interval.histogram[bucket];
+	}
+	dir->interval.sent = 0;
+	dir->interval.refused = 0;
+	dir->interval.lost = 0;
+	dir->total.sent += interval.sent;
+	dir->total.refused += interval.refused;
+	dir->total.lost += interval.lost;
+	dir->total.received += interval.received;
+	return interval;
+}
+
+static void print_stats(const char *label, const char *name, STATS_t *stats, double seconds)
+{
+	printf("%s %-4s sent=%.1f/s received=%.1f/s refused=%"PRIu64" lost=%"PRIu64,
+		label, name, stats->sent / seconds, stats->received / seconds, stats->refused, stats->lost);
+	if (stats->received != 0) {
+		printf(" latency us p50=%"PRId64" p90=%"PRId64" p99=%"PRId64" p99.9=%"PRId64" max=%"PRId64,
+			histogram_percentile(stats->histogram, stats->received, 500),
+			histogram_percentile(stats->histogram, stats->received, 900),
+			histogram_percentile(stats->histogram, stats->received, 990),
+			histogram_percentile(stats->histogram, stats->received, 999),
+			histogram_max(stats->histogram));
+	}
+	printf("\n");
+}
+
+static void on_signal(int signo)
+{
+	stop = 1;
+}
+
+static void usage(const char *program)
+{
+	printf("usage: %s [options]\n", program);
+	harness_usage();
+	printf("  -u RATE    CAN to MQTT frames per second, 0 is off (default 1000)\n");
+	printf("  -d RATE    MQTT to CAN messages per second, 0 is off (default 1000)\n");
+	printf("  -t SECONDS length of the run, Ctrl-C stops it early (default 60)\n");
+	printf("  -I SECONDS report interval (default 10)\n");
+	printf("  -z SKEW    rows are picked with weight 1/rank^SKEW, 0 is uniform (default 0)\n");
+	printf("  -N RATE    frames per second with CAN IDs that are in no can2mqtt row (default 0)\n");
+	printf("  -R STEP    raise each rate by STEP every interval until the bridge falls behind\n");
+	printf("  -L MS      in ramp mode, an interval with a p99 latency above MS falls behind (default 100)\n");
+	printf("  -K PERCENT in ramp mode, an interval where less than PERCENT of the frames came back falls behind (default 99)\n");
+	printf("  -S SEED    seed of the row and noise picks (default 1)\n");
+}
+
+int main(int argc, char *argv[])
+{
+	double seconds = 60;
+	double interval_s = 10;
+	double skew = 0;
+	double noise_rate = 0;
+	double ramp = 0;
+	int64_t latency_limit = 100000;
+	double keep_up = 99;
+	direction[HARNESS_UP].rate = 1000;
+	direction[HARNESS_DOWN].rate = 1000;
+	esp_log_level_set("*", ESP_LOG_WARN);
+
+	int opt;
+	while ((opt = getopt(argc, argv, HARNESS_OPTIONS "u:d:t:I:z:N:R:L:K:S:h")) != -1) {
+		if (harness_option(opt, optarg)) continue;
+		switch (opt) {
+			case 'u': direction[HARNESS_UP].rate = atof(optarg); break;
+			case 'd': direction[HARNESS_DOWN].rate = atof(optarg); break;
+			case 't': seconds = atof(optarg); break;
+			case 'I': interval_s = atof(optarg); break;
+			case 'z': skew = atof(optarg); break;
+			case 'N': noise_rate = atof(optarg); break;
+			case 'R': ramp = atof(optarg); break;
+			case 'L': latency_limit = atof(optarg) * 1000; break;
+			case 'K': keep_up = atof(optarg); break;
+			case 'S': random_state = strtoul(optarg, NULL, 0); break;
+			default: usage(argv[0]); return 1;
+		}
+	}
+	if ((direction[HARNESS_UP].rate <= 0 && direction[HARNESS_DOWN].rate <= 0)
+		|| seconds <= 0 || interval_s <= 0 || skew < 0 || noise_rate < 0 || ramp < 0 || keep_up > 100 || random_state == 0) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	harness_receive_frames(on_frame);
+	esp_mqtt_client_handle_t client = harness_start(NULL);
+	if (client == NULL) return 1;
+	cdf[HARNESS_UP] = build_cdf(npublish, skew);
+	cdf[HARNESS_DOWN] = build_cdf(nsubscribe, skew);
+	build_noise();
+	for (int dir=0;dir<2;dir++) {
+		if (direction[dir].rate <= 0) continue;
+		direction[dir].ring = calloc(RING_SIZE, sizeof(SLOT_t));
+		configASSERT( direction[dir].ring );
+		// No sequence number matches before the first frame is sent
+		for (uint32_t i=0;i<RING_SIZE;i++) direction[dir].ring[i].sequence = HARNESS_WARMUP;
+		if (harness_warmup(send_frame, client, dir, &direction[dir].warm) == false) {
+			ESP_LOGE(TAG, "The bridge did not pass a frame %s", direction[dir].name);
+			return 1;
+		}
+	}
+	signal(SIGINT, on_signal);
+
+	printf("can2mqtt rows=%d mqtt2can rows=%d up=%.0f/s down=%.0f/s noise=%.0f/s skew=%.2f duration=%.0fs%s\n",
+		npublish, nsubscribe, direction[HARNESS_UP].rate, direction[HARNESS_DOWN].rate, noise_rate, skew, seconds,
+		ramp > 0 ? " ramp" : "");
+
+	// The bridge does not allocate after the start, the heap in use must not grow during the run,
+	// taken after the first printf, which allocates the buffer of stdout
+	size_t heap_start = mallinfo2().uordblks;
+
+	// Frames start on a fixed schedule, so a slow bridge does not lower the offered load
+	int64_t start = esp_timer_get_time();
+	int64_t end = start + (int64_t)(seconds * 1000000.0);
+	int64_t interval_start = start;
+	int64_t interval_us = (int64_t)(interval_s * 1000000.0);
+	int64_t noise_due = start;
+	for (int dir=0;dir<2;dir++) direction[dir].due = start;
+
+	while (stop == 0) {
+		int64_t now = esp_timer_get_time();
+		if (now >= end) break;
+		int64_t next = now + 1000;
+		for (int dir=0;dir<2;dir++) {
+			DIRECTION_t *d = &direction[dir];
+			if (d->rate <= 0) continue;
+			while (d->due <= now) {
+				send_next(client, d, dir);
+				d->due += (int64_t)(1000000.0 / d->rate);
+			}
+			if (d->due < next) next = d->due;
+		}
+		if (noise_rate > 0 && nnoise != 0) {
+			while (noise_due <= now) {
+				uint8_t data[8] = {0};
+				harness_inject(noise_id[random_next() % nnoise], 0, data);
+				noise_due += (int64_t)(1000000.0 / noise_rate);
+			}
+			if (noise_due < next) next = noise_due;
+		}
+
+		if (now - interval_start >= interval_us) {
+			double elapsed = (now - interval_start) / 1000000.0;
+			char label[32];
+			snprintf(label, sizeof(label), "[%7.0fs]", (now - start) / 1000000.0);
+			bool active = false;
+			for (int dir=0;dir<2;dir++) {
+				DIRECTION_t *d = &direction[dir];
+				if (d->ring == NULL) continue;
+				sweep(d, now);
+				STATS_t stats = collect(d);
+				if (d->rate > 0 || stats.received != 0 || stats.lost != 0) print_stats(label, d->name, &stats, elapsed);
+				if (ramp <= 0 || d->rate <= 0) continue;
+				// Refused frames never come back, frames in flight at the end of the interval are in the margin
+				bool keeps_up = stats.received >= stats.sent * keep_up / 100.0
+					&& (stats.received == 0 || histogram_percentile(stats.histogram, stats.received, 990) <= latency_limit);
+				if (keeps_up) {
+					d->ramp_rate = d->rate;
+					d->rate += ramp;
+					active = true;
+				} else {
+					printf("%s %-4s falls behind at %.0f/s\n", label, d->name, d->rate);
+					d->saturated = true;
+					d->rate = 0;
+				}
+			}
+			interval_start = now;
+			if (ramp > 0 && active == false) break;
+		} else {
+			for (int dir=0;dir<2;dir++) {
+				if (direction[dir].ring != NULL) sweep(&direction[dir], now);
+			}
+		}
+
+		int64_t wait = next - esp_timer_get_time();
+		if (wait > 50) usleep(wait);
+	}
+
+	// The frames still in flight come back or time out
+	double elapsed = (esp_timer_get_time() - start) / 1000000.0;
+	for (int dir=0;dir<2;dir++) {
+		DIRECTION_t *d = &direction[dir];
+		if (d->ring == NULL) continue;
+		while (d->sweep != d->sequence) {
+			usleep(10000);
+			sweep(d, esp_timer_get_time());
+		}
+		collect(d);
+	}
+	printf("total %.0fs\n", elapsed);
+	for (int dir=0;dir<2;dir++) {
+		DIRECTION_t *d = &direction[dir];
+		if (d->ring == NULL) continue;
+		print_stats("       ", d->name, &d->total, elapsed);
+		if (d->saturated && d->ramp_rate == 0) {
+			printf("        %-4s falls behind at the starting rate\n", d->name);
+		} else if (d->saturated) {
+			printf("        %-4s saturation point %.0f/s\n", d->name, d->ramp_rate);
+		} else if (ramp > 0) {
+			printf("        %-4s kept up with %.0f/s\n", d->name, d->ramp_rate);
+		}
+	}
+	printf("heap in use start=%zu end=%zu\n", heap_start, mallinfo2().uordblks);
+	arena_report("soak");
+	esp_mqtt_client_stop(client);
+	return 0;
+}
@@ -0,0 +1,364 @@
+/*
+	This code is in the Public Domain (or CC0 licensed, at your option.)
+
+	Unless required by applicable law or agreed to in writing, this
+	software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+	CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "mqtt.h"
+#include "frame.h"
+#include "aggregate.h"
+#include "arena.h"
+
+static const char *TAG = "AGGREGATE";
+
+_Static_assert(sizeof(AGGREGATE_SUMMARY_t) <= CANFD_MAX_DATA_LEN, "summary must fit MQTT_t.data");
+
+/*
+ * The table is sorted by frame type and CAN ID, so a received frame
+ * finds its rows with a binary search even with thousands of rows.
+ * Frames and window ends are both handled in the TWAI task, so no lock is taken.
+ */
+AGGREGATE_t *aggregate;
+int16_t naggregate;
+
+/*
+ * Hashed timer wheel with 1 ms slots, like cyclic.c.
+ * A row sits in slot (due % AGGREGATE_SLOTS), so a poll only looks at
+ * the slots of the milliseconds that passed since the last poll,
+ * not at every row of the table.
+ */
+#define	AGGREGATE_SLOTS	256
+
+static int16_t wheel[AGGREGATE_SLOTS];
+// Last millisecond whose slot was handled
+static uint32_t current;
+
+static uint32_t now_ms(void)
+{
+	return esp_timer_get_time() / 1000;
+}
+
+static int compare_key(uint16_t extd1, uint32_t canid1, uint16_t extd2, uint32_t canid2)
+{
+	if (extd1 != extd2) return (extd1 < extd2) ? -1 : 1;
+	if (canid1 != canid2) return (canid1 < canid2) ? -1 : 1;
+	return 0;
+}
+
+static int compare_entry(const void *a, const void *b)
+{
+	const AGGREGATE_t *entry1 = a;
+	const AGGREGATE_t *entry2 = b;
+	return compare_key(entry1->extd, entry1->canid, entry2->extd, entry2->canid);
+}
+
+static void wheel_insert(int16_t index)
+{
+	int16_t slot = aggregate[index].due % AGGREGATE_SLOTS;
+	aggregate[index].next = wheel[slot];
+	wheel[slot] = index;
+}
+
+static void window_reset(AGGREGATE_t *entry)
+{
+	entry->count = 0;
+	entry->changes = 0;
+	entry->changed = 0;
+	entry->sum = 0;
+}
+
+esp_err_t build_aggregate_table(AGGREGATE_t **entries, char *file, int16_t *nentry)
+{
+	ESP_LOGI(TAG, "build_aggregate_table file=%s", file);
+	char line[160];
+	int _nentry = 0;
+
+	FILE* f = fopen(file, "r");
+	if (f == NULL) {
+		ESP_LOGE(TAG, "Failed to open file for reading");
+		return ESP_FAIL;
+	}
+	while (1){
+		if ( fgets(line, sizeof(line) ,f) == 0 ) break;
+		char* pos = strchr(line, '\n');
+		if (pos) *pos = '\0';
+		if (strlen(line) == 0) continue;
+		if (line[0] == '#') continue;
+		_nentry++;
+	}
+	fclose(f);
+	ESP_LOGI(TAG, "build_aggregate_table _nentry=%d", _nentry);
+
+	*entries = arena_calloc(_nentry, sizeof(AGGREGATE_t));
+	if (*entries == NULL) {
+		ESP_LOGE(TAG, "Error allocating memory for aggregate");
+		return ESP_ERR_NO_MEM;
+	}
+
+	f = fopen(file, "r");
+	if (f == NULL) {
+		ESP_LOGE(TAG, "Failed to open file for reading");
+		return ESP_FAIL;
+	}
+
+	char *ptr;
+	int index = 0;
+	while (1){
+		if ( fgets(line, sizeof(line) ,f) == 0 ) break;
+		char* pos = strchr(line, '\n');
+		if (pos) *pos = '\0';
+		ESP_LOGD(TAG, "line=[%s]", line);
+		if (strlen(line) == 0) continue;
+		if (line[0] == '#') continue;
+		AGGREGATE_t *entry = (*entries+index);
+		memset(entry, 0, sizeof(AGGREGATE_t));
+
+		// Frame type and CAN ID
+		uint16_t extd, fdf, brs;
+		ptr = strtok(line, ",");
+		if (can_parse_frame_type(ptr, &extd, &fdf, &brs) != ESP_OK) {
+			ESP_LOGE(TAG, "This line is invalid [%s]", line);
+			continue;
+		}
+		entry->extd = extd;
+		entry->fdf = fdf;
+		ptr = strtok(NULL, ",");
+		if (ptr == NULL) continue;
+		entry->canid = strtol(ptr, NULL, 16);
+		if (entry->canid == 0) {
+			ESP_LOGE(TAG, "This line is invalid [%s]", line);
+			continue;
+		}
+
+		// Summary topic and window length
+		char *topic = strtok(NULL, ",");
+		ptr = strtok(NULL, ",");
+		if (topic == NULL || ptr == NULL || strlen(topic) >= sizeof(((MQTT_t *)0)->topic)) {
+			ESP_LOGE(TAG, "This line is invalid [%s]", line);
+			continue;
+		}
+		entry->window_ms = strtol(ptr, NULL, 10);
+		if (entry->window_ms < 10) {
+			ESP_LOGE(TAG, "This line is invalid [%s]", line);
+			continue;
+		}
+
+		// Optional start byte, length, byte order and sign of the signal
+		entry->start = 0;
+		entry->length = 1;
+		entry->big_endian = 1;
+		entry->is_signed = 0;
+		ptr = strtok(NULL, ",");
+		if (ptr != NULL) entry->start = strtol(ptr, NULL, 10);
+		ptr = strtok(NULL, ",");
+		if (ptr != NULL) entry->length = strtol(ptr, NULL, 10);
+		ptr = strtok(NULL, ",");
+		if (ptr != NULL) {
+			if (strcmp(ptr, "L") == 0) {
+				entry->big_endian = 0;
+			} else if (strcmp(ptr, "B") != 0) {
+				ESP_LOGE(TAG, "This line is invalid [%s]", line);
+				continue;
+			}
+		}
+		ptr = strtok(NULL, ",");
+		if (ptr != NULL) {
+			if (strcmp(ptr, "S") == 0) {
+				entry->is_signed = 1;
+			} else if (strcmp(ptr, "U") != 0) {
+				ESP_LOGE(TAG, "This line is invalid [%s]", line);
+				continue;
+			}
+		}
+		int16_t max_len = fdf ? CANFD_MAX_DATA_LEN : CAN_MAX_DATA_LEN;
+		if (entry->length < 1 || entry->length > 4 || entry->start + entry->length > max_len) {
+			ESP_LOGE(TAG, "This line is invalid [%s]", line);
+			continue;
+		}
+		entry->topic = arena_strdup(topic);
+		if (entry->topic == NULL) {
+			fclose(f);
+			return ESP_ERR_NO_MEM;
+		}
+		entry->topic_len = strlen(topic);
+		index++;
+	}
+	fclose(f);
+	*nentry = index;
+
+	qsort(*entries, index, sizeof(AGGREGATE_t), compare_entry);
+
+	// Spread the window ends, so all summaries do not hit the MQTT queue at the same time
+	uint32_t now = now_ms();
+	current = now;
+	for (int slot=0;slot<AGGREGATE_SLOTS;slot++) wheel[slot] = -1;
+	for(int i=0;i<index;i++) {
+		AGGREGATE_t *entry = (*entries+i);
+		entry->due = now + entry->window_ms + (i % entry->window_ms);
+		int16_t slot = entry->due % AGGREGATE_SLOTS;
+		entry->next = wheel[slot];
+		wheel[slot] = i;
+	}
+	return ESP_OK;
+}
+
+void dump_aggregate_table(AGGREGATE_t *entries, int16_t nentry)
+{
+	for(int i=0;i<nentry;i++) {
+		ESP_LOGI(TAG, "aggregate=[%d] extd=%d fdf=%d canid=0x%"PRIx32" topic=[%s] window_ms=%"PRIu32" start=%d length=%d big_endian=%d signed=%d",
+		i, (entries+i)->extd, (entries+i)->fdf, (entries+i)->canid, (entries+i)->topic, (entries+i)->window_ms,
+		(entries+i)->start, (entries+i)->length, (entries+i)->big_endian, (entries+i)->is_signed);
+	}
+}
+
+static int64_t signal_value(AGGREGATE_t *entry, const uint8_t *data)
+{
+	uint32_t raw = 0;
+	for(int i=0;i<entry->length;i++) {
+		if (entry->big_endian) {
+			raw = (raw << 8) | data[entry->start + i];
+		} else {
+			raw |= (uint32_t)data[entry->start + i] << (8 * i);
+		}
+	}
+	if (entry->is_signed == 0) return raw;
+	int shift = 32 - 8 * entry->length;
+	return (int32_t)(raw << shift) >> shift;
+}
+
+static void window_update(AGGREGATE_t *entry, const uint8_t *data, int16_t data_len)
+{
+	int64_t value = signal_value(entry, data);
+	if (entry->count == 0) {
+		entry->min = value;
+		entry->max = value;
+	} else {
+		if (value < entry->min) entry->min = value;
+		if (value > entry->max) entry->max = value;
+	}
+	entry->last = value;
+	entry->sum += value;
+	entry->count++;
+
+	// The previous frame may belong to the last window
+	int16_t len = (data_len > sizeof(entry->prev)) ? sizeof(entry->prev) : data_len;
+	if (entry->prev_len != 0) {
+		uint8_t changed = 0;
+		for(int i=0;i<len;i++) {
+			if (data[i] != entry->prev[i]) changed |= (1 << i);
+		}
+		if (changed != 0 || len != entry->prev_len) entry->changes++;
+		entry->changed |= changed;
+	}
+	memcpy(entry->prev, data, len);
+	entry->prev_len = len;
+}
+
+// Called from the TWAI task for every received data frame
+void aggregate_rx_frame(uint32_t canid, int16_t extd, int16_t fdf, const char *data, int16_t data_len)
+{
+	// First row with this frame type and CAN ID
+	int low = 0;
+	int high = naggregate;
+	while (low < high) {
+		int middle = (low + high) / 2;
+		if (compare_key(aggregate[middle].extd, aggregate[middle].canid, extd, canid) < 0) {
+			low = middle + 1;
+		} else {
+			high = middle;
+		}
+	}
+	for(int index=low;index<naggregate;index++) {
+		AGGREGATE_t *entry = &aggregate[index];
+		if (entry->canid != canid || entry->extd != extd) break;
+		if (entry->fdf != fdf) continue;
+		if (entry->start + entry->length > data_len) continue;
+		window_update(entry, (const uint8_t *)data, data_len);
+	}
+}
+
+static bool window_publish(AGGREGATE_t *entry)
+{
+	MQTT_t mqttBuf;
+	mqttBuf.timestamp = esp_timer_get_time();
+	mqttBuf.topic_type = PUBLISH_SUMMARY;
+	mqttBuf.topic_len = entry->topic_len;
+	strcpy(mqttBuf.topic, entry->topic);
+	AGGREGATE_SUMMARY_t summary = {
+		.window_ms = entry->window_ms,
+		.count = entry->count,
+		.changes = entry->changes,
+		.min = entry->min,
+		.max = entry->max,
+		.last = entry->last,
+		.sum = entry->sum,
+		.changed = entry->changed,
+	};
+	memcpy(mqttBuf.data, &summary, sizeof(summary));
+	mqttBuf.data_len = sizeof(summary);
+	return (mqtt_tx_send(&mqttBuf, 0) == pdPASS);
+}
+
+// Publishes the windows of one slot that have ended, false when the MQTT queue was full
+static bool wheel_tick(uint32_t tick, uint32_t now)
+{
+	int16_t slot = tick % AGGREGATE_SLOTS;
+	int16_t index = wheel[slot];
+	wheel[slot] = -1;
+	bool sent = true;
+	while (index != -1) {
+		AGGREGATE_t *entry = &aggregate[index];
+		int16_t next = entry->next;
+		// Rows of a later turn of the wheel stay in the slot
+		if (sent && (int32_t)(tick - entry->due) >= 0) {
+			if (window_publish(entry)) {
+				window_reset(entry);
+				entry->due += entry->window_ms;
+				// Skip the windows missed while the task was blocked
+				if ((int32_t)(now - entry->due) >= 0) entry->due = now + entry->window_ms;
+			} else {
+				sent = false;
+			}
+		}
+		wheel_insert(index);
+		index = next;
+	}
+	return sent;
+}
+
+// Called from the TWAI task loop, publishes the windows that have ended
+void aggregate_poll(void)
+{
+	uint32_t now = now_ms();
+	// After a long block one turn of the wheel visits every slot
+	if ((int32_t)(now - current) > AGGREGATE_SLOTS) current = now - AGGREGATE_SLOTS;
+	while ((int32_t)(now - current) > 0) {
+		// A full MQTT queue extends the window until the next poll
+		if (wheel_tick(current + 1, now) == false) {
+			ESP_LOGD(TAG, "mqtt_tx_send Fail");
+			return;
+		}
+		current++;
+	}
+}
+
+int aggregate_json(const AGGREGATE_SUMMARY_t *summary, char *buf, size_t size)
+{
+	if (summary->count == 0) {
+		return snprintf(buf, size, "{\"window_ms\":%"PRIu32",\"count\":0}", summary->window_ms);
+	}
+	return snprintf(buf, size,
+		"{\"window_ms\":%"PRIu32",\"count\":%"PRIu32",\"min\":%"PRId64",\"max\":%"PRId64",\"mean\":%.3f,\"last\":%"PRId64",\"changes\":%"PRIu32",\"changed\":\"%02x\"}",
+		summary->window_ms, summary->count, summary->min, summary->max, (double)summary->sum / summary->count,
+		summary->last, summary->changes, summary->changed);
+}
@@ -0,0 +1,58 @@
+#ifndef AGGREGATE_H_
+#define AGGREGATE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+
+/*
+ * Windowed statistics of one signal, published once per window instead of every frame.
+ * The signal is an unsigned or signed integer of 1 to 4 bytes in the frame data.
+ * The entry is a fixed-size struct, so thousands of rows fit in RAM.
+ */
+typedef struct {
+	// Configuration
+	uint32_t canid;
+	uint8_t extd;
+	uint8_t fdf;
+	uint8_t start;		// first byte of the signal
+	uint8_t length;		// 1..4 bytes
+	uint8_t big_endian;
+	uint8_t is_signed;
+	int16_t topic_len;
+	char * topic;
+	uint32_t window_ms;
+
+	// Window state
+	uint32_t due;		// esp_timer milliseconds when the window closes
+	int16_t next;		// next row in the same wheel slot, -1 = end
+	uint32_t count;		// frames in this window
+	uint32_t changes;	// frames whose data differed from the previous frame
+	int64_t min;
+	int64_t max;
+	int64_t last;
+	int64_t sum;
+	uint8_t prev[8];	// first 8 data bytes of the previous frame
+	uint8_t changed;	// bit n set when byte n changed during the window
+	uint8_t prev_len;
+} AGGREGATE_t;
+
+// data[] of a PUBLISH_SUMMARY record, formatted as JSON by mqtt_pub_task
+typedef struct {
+	uint32_t window_ms;
+	uint32_t count;
+	uint32_t changes;
+	int64_t min;
+	int64_t max;
+	int64_t last;
+	int64_t sum;
+	uint8_t changed;
+} AGGREGATE_SUMMARY_t;
+
+esp_err_t build_aggregate_table(AGGREGATE_t **entries, char *file, int16_t *nentry);
+void dump_aggregate_table(AGGREGATE_t *entries, int16_t nentry);
+void aggregate_rx_frame(uint32_t canid, int16_t extd, int16_t fdf, const char *data, int16_t data_len);
+void aggregate_poll(void);
+int aggregate_json(const AGGREGATE_SUMMARY_t *summary, char *buf, size_t size);
+
+#endif /* AGGREGATE_H_ */
@@ -0,0 +1,139 @@
+/*
+	This code is in the Public Domain (or CC0 licensed, at your option.)
+
+	Unless required by applicable law or agreed to in writing, this
+	software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+	CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "esp_err.h"
+#include "esp_log.h"
+#include "esp_heap_caps.h"
+
+#include "arena.h"
+
+static const char *TAG = "ARENA";
+
+/*
+ * The arena is taken from the heap once, early in app_main, before WiFi
+ * and TLS allocate their buffers. The tables, the topic strings and the
+ * subscribe list are carved out of it one after the other.
+ * With CONFIG_ARENA_PSRAM it is placed in PSRAM, which keeps large
+ * tables out of internal RAM.
+ */
+#define	ARENA_ALIGN	8
+
+// Interned strings are chained per bucket, the chain links live in the arena too
+#define	INTERN_BUCKETS	64
+
+typedef struct intern {
+	struct intern *next;
+	uint16_t len;
+	char str[];
+} INTERN_t;
+
+static uint8_t *arena;
+static size_t arena_capacity;
+static size_t arena_offset;
+static INTERN_t **intern_bucket;
+static size_t intern_saved;	// bytes not copied because the string was already there
+
+esp_err_t arena_init(size_t size)
+{
+#if CONFIG_ARENA_PSRAM
+	arena = heap_caps_malloc(size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+#else
+	arena = heap_caps_malloc(size, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+#endif
+	if (arena == NULL) {
+		ESP_LOGE(TAG, "Failed to allocate %zu bytes", size);
+		return ESP_ERR_NO_MEM;
+	}
+	arena_capacity = size;
+	arena_offset = 0;
+	intern_bucket = arena_calloc(INTERN_BUCKETS, sizeof(INTERN_t *));
+	if (intern_bucket == NULL) return ESP_ERR_NO_MEM;
+	return ESP_OK;
+}
+
+void *arena_alloc(size_t size)
+{
+	size_t offset = (arena_offset + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+	if (arena == NULL || offset + size > arena_capacity) {
+		ESP_LOGE(TAG, "Out of space for %zu bytes, used %zu of %zu. Increase ARENA_SIZE", size, arena_offset, arena_capacity);
+		return NULL;
+	}
+	arena_offset = offset + size;
+	return &arena[offset];
+}
+
+void *arena_calloc(size_t count, size_t size)
+{
+	void *ptr = arena_alloc(count * size);
+	if (ptr != NULL) memset(ptr, 0, count * size);
+	return ptr;
+}
+
+static uint32_t intern_hash(const char *str, size_t len)
+{
+	// FNV-1a
+	uint32_t hash = 2166136261u;
+	for (size_t i=0;i<len;i++) {
+		hash ^= (uint8_t)str[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+char *arena_intern(const char *str, size_t len)
+{
+	if (intern_bucket == NULL) return NULL;
+	INTERN_t **bucket = &intern_bucket[intern_hash(str, len) % INTERN_BUCKETS];
+	for (INTERN_t *entry=*bucket;entry!=NULL;entry=entry->next) {
+		if (entry->len == len && memcmp(entry->str, str, len) == 0) {
+			intern_saved += len + 1;
+			return entry->str;
+		}
+	}
+	INTERN_t *entry = arena_alloc(sizeof(INTERN_t) + len + 1);
+	if (entry == NULL) return NULL;
+	entry->len = len;
+	memcpy(entry->str, str, len);
+	entry->str[len] = 0;
+	entry->next = *bucket;
+	*bucket = entry;
+	return entry->str;
+}
+
+char *arena_strdup(const char *str)
+{
+	return arena_intern(str, strlen(str));
+}
+
+size_t arena_used(void)
+{
+	return arena_offset;
+}
+
+size_t arena_size(void)
+{
+	return arena_capacity;
+}
+
+// Memory footprint at a point of the boot, compared with later metrics snapshots
+void arena_report(const char *stage)
+{
+	ESP_LOGI(TAG, "%s: arena used=%zu of %zu (interning saved %zu)", stage, arena_offset, arena_capacity, intern_saved);
+	ESP_LOGI(TAG, "%s: internal free=%zu min=%zu largest=%zu", stage,
+		heap_caps_get_free_size(MALLOC_CAP_INTERNAL),
+		heap_caps_get_minimum_free_size(MALLOC_CAP_INTERNAL),
+		heap_caps_get_largest_free_block(MALLOC_CAP_INTERNAL));
+#if CONFIG_SPIRAM
+	ESP_LOGI(TAG, "%s: psram free=%zu largest=%zu", stage,
+		heap_caps_get_free_size(MALLOC_CAP_SPIRAM),
+		heap_caps_get_largest_free_block(MALLOC_CAP_SPIRAM));
+#endif
+}
@@ -0,0 +1,21 @@
+#ifndef ARENA_H_
+#define ARENA_H_
+
+#include <stddef.h>
+#include "esp_err.h"
+
+/*
+ * One block of memory for the tables built at boot.
+ * Nothing in it is freed, so the tables cannot fragment the heap.
+ */
+esp_err_t arena_init(size_t size);
+void *arena_alloc(size_t size);
+void *arena_calloc(size_t count, size_t size);
+// Topic strings are stored once, equal strings share the same copy
+char *arena_intern(const char *str, size_t len);
+char *arena_strdup(const char *str);
+size_t arena_used(void);
+size_t arena_size(void);
+void arena_report(const char *stage);
+
+#endif /* ARENA_H_ */
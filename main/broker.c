@@ -0,0 +1,449 @@
+/*
+	This code is in the Public Domain (or CC0 licensed, at your option.)
+
+	Unless required by applicable law or agreed to in writing, this
+	software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+	CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_err.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "broker.h"
+#include "metrics.h"
+#if CONFIG_MQTT_TLS_RESUME
+#include "tls_resume.h"
+#endif
+
+static const char *TAG = "BROKER";
+
+#if CONFIG_MQTT_TRANSPORT_OVER_TCP
+#define	BROKER_SCHEME	"mqtt"
+#define	BROKER_PORT	CONFIG_MQTT_PORT_TCP
+#define	BROKER_PATH	""
+#elif CONFIG_MQTT_TRANSPORT_OVER_SSL
+#define	BROKER_SCHEME	"mqtts"
+#define	BROKER_PORT	CONFIG_MQTT_PORT_SSL
+#define	BROKER_PATH	""
+#elif CONFIG_MQTT_TRANSPORT_OVER_WS
+#define	BROKER_SCHEME	"ws"
+#define	BROKER_PORT	CONFIG_MQTT_PORT_WS
+#define	BROKER_PATH	"/mqtt"
+#elif CONFIG_MQTT_TRANSPORT_OVER_WSS
+#define	BROKER_SCHEME	"wss"
+#define	BROKER_PORT	CONFIG_MQTT_PORT_WSS
+#define	BROKER_PATH	"/mqtt"
+#elif CONFIG_MQTT_TRANSPORT_OVER_SN
+#define	BROKER_SCHEME	"mqttsn"
+#define	BROKER_PORT	CONFIG_MQTT_PORT_SN
+#define	BROKER_PATH	""
+#endif
+
+// A broker that was given up is tried again after this time, unless no other one is left
+#define	BROKER_RETRY_US	(30 * 1000000LL)
+
+// An mDNS name that did not answer is asked again after this time, the last address is kept meanwhile
+#define	BROKER_RESOLVE_RETRY_US	(10 * 1000000LL)
+
+// mqtt_pub_task and mqtt_sub_task
+#define	BROKER_LINKS	2
+
+static BROKER_t broker[BROKER_MAX];
+static int16_t nbroker;
+static bool resolved;
+static BROKER_LINK_t *links[BROKER_LINKS];
+static int16_t nlink;
+
+static StackType_t resolve_stack[1024*3];
+static StaticTask_t resolve_tcb;
+
+// Health and link state, changed by the tasks and by the event handlers of every client.
+// No esp_mqtt function is called while it is held, the client may be dispatching an event.
+static SemaphoreHandle_t xMutexBroker;
+static StaticSemaphore_t broker_mutex;
+
+esp_err_t query_mdns_host(const char * host_name, char *ip);
+
+static void broker_add(const char *entry, int len)
+{
+	while (len > 0 && *entry == ' ') {
+		entry++;
+		len--;
+	}
+	while (len > 0 && entry[len-1] == ' ') len--;
+	if (len == 0) return;
+	if (nbroker == BROKER_MAX) {
+		ESP_LOGW(TAG, "Only %d brokers are used", BROKER_MAX);
+		return;
+	}
+	BROKER_t *b = &broker[nbroker];
+	memset(b, 0, sizeof(BROKER_t));
+	// host or host:port
+	b->port = BROKER_PORT;
+	const char *colon = memchr(entry, ':', len);
+	int host_len = len;
+	if (colon != NULL) {
+		host_len = colon - entry;
+		b->port = atoi(colon + 1);
+	}
+	if (host_len == 0 || host_len >= sizeof(b->host) || b->port <= 0 || b->port > 65535) {
+		ESP_LOGE(TAG, "This broker is invalid [%.*s]", len, entry);
+		return;
+	}
+	memcpy(b->host, entry, host_len);
+	b->host[host_len] = 0;
+	b->mdns = (strstr(b->host, ".local") != NULL);
+	nbroker++;
+}
+
+esp_err_t broker_init(void)
+{
+	xMutexBroker = xSemaphoreCreateMutexStatic(&broker_mutex);
+	configASSERT( xMutexBroker );
+	nbroker = 0;
+	broker_add(CONFIG_MQTT_BROKER, strlen(CONFIG_MQTT_BROKER));
+#if CONFIG_MQTT_FAILOVER_ENABLE
+	// Comma separated, tried in order after MQTT_BROKER
+	const char *list = CONFIG_MQTT_BROKER_FAILOVER;
+	while (*list) {
+		const char *end = strchr(list, ',');
+		broker_add(list, end ? end - list : strlen(list));
+		if (end == NULL) break;
+		list = end + 1;
+	}
+#endif
+	if (nbroker == 0) return ESP_ERR_INVALID_ARG;
+	broker_dump();
+	return ESP_OK;
+}
+
+void broker_dump(void)
+{
+	int64_t now = esp_timer_get_time();
+	for (int i=0;i<nbroker;i++) {
+		BROKER_t *b = &broker[i];
+		ESP_LOGI(TAG, "broker[%d] host=[%s] port=%d connects=%"PRIu32" failures=%"PRIu32" %s", i, b->host, b->port,
+			b->connects, b->failures, (b->down_since == 0) ? "up" : "down");
+		if (b->down_since != 0) ESP_LOGI(TAG, "  down for %"PRId64" s", (now - b->down_since) / 1000000);
+	}
+}
+
+// Build the URI of a broker, an mDNS name is replaced by its address
+static bool broker_resolve(int16_t index, char *uri, size_t size)
+{
+	BROKER_t *b = &broker[index];
+	char ip[128];
+	strcpy(ip, b->host);
+	if (b->mdns) {
+		char name[64];
+		snprintf(name, sizeof(name), "%.*s", (int)(strstr(b->host, ".local") - b->host), b->host);
+		if (query_mdns_host(name, ip) != ESP_OK) return false;
+	}
+	snprintf(uri, size, BROKER_SCHEME "://%.60s:%d" BROKER_PATH, ip, b->port);
+	return true;
+}
+
+// Copy of the URI, the resolve task may change it
+static void broker_uri(int16_t index, char *uri)
+{
+	xSemaphoreTake(xMutexBroker, portMAX_DELAY);
+	strcpy(uri, broker[index].uri);
+	xSemaphoreGive(xMutexBroker);
+}
+
+// Clients connected to the broker keep their connection, the new address is used on the next connect
+static void broker_apply_uri(int16_t index)
+{
+#if CONFIG_MQTT_TRANSPORT_OVER_SN
+	// The MQTT-SN client keeps the address it was started with
+	return;
+#endif
+	char uri[128];
+	esp_mqtt_client_handle_t client[BROKER_LINKS * 2];
+	int nclient = 0;
+	xSemaphoreTake(xMutexBroker, portMAX_DELAY);
+	strcpy(uri, broker[index].uri);
+	for (int i=0;i<nlink;i++) {
+		for (int j=0;j<2;j++) {
+			BROKER_SLOT_t *slot = &links[i]->slot[j];
+			if (slot->client != NULL && slot->broker == index) client[nclient++] = slot->client;
+		}
+	}
+	xSemaphoreGive(xMutexBroker);
+	for (int i=0;i<nclient;i++) esp_mqtt_client_set_uri(client[i], uri);
+}
+
+// mDNS answers are kept for MQTT_RESOLVE_TTL and renewed here, so a reconnect never waits for a query
+static void broker_resolve_task(void *pvParameters)
+{
+	while (1) {
+		vTaskDelay(pdMS_TO_TICKS(1000));
+		for (int16_t i=0;i<nbroker;i++) {
+			BROKER_t *b = &broker[i];
+			int64_t now = esp_timer_get_time();
+			if (b->mdns == false || now < b->refresh_at) continue;
+			char uri[128];
+			if (broker_resolve(i, uri, sizeof(uri)) == false) {
+				ESP_LOGW(TAG, "%s did not answer, keep uri=[%s]", b->host, b->uri);
+				b->refresh_at = esp_timer_get_time() + BROKER_RESOLVE_RETRY_US;
+				continue;
+			}
+			b->refresh_at = esp_timer_get_time() + CONFIG_MQTT_RESOLVE_TTL * 1000000LL;
+			xSemaphoreTake(xMutexBroker, portMAX_DELAY);
+			bool changed = (strcmp(b->uri, uri) != 0);
+			if (changed) strcpy(b->uri, uri);
+			xSemaphoreGive(xMutexBroker);
+			if (changed) {
+				ESP_LOGW(TAG, "broker[%d] moved, uri=[%s]", i, uri);
+				broker_apply_uri(i);
+			}
+		}
+	}
+}
+
+// Every URI is built before the first connect, so a failover never waits for mDNS
+static void broker_resolve_all(void)
+{
+	xSemaphoreTake(xMutexBroker, portMAX_DELAY);
+	if (resolved == false) {
+		bool mdns = false;
+		for (int i=0;i<nbroker;i++) {
+			BROKER_t *b = &broker[i];
+			b->refresh_at = esp_timer_get_time() + CONFIG_MQTT_RESOLVE_TTL * 1000000LL;
+			if (broker_resolve(i, b->uri, sizeof(b->uri)) == false) {
+				// Left to the resolver of the client until the resolve task gets an answer
+				ESP_LOGW(TAG, "%s did not answer", b->host);
+				snprintf(b->uri, sizeof(b->uri), BROKER_SCHEME "://%.60s:%d" BROKER_PATH, b->host, b->port);
+				b->refresh_at = esp_timer_get_time() + BROKER_RESOLVE_RETRY_US;
+			}
+			ESP_LOGI(TAG, "broker[%d] uri=[%s]", i, b->uri);
+			if (b->mdns) mdns = true;
+		}
+		if (mdns) xTaskCreateStatic(broker_resolve_task, "broker_resolve", sizeof(resolve_stack), NULL, 1, resolve_stack, &resolve_tcb);
+		resolved = true;
+	}
+	xSemaphoreGive(xMutexBroker);
+}
+
+static void broker_mark_up(int16_t index)
+{
+	broker[index].connects++;
+	broker[index].down_since = 0;
+}
+
+static void broker_mark_down(int16_t index)
+{
+	if (broker[index].down_since != 0) return;
+	broker[index].down_since = esp_timer_get_time();
+	broker[index].failures++;
+	ESP_LOGW(TAG, "broker %s:%d is down", broker[index].host, broker[index].port);
+}
+
+// The first usable broker in list order, or the one given up the longest ago
+static int16_t broker_pick(int16_t exclude)
+{
+	int64_t now = esp_timer_get_time();
+	int16_t oldest = -1;
+	for (int16_t i=0;i<nbroker;i++) {
+		if (i == exclude) continue;
+		if (broker[i].down_since == 0 || now - broker[i].down_since >= BROKER_RETRY_US) return i;
+		if (oldest < 0 || broker[i].down_since < broker[oldest].down_since) oldest = i;
+	}
+	return oldest;
+}
+
+// Called with xMutexBroker held
+static void link_switch(BROKER_LINK_t *link, int64_t now)
+{
+	link->active = 1 - link->active;
+	link->generation++;
+	BROKER_t *b = &broker[link->slot[link->active].broker];
+	if (link->lost != 0) {
+		ESP_LOGW(TAG, "%s: failover to %s:%d after %"PRId64" ms", link->name, b->host, b->port, (now - link->lost) / 1000);
+	} else {
+		ESP_LOGI(TAG, "%s: back to %s:%d", link->name, b->host, b->port);
+	}
+	link->lost = 0;
+	metrics_count(METRIC_FAILOVERS);
+}
+
+// The standby client was connected before, so the task sees a connect of the new active client
+static void link_connected(BROKER_LINK_t *link, esp_event_base_t base, esp_mqtt_client_handle_t client)
+{
+	esp_mqtt_event_t event;
+	memset(&event, 0, sizeof(event));
+	event.event_id = MQTT_EVENT_CONNECTED;
+	event.client = client;
+	link->handler(NULL, base, MQTT_EVENT_CONNECTED, &event);
+}
+
+static void link_event_handler(void *handler_args, esp_event_base_t base, int32_t event_id, void *event_data)
+{
+	BROKER_LINK_t *link = handler_args;
+	esp_mqtt_event_handle_t event = event_data;
+	int64_t now = esp_timer_get_time();
+	int16_t index = (event->client == link->slot[1].client) ? 1 : 0;
+	BROKER_SLOT_t *slot = &link->slot[index];
+	bool forward = false;
+	bool promoted = false;
+
+	xSemaphoreTake(xMutexBroker, portMAX_DELAY);
+	bool active = (index == link->active);
+	switch (event->event_id) {
+		case MQTT_EVENT_CONNECTED:
+			slot->connected = true;
+			slot->since = now;
+			broker_mark_up(slot->broker);
+			ESP_LOGI(TAG, "%s: %s client connected to %s:%d", link->name, active ? "active" : "standby",
+				broker[slot->broker].host, broker[slot->broker].port);
+			if (active) {
+				link->lost = 0;
+				forward = true;
+			} else if (link->lost != 0 && link->slot[link->active].connected == false) {
+				// At boot the active client is given FAILOVER_MS by broker_link_poll
+				link_switch(link, now);
+				promoted = true;
+			}
+			break;
+		case MQTT_EVENT_DISCONNECTED:
+			// A retarget clears connected first, so its disconnect is not counted
+			if (slot->connected) {
+				slot->connected = false;
+				slot->since = now;
+			}
+			if (active == false) break;
+			if (link->lost == 0) link->lost = now;
+			if (link->standby && link->slot[1-index].connected) {
+				link_switch(link, now);
+				promoted = true;
+			} else {
+				forward = true;
+			}
+			break;
+		case MQTT_EVENT_PUBLISHED:
+			// Late acknowledgements of a client that is no longer active as well
+			forward = true;
+			break;
+		default:
+			forward = active;
+			break;
+	}
+	esp_mqtt_client_handle_t client = link->slot[link->active].client;
+	xSemaphoreGive(xMutexBroker);
+
+	if (forward) link->handler(NULL, base, event_id, event_data);
+	if (promoted) link_connected(link, base, client);
+}
+
+esp_err_t broker_link_start(BROKER_LINK_t *link, const esp_mqtt_client_config_t *config)
+{
+	broker_resolve_all();
+	int nslot = (link->standby && nbroker > 1) ? 2 : 1;
+	link->standby = (nslot == 2);
+	link->active = 0;
+	link->generation = 0;
+	link->lost = 0;
+	memset(link->slot, 0, sizeof(link->slot));
+	xSemaphoreTake(xMutexBroker, portMAX_DELAY);
+	if (nlink < BROKER_LINKS) links[nlink++] = link;
+	xSemaphoreGive(xMutexBroker);
+	for (int i=0;i<nslot;i++) {
+		BROKER_SLOT_t *slot = &link->slot[i];
+		xSemaphoreTake(xMutexBroker, portMAX_DELAY);
+		slot->broker = broker_pick((i == 0) ? -1 : link->slot[0].broker);
+		xSemaphoreGive(xMutexBroker);
+		slot->since = esp_timer_get_time();
+		char uri[128];
+		broker_uri(slot->broker, uri);
+		esp_mqtt_client_config_t mqtt_cfg = *config;
+		mqtt_cfg.broker.address.uri = uri;
+#if CONFIG_MQTT_TLS_RESUME
+		// One transport per client, it keeps the session of that client
+		mqtt_cfg.network.transport = tls_resume_transport(config->broker.verification.certificate);
+		if (mqtt_cfg.network.transport == NULL) return ESP_ERR_NO_MEM;
+#endif
+		ESP_LOGI(TAG, "%s: %s uri=[%s]", link->name, (i == 0) ? "active" : "standby", mqtt_cfg.broker.address.uri);
+		slot->client = esp_mqtt_client_init(&mqtt_cfg);
+		if (slot->client == NULL) return ESP_FAIL;
+		esp_mqtt_client_register_event(slot->client, ESP_EVENT_ANY_ID, link_event_handler, link);
+		esp_mqtt_client_start(slot->client);
+	}
+	return ESP_OK;
+}
+
+esp_mqtt_client_handle_t broker_link_client(BROKER_LINK_t *link)
+{
+	return link->slot[link->active].client;
+}
+
+#if CONFIG_MQTT_FAILOVER_ENABLE
+// Point a client at another broker, called without xMutexBroker
+static void slot_retarget(BROKER_LINK_t *link, BROKER_SLOT_t *slot, bool connected)
+{
+	BROKER_t *b = &broker[slot->broker];
+	char uri[128];
+	broker_uri(slot->broker, uri);
+	ESP_LOGW(TAG, "%s: %s client moves to %s:%d", link->name, (slot == &link->slot[link->active]) ? "active" : "standby", b->host, b->port);
+	esp_mqtt_client_set_uri(slot->client, uri);
+	if (connected) esp_mqtt_client_disconnect(slot->client);
+	esp_mqtt_client_reconnect(slot->client);
+}
+#endif
+
+// Called periodically by the task that owns the link
+void broker_link_poll(BROKER_LINK_t *link)
+{
+#if CONFIG_MQTT_FAILOVER_ENABLE
+	if (nbroker < 2) return;
+	int64_t now = esp_timer_get_time();
+	int64_t timeout = CONFIG_MQTT_FAILOVER_MS * 1000LL;
+	BROKER_SLOT_t *retarget = NULL;
+	bool connected = false;
+	bool promoted = false;
+
+	xSemaphoreTake(xMutexBroker, portMAX_DELAY);
+	BROKER_SLOT_t *active = &link->slot[link->active];
+	BROKER_SLOT_t *standby = link->standby ? &link->slot[1 - link->active] : NULL;
+	bool lost = (active->connected == false && (link->lost != 0 || now - active->since >= timeout));
+	if (standby != NULL && standby->connected && (lost
+		|| (standby->broker < active->broker && now - standby->since >= timeout))) {
+		// The active client is lost, or an earlier broker of the list has stayed up long enough
+		link_switch(link, now);
+		promoted = true;
+	} else if (active->connected == false && now - active->since >= timeout) {
+		broker_mark_down(active->broker);
+		retarget = active;
+	} else if (standby != NULL && standby->connected == false && now - standby->since >= timeout) {
+		broker_mark_down(standby->broker);
+		retarget = standby;
+	} else if (standby != NULL && standby->broker == active->broker) {
+		// The active client moved to the broker of the standby
+		retarget = standby;
+	}
+	if (retarget != NULL) {
+		// Never the broker the active client is on or has just given up
+		int16_t index = broker_pick(active->broker);
+		if (index < 0 || (index == retarget->broker && retarget->connected)) {
+			retarget = NULL;
+		} else {
+			connected = retarget->connected;
+			retarget->connected = false;
+			retarget->broker = index;
+			retarget->since = now;
+		}
+	}
+	esp_mqtt_client_handle_t client = link->slot[link->active].client;
+	xSemaphoreGive(xMutexBroker);
+
+	if (promoted) link_connected(link, NULL, client);
+	if (retarget != NULL) slot_retarget(link, retarget, connected);
+#endif
+}
@@ -0,0 +1,57 @@
+#ifndef BROKER_H_
+#define BROKER_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "esp_event.h"
+#include "mqtt_client.h"
+#if CONFIG_MQTT_TRANSPORT_OVER_SN
+#include "mqttsn.h"
+#endif
+
+// MQTT_BROKER followed by the failover brokers
+#define	BROKER_MAX	4
+
+typedef struct {
+	char host[64];
+	int port;
+	char uri[128];		// built on first use, a failover does not resolve the name again
+	bool mdns;		// the host is a .local name
+	int64_t refresh_at;	// time the mDNS name is resolved again in the background
+	uint32_t connects;
+	uint32_t failures;	// times the broker was given up
+	int64_t down_since;	// 0 while the broker is usable
+} BROKER_t;
+
+// One client of a link, connected to one broker of the list
+typedef struct {
+	esp_mqtt_client_handle_t client;
+	int16_t broker;
+	volatile bool connected;
+	int64_t since;		// time of the last connect, disconnect or retarget
+} BROKER_SLOT_t;
+
+/*
+ * The connection of one task to the broker list.
+ * The task handler only sees the events of the active client.
+ * With standby, a second client stays connected to the next broker
+ * and becomes the active client as soon as the active one is lost.
+ */
+typedef struct {
+	const char *name;
+	esp_event_handler_t handler;
+	bool standby;
+	BROKER_SLOT_t slot[2];
+	volatile int16_t active;
+	volatile uint32_t generation;	// changes when another client becomes active
+	int64_t lost;		// time the active client was lost, 0 while connected
+} BROKER_LINK_t;
+
+esp_err_t broker_init(void);
+void broker_dump(void);
+esp_err_t broker_link_start(BROKER_LINK_t *link, const esp_mqtt_client_config_t *config);
+void broker_link_poll(BROKER_LINK_t *link);
+esp_mqtt_client_handle_t broker_link_client(BROKER_LINK_t *link);
+
+#endif /* BROKER_H_ */
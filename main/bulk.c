@@ -0,0 +1,226 @@
+/*
+	This code is in the Public Domain (or CC0 licensed, at your option.)
+
+	Unless required by applicable law or agreed to in writing, this
+	software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+	CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/message_buffer.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "mqtt.h"
+#include "frame.h"
+#include "bulk.h"
+#include "metrics.h"
+
+static const char *TAG = "BULK";
+
+/*
+ * The MQTT event handler copies each fragment of a bulk message into a
+ * bounded message buffer, and bulk_task parses it and waits for the TX path.
+ * A full buffer holds the handler back as long as bulk_task drains it,
+ * so a paced burst is applied whole. Only when nothing drains for
+ * BULK_STALL_MS, a bus that stays down, the rest of the message is dropped
+ * and the sender learns it from the status topic.
+ */
+#define	BULK_BUFFER_SIZE	4096
+#define	BULK_CHUNK_LEN		1024
+// The handler checks for progress of bulk_task this often while the buffer is full
+#define	BULK_WAIT_MS		100
+// Longest time the handler waits without progress, well below the MQTT keepalive
+#define	BULK_STALL_MS		10000
+
+// First byte of each chunk in the buffer
+#define	BULK_CHUNK_BEGIN	0
+#define	BULK_CHUNK_DATA		1
+#define	BULK_CHUNK_END		2
+
+static MessageBufferHandle_t xMessageBufferBulk;
+static uint8_t bulk_storage[BULK_BUFFER_SIZE];
+static StaticMessageBuffer_t bulk_buffer;
+
+// The rest of the message being received is dropped
+static bool dropping;
+// Bytes of the message being received that were queued
+static uint32_t accepted;
+// Chunks taken by bulk_task, the handler waits as long as this moves
+static volatile uint32_t chunks_taken;
+
+/*
+ * Records may be split anywhere between MQTT fragments,
+ * so only the record being parsed is kept here.
+ */
+static uint8_t record[BULK_HEADER_LEN + CANFD_MAX_DATA_LEN + 2];
+static int16_t record_len;
+static int16_t record_need;
+static uint32_t nframes;
+// A record with an impossible DLC was found, the rest of the message is skipped
+static bool invalid;
+
+// Outcome of a bulk message, retained like the bus state
+static void bulk_status(const char *result, uint32_t count)
+{
+	MQTT_t mqttBuf;
+	mqttBuf.timestamp = esp_timer_get_time();
+	mqttBuf.topic_type = PUBLISH_STATUS;
+	mqttBuf.topic_len = strlen(CONFIG_BULK_STATUS_TOPIC);
+	strcpy(mqttBuf.topic, CONFIG_BULK_STATUS_TOPIC);
+	mqttBuf.data_len = snprintf(mqttBuf.data, sizeof(mqttBuf.data), "{\"result\":\"%s\",\"count\":%"PRIu32"}", result, count);
+	if (mqtt_tx_send(&mqttBuf, 0) != pdPASS) {
+		ESP_LOGW(TAG, "mqtt_tx_send Fail");
+	}
+}
+
+static bool chunk_send(uint8_t type, const uint8_t *data, int data_len)
+{
+	static uint8_t chunk[1 + BULK_CHUNK_LEN];
+	chunk[0] = type;
+	if (data_len != 0) memcpy(&chunk[1], data, data_len);
+	uint32_t stalled_ms = 0;
+	uint32_t taken = chunks_taken;
+	while (stalled_ms < BULK_STALL_MS) {
+		if (xMessageBufferSend(xMessageBufferBulk, chunk, 1 + data_len, pdMS_TO_TICKS(BULK_WAIT_MS)) == 1 + data_len) {
+			accepted += data_len;
+			return true;
+		}
+		stalled_ms = (taken == chunks_taken) ? stalled_ms + BULK_WAIT_MS : 0;
+		taken = chunks_taken;
+	}
+	ESP_LOGE(TAG, "bulk buffer stalled, rest of the message dropped after %"PRIu32" bytes", accepted);
+	metrics_count(METRIC_BULK_DROPPED);
+	// The frames already queued still go out, count tells how many bytes of the message were taken
+	bulk_status("truncated", accepted);
+	dropping = true;
+	return false;
+}
+
+// Called from the MQTT event handler at the first fragment of a bulk message
+void bulk_begin(void)
+{
+	dropping = false;
+	accepted = 0;
+	chunk_send(BULK_CHUNK_BEGIN, NULL, 0);
+}
+
+// Called from the MQTT event handler with each fragment
+void bulk_write(const uint8_t *data, int data_len)
+{
+	for (int offset=0;offset<data_len && dropping == false;offset+=BULK_CHUNK_LEN) {
+		int len = data_len - offset;
+		if (len > BULK_CHUNK_LEN) len = BULK_CHUNK_LEN;
+		chunk_send(BULK_CHUNK_DATA, &data[offset], len);
+	}
+}
+
+// Called from the MQTT event handler after the last fragment
+void bulk_end(void)
+{
+	if (dropping) return;
+	chunk_send(BULK_CHUNK_END, NULL, 0);
+}
+
+static void bulk_send(void)
+{
+	FRAME_t frame;
+	frame.timestamp = 0;
+	uint8_t flags = record[4];
+	frame.canid = (record[0] << 24) | (record[1] << 16) | (record[2] << 8) | record[3];
+	frame.extd = (flags & BULK_FLAG_EXTD) ? 1 : 0;
+	frame.rtr = (flags & BULK_FLAG_RTR) ? 1 : 0;
+	frame.fdf = (flags & BULK_FLAG_FDF) ? 1 : 0;
+	frame.brs = (flags & BULK_FLAG_BRS) ? 1 : 0;
+	frame.esi = 0;
+	frame.priority = TX_PRIORITY_BULK;
+	frame.data_len = frame.rtr ? 0 : can_dlc_to_len(record[5], frame.fdf);
+	memcpy(frame.data, &record[BULK_HEADER_LEN], frame.data_len);
+	uint32_t delay_us = 0;
+	if (flags & BULK_FLAG_DELAY) {
+		delay_us = (record[BULK_HEADER_LEN+frame.data_len] << 8) | record[BULK_HEADER_LEN+frame.data_len+1];
+	}
+	ESP_LOGD(TAG, "canid=0x%"PRIx32" extd=%d data_len=%d delay_us=%"PRIu32, frame.canid, frame.extd, frame.data_len, delay_us);
+
+	// Only this task waits while the TX path is full, the bulk buffer then fills up
+	if (twai_tx_send(&frame, portMAX_DELAY) != pdPASS) {
+		ESP_LOGE(TAG, "twai_tx_send Fail");
+	}
+	nframes++;
+	// Paced here, so the shared TX task keeps serving the other classes during the gap
+	frame_delay(delay_us);
+}
+
+static void parse(const uint8_t *data, int data_len)
+{
+	for (int i=0;i<data_len && invalid == false;i++) {
+		record[record_len++] = data[i];
+		if (record_len < record_need) continue;
+
+		// Header complete, now the length of the whole record is known
+		if (record_len == BULK_HEADER_LEN) {
+			uint8_t flags = record[4];
+			// The records after it cannot be found, so the rest of the message is not sent
+			uint8_t max_dlc = (flags & BULK_FLAG_FDF) ? 15 : CAN_MAX_DATA_LEN;
+			if ((flags & BULK_FLAG_RTR) == 0 && record[5] > max_dlc) {
+				ESP_LOGE(TAG, "Invalid DLC %d flags=0x%02x after %"PRIu32" frames, rest of the message dropped", record[5], flags, nframes);
+				invalid = true;
+				break;
+			}
+			int16_t len = 0;
+			if ((flags & BULK_FLAG_RTR) == 0) len = can_dlc_to_len(record[5], (flags & BULK_FLAG_FDF) ? 1 : 0);
+			record_need = BULK_HEADER_LEN + len;
+			if (flags & BULK_FLAG_DELAY) record_need += 2;
+			if (record_len < record_need) continue;
+		}
+
+		bulk_send();
+		record_len = 0;
+		record_need = BULK_HEADER_LEN;
+	}
+}
+
+void bulk_task(void *pvParameters)
+{
+	ESP_LOGI(TAG, "Start");
+	static uint8_t chunk[1 + BULK_CHUNK_LEN];
+	while (1) {
+		size_t received = xMessageBufferReceive(xMessageBufferBulk, chunk, sizeof(chunk), portMAX_DELAY);
+		if (received == 0) continue;
+		chunks_taken++;
+		switch (chunk[0]) {
+			case BULK_CHUNK_BEGIN:
+				// Also ends a message whose end was dropped
+				record_len = 0;
+				record_need = BULK_HEADER_LEN;
+				nframes = 0;
+				invalid = false;
+				break;
+			case BULK_CHUNK_DATA:
+				parse(&chunk[1], received - 1);
+				break;
+			case BULK_CHUNK_END:
+				if (record_len != 0 && invalid == false) {
+					ESP_LOGW(TAG, "Incomplete record discarded record_len=%d", record_len);
+				}
+				ESP_LOGI(TAG, "%"PRIu32" frames sent", nframes);
+				bulk_status(invalid ? "invalid" : "sent", nframes);
+				record_len = 0;
+				record_need = BULK_HEADER_LEN;
+				break;
+		}
+	}
+
+	// Never reach here
+	vTaskDelete(NULL);
+}
+
+void bulk_init(void)
+{
+	xMessageBufferBulk = xMessageBufferCreateStatic( sizeof(bulk_storage), bulk_storage, &bulk_buffer );
+	configASSERT( xMessageBufferBulk );
+}
@@ -0,0 +1,32 @@
+#ifndef BULK_H_
+#define BULK_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Bulk record format (big endian)
+ * offset size
+ * 0      4    CAN ID
+ * 4      1    flags (BULK_FLAG_*)
+ * 5      1    DLC (0-8, 0-15 for CAN FD), a larger one drops the rest of the message
+ * 6      n    data (length from DLC, none for remote frames)
+ * 6+n    2    inter-frame delay in microseconds (only with BULK_FLAG_DELAY)
+ */
+#define	BULK_FLAG_EXTD	0x01
+#define	BULK_FLAG_RTR	0x02
+#define	BULK_FLAG_FDF	0x04
+#define	BULK_FLAG_BRS	0x08
+#define	BULK_FLAG_DELAY	0x80
+
+#define	BULK_HEADER_LEN	6
+
+// MQTT event handler side, waits while bulk_task drains the buffer
+void bulk_begin(void);
+void bulk_write(const uint8_t *data, int data_len);
+void bulk_end(void);
+
+void bulk_init(void);
+void bulk_task(void *pvParameters);
+
+#endif /* BULK_H_ */
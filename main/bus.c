@@ -0,0 +1,121 @@
+/*
+	This code is in the Public Domain (or CC0 licensed, at your option.)
+
+	Unless required by applicable law or agreed to in writing, this
+	software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+	CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "bus.h"
+#include "frame.h"
+#include "metrics.h"
+
+static const char *TAG = "BUS";
+
+/*
+ * Bus state shared by both TWAI drivers.
+ * Only the receiving task changes the state, the TX task reads it.
+ * Bus-off is recovered after a backoff that doubles each time,
+ * and falls back to the minimum once the bus has been up for a while.
+ */
+static volatile bus_state_t state = BUS_ERROR_ACTIVE;
+static int64_t down_since;
+static int64_t up_since;
+static int64_t recover_at;
+static int64_t recovering_since;
+static uint32_t backoff_ms = CONFIG_BUS_BACKOFF_MIN_MS;
+
+// The backoff is reset after this much time without bus-off
+#define	BUS_STABLE_US	(10 * 1000000LL)
+// 128 x 11 recessive bits take 56 ms even at 25 Kbit/s
+#define	BUS_RECOVERY_TIMEOUT_US	(1000000LL)
+
+static const char *state_name[] = {"error_active", "error_warning", "error_passive", "bus_off", "recovering"};
+
+static void bus_publish(bus_state_t new_state, uint32_t down_ms)
+{
+	MQTT_t mqttBuf;
+	mqttBuf.timestamp = esp_timer_get_time();
+	mqttBuf.topic_type = PUBLISH_STATUS;
+	mqttBuf.topic_len = strlen(CONFIG_BUS_STATUS_TOPIC);
+	strcpy(mqttBuf.topic, CONFIG_BUS_STATUS_TOPIC);
+	mqttBuf.data_len = snprintf(mqttBuf.data, sizeof(mqttBuf.data), "{\"state\":\"%s\",\"down_ms\":%"PRIu32"}",
+		state_name[new_state], down_ms);
+	// Never block the receiving task, the next change publishes the state again
+	if (mqtt_tx_send(&mqttBuf, 0) != pdPASS) {
+		ESP_LOGW(TAG, "mqtt_tx_send Fail");
+	}
+}
+
+void bus_set_state(bus_state_t new_state)
+{
+	if (new_state == state) return;
+	bus_state_t old_state = state;
+	state = new_state;
+	ESP_LOGW(TAG, "%s -> %s", state_name[old_state], state_name[new_state]);
+
+	int64_t now = esp_timer_get_time();
+	uint32_t down_ms = 0;
+	switch (new_state) {
+		case BUS_ERROR_WARNING:
+			metrics_count(METRIC_ERROR_WARNING);
+			break;
+		case BUS_ERROR_PASSIVE:
+			metrics_count(METRIC_ERROR_PASSIVE);
+			break;
+		case BUS_OFF:
+			// Back from BUS_RECOVERING means the recovery failed, the bus is still down
+			if (old_state != BUS_RECOVERING) {
+				metrics_count(METRIC_BUS_OFF);
+				down_since = now;
+				if (now - up_since > BUS_STABLE_US) backoff_ms = CONFIG_BUS_BACKOFF_MIN_MS;
+			}
+			recover_at = now + backoff_ms * 1000LL;
+			ESP_LOGW(TAG, "recovery in %"PRIu32" ms", backoff_ms);
+			backoff_ms *= 2;
+			if (backoff_ms > CONFIG_BUS_BACKOFF_MAX_MS) backoff_ms = CONFIG_BUS_BACKOFF_MAX_MS;
+			break;
+		case BUS_RECOVERING:
+			recovering_since = now;
+			break;
+		case BUS_ERROR_ACTIVE:
+			if (old_state == BUS_OFF || old_state == BUS_RECOVERING) {
+				down_ms = (now - down_since) / 1000;
+				metrics_add(METRIC_BUS_DOWN_MS, down_ms);
+				ESP_LOGW(TAG, "bus was down for %"PRIu32" ms", down_ms);
+				up_since = now;
+			}
+			break;
+	}
+	bus_publish(new_state, down_ms);
+}
+
+bus_state_t bus_get_state(void)
+{
+	return state;
+}
+
+// Frames can be handed to the driver
+bool bus_available(void)
+{
+	return (state != BUS_OFF && state != BUS_RECOVERING);
+}
+
+// Bus-off and the backoff has passed, the caller starts the recovery
+bool bus_recovery_due(void)
+{
+	int64_t now = esp_timer_get_time();
+	// A recovery that did not finish in time counts as failed
+	if (state == BUS_RECOVERING && now - recovering_since > BUS_RECOVERY_TIMEOUT_US) {
+		ESP_LOGW(TAG, "recovery timeout");
+		bus_set_state(BUS_OFF);
+	}
+	return (state == BUS_OFF && now >= recover_at);
+}
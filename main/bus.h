@@ -0,0 +1,21 @@
+#ifndef BUS_H_
+#define BUS_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Same order as the error states of the TWAI driver
+typedef enum {
+	BUS_ERROR_ACTIVE = 0,
+	BUS_ERROR_WARNING,
+	BUS_ERROR_PASSIVE,
+	BUS_OFF,
+	BUS_RECOVERING,
+} bus_state_t;
+
+void bus_set_state(bus_state_t state);
+bus_state_t bus_get_state(void);
+bool bus_available(void);
+bool bus_recovery_due(void);
+
+#endif /* BUS_H_ */
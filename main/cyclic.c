@@ -0,0 +1,246 @@
+/*
+	This code is in the Public Domain (or CC0 licensed, at your option.)
+
+	Unless required by applicable law or agreed to in writing, this
+	software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+	CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "mqtt.h"
+#include "frame.h"
+#include "bulk.h"
+#include "cyclic.h"
+
+static const char *TAG = "CYCLIC";
+
+/*
+ * Hashed timer wheel with 1 ms slots.
+ * An entry sits in slot (due % CYCLIC_SLOTS) and fires when the wheel
+ * reaches its due time, so each tick only looks at one short list.
+ * The wheel is driven by esp_timer, not by the FreeRTOS tick.
+ */
+#define	CYCLIC_SLOTS	64
+#define	CYCLIC_TICK_US	1000
+
+typedef struct {
+	bool used;
+	FRAME_t frame;
+	uint16_t period;
+	uint8_t counter_pos;
+	uint8_t checksum_pos;
+	uint8_t counter;
+	uint32_t due;		// wheel tick of the next transmission
+	int16_t next;		// next entry in the same slot, -1 = end
+	uint32_t overrun;	// transmissions lost because the TX path was full
+} CYCLIC_t;
+
+static CYCLIC_t entries[CONFIG_CYCLIC_ENTRIES];
+static int16_t wheel[CYCLIC_SLOTS];
+static uint32_t current;
+static SemaphoreHandle_t xMutexCyclic;
+static StaticSemaphore_t cyclic_mutex;
+
+static void wheel_insert(int16_t index)
+{
+	int16_t slot = entries[index].due % CYCLIC_SLOTS;
+	entries[index].next = wheel[slot];
+	wheel[slot] = index;
+}
+
+static void wheel_remove(int16_t index)
+{
+	int16_t *link = &wheel[entries[index].due % CYCLIC_SLOTS];
+	while (*link != -1) {
+		if (*link == index) {
+			*link = entries[index].next;
+			return;
+		}
+		link = &entries[*link].next;
+	}
+}
+
+static void cyclic_send(CYCLIC_t *entry)
+{
+	FRAME_t *frame = &entry->frame;
+	if (entry->counter_pos < frame->data_len) {
+		frame->data[entry->counter_pos] = entry->counter++;
+	}
+	if (entry->checksum_pos < frame->data_len) {
+		// 8-bit sum of all other data bytes
+		uint8_t sum = 0;
+		for (int i=0;i<frame->data_len;i++) {
+			if (i != entry->checksum_pos) sum += frame->data[i];
+		}
+		frame->data[entry->checksum_pos] = sum;
+	}
+	frame->timestamp = 0;
+	if (twai_tx_send(frame, 0) != pdPASS) entry->overrun++;
+}
+
+static void wheel_tick(uint32_t tick)
+{
+	int16_t slot = tick % CYCLIC_SLOTS;
+	int16_t index = wheel[slot];
+	wheel[slot] = -1;
+	while (index != -1) {
+		int16_t next = entries[index].next;
+		if (entries[index].due == tick) {
+			cyclic_send(&entries[index]);
+			entries[index].due += entries[index].period;
+		}
+		wheel_insert(index);
+		index = next;
+	}
+}
+
+static void cyclic_timer_callback(void *arg)
+{
+	uint32_t now = esp_timer_get_time() / CYCLIC_TICK_US;
+	xSemaphoreTake(xMutexCyclic, portMAX_DELAY);
+	// Catch up if the callback was late, so the cycle does not drift
+	while ((int32_t)(now - current) > 0) {
+		current++;
+		wheel_tick(current);
+	}
+	xSemaphoreGive(xMutexCyclic);
+}
+
+static int16_t cyclic_find(uint32_t canid, int16_t extd)
+{
+	for (int index=0;index<CONFIG_CYCLIC_ENTRIES;index++) {
+		if (entries[index].used == false) continue;
+		if (entries[index].frame.canid != canid) continue;
+		if (entries[index].frame.extd != extd) continue;
+		return index;
+	}
+	return -1;
+}
+
+static void cyclic_set(const uint8_t *data, int data_len)
+{
+	if (data_len < 11) {
+		ESP_LOGW(TAG, "Command too short %d", data_len);
+		return;
+	}
+	uint32_t canid = (data[1] << 24) | (data[2] << 16) | (data[3] << 8) | data[4];
+	uint8_t flags = data[5];
+	uint16_t period = (data[6] << 8) | data[7];
+	int16_t fdf = (flags & BULK_FLAG_FDF) ? 1 : 0;
+	int16_t len = can_dlc_to_len(data[10], fdf);
+	if (period == 0 || data_len < 11 + len) {
+		ESP_LOGW(TAG, "Invalid command period=%d len=%d", period, len);
+		return;
+	}
+
+	xSemaphoreTake(xMutexCyclic, portMAX_DELAY);
+	int16_t extd = (flags & BULK_FLAG_EXTD) ? 1 : 0;
+	int16_t index = cyclic_find(canid, extd);
+	bool update = (index >= 0);
+	if (update == false) {
+		for (index=0;index<CONFIG_CYCLIC_ENTRIES;index++) {
+			if (entries[index].used == false) break;
+		}
+		if (index == CONFIG_CYCLIC_ENTRIES) {
+			xSemaphoreGive(xMutexCyclic);
+			ESP_LOGW(TAG, "No free entry for canid=0x%"PRIx32, canid);
+			return;
+		}
+	}
+
+	// Payload and period are replaced under the lock, the due time is kept
+	CYCLIC_t *entry = &entries[index];
+	entry->frame.canid = canid;
+	entry->frame.extd = extd;
+	entry->frame.rtr = 0;
+	entry->frame.fdf = fdf;
+	entry->frame.brs = (flags & BULK_FLAG_BRS) ? 1 : 0;
+	entry->frame.esi = 0;
+	// Keep-alive timing must not suffer from queued bulk frames
+	entry->frame.priority = TX_PRIORITY_HIGH;
+	entry->frame.data_len = len;
+	memcpy(entry->frame.data, &data[11], len);
+	entry->period = period;
+	entry->counter_pos = data[8];
+	entry->checksum_pos = data[9];
+	if (update == false) {
+		entry->used = true;
+		entry->counter = 0;
+		entry->overrun = 0;
+		// First transmission on the next tick
+		entry->due = current + 1;
+		wheel_insert(index);
+	}
+	xSemaphoreGive(xMutexCyclic);
+	ESP_LOGI(TAG, "%s canid=0x%"PRIx32" period=%d len=%d", update ? "update" : "register", canid, period, len);
+}
+
+static void cyclic_cancel(const uint8_t *data, int data_len)
+{
+	if (data_len < 6) {
+		ESP_LOGW(TAG, "Command too short %d", data_len);
+		return;
+	}
+	uint32_t canid = (data[1] << 24) | (data[2] << 16) | (data[3] << 8) | data[4];
+	int16_t extd = (data[5] & BULK_FLAG_EXTD) ? 1 : 0;
+	xSemaphoreTake(xMutexCyclic, portMAX_DELAY);
+	int16_t index = cyclic_find(canid, extd);
+	if (index >= 0) {
+		wheel_remove(index);
+		entries[index].used = false;
+	}
+	xSemaphoreGive(xMutexCyclic);
+	ESP_LOGI(TAG, "cancel canid=0x%"PRIx32" found=%d", canid, index >= 0);
+}
+
+static void cyclic_cancel_all(void)
+{
+	xSemaphoreTake(xMutexCyclic, portMAX_DELAY);
+	for (int slot=0;slot<CYCLIC_SLOTS;slot++) wheel[slot] = -1;
+	for (int index=0;index<CONFIG_CYCLIC_ENTRIES;index++) entries[index].used = false;
+	xSemaphoreGive(xMutexCyclic);
+	ESP_LOGI(TAG, "cancel all");
+}
+
+// Called from the MQTT event handler with a message on the cyclic topic
+void cyclic_command(const uint8_t *data, int data_len)
+{
+	if (data_len < 1) return;
+	switch (data[0]) {
+		case CYCLIC_CMD_SET:
+			cyclic_set(data, data_len);
+			break;
+		case CYCLIC_CMD_CANCEL:
+			cyclic_cancel(data, data_len);
+			break;
+		case CYCLIC_CMD_CANCEL_ALL:
+			cyclic_cancel_all();
+			break;
+		default:
+			ESP_LOGW(TAG, "Unknown command 0x%x", data[0]);
+			break;
+	}
+}
+
+void cyclic_init(void)
+{
+	for (int slot=0;slot<CYCLIC_SLOTS;slot++) wheel[slot] = -1;
+	xMutexCyclic = xSemaphoreCreateMutexStatic(&cyclic_mutex);
+	configASSERT( xMutexCyclic );
+	current = esp_timer_get_time() / CYCLIC_TICK_US;
+
+	const esp_timer_create_args_t timer_args = {
+		.callback = cyclic_timer_callback,
+		.name = "cyclic",
+	};
+	esp_timer_handle_t timer;
+	ESP_ERROR_CHECK(esp_timer_create(&timer_args, &timer));
+	ESP_ERROR_CHECK(esp_timer_start_periodic(timer, CYCLIC_TICK_US));
+}
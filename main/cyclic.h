@@ -0,0 +1,36 @@
+#ifndef CYCLIC_H_
+#define CYCLIC_H_
+
+#include <stdint.h>
+
+/*
+ * Cyclic command format (big endian)
+ * Set, registers a new entry or updates an existing one:
+ * offset size
+ * 0      1    CYCLIC_CMD_SET
+ * 1      4    CAN ID
+ * 5      1    flags (BULK_FLAG_EXTD/FDF/BRS)
+ * 6      2    period in milliseconds
+ * 8      1    counter byte position (CYCLIC_NONE = no counter)
+ * 9      1    checksum byte position (CYCLIC_NONE = no checksum)
+ * 10     1    DLC
+ * 11     n    data
+ *
+ * Cancel:
+ * 0      1    CYCLIC_CMD_CANCEL
+ * 1      4    CAN ID
+ * 5      1    flags
+ *
+ * Cancel all:
+ * 0      1    CYCLIC_CMD_CANCEL_ALL
+ */
+#define	CYCLIC_CMD_SET		0x01
+#define	CYCLIC_CMD_CANCEL	0x02
+#define	CYCLIC_CMD_CANCEL_ALL	0x03
+
+#define	CYCLIC_NONE	0xFF
+
+void cyclic_init(void);
+void cyclic_command(const uint8_t *data, int data_len);
+
+#endif /* CYCLIC_H_ */
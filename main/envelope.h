@@ -0,0 +1,55 @@
+#ifndef ENVELOPE_H_
+#define ENVELOPE_H_
+
+#include <stdint.h>
+#include "mqtt.h"
+
+/*
+ * Envelope format (big endian)
+ * offset size
+ * 0      1    version (ENVELOPE_VERSION)
+ * 1      1    flags (ENVELOPE_FLAG_*)
+ * 2      1    data length
+ * 3      1    reserved, 0
+ * 4      4    sequence number, counts every frame the bridge publishes
+ * 8      8    receive time in microseconds since boot
+ * 16     4    CAN ID
+ * 20     n    data
+ */
+#define	ENVELOPE_VERSION	1
+
+#define	ENVELOPE_FLAG_EXTD	0x01
+#define	ENVELOPE_FLAG_RTR	0x02
+#define	ENVELOPE_FLAG_FDF	0x04
+#define	ENVELOPE_FLAG_BRS	0x08
+#define	ENVELOPE_FLAG_ESI	0x10
+
+#define	ENVELOPE_HEADER_LEN	20
+#define	ENVELOPE_MAX_LEN	(ENVELOPE_HEADER_LEN + CANFD_MAX_DATA_LEN)
+
+static inline void envelope_put32(uint8_t *buf, uint32_t value)
+{
+	buf[0] = value >> 24;
+	buf[1] = value >> 16;
+	buf[2] = value >> 8;
+	buf[3] = value;
+}
+
+// Returns the envelope length, buf must hold ENVELOPE_MAX_LEN bytes
+static inline int envelope_pack(uint8_t *buf, const MQTT_t *mqttBuf)
+{
+	buf[0] = ENVELOPE_VERSION;
+	buf[1] = mqttBuf->flags;
+	buf[2] = mqttBuf->data_len;
+	buf[3] = 0;
+	envelope_put32(&buf[4], mqttBuf->sequence);
+	envelope_put32(&buf[8], (uint64_t)mqttBuf->timestamp >> 32);
+	envelope_put32(&buf[12], (uint64_t)mqttBuf->timestamp);
+	envelope_put32(&buf[16], mqttBuf->canid);
+	for (int i=0;i<mqttBuf->data_len;i++) {
+		buf[ENVELOPE_HEADER_LEN+i] = mqttBuf->data[i];
+	}
+	return ENVELOPE_HEADER_LEN + mqttBuf->data_len;
+}
+
+#endif /* ENVELOPE_H_ */
@@ -0,0 +1,332 @@
+/*
+	This code is in the Public Domain (or CC0 licensed, at your option.)
+
+	Unless required by applicable law or agreed to in writing, this
+	software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+	CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/message_buffer.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "frame.h"
+#include "metrics.h"
+#include "trace.h"
+
+static const char *TAG = "FRAME";
+
+/*
+ * MQTT_t and FRAME_t are sized for CAN FD (64 bytes of data).
+ * A plain queue would reserve that much for every classic frame too,
+ * so both directions use message buffers that only store the used bytes.
+ * Message buffers allow one writer at a time, so senders take a mutex.
+ * The mutex is only held to copy a message in. A sender that waits for room
+ * waits on the space semaphore of the buffer, which the consumer gives,
+ * so a sender that does not wait never finds the mutex held by one that does.
+ *
+ * The CAN TX path has one message buffer per priority class.
+ * Frames keep their order within a class, so bulk and ISO-TP sequences
+ * are never reordered, but a high class frame overtakes queued bulk frames.
+ */
+static MessageBufferHandle_t xMessageBuffer_mqtt_tx;
+static size_t mqtt_tx_size;
+static SemaphoreHandle_t xMutex_mqtt_tx;
+static SemaphoreHandle_t xSpace_mqtt_tx;
+
+static MessageBufferHandle_t xMessageBuffer_twai_tx[TX_PRIORITY_CLASSES];
+static SemaphoreHandle_t xMutex_twai_tx[TX_PRIORITY_CLASSES];
+static SemaphoreHandle_t xSpace_twai_tx[TX_PRIORITY_CLASSES];
+// Counts queued frames of all classes, so the consumer can block on one object
+static SemaphoreHandle_t xSemaphore_twai_tx;
+
+// Depth of each class in full-size records
+static const int16_t twai_tx_depth[TX_PRIORITY_CLASSES] = {
+	FRAME_QUEUE_DEPTH,	// TX_PRIORITY_HIGH
+	FRAME_QUEUE_DEPTH,	// TX_PRIORITY_NORMAL
+	FRAME_QUEUE_DEPTH*2,	// TX_PRIORITY_BULK
+};
+#define	TWAI_TX_DEPTH_TOTAL	(FRAME_QUEUE_DEPTH*4)
+
+/*
+ * The buffers are static, so they are placed at link time and never come from the heap.
+ * Each message costs its length plus a size_t length word, and FreeRTOS wants one more byte.
+ */
+#define	MQTT_TX_SIZE	(FRAME_QUEUE_DEPTH * (sizeof(MQTT_t) + sizeof(size_t)))
+static uint8_t mqtt_tx_storage[MQTT_TX_SIZE + 1];
+static StaticMessageBuffer_t mqtt_tx_buffer;
+static StaticSemaphore_t mqtt_tx_mutex;
+static StaticSemaphore_t mqtt_tx_space;
+
+static uint8_t twai_tx_storage[TWAI_TX_DEPTH_TOTAL * (sizeof(FRAME_t) + sizeof(size_t)) + TX_PRIORITY_CLASSES];
+static StaticMessageBuffer_t twai_tx_buffer[TX_PRIORITY_CLASSES];
+static StaticSemaphore_t twai_tx_mutex[TX_PRIORITY_CLASSES];
+static StaticSemaphore_t twai_tx_space[TX_PRIORITY_CLASSES];
+static StaticSemaphore_t twai_tx_count;
+
+static size_t twai_tx_size[TX_PRIORITY_CLASSES];
+static TX_STATS_t twai_tx_stats[TX_PRIORITY_CLASSES];
+// Frames served from a higher class while this class was waiting
+static uint32_t twai_tx_skipped[TX_PRIORITY_CLASSES];
+
+// Ends the wait of frame_delay, finer than the FreeRTOS tick without spinning
+static esp_timer_handle_t delay_timer;
+static SemaphoreHandle_t xSemaphore_delay;
+static StaticSemaphore_t delay_semaphore;
+
+// FD DLC 9..15 to data length
+static const int16_t canfd_dlc_len[16] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 12, 16, 20, 24, 32, 48, 64};
+
+static void delay_timer_callback(void *arg)
+{
+	xSemaphoreGive(xSemaphore_delay);
+}
+
+void frame_queue_create(void)
+{
+	mqtt_tx_size = MQTT_TX_SIZE;
+	xMessageBuffer_mqtt_tx = xMessageBufferCreateStatic( mqtt_tx_size, mqtt_tx_storage, &mqtt_tx_buffer );
+	configASSERT( xMessageBuffer_mqtt_tx );
+	xMutex_mqtt_tx = xSemaphoreCreateMutexStatic( &mqtt_tx_mutex );
+	configASSERT( xMutex_mqtt_tx );
+	xSpace_mqtt_tx = xSemaphoreCreateCountingStatic( 1, 0, &mqtt_tx_space );
+	configASSERT( xSpace_mqtt_tx );
+	size_t offset = 0;
+	for (int i=0;i<TX_PRIORITY_CLASSES;i++) {
+		size_t size = twai_tx_depth[i] * (sizeof(FRAME_t) + sizeof(size_t));
+		configASSERT( offset + size + 1 <= sizeof(twai_tx_storage) );
+		twai_tx_size[i] = size;
+		xMessageBuffer_twai_tx[i] = xMessageBufferCreateStatic( size, &twai_tx_storage[offset], &twai_tx_buffer[i] );
+		configASSERT( xMessageBuffer_twai_tx[i] );
+		offset += size + 1;
+		xMutex_twai_tx[i] = xSemaphoreCreateMutexStatic( &twai_tx_mutex[i] );
+		configASSERT( xMutex_twai_tx[i] );
+		xSpace_twai_tx[i] = xSemaphoreCreateCountingStatic( 1, 0, &twai_tx_space[i] );
+		configASSERT( xSpace_twai_tx[i] );
+		twai_tx_stats[i].min_free = size;
+	}
+	xSemaphore_twai_tx = xSemaphoreCreateCountingStatic( 0xFFFF, 0, &twai_tx_count );
+	configASSERT( xSemaphore_twai_tx );
+	xSemaphore_delay = xSemaphoreCreateCountingStatic( 1, 0, &delay_semaphore );
+	configASSERT( xSemaphore_delay );
+	const esp_timer_create_args_t timer_args = {
+		.callback = delay_timer_callback,
+		.name = "frame_delay",
+	};
+	ESP_ERROR_CHECK(esp_timer_create(&timer_args, &delay_timer));
+}
+
+// Copies the messages in under the mutex, waits for room without it. Returns the number sent.
+static int buffer_send(MessageBufferHandle_t xMessageBuffer, SemaphoreHandle_t xMutex, SemaphoreHandle_t xSpace,
+	const void *data, size_t stride, int count, size_t (*length)(const void *), TickType_t xTicksToWait)
+{
+	int sent = 0;
+	TickType_t start = xTaskGetTickCount();
+	while (1) {
+		// Held only for the copies, so this wait is short
+		xSemaphoreTake(xMutex, portMAX_DELAY);
+		for (;sent<count;sent++) {
+			const void *message = (const uint8_t *)data + sent * stride;
+			size_t message_len = length(message);
+			if (xMessageBufferSend(xMessageBuffer, message, message_len, 0) != message_len) break;
+		}
+		xSemaphoreGive(xMutex);
+		if (sent == count) return sent;
+		TickType_t elapsed = xTaskGetTickCount() - start;
+		if (elapsed >= xTicksToWait) return sent;
+		xSemaphoreTake(xSpace, xTicksToWait - elapsed);
+	}
+}
+
+static size_t mqtt_length(const void *message)
+{
+	return MQTT_SIZE((const MQTT_t *)message);
+}
+
+static size_t frame_length(const void *message)
+{
+	return FRAME_SIZE((const FRAME_t *)message);
+}
+
+BaseType_t mqtt_tx_send(MQTT_t *mqttBuf, TickType_t xTicksToWait)
+{
+	BaseType_t ret = (buffer_send(xMessageBuffer_mqtt_tx, xMutex_mqtt_tx, xSpace_mqtt_tx, mqttBuf, sizeof(MQTT_t), 1, mqtt_length, xTicksToWait) == 1) ? pdPASS : pdFAIL;
+	if (ret == pdPASS) {
+		metrics_count(METRIC_MQTT_QUEUED);
+		metrics_queue_level(QUEUE_MQTT_TX, mqtt_tx_size - xMessageBufferSpacesAvailable(xMessageBuffer_mqtt_tx), mqtt_tx_size);
+	} else {
+		metrics_count(METRIC_MQTT_DROPPED);
+	}
+	return ret;
+}
+
+// A batch of records under one lock, returns the number queued
+int mqtt_tx_send_many(MQTT_t *records, int count, TickType_t xTicksToWait)
+{
+	int sent = buffer_send(xMessageBuffer_mqtt_tx, xMutex_mqtt_tx, xSpace_mqtt_tx, records, sizeof(MQTT_t), count, mqtt_length, xTicksToWait);
+	if (sent > 0) {
+		metrics_add(METRIC_MQTT_QUEUED, sent);
+		metrics_queue_level(QUEUE_MQTT_TX, mqtt_tx_size - xMessageBufferSpacesAvailable(xMessageBuffer_mqtt_tx), mqtt_tx_size);
+	}
+	if (sent < count) metrics_add(METRIC_MQTT_DROPPED, count - sent);
+	return sent;
+}
+
+BaseType_t mqtt_tx_receive(MQTT_t *mqttBuf, TickType_t xTicksToWait)
+{
+	size_t received = xMessageBufferReceive(xMessageBuffer_mqtt_tx, mqttBuf, sizeof(MQTT_t), xTicksToWait);
+	if (received == 0) return pdFAIL;
+	xSemaphoreGive(xSpace_mqtt_tx);
+	if (received != MQTT_SIZE(mqttBuf)) {
+		ESP_LOGE(TAG, "Broken MQTT record %zu", received);
+		return pdFAIL;
+	}
+	return pdPASS;
+}
+
+BaseType_t twai_tx_send(FRAME_t *frame, TickType_t xTicksToWait)
+{
+	int16_t priority = frame->priority;
+	if (priority < 0 || priority >= TX_PRIORITY_CLASSES) priority = TX_PRIORITY_NORMAL;
+	// Frames from MQTT keep the time the message arrived
+	if (frame->timestamp == 0) frame->timestamp = esp_timer_get_time();
+
+	int sent = buffer_send(xMessageBuffer_twai_tx[priority], xMutex_twai_tx[priority], xSpace_twai_tx[priority],
+		frame, sizeof(FRAME_t), 1, frame_length, xTicksToWait);
+	if (sent == 1) {
+		size_t free = xMessageBufferSpacesAvailable(xMessageBuffer_twai_tx[priority]);
+		if (free < twai_tx_stats[priority].min_free) twai_tx_stats[priority].min_free = free;
+		metrics_count(METRIC_TWAI_QUEUED);
+		trace_record(TRACE_TWAI_QUEUED, frame->canid, frame->data_len, priority);
+		metrics_queue_level(QUEUE_TWAI_TX_HIGH + priority, twai_tx_size[priority] - free, twai_tx_size[priority]);
+	} else {
+		twai_tx_stats[priority].dropped++;
+		metrics_count(METRIC_TWAI_DROPPED);
+		trace_record(TRACE_TWAI_DROPPED, frame->canid, frame->data_len, priority);
+	}
+	if (sent != 1) return pdFAIL;
+	xSemaphoreGive(xSemaphore_twai_tx);
+	return pdPASS;
+}
+
+// Pick the class to serve next; only called by the single consumer
+static int16_t twai_tx_select(void)
+{
+	int16_t selected = -1;
+	for (int i=0;i<TX_PRIORITY_CLASSES;i++) {
+		if (xMessageBufferIsEmpty(xMessageBuffer_twai_tx[i]) == pdTRUE) continue;
+		if (selected < 0) {
+			selected = i;
+			continue;
+		}
+		// A lower class is waiting behind the selected one
+		if (++twai_tx_skipped[i] >= CONFIG_TX_STARVATION_LIMIT) {
+			twai_tx_skipped[i] = 0;
+			twai_tx_stats[i].promoted++;
+			return i;
+		}
+	}
+	if (selected >= 0) twai_tx_skipped[selected] = 0;
+	return selected;
+}
+
+BaseType_t twai_tx_receive(FRAME_t *frame, TickType_t xTicksToWait)
+{
+	if (xSemaphoreTake(xSemaphore_twai_tx, xTicksToWait) != pdTRUE) return pdFAIL;
+	int16_t priority = twai_tx_select();
+	if (priority < 0) return pdFAIL;
+	size_t received = xMessageBufferReceive(xMessageBuffer_twai_tx[priority], frame, sizeof(FRAME_t), 0);
+	if (received == 0) return pdFAIL;
+	xSemaphoreGive(xSpace_twai_tx[priority]);
+	if (received != FRAME_SIZE(frame)) {
+		ESP_LOGE(TAG, "Broken FRAME record %zu", received);
+		return pdFAIL;
+	}
+
+	TX_STATS_t *stats = &twai_tx_stats[priority];
+	uint32_t wait_us = esp_timer_get_time() - frame->timestamp;
+	stats->sent++;
+	stats->total_wait_us += wait_us;
+	if (wait_us > stats->max_wait_us) stats->max_wait_us = wait_us;
+	return pdPASS;
+}
+
+void twai_tx_get_stats(int16_t priority, TX_STATS_t *stats)
+{
+	*stats = twai_tx_stats[priority];
+}
+
+void twai_tx_dump_stats(void)
+{
+	for (int i=0;i<TX_PRIORITY_CLASSES;i++) {
+		TX_STATS_t *stats = &twai_tx_stats[i];
+		uint32_t average = stats->sent ? stats->total_wait_us / stats->sent : 0;
+		ESP_LOGI(TAG, "priority=%d sent=%"PRIu32" dropped=%"PRIu32" promoted=%"PRIu32" wait avg=%"PRIu32"us max=%"PRIu32"us min_free=%zu",
+			i, stats->sent, stats->dropped, stats->promoted, average, stats->max_wait_us, stats->min_free);
+	}
+}
+
+/*
+ * Frame type column of the csv files:
+ * S/E = Standard/Extended classic frame
+ * SF/EF = Standard/Extended CAN FD frame
+ * SFB/EFB = Standard/Extended CAN FD frame with bit rate switch
+ */
+esp_err_t can_parse_frame_type(const char *ptr, uint16_t *extd, uint16_t *fdf, uint16_t *brs)
+{
+	if (ptr[0] == 'S') {
+		*extd = 0;
+	} else if (ptr[0] == 'E') {
+		*extd = 1;
+	} else {
+		return ESP_FAIL;
+	}
+	*fdf = 0;
+	*brs = 0;
+	if (strcmp(&ptr[1], "") == 0) return ESP_OK;
+	if (strcmp(&ptr[1], "F") == 0) {
+		*fdf = 1;
+	} else if (strcmp(&ptr[1], "FB") == 0) {
+		*fdf = 1;
+		*brs = 1;
+	} else {
+		return ESP_FAIL;
+	}
+	return ESP_OK;
+}
+
+int16_t can_dlc_to_len(uint8_t dlc, int16_t fdf)
+{
+	if (dlc > 15) dlc = 15;
+	// Classic frames may use DLC 9..15, but still carry 8 bytes
+	if (fdf == 0) return (dlc > CAN_MAX_DATA_LEN) ? CAN_MAX_DATA_LEN : dlc;
+	return canfd_dlc_len[dlc];
+}
+
+uint8_t can_len_to_dlc(int16_t len)
+{
+	for (uint8_t dlc=0;dlc<16;dlc++) {
+		if (canfd_dlc_len[dlc] >= len) return dlc;
+	}
+	return 15;
+}
+
+// Round up to the next length an FD frame can carry
+int16_t canfd_valid_len(int16_t len)
+{
+	return canfd_dlc_len[can_len_to_dlc(len)];
+}
+
+// The caller sleeps until a one-shot timer fires, one caller at a time
+void frame_delay(uint32_t delay_us)
+{
+	if (delay_us == 0) return;
+	if (esp_timer_start_once(delay_timer, delay_us) != ESP_OK) return;
+	xSemaphoreTake(xSemaphore_delay, portMAX_DELAY);
+}
@@ -0,0 +1,43 @@
+#ifndef FRAME_H_
+#define FRAME_H_
+
+#include "freertos/FreeRTOS.h"
+#include "esp_err.h"
+#include "mqtt.h"
+
+// Number of full-size records each message buffer can hold.
+// Classic frames only use the header plus 8 bytes, so more of them fit.
+#define	FRAME_QUEUE_DEPTH	10
+
+// CAN TX priority classes, lower value is served first
+#define	TX_PRIORITY_HIGH	0
+#define	TX_PRIORITY_NORMAL	1
+#define	TX_PRIORITY_BULK	2
+#define	TX_PRIORITY_CLASSES	3
+
+typedef struct {
+	uint32_t sent;		// frames handed to the driver
+	uint32_t dropped;	// frames refused because the class was full
+	uint32_t promoted;	// frames served ahead of a higher class to stop starvation
+	uint32_t max_wait_us;	// longest time from entering the bridge to leaving the queue
+	uint64_t total_wait_us;
+	size_t min_free;	// lowest free space seen in bytes
+} TX_STATS_t;
+
+void frame_queue_create(void);
+
+BaseType_t mqtt_tx_send(MQTT_t *mqttBuf, TickType_t xTicksToWait);
+int mqtt_tx_send_many(MQTT_t *records, int count, TickType_t xTicksToWait);
+BaseType_t mqtt_tx_receive(MQTT_t *mqttBuf, TickType_t xTicksToWait);
+BaseType_t twai_tx_send(FRAME_t *frame, TickType_t xTicksToWait);
+BaseType_t twai_tx_receive(FRAME_t *frame, TickType_t xTicksToWait);
+void twai_tx_get_stats(int16_t priority, TX_STATS_t *stats);
+void twai_tx_dump_stats(void);
+
+esp_err_t can_parse_frame_type(const char *ptr, uint16_t *extd, uint16_t *fdf, uint16_t *brs);
+int16_t can_dlc_to_len(uint8_t dlc, int16_t fdf);
+uint8_t can_len_to_dlc(int16_t len);
+int16_t canfd_valid_len(int16_t len);
+void frame_delay(uint32_t delay_us);
+
+#endif /* FRAME_H_ */
@@ -0,0 +1,315 @@
+/*
+	This code is in the Public Domain (or CC0 licensed, at your option.)
+
+	Unless required by applicable law or agreed to in writing, this
+	software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+	CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+/*
+ * ISO-TP segmentation and reassembly.
+ * This file only holds the protocol state machine.
+ * Frames, buffers and time are supplied by the caller,
+ * so it does not depend on the TWAI driver or FreeRTOS.
+ */
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <string.h>
+#include "esp_log.h"
+
+#include "isotp.h"
+
+static const char *TAG = "ISOTP";
+
+#define	PCI_SF	0x00
+#define	PCI_FF	0x10
+#define	PCI_CF	0x20
+#define	PCI_FC	0x30
+
+#define	FC_CTS		0
+#define	FC_WAIT		1
+#define	FC_OVFLW	2
+
+static bool time_after(uint32_t now, uint32_t deadline)
+{
+	return (int32_t)(now - deadline) >= 0;
+}
+
+static uint32_t stmin_to_us(uint8_t stmin)
+{
+	if (stmin <= 0x7F) return stmin * 1000;
+	if (stmin >= 0xF1 && stmin <= 0xF9) return (stmin - 0xF0) * 100;
+	// Reserved values mean the longest time
+	return 0x7F * 1000;
+}
+
+static bool send_frame(ISOTP_t *session, uint8_t *frame, int16_t len)
+{
+	memset(&frame[len], ISOTP_PADDING, 8 - len);
+	return isotp_send_frame(session, frame);
+}
+
+// Sends the pending flow control, false while the TX path does not take it
+static bool fc_continue(ISOTP_t *session)
+{
+	uint8_t frame[8];
+	frame[0] = PCI_FC | session->rx_fc_status;
+	frame[1] = session->block_size;
+	frame[2] = session->stmin;
+	if (send_frame(session, frame, 3) == false) return false;
+	session->rx_fc_pending = false;
+	return true;
+}
+
+// A flow control the TX path refuses is retried by isotp_poll until N_Br ends
+static void send_flow_control(ISOTP_t *session, uint8_t fs, uint32_t now)
+{
+	session->rx_fc_status = fs;
+	session->rx_fc_pending = true;
+	session->rx_fc_deadline = now + ISOTP_FC_TIMEOUT_MS * 1000;
+	if (fc_continue(session) == false) {
+		ESP_LOGD(TAG, "flow control pending tx_id=0x%"PRIx32, session->tx_id);
+	}
+}
+
+static void tx_abort(ISOTP_t *session, const char *reason)
+{
+	ESP_LOGW(TAG, "tx_id=0x%"PRIx32" transmit aborted: %s", session->tx_id, reason);
+	isotp_buffer_free(session->tx_buf);
+	session->tx_buf = NULL;
+	session->tx_state = ISOTP_IDLE;
+}
+
+static void rx_abort(ISOTP_t *session, const char *reason)
+{
+	ESP_LOGW(TAG, "rx_id=0x%"PRIx32" receive aborted: %s", session->rx_id, reason);
+	isotp_buffer_free(session->rx_buf);
+	session->rx_buf = NULL;
+	session->rx_state = ISOTP_IDLE;
+	session->rx_fc_pending = false;
+}
+
+static void tx_done(ISOTP_t *session)
+{
+	ESP_LOGD(TAG, "tx_id=0x%"PRIx32" sent %d bytes", session->tx_id, session->tx_len);
+	isotp_buffer_free(session->tx_buf);
+	session->tx_buf = NULL;
+	session->tx_state = ISOTP_IDLE;
+}
+
+// Send as many frames as the TX path accepts; the rest is sent by isotp_poll
+static void tx_continue(ISOTP_t *session, uint32_t now)
+{
+	uint8_t frame[8];
+
+	if (session->tx_pos == 0) {
+		if (session->tx_len <= 7) {
+			frame[0] = PCI_SF | session->tx_len;
+			memcpy(&frame[1], session->tx_buf, session->tx_len);
+			if (send_frame(session, frame, 1 + session->tx_len)) tx_done(session);
+			return;
+		}
+		frame[0] = PCI_FF | (session->tx_len >> 8);
+		frame[1] = session->tx_len & 0xFF;
+		memcpy(&frame[2], session->tx_buf, 6);
+		if (send_frame(session, frame, 8) == false) return;
+		session->tx_pos = 6;
+		session->tx_sn = 1;
+		session->tx_wft = 0;
+		session->tx_state = ISOTP_TX_WAIT_FC;
+		session->tx_deadline = now + ISOTP_TIMEOUT_MS * 1000;
+		return;
+	}
+
+	while (session->tx_pos < session->tx_len) {
+		if (session->tx_bs != 0 && session->tx_bs_count >= session->tx_bs) break;
+		// STmin is kept by queueing each frame only when it is due, the shared TX task never waits for it
+		if (session->tx_stmin_us != 0 && time_after(now, session->tx_due) == false) return;
+		int16_t len = session->tx_len - session->tx_pos;
+		if (len > 7) len = 7;
+		frame[0] = PCI_CF | session->tx_sn;
+		memcpy(&frame[1], &session->tx_buf[session->tx_pos], len);
+		if (send_frame(session, frame, 1 + len) == false) return;
+		session->tx_due = now + session->tx_stmin_us;
+		session->tx_pos += len;
+		session->tx_sn = (session->tx_sn + 1) & 0x0F;
+		session->tx_bs_count++;
+	}
+
+	if (session->tx_pos >= session->tx_len) {
+		tx_done(session);
+	} else {
+		session->tx_state = ISOTP_TX_WAIT_FC;
+		session->tx_deadline = now + ISOTP_TIMEOUT_MS * 1000;
+	}
+}
+
+// Start sending a PDU. The session owns buf until the transfer ends.
+bool isotp_send(ISOTP_t *session, uint8_t *buf, uint16_t len, uint32_t now)
+{
+	if (session->tx_state != ISOTP_IDLE) {
+		ESP_LOGW(TAG, "tx_id=0x%"PRIx32" busy", session->tx_id);
+		return false;
+	}
+	if (len == 0 || len > ISOTP_MAX_PDU_LEN) {
+		ESP_LOGW(TAG, "tx_id=0x%"PRIx32" invalid length %d", session->tx_id, len);
+		return false;
+	}
+	session->tx_buf = buf;
+	session->tx_len = len;
+	session->tx_pos = 0;
+	session->tx_state = ISOTP_TX_SENDING;
+	tx_continue(session, now);
+	return true;
+}
+
+static void on_flow_control(ISOTP_t *session, const uint8_t *data, int16_t len, uint32_t now)
+{
+	if (session->tx_state != ISOTP_TX_WAIT_FC) return;
+	if (len < 3) return;
+	switch (data[0] & 0x0F) {
+		case FC_CTS:
+			session->tx_bs = data[1];
+			session->tx_bs_count = 0;
+			session->tx_stmin_us = stmin_to_us(data[2]);
+			session->tx_due = now;
+			session->tx_wft = 0;
+			session->tx_state = ISOTP_TX_SENDING;
+			tx_continue(session, now);
+			break;
+		case FC_WAIT:
+			if (++session->tx_wft > ISOTP_MAX_WFT) {
+				tx_abort(session, "too many FC WAIT");
+			} else {
+				session->tx_deadline = now + ISOTP_TIMEOUT_MS * 1000;
+			}
+			break;
+		case FC_OVFLW:
+			tx_abort(session, "FC overflow");
+			break;
+		default:
+			tx_abort(session, "invalid flow status");
+			break;
+	}
+}
+
+static void on_single_frame(ISOTP_t *session, const uint8_t *data, int16_t len)
+{
+	int16_t sf_len = data[0] & 0x0F;
+	if (sf_len == 0 || sf_len > 7 || sf_len > len - 1) return;
+	// A new PDU ends the one in progress
+	if (session->rx_state != ISOTP_IDLE) rx_abort(session, "new single frame");
+	uint8_t *buf = isotp_buffer_alloc();
+	if (buf == NULL) {
+		ESP_LOGW(TAG, "rx_id=0x%"PRIx32" no buffer", session->rx_id);
+		return;
+	}
+	memcpy(buf, &data[1], sf_len);
+	isotp_pdu_received(session, buf, sf_len);
+}
+
+static void on_first_frame(ISOTP_t *session, const uint8_t *data, int16_t len, uint32_t now)
+{
+	if (len < 8) return;
+	uint16_t ff_len = ((data[0] & 0x0F) << 8) | data[1];
+	if (session->rx_state != ISOTP_IDLE) rx_abort(session, "new first frame");
+	// FF_DL 0 announces a PDU longer than 4095 bytes
+	if (ff_len == 0) {
+		send_flow_control(session, FC_OVFLW, now);
+		return;
+	}
+	if (ff_len < 8) return;
+	session->rx_buf = isotp_buffer_alloc();
+	if (session->rx_buf == NULL) {
+		ESP_LOGW(TAG, "rx_id=0x%"PRIx32" no buffer", session->rx_id);
+		send_flow_control(session, FC_OVFLW, now);
+		return;
+	}
+	memcpy(session->rx_buf, &data[2], 6);
+	session->rx_len = ff_len;
+	session->rx_pos = 6;
+	session->rx_sn = 1;
+	session->rx_bs = session->block_size;
+	session->rx_state = ISOTP_RX_RECEIVING;
+	session->rx_deadline = now + ISOTP_TIMEOUT_MS * 1000;
+	send_flow_control(session, FC_CTS, now);
+}
+
+static void on_consecutive_frame(ISOTP_t *session, const uint8_t *data, int16_t len, uint32_t now)
+{
+	if (session->rx_state != ISOTP_RX_RECEIVING) return;
+	if ((data[0] & 0x0F) != session->rx_sn) {
+		rx_abort(session, "wrong sequence number");
+		return;
+	}
+	int16_t cf_len = session->rx_len - session->rx_pos;
+	if (cf_len > 7) cf_len = 7;
+	if (cf_len > len - 1) {
+		rx_abort(session, "short consecutive frame");
+		return;
+	}
+	memcpy(&session->rx_buf[session->rx_pos], &data[1], cf_len);
+	session->rx_pos += cf_len;
+	session->rx_sn = (session->rx_sn + 1) & 0x0F;
+	session->rx_deadline = now + ISOTP_TIMEOUT_MS * 1000;
+
+	if (session->rx_pos >= session->rx_len) {
+		session->rx_state = ISOTP_IDLE;
+		isotp_pdu_received(session, session->rx_buf, session->rx_len);
+		session->rx_buf = NULL;
+		return;
+	}
+	if (session->block_size != 0 && --session->rx_bs == 0) {
+		session->rx_bs = session->block_size;
+		send_flow_control(session, FC_CTS, now);
+	}
+}
+
+// Handle a frame received on rx_id
+void isotp_on_frame(ISOTP_t *session, const uint8_t *data, int16_t len, uint32_t now)
+{
+	if (len < 1) return;
+	switch (data[0] & 0xF0) {
+		case PCI_SF:
+			on_single_frame(session, data, len);
+			break;
+		case PCI_FF:
+			on_first_frame(session, data, len, now);
+			break;
+		case PCI_CF:
+			on_consecutive_frame(session, data, len, now);
+			break;
+		case PCI_FC:
+			on_flow_control(session, data, len, now);
+			break;
+		default:
+			break;
+	}
+}
+
+// Time the next consecutive frame is due, false when the session does not wait for STmin
+bool isotp_tx_due(ISOTP_t *session, uint32_t *due)
+{
+	if (session->tx_state != ISOTP_TX_SENDING || session->tx_stmin_us == 0) return false;
+	*due = session->tx_due;
+	return true;
+}
+
+// Resume sending and check timeouts
+void isotp_poll(ISOTP_t *session, uint32_t now)
+{
+	if (session->tx_state == ISOTP_TX_SENDING) {
+		tx_continue(session, now);
+	} else if (session->tx_state == ISOTP_TX_WAIT_FC && time_after(now, session->tx_deadline)) {
+		tx_abort(session, "N_Bs timeout");
+	}
+	if (session->rx_fc_pending && fc_continue(session) == false && time_after(now, session->rx_fc_deadline)) {
+		ESP_LOGW(TAG, "flow control not sent tx_id=0x%"PRIx32, session->tx_id);
+		session->rx_fc_pending = false;
+		if (session->rx_state == ISOTP_RX_RECEIVING) rx_abort(session, "N_Br timeout");
+	}
+	if (session->rx_state == ISOTP_RX_RECEIVING && time_after(now, session->rx_deadline)) {
+		rx_abort(session, "N_Cr timeout");
+	}
+}
@@ -0,0 +1,84 @@
+#ifndef ISOTP_H_
+#define ISOTP_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+
+// ISO 15765-2 transport over classic CAN frames
+#define	ISOTP_MAX_PDU_LEN	4095
+
+// N_Bs / N_Cr timeout
+#define	ISOTP_TIMEOUT_MS	1000
+// N_Br, a flow control not sent by then would reach the peer after its N_Bs timeout
+#define	ISOTP_FC_TIMEOUT_MS	900
+// Number of FC WAIT frames accepted in a row
+#define	ISOTP_MAX_WFT		10
+#define	ISOTP_PADDING		0xCC
+
+enum {
+	ISOTP_IDLE = 0,
+	ISOTP_TX_SENDING,	// sending consecutive frames
+	ISOTP_TX_WAIT_FC,	// waiting for flow control
+	ISOTP_RX_RECEIVING,	// waiting for consecutive frames
+};
+
+typedef struct {
+	// Configuration
+	uint32_t tx_id;
+	uint32_t rx_id;
+	uint16_t extd;
+	char * tx_topic;	// MQTT to CAN
+	int16_t tx_topic_len;
+	char * rx_topic;	// CAN to MQTT
+	int16_t rx_topic_len;
+	uint8_t block_size;	// sent in our flow control frames
+	uint8_t stmin;
+
+	// Transmit state
+	uint8_t tx_state;
+	uint8_t *tx_buf;
+	uint16_t tx_len;
+	uint16_t tx_pos;
+	uint8_t tx_sn;
+	uint8_t tx_bs;		// block size from flow control, 0 = unlimited
+	uint8_t tx_bs_count;	// frames sent in this block
+	uint8_t tx_wft;
+	uint32_t tx_stmin_us;
+	uint32_t tx_due;	// time the next consecutive frame may be queued
+	uint32_t tx_deadline;
+
+	// Receive state
+	uint8_t rx_state;
+	uint8_t *rx_buf;
+	uint16_t rx_len;
+	uint16_t rx_pos;
+	uint8_t rx_sn;
+	uint8_t rx_bs;		// frames left until we send the next flow control
+	uint32_t rx_deadline;
+	bool rx_fc_pending;	// flow control the TX path did not take yet
+	uint8_t rx_fc_status;
+	uint32_t rx_fc_deadline;
+} ISOTP_t;
+
+// now is a free running microsecond clock, it may wrap
+bool isotp_send(ISOTP_t *session, uint8_t *buf, uint16_t len, uint32_t now);
+void isotp_on_frame(ISOTP_t *session, const uint8_t *data, int16_t len, uint32_t now);
+void isotp_poll(ISOTP_t *session, uint32_t now);
+bool isotp_tx_due(ISOTP_t *session, uint32_t *due);
+
+// Supplied by the caller of the engine
+bool isotp_send_frame(ISOTP_t *session, const uint8_t *data);
+void isotp_pdu_received(ISOTP_t *session, uint8_t *buf, uint16_t len);
+uint8_t *isotp_buffer_alloc(void);
+void isotp_buffer_free(uint8_t *buf);
+
+// Bridge side (isotp_task.c)
+esp_err_t build_isotp_table(ISOTP_t **sessions, char *file, int16_t *nsession);
+void isotp_init(void);
+void isotp_task(void *pvParameters);
+bool isotp_rx_frame(uint32_t canid, int16_t extd, const char *data, int16_t data_len);
+int16_t isotp_find_topic(const char *topic, int topic_len);
+void isotp_request(int16_t session, const char *data, int data_len, int offset, int total_data_len);
+
+#endif /* ISOTP_H_ */
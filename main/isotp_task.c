@@ -0,0 +1,328 @@
+/*
+	This code is in the Public Domain (or CC0 licensed, at your option.)
+
+	Unless required by applicable law or agreed to in writing, this
+	software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+	CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "mqtt.h"
+#include "frame.h"
+#include "isotp.h"
+#include "arena.h"
+
+static const char *TAG = "ISOTP_TASK";
+
+#define	ISOTP_EVENT_FRAME	1
+#define	ISOTP_EVENT_REQUEST	2
+#define	ISOTP_EVENT_DUE		3	// a consecutive frame waiting for STmin is due
+
+typedef struct {
+	int16_t type;
+	int16_t session;
+	uint8_t *buffer;	// ISOTP_EVENT_REQUEST
+	uint16_t length;
+	uint8_t data[8];	// ISOTP_EVENT_FRAME
+} ISOTP_EVENT_t;
+
+ISOTP_t *isotp;
+int16_t nisotp;
+
+#define	ISOTP_QUEUE_DEPTH	20
+static QueueHandle_t xQueueIsotp;
+static uint8_t isotp_queue_storage[ISOTP_QUEUE_DEPTH * sizeof(ISOTP_EVENT_t)];
+static StaticQueue_t isotp_queue;
+
+// Pool of PDU buffers shared by all sessions, the free list is a queue of pointers
+static uint8_t pool[CONFIG_ISOTP_BUFFERS][ISOTP_MAX_PDU_LEN];
+static QueueHandle_t xQueuePool;
+static uint8_t pool_queue_storage[CONFIG_ISOTP_BUFFERS * sizeof(uint8_t *)];
+static StaticQueue_t pool_queue;
+
+// PDU being received from MQTT
+static uint8_t *request_buffer;
+
+// Wakes the task when the next consecutive frame is due, finer than the FreeRTOS tick
+static esp_timer_handle_t due_timer;
+
+uint8_t *isotp_buffer_alloc(void)
+{
+	uint8_t *buf;
+	if (xQueueReceive(xQueuePool, &buf, 0) != pdPASS) return NULL;
+	return buf;
+}
+
+void isotp_buffer_free(uint8_t *buf)
+{
+	if (buf == NULL) return;
+	xQueueSend(xQueuePool, &buf, 0);
+}
+
+bool isotp_send_frame(ISOTP_t *session, const uint8_t *data)
+{
+	FRAME_t frame;
+	frame.timestamp = 0;
+	frame.canid = session->tx_id;
+	frame.extd = session->extd;
+	frame.rtr = 0;
+	frame.fdf = 0;
+	frame.brs = 0;
+	frame.esi = 0;
+	frame.priority = TX_PRIORITY_NORMAL;
+	frame.data_len = 8;
+	memcpy(frame.data, data, 8);
+	// Never block, a full TX path is retried on the next poll
+	return (twai_tx_send(&frame, 0) == pdPASS);
+}
+
+void isotp_pdu_received(ISOTP_t *session, uint8_t *buf, uint16_t len)
+{
+	ESP_LOGI(TAG, "rx_id=0x%"PRIx32" received %d bytes", session->rx_id, len);
+	MQTT_t mqttBuf;
+	// The last frame of the PDU arrived just now
+	mqttBuf.timestamp = esp_timer_get_time();
+	mqttBuf.topic_type = PUBLISH_PDU;
+	mqttBuf.topic_len = session->rx_topic_len;
+	strcpy(mqttBuf.topic, session->rx_topic);
+	PDU_t pdu = { .buffer = buf, .length = len };
+	memcpy(mqttBuf.data, &pdu, sizeof(pdu));
+	mqttBuf.data_len = sizeof(pdu);
+	// mqtt_pub_task frees the buffer after publishing
+	if (mqtt_tx_send(&mqttBuf, pdMS_TO_TICKS(100)) != pdPASS) {
+		ESP_LOGE(TAG, "mqtt_tx_send Fail");
+		isotp_buffer_free(buf);
+	}
+}
+
+// Called from the TWAI task for every received frame
+bool isotp_rx_frame(uint32_t canid, int16_t extd, const char *data, int16_t data_len)
+{
+	for(int index=0;index<nisotp;index++) {
+		if (isotp[index].rx_id != canid) continue;
+		if (isotp[index].extd != extd) continue;
+		ISOTP_EVENT_t event;
+		event.type = ISOTP_EVENT_FRAME;
+		event.session = index;
+		event.length = (data_len > 8) ? 8 : data_len;
+		memcpy(event.data, data, event.length);
+		if (xQueueSend(xQueueIsotp, &event, 0) != pdPASS) {
+			ESP_LOGW(TAG, "xQueueSend Fail");
+		}
+		return true;
+	}
+	return false;
+}
+
+// Returns the session whose request topic matches, or -1
+int16_t isotp_find_topic(const char *topic, int topic_len)
+{
+	for(int index=0;index<nisotp;index++) {
+		if (isotp[index].tx_topic_len != topic_len) continue;
+		if (strncmp(isotp[index].tx_topic, topic, topic_len) == 0) return index;
+	}
+	return -1;
+}
+
+// Called from the MQTT event handler with each fragment of a request
+void isotp_request(int16_t session, const char *data, int data_len, int offset, int total_data_len)
+{
+	if (offset == 0) {
+		if (request_buffer != NULL) isotp_buffer_free(request_buffer);
+		request_buffer = NULL;
+		if (total_data_len == 0 || total_data_len > ISOTP_MAX_PDU_LEN) {
+			ESP_LOGW(TAG, "Invalid PDU length %d", total_data_len);
+			return;
+		}
+		request_buffer = isotp_buffer_alloc();
+		if (request_buffer == NULL) {
+			ESP_LOGW(TAG, "no buffer for request");
+			return;
+		}
+	}
+	if (request_buffer == NULL) return;
+	memcpy(&request_buffer[offset], data, data_len);
+	if (offset + data_len < total_data_len) return;
+
+	ISOTP_EVENT_t event;
+	event.type = ISOTP_EVENT_REQUEST;
+	event.session = session;
+	event.buffer = request_buffer;
+	event.length = total_data_len;
+	request_buffer = NULL;
+	if (xQueueSend(xQueueIsotp, &event, 0) != pdPASS) {
+		ESP_LOGW(TAG, "xQueueSend Fail");
+		isotp_buffer_free(event.buffer);
+	}
+}
+
+esp_err_t build_isotp_table(ISOTP_t **sessions, char *file, int16_t *nsession)
+{
+	ESP_LOGI(TAG, "build_isotp_table file=%s", file);
+	char line[160];
+	int _nsession = 0;
+
+	FILE* f = fopen(file, "r");
+	if (f == NULL) {
+		ESP_LOGE(TAG, "Failed to open file for reading");
+		return ESP_FAIL;
+	}
+	while (1){
+		if ( fgets(line, sizeof(line) ,f) == 0 ) break;
+		char* pos = strchr(line, '\n');
+		if (pos) *pos = '\0';
+		if (strlen(line) == 0) continue;
+		if (line[0] == '#') continue;
+		_nsession++;
+	}
+	fclose(f);
+	ESP_LOGI(TAG, "build_isotp_table _nsession=%d", _nsession);
+
+	*sessions = arena_calloc(_nsession, sizeof(ISOTP_t));
+	if (*sessions == NULL) {
+		ESP_LOGE(TAG, "Error allocating memory for session");
+		return ESP_ERR_NO_MEM;
+	}
+
+	f = fopen(file, "r");
+	if (f == NULL) {
+		ESP_LOGE(TAG, "Failed to open file for reading");
+		return ESP_FAIL;
+	}
+
+	char *ptr;
+	int index = 0;
+	while (1){
+		if ( fgets(line, sizeof(line) ,f) == 0 ) break;
+		char* pos = strchr(line, '\n');
+		if (pos) *pos = '\0';
+		ESP_LOGD(TAG, "line=[%s]", line);
+		if (strlen(line) == 0) continue;
+		if (line[0] == '#') continue;
+		ISOTP_t *session = (*sessions+index);
+		memset(session, 0, sizeof(ISOTP_t));
+
+		// Frame type
+		ptr = strtok(line, ",");
+		if (strcmp(ptr, "S") == 0) {
+			session->extd = 0;
+		} else if (strcmp(ptr, "E") == 0) {
+			session->extd = 1;
+		} else {
+			ESP_LOGE(TAG, "This line is invalid [%s]", line);
+			continue;
+		}
+
+		// CAN ID sent by the bridge, then CAN ID sent by the ECU
+		ptr = strtok(NULL, ",");
+		if (ptr == NULL) continue;
+		session->tx_id = strtol(ptr, NULL, 16);
+		ptr = strtok(NULL, ",");
+		if (ptr == NULL) continue;
+		session->rx_id = strtol(ptr, NULL, 16);
+		if (session->tx_id == 0 || session->rx_id == 0) {
+			ESP_LOGE(TAG, "This line is invalid [%s]", line);
+			continue;
+		}
+
+		// Request topic, then response topic
+		char *tx_topic = strtok(NULL, ",");
+		char *rx_topic = strtok(NULL, ",");
+		if (tx_topic == NULL || rx_topic == NULL || strlen(rx_topic) >= sizeof(((MQTT_t *)0)->topic)) {
+			ESP_LOGE(TAG, "This line is invalid [%s]", line);
+			continue;
+		}
+		session->tx_topic = arena_strdup(tx_topic);
+		session->tx_topic_len = strlen(tx_topic);
+		session->rx_topic = arena_strdup(rx_topic);
+		if (session->tx_topic == NULL || session->rx_topic == NULL) {
+			fclose(f);
+			return ESP_ERR_NO_MEM;
+		}
+		session->rx_topic_len = strlen(rx_topic);
+		session->block_size = CONFIG_ISOTP_BLOCK_SIZE;
+		session->stmin = CONFIG_ISOTP_STMIN;
+		index++;
+	}
+	fclose(f);
+	*nsession = index;
+	return ESP_OK;
+}
+
+static void due_timer_callback(void *arg)
+{
+	ISOTP_EVENT_t event = { .type = ISOTP_EVENT_DUE };
+	xQueueSend(xQueueIsotp, &event, 0);
+}
+
+// The engine runs on a wrapping microsecond clock
+static uint32_t isotp_now(void)
+{
+	return (uint32_t)esp_timer_get_time();
+}
+
+void isotp_task(void *pvParameters)
+{
+	ESP_LOGI(TAG, "Start");
+	for(int index=0;index<nisotp;index++) {
+		ESP_LOGI(TAG, "isotp[%d] extd=%d tx_id=0x%"PRIx32" rx_id=0x%"PRIx32" tx_topic=[%s] rx_topic=[%s]",
+		index, isotp[index].extd, isotp[index].tx_id, isotp[index].rx_id, isotp[index].tx_topic, isotp[index].rx_topic);
+	}
+
+	ISOTP_EVENT_t event;
+	while (1) {
+		if (xQueueReceive(xQueueIsotp, &event, pdMS_TO_TICKS(10)) == pdPASS) {
+			uint32_t now = isotp_now();
+			ISOTP_t *session = &isotp[event.session];
+			if (event.type == ISOTP_EVENT_DUE) {
+				// isotp_poll below sends it
+			} else if (event.type == ISOTP_EVENT_FRAME) {
+				isotp_on_frame(session, event.data, event.length, now);
+			} else if (event.type == ISOTP_EVENT_REQUEST) {
+				ESP_LOGI(TAG, "tx_id=0x%"PRIx32" request %d bytes", session->tx_id, event.length);
+				if (isotp_send(session, event.buffer, event.length, now) == false) {
+					isotp_buffer_free(event.buffer);
+				}
+			}
+		}
+
+		uint32_t now = isotp_now();
+		int32_t wait = INT32_MAX;
+		for(int index=0;index<nisotp;index++) {
+			isotp_poll(&isotp[index], now);
+			uint32_t due;
+			if (isotp_tx_due(&isotp[index], &due) && (int32_t)(due - now) < wait) wait = due - now;
+		}
+		// A frame that is due but found the TX path full, or a pending flow control, is retried by the 10 ms poll
+		esp_timer_stop(due_timer);
+		if (wait > 0 && wait != INT32_MAX) esp_timer_start_once(due_timer, wait);
+	} // end while
+
+	// Never reach here
+	vTaskDelete(NULL);
+}
+
+void isotp_init(void)
+{
+	xQueueIsotp = xQueueCreateStatic( ISOTP_QUEUE_DEPTH, sizeof(ISOTP_EVENT_t), isotp_queue_storage, &isotp_queue );
+	configASSERT( xQueueIsotp );
+	xQueuePool = xQueueCreateStatic( CONFIG_ISOTP_BUFFERS, sizeof(uint8_t *), pool_queue_storage, &pool_queue );
+	configASSERT( xQueuePool );
+	for (int i=0;i<CONFIG_ISOTP_BUFFERS;i++) {
+		uint8_t *buf = pool[i];
+		xQueueSend(xQueuePool, &buf, 0);
+	}
+	const esp_timer_create_args_t timer_args = {
+		.callback = due_timer_callback,
+		.name = "isotp",
+	};
+	ESP_ERROR_CHECK(esp_timer_create(&timer_args, &due_timer));
+}
@@ -23,11 +23,30 @@
 #include "mdns.h"
 
 #include "mqtt.h"
+#include "frame.h"
+#include "arena.h"
+#include "broker.h"
+#if CONFIG_ISOTP_ENABLE
+#include "isotp.h"
+#endif
+#if CONFIG_CYCLIC_ENABLE
+#include "cyclic.h"
+#endif
+#if CONFIG_ROUTE_ENABLE
+#include "route.h"
+#endif
+#if CONFIG_AGGREGATE_ENABLE
+#include "aggregate.h"
+#endif
+#if CONFIG_BULK_ENABLE
+#include "bulk.h"
+#endif
 
 static const char *TAG = "MAIN";
 
 /* FreeRTOS event group to signal when we are connected*/
 static EventGroupHandle_t s_wifi_event_group;
+static StaticEventGroup_t s_wifi_event_group_buffer;
 
 /* The event group allows multiple bits for each event, but we only care about two events:
  * - we are connected to the AP with an IP
@@ -37,13 +56,22 @@ static EventGroupHandle_t s_wifi_event_group;
 
 static int s_retry_num = 0;
 
-QueueHandle_t xQueue_mqtt_tx;
-QueueHandle_t xQueue_twai_tx;
-
 TOPIC_t *publish;
 int16_t	npublish;
 TOPIC_t *subscribe;
 int16_t	nsubscribe;
+#if CONFIG_ISOTP_ENABLE
+extern ISOTP_t *isotp;
+extern int16_t nisotp;
+#endif
+#if CONFIG_ROUTE_ENABLE
+extern ROUTE_t *route;
+extern int16_t nroute;
+#endif
+#if CONFIG_AGGREGATE_ENABLE
+extern AGGREGATE_t *aggregate;
+extern int16_t naggregate;
+#endif
 
 static void event_handler(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data)
 {
@@ -68,7 +96,7 @@ static void event_handler(void* arg, esp_event_base_t event_base, int32_t event_
 
 esp_err_t wifi_init_sta(void)
 {
-	s_wifi_event_group = xEventGroupCreate();
+	s_wifi_event_group = xEventGroupCreateStatic(&s_wifi_event_group_buffer);
 
 	ESP_ERROR_CHECK(esp_netif_init());
 	ESP_ERROR_CHECK(esp_event_loop_create_default());
@@ -168,13 +196,13 @@ esp_err_t mountSPIFFS(char * partition_label, char * base_path) {
 	if (ret != ESP_OK) {
 		ESP_LOGE(TAG, "Failed to get SPIFFS partition information (%s)", esp_err_to_name(ret));
 	} else {
-		ESP_LOGI(TAG, "Partition size: total: %d, used: %d", total, used);
+		ESP_LOGI(TAG, "Partition size: total: %zu, used: %zu", total, used);
 		DIR* dir = opendir(base_path);
 		assert(dir != NULL);
 		while (true) {
 			struct dirent*pe = readdir(dir);
 			if (!pe) break;
-			ESP_LOGI(TAG, "d_name=%s d_ino=%d d_type=%x", pe->d_name,pe->d_ino, pe->d_type);
+			ESP_LOGI(TAG, "d_name=%s d_ino=%d d_type=%x", pe->d_name,(int)pe->d_ino, pe->d_type);
 		}
 		closedir(dir);
 	}
@@ -204,148 +232,33 @@ esp_err_t query_mdns_host(const char * host_name, char *ip)
 	return ESP_OK;
 }
 
-void convert_mdns_host(char * from, char * to)
-{
-	ESP_LOGI(__FUNCTION__, "from=[%s]",from);
-	strcpy(to, from);
-	char *sp;
-	sp = strstr(from, ".local");
-	if (sp == NULL) return;
-
-	int _len = sp - from;
-	ESP_LOGD(__FUNCTION__, "_len=%d", _len);
-	char _from[128];
-	strcpy(_from, from);
-	_from[_len] = 0;
-	ESP_LOGI(__FUNCTION__, "_from=[%s]", _from);
-
-	char _ip[128];
-	esp_err_t ret = query_mdns_host(_from, _ip);
-	ESP_LOGI(__FUNCTION__, "query_mdns_host=%d _ip=[%s]", ret, _ip);
-	if (ret != ESP_OK) return;
-
-	strcpy(to, _ip);
-	ESP_LOGI(__FUNCTION__, "to=[%s]", to);
-}
-
-esp_err_t build_table(TOPIC_t **topics, char *file, int16_t *ntopic)
-{
-	ESP_LOGI(TAG, "build_table file=%s", file);
-	char line[128];
-	int _ntopic = 0;
-
-	FILE* f = fopen(file, "r");
-	if (f == NULL) {
-		ESP_LOGE(TAG, "Failed to open file for reading");
-		return ESP_FAIL;
-	}
-	while (1){
-		if ( fgets(line, sizeof(line) ,f) == 0 ) break;
-		// strip newline
-		char* pos = strchr(line, '\n');
-		if (pos) {
-			*pos = '\0';
-		}
-		ESP_LOGD(TAG, "line=[%s]", line);
-		if (strlen(line) == 0) continue;
-		if (line[0] == '#') continue;
-		_ntopic++;
-	}
-	fclose(f);
-	ESP_LOGI(TAG, "build_table _ntopic=%d", _ntopic);
-	
-	*topics = calloc(_ntopic, sizeof(TOPIC_t));
-	if (*topics == NULL) {
-		ESP_LOGE(TAG, "Error allocating memory for topic");
-		return ESP_ERR_NO_MEM;
-	}
-
-	f = fopen(file, "r");
-	if (f == NULL) {
-		ESP_LOGE(TAG, "Failed to open file for reading");
-		return ESP_FAIL;
-	}
-
-	char *ptr;
-	int index = 0;
-	while (1){
-		if ( fgets(line, sizeof(line) ,f) == 0 ) break;
-		// strip newline
-		char* pos = strchr(line, '\n');
-		if (pos) {
-			*pos = '\0';
-		}
-		ESP_LOGD(TAG, "line=[%s]", line);
-		if (strlen(line) == 0) continue;
-		if (line[0] == '#') continue;
-
-		// Frame type
-		ptr = strtok(line, ",");
-		ESP_LOGD(TAG, "ptr=%s", ptr);
-		if (strcmp(ptr, "S") == 0) {
-			(*topics+index)->frame = 0;
-		} else if (strcmp(ptr, "E") == 0) {
-			(*topics+index)->frame = 1;
-		} else {
-			ESP_LOGE(TAG, "This line is invalid [%s]", line);
-			continue;
-		}
-
-		// CAN ID
-		uint32_t canid;
-		ptr = strtok(NULL, ",");
-		if(ptr == NULL) continue;
-		ESP_LOGD(TAG, "ptr=%s", ptr);
-		canid = strtol(ptr, NULL, 16);
-		if (canid == 0) {
-			ESP_LOGE(TAG, "This line is invalid [%s]", line);
-			continue;
-		}
-		(*topics+index)->canid = canid;
-
-		// mqtt topic
-		char *sp;
-		ptr = strtok(NULL, ",");
-		if(ptr == NULL) {
-			ESP_LOGE(TAG, "This line is invalid [%s]", line);
-			continue;
-		}
-		ESP_LOGD(TAG, "ptr=[%s] strlen=%d", ptr, strlen(ptr));
-		sp = strstr(ptr,"#");
-		if (sp != NULL) {
-			ESP_LOGE(TAG, "This line is invalid [%s]", line);
-			continue;
-		}
-		sp = strstr(ptr,"+");
-		if (sp != NULL) {
-			ESP_LOGE(TAG, "This line is invalid [%s]", line);
-			continue;
-		}
-		(*topics+index)->topic = (char *)malloc(strlen(ptr)+1);
-		strcpy((*topics+index)->topic, ptr);
-		(*topics+index)->topic_len = strlen(ptr);
-		index++;
-	}
-	fclose(f);
-	*ntopic = index;
-	return ESP_OK;
-}
-
-void dump_table(TOPIC_t *topics, int16_t ntopic)
-{
-	for(int i=0;i<ntopic;i++) {
-		ESP_LOGI(TAG, "topics=[%d] frame=%d canid=0x%"PRIx32" topic=[%s] topic_len=%d",
-		i, (topics+i)->frame, (topics+i)->canid, (topics+i)->topic, (topics+i)->topic_len);
-	}
-
-}
-
+esp_err_t build_table(TOPIC_t **topics, char *file, int16_t *ntopic, bool allow_wildcard);
+void dump_table(TOPIC_t *topics, int16_t ntopic);
 void mqtt_pub_task(void *pvParameters);
 void mqtt_sub_task(void *pvParameters);
 void twai_task(void *pvParameters);
 
+// Task stacks are static, so they never come from the heap
+static StackType_t mqtt_pub_stack[1024*4];
+static StaticTask_t mqtt_pub_tcb;
+static StackType_t mqtt_sub_stack[1024*4];
+static StaticTask_t mqtt_sub_tcb;
+static StackType_t twai_rx_stack[1024*6];
+static StaticTask_t twai_rx_tcb;
+#if CONFIG_ISOTP_ENABLE
+static StackType_t isotp_stack[1024*4];
+static StaticTask_t isotp_tcb;
+#endif
+#if CONFIG_BULK_ENABLE
+static StackType_t bulk_stack[1024*3];
+static StaticTask_t bulk_tcb;
+#endif
+
 void app_main()
 {
+	// The arena is taken before WiFi and TLS allocate their buffers
+	ESP_ERROR_CHECK(arena_init(CONFIG_ARENA_SIZE));
+
 	// Initialize NVS
 	esp_err_t ret = nvs_flash_init();
 	if (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND) {
@@ -360,19 +273,19 @@ void app_main()
 	// Initialize mDNS
 	ESP_ERROR_CHECK(mdns_init());
 
+	// Broker list for failover, names are resolved when the first client starts and kept for MQTT_RESOLVE_TTL
+	ESP_ERROR_CHECK(broker_init());
+
 	// Mount SPIFFS
 	char *partition_label = "storage";
 	char *base_path = "/spiffs"; 
 	ESP_ERROR_CHECK(mountSPIFFS(partition_label, base_path));
 
 	// Create Queue
-	xQueue_mqtt_tx = xQueueCreate( 10, sizeof(MQTT_t) );
-	configASSERT( xQueue_mqtt_tx );
-	xQueue_twai_tx = xQueueCreate( 10, sizeof(FRAME_t) );
-	configASSERT( xQueue_twai_tx );
+	frame_queue_create();
 
 	// build publish table
-	ret = build_table(&publish, "/spiffs/can2mqtt.csv", &npublish);
+	ret = build_table(&publish, "/spiffs/can2mqtt.csv", &npublish, false);
 	if (ret != ESP_OK) {
 		ESP_LOGE(TAG, "build publish table fail");
 		while(1) { vTaskDelay(1); }
@@ -380,14 +293,56 @@ void app_main()
 	dump_table(publish, npublish);
 
 	// build subscribe table
-	ret = build_table(&subscribe, "/spiffs/mqtt2can.csv", &nsubscribe);
+	ret = build_table(&subscribe, "/spiffs/mqtt2can.csv", &nsubscribe, true);
 	if (ret != ESP_OK) {
 		ESP_LOGE(TAG, "build subscribe table fail");
 		while(1) { vTaskDelay(1); }
 	}
 	dump_table(subscribe, nsubscribe);
 
-	xTaskCreate(mqtt_pub_task, "mqtt_pub", 1024*4, NULL, 2, NULL);
-	xTaskCreate(mqtt_sub_task, "mqtt_sub", 1024*4, NULL, 2, NULL);
-	xTaskCreate(twai_task, "twai_rx", 1024*6, NULL, 2, NULL);
+#if CONFIG_ISOTP_ENABLE
+	// build ISO-TP session table
+	ret = build_isotp_table(&isotp, "/spiffs/isotp.csv", &nisotp);
+	if (ret != ESP_OK) {
+		ESP_LOGE(TAG, "build isotp table fail");
+		while(1) { vTaskDelay(1); }
+	}
+	isotp_init();
+	xTaskCreateStatic(isotp_task, "isotp", sizeof(isotp_stack), NULL, 3, isotp_stack, &isotp_tcb);
+#endif
+
+#if CONFIG_ROUTE_ENABLE
+	// build local routing table
+	ret = build_route_table(&route, "/spiffs/route.csv", &nroute);
+	if (ret != ESP_OK) {
+		ESP_LOGE(TAG, "build route table fail");
+		while(1) { vTaskDelay(1); }
+	}
+	dump_route_table(route, nroute);
+#endif
+
+#if CONFIG_AGGREGATE_ENABLE
+	// build aggregation table
+	ret = build_aggregate_table(&aggregate, "/spiffs/aggregate.csv", &naggregate);
+	if (ret != ESP_OK) {
+		ESP_LOGE(TAG, "build aggregate table fail");
+		while(1) { vTaskDelay(1); }
+	}
+	dump_aggregate_table(aggregate, naggregate);
+#endif
+
+#if CONFIG_CYCLIC_ENABLE
+	cyclic_init();
+#endif
+
+#if CONFIG_BULK_ENABLE
+	bulk_init();
+	// Below the command path, a long burst only takes the time the other tasks leave
+	xTaskCreateStatic(bulk_task, "bulk", sizeof(bulk_stack), NULL, 1, bulk_stack, &bulk_tcb);
+#endif
+
+	xTaskCreateStatic(mqtt_pub_task, "mqtt_pub", sizeof(mqtt_pub_stack), NULL, 2, mqtt_pub_stack, &mqtt_pub_tcb);
+	xTaskCreateStatic(mqtt_sub_task, "mqtt_sub", sizeof(mqtt_sub_stack), NULL, 2, mqtt_sub_stack, &mqtt_sub_tcb);
+	xTaskCreateStatic(twai_task, "twai_rx", sizeof(twai_rx_stack), NULL, 2, twai_rx_stack, &twai_rx_tcb);
+	arena_report("boot");
 }
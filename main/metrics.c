@@ -0,0 +1,116 @@
+/*
+	This code is in the Public Domain (or CC0 licensed, at your option.)
+
+	Unless required by applicable law or agreed to in writing, this
+	software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+	CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <string.h>
+#include "esp_timer.h"
+
+#include "metrics.h"
+
+/*
+ * Counters and histograms are updated from several tasks with relaxed
+ * atomic adds, so the hot path never takes a lock.
+ * A snapshot may mix values from slightly different moments.
+ */
+static uint32_t counters[METRIC_COUNTERS];
+static uint32_t histograms[METRIC_HISTOGRAMS][METRIC_BUCKETS];
+// Highest fill level seen, in permille of the capacity
+static uint32_t queue_high[METRIC_QUEUES];
+
+// Publish time of QoS1 messages waiting for PUBACK, indexed by msg_id
+#define	INFLIGHT_SLOTS	32
+typedef struct {
+	int msg_id;
+	int64_t timestamp;
+} INFLIGHT_t;
+static INFLIGHT_t inflight[INFLIGHT_SLOTS];
+
+static const char *counter_name[METRIC_COUNTERS] = {
+	"can_rx", "matched", "mqtt_queued", "mqtt_dropped", "published", "acked",
+	"mqtt_rx", "sub_dropped", "twai_queued", "twai_dropped", "can_tx", "can_tx_failed",
+	"reconnects", "error_warning", "error_passive", "bus_off", "bus_down_ms",
+	"routed", "failovers", "bulk_dropped",
+};
+static const char *histogram_name[METRIC_HISTOGRAMS] = {
+	"rx_to_publish", "publish_to_ack", "to_can_tx", "connect_to_command",
+	"tls_full", "tls_resumed",
+};
+static const char *queue_name[METRIC_QUEUES] = {
+	"mqtt_tx", "subscribe", "twai_tx_high", "twai_tx_normal", "twai_tx_bulk",
+};
+
+void metrics_count(metric_t id)
+{
+	__atomic_fetch_add(&counters[id], 1, __ATOMIC_RELAXED);
+}
+
+void metrics_add(metric_t id, uint32_t value)
+{
+	__atomic_fetch_add(&counters[id], value, __ATOMIC_RELAXED);
+}
+
+void metrics_latency(histogram_t id, int64_t us)
+{
+	int bucket = 0;
+	if (us > 1) bucket = 31 - __builtin_clz((uint32_t)(us > UINT32_MAX ? UINT32_MAX : us));
+	if (bucket >= METRIC_BUCKETS) bucket = METRIC_BUCKETS - 1;
+	__atomic_fetch_add(&histograms[id][bucket], 1, __ATOMIC_RELAXED);
+}
+
+void metrics_queue_level(metric_queue_t id, size_t used, size_t capacity)
+{
+	if (capacity == 0) return;
+	uint32_t level = (used * 1000) / capacity;
+	uint32_t high = __atomic_load_n(&queue_high[id], __ATOMIC_RELAXED);
+	while (level > high) {
+		if (__atomic_compare_exchange_n(&queue_high[id], &high, level, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+	}
+}
+
+void metrics_publish_sent(int msg_id, int64_t timestamp)
+{
+	if (msg_id <= 0) return;
+	INFLIGHT_t *slot = &inflight[msg_id % INFLIGHT_SLOTS];
+	slot->msg_id = msg_id;
+	slot->timestamp = timestamp;
+}
+
+void metrics_publish_acked(int msg_id)
+{
+	metrics_count(METRIC_ACKED);
+	if (msg_id <= 0) return;
+	INFLIGHT_t *slot = &inflight[msg_id % INFLIGHT_SLOTS];
+	// The slot may have been reused by a later message
+	if (slot->msg_id != msg_id) return;
+	metrics_latency(HIST_PUBLISH_TO_ACK, esp_timer_get_time() - slot->timestamp);
+	slot->msg_id = 0;
+}
+
+// Compact JSON, returns the length or -1 if buf is too small
+int metrics_snapshot(char *buf, size_t size)
+{
+	int len = snprintf(buf, size, "{\"uptime\":%"PRId64, esp_timer_get_time() / 1000000);
+	for (int i=0;i<METRIC_COUNTERS && len<size;i++) {
+		len += snprintf(&buf[len], size-len, ",\"%s\":%"PRIu32, counter_name[i], counters[i]);
+	}
+	for (int i=0;i<METRIC_QUEUES && len<size;i++) {
+		len += snprintf(&buf[len], size-len, ",\"%s_hwm\":%"PRIu32, queue_name[i], queue_high[i]);
+	}
+	for (int i=0;i<METRIC_HISTOGRAMS && len<size;i++) {
+		len += snprintf(&buf[len], size-len, ",\"%s\":[", histogram_name[i]);
+		for (int j=0;j<METRIC_BUCKETS && len<size;j++) {
+			len += snprintf(&buf[len], size-len, "%s%"PRIu32, j ? "," : "", histograms[i][j]);
+		}
+		if (len < size) len += snprintf(&buf[len], size-len, "]");
+	}
+	if (len < size) len += snprintf(&buf[len], size-len, "}");
+	if (len >= size) return -1;
+	return len;
+}
@@ -0,0 +1,73 @@
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Pipeline counters
+typedef enum {
+	METRIC_CAN_RX = 0,	// frames received from the CANbus
+	METRIC_MATCHED,		// received frames found in can2mqtt.csv
+	METRIC_MQTT_QUEUED,	// records queued for mqtt_pub_task
+	METRIC_MQTT_DROPPED,	// records lost before publishing
+	METRIC_PUBLISHED,	// esp_mqtt_client_publish calls that succeeded
+	METRIC_ACKED,		// PUBACK received
+	METRIC_MQTT_RX,		// messages received from the broker
+	METRIC_SUB_DROPPED,	// messages lost because xQueueSubscribe was full
+	METRIC_TWAI_QUEUED,	// frames queued for the CAN TX task
+	METRIC_TWAI_DROPPED,	// frames refused by the CAN TX queue
+	METRIC_CAN_TX,		// frames transmitted
+	METRIC_CAN_TX_FAILED,	// frames the driver did not transmit
+	METRIC_RECONNECTS,	// subscriber reconnects to the broker
+	METRIC_ERROR_WARNING,	// CAN controller entered error warning
+	METRIC_ERROR_PASSIVE,	// CAN controller entered error passive
+	METRIC_BUS_OFF,		// CAN controller went bus-off
+	METRIC_BUS_DOWN_MS,	// total time the CANbus was unavailable
+	METRIC_ROUTED,		// frames routed from CAN to CAN inside the bridge
+	METRIC_FAILOVERS,	// switches between the brokers of the failover list
+	METRIC_BULK_DROPPED,	// bulk messages cut short because the bulk buffer stalled
+	METRIC_COUNTERS
+} metric_t;
+
+// Latency histograms
+typedef enum {
+	HIST_RX_TO_PUBLISH = 0,	// CAN receive to publish call
+	HIST_PUBLISH_TO_ACK,	// publish call to PUBACK
+	HIST_TO_CAN_TX,		// MQTT receive (or enqueue, or CAN receive of a routed frame) to CAN transmit
+	HIST_CONNECT_TO_COMMAND,	// subscriber connect to the first command received
+	HIST_TLS_FULL,		// TLS handshake without a saved session
+	HIST_TLS_RESUMED,	// TLS handshake offering the session of the last one
+	METRIC_HISTOGRAMS
+} histogram_t;
+
+// Bucket i counts latencies in [2^i, 2^(i+1)) microseconds, the last bucket is open ended
+#define	METRIC_BUCKETS	24
+
+// Queues with a high-water mark
+typedef enum {
+	QUEUE_MQTT_TX = 0,
+	QUEUE_SUBSCRIBE,
+	QUEUE_TWAI_TX_HIGH,
+	QUEUE_TWAI_TX_NORMAL,
+	QUEUE_TWAI_TX_BULK,
+	METRIC_QUEUES
+} metric_queue_t;
+
+#if CONFIG_METRICS_ENABLE
+void metrics_count(metric_t id);
+void metrics_add(metric_t id, uint32_t value);
+void metrics_latency(histogram_t id, int64_t us);
+void metrics_queue_level(metric_queue_t id, size_t used, size_t capacity);
+void metrics_publish_sent(int msg_id, int64_t timestamp);
+void metrics_publish_acked(int msg_id);
+int metrics_snapshot(char *buf, size_t size);
+#else
+static inline void metrics_count(metric_t id) { }
+static inline void metrics_add(metric_t id, uint32_t value) { }
+static inline void metrics_latency(histogram_t id, int64_t us) { }
+static inline void metrics_queue_level(metric_queue_t id, size_t used, size_t capacity) { }
+static inline void metrics_publish_sent(int msg_id, int64_t timestamp) { }
+static inline void metrics_publish_acked(int msg_id) { }
+#endif
+
+#endif /* METRICS_H_ */
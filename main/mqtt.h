@@ -1,28 +1,73 @@
+#ifndef MQTT_H_
+#define MQTT_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
 #define	PUBLISH		100
 #define	SUBSCRIBE	200
+#define	PUBLISH_PDU	101
+#define	TRACE_DUMP	102
+#define	PUBLISH_STATUS	103
+#define	PUBLISH_SUMMARY	104
+
+#define	CAN_MAX_DATA_LEN	8
+#define	CANFD_MAX_DATA_LEN	64
 
 typedef struct {
-	char topic[64];
-	int16_t topic_len;
+	int64_t timestamp;	// esp_timer time when the frame entered the bridge
 	int32_t canid;
+	int16_t priority;	// TX priority class
 	int16_t extd;
 	int16_t rtr;
+	int16_t fdf;
+	int16_t brs;
+	int16_t esi;
 	int16_t data_len;
-	char data[8];
+	char data[CANFD_MAX_DATA_LEN];
 } FRAME_t;
 
+// Only the used part of data[] travels through the message buffers
+#define	FRAME_SIZE(f)	(offsetof(FRAME_t, data) + (f)->data_len)
+
 typedef struct {
+	int64_t timestamp;	// esp_timer time when the CAN frame was received
+	uint32_t sequence;	// counts every CAN frame queued for publishing
+	uint32_t canid;
+	uint8_t flags;		// ENVELOPE_FLAG_*
+	uint8_t encoding;	// payload_t of the can2mqtt.csv row
 	int16_t topic_type;
 	int16_t topic_len;
 	char topic[64];
 	int16_t data_len;
-	char data[64];
+	char data[CANFD_MAX_DATA_LEN];
 } MQTT_t;
 
+#define	MQTT_SIZE(m)	(offsetof(MQTT_t, data) + (m)->data_len)
+
+// data[] of a PUBLISH_PDU record, the payload lives in an ISO-TP pool buffer
+typedef struct {
+	uint8_t *buffer;
+	uint16_t length;
+} PDU_t;
+
+typedef struct {
+	uint32_t low;
+	uint32_t high;
+} CANID_RANGE_t;
+
 typedef struct {
 	uint16_t frame;
+	uint16_t fdf;
+	uint16_t brs;
+	int16_t priority;
+	uint8_t encoding;	// payload_t, PUBLISH rows only
 	uint32_t canid;
 	char * topic;
 	int16_t topic_len;
+	int16_t wildcard;	// offset of the + level that carries the CAN ID, -1 for a plain topic
+	int16_t nrange;		// allowed CAN IDs of a wildcard row, 0 allows every ID
+	CANID_RANGE_t *range;
 } TOPIC_t;
 
+#endif /* MQTT_H_ */
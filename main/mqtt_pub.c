@@ -15,12 +15,31 @@
 #include "freertos/task.h"
 #include "freertos/queue.h"
 #include "freertos/event_groups.h"
+#include "freertos/semphr.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "esp_event.h"
 #include "esp_mac.h"
 #include "mqtt_client.h"
+#if CONFIG_MQTT_TRANSPORT_OVER_SN
+#include "mqttsn.h"
+#endif
 
 #include "mqtt.h"
+#include "frame.h"
+#include "broker.h"
+#include "metrics.h"
+#include "trace.h"
+#include "payload.h"
+#if CONFIG_PROFILE_ENABLE
+#include "profile.h"
+#endif
+#if CONFIG_ISOTP_ENABLE
+#include "isotp.h"
+#endif
+#if CONFIG_AGGREGATE_ENABLE
+#include "aggregate.h"
+#endif
 
 static const char *TAG = "PUB";
 
@@ -28,10 +47,145 @@ extern const uint8_t root_cert_pem_start[] asm("_binary_root_cert_pem_start");
 extern const uint8_t root_cert_pem_end[] asm("_binary_root_cert_pem_end");
 
 static EventGroupHandle_t s_mqtt_event_group;
+static StaticEventGroup_t s_mqtt_event_group_buffer;
 #define MQTT_CONNECTED_BIT BIT0
 
-extern QueueHandle_t xQueue_mqtt_tx;
-extern QueueHandle_t xQueue_twai_tx;
+static BROKER_LINK_t link = {
+	.name = "pub",
+	.handler = NULL,
+#if CONFIG_MQTT_BROKER_STANDBY
+	.standby = true,
+#endif
+};
+
+#if CONFIG_MQTT_BROKER_STANDBY
+/*
+ * QoS 1 messages not acknowledged yet.
+ * The outbox of esp_mqtt belongs to one client, so after a switch to the
+ * standby client these are published again on the new broker.
+ * Every frame encoding fits, larger payloads such as ISO-TP PDUs and trace dumps are not kept.
+ */
+#define	INFLIGHT_DATA_LEN	PAYLOAD_MAX_LEN
+
+typedef struct {
+	esp_mqtt_client_handle_t client;	// NULL when the slot is free
+	int msg_id;
+	int16_t len;
+	char topic[64];
+	char data[INFLIGHT_DATA_LEN];
+} INFLIGHT_t;
+
+static INFLIGHT_t inflight[CONFIG_MQTT_INFLIGHT];
+static int16_t inflight_next;
+static SemaphoreHandle_t xMutexInflight;
+static StaticSemaphore_t inflight_mutex;
+
+// msg_id of a slot taken before esp_mqtt_client_publish has returned
+#define	INFLIGHT_RESERVED	-1
+
+// PUBACKs that came before the msg_id of their slot was known
+#define	INFLIGHT_EARLY_ACKS	4
+
+typedef struct {
+	esp_mqtt_client_handle_t client;
+	int msg_id;
+} INFLIGHT_ACK_t;
+
+static INFLIGHT_ACK_t early_ack[INFLIGHT_EARLY_ACKS];
+static int16_t early_ack_next;
+
+// Take the slot before publishing, returns -1 when the message is not kept
+static int inflight_reserve(esp_mqtt_client_handle_t client, const char *topic, const char *data, int len)
+{
+	if (len > INFLIGHT_DATA_LEN || strlen(topic) >= sizeof(inflight[0].topic)) return -1;
+	xSemaphoreTake(xMutexInflight, portMAX_DELAY);
+	// The oldest entry makes room, it is rarely still waiting for its PUBACK
+	int index = inflight_next;
+	INFLIGHT_t *entry = &inflight[index];
+	if (entry->client != NULL) ESP_LOGD(TAG, "inflight msg_id=%d is no longer kept", entry->msg_id);
+	inflight_next = (inflight_next + 1) % CONFIG_MQTT_INFLIGHT;
+	entry->client = client;
+	entry->msg_id = INFLIGHT_RESERVED;
+	entry->len = len;
+	strcpy(entry->topic, topic);
+	memcpy(entry->data, data, len);
+	xSemaphoreGive(xMutexInflight);
+	return index;
+}
+
+// Store the msg_id of a reserved slot, or free it when the publish failed or the PUBACK is already in
+static void inflight_commit(int index, esp_mqtt_client_handle_t client, int msg_id)
+{
+	if (index < 0) return;
+	xSemaphoreTake(xMutexInflight, portMAX_DELAY);
+	INFLIGHT_t *entry = &inflight[index];
+	if (entry->client == client && entry->msg_id == INFLIGHT_RESERVED) {
+		entry->msg_id = msg_id;
+		if (msg_id < 0) entry->client = NULL;
+		for (int i=0;i<INFLIGHT_EARLY_ACKS && msg_id >= 0;i++) {
+			if (early_ack[i].client == client && early_ack[i].msg_id == msg_id) {
+				early_ack[i].client = NULL;
+				entry->client = NULL;
+				break;
+			}
+		}
+	}
+	xSemaphoreGive(xMutexInflight);
+}
+
+static void inflight_ack(esp_mqtt_client_handle_t client, int msg_id)
+{
+	xSemaphoreTake(xMutexInflight, portMAX_DELAY);
+	bool found = false;
+	for (int i=0;i<CONFIG_MQTT_INFLIGHT;i++) {
+		if (inflight[i].client == client && inflight[i].msg_id == msg_id) {
+			inflight[i].client = NULL;
+			found = true;
+			break;
+		}
+	}
+	if (found == false) {
+		early_ack[early_ack_next].client = client;
+		early_ack[early_ack_next].msg_id = msg_id;
+		early_ack_next = (early_ack_next + 1) % INFLIGHT_EARLY_ACKS;
+	}
+	xSemaphoreGive(xMutexInflight);
+}
+
+/*
+ * Publish the messages of other clients again, oldest first.
+ * Each entry is copied and reserved under the mutex and published without it,
+ * esp_mqtt holds its own lock while the PUBACK handler waits for this mutex.
+ */
+static void inflight_resend(esp_mqtt_client_handle_t client)
+{
+	// Only this task publishes, the copy is kept off its stack
+	static INFLIGHT_t pending;
+	int resent = 0;
+	for (int n=0;n<CONFIG_MQTT_INFLIGHT;n++) {
+		int index = (inflight_next + n) % CONFIG_MQTT_INFLIGHT;
+		xSemaphoreTake(xMutexInflight, portMAX_DELAY);
+		INFLIGHT_t *entry = &inflight[index];
+		bool found = (entry->client != NULL && entry->client != client);
+		if (found) {
+			memcpy(&pending, entry, sizeof(INFLIGHT_t));
+			entry->client = client;
+			entry->msg_id = INFLIGHT_RESERVED;
+		}
+		xSemaphoreGive(xMutexInflight);
+		if (found == false) continue;
+		// esp_mqtt takes strlen(data) when len is 0
+		int msg_id = esp_mqtt_client_publish(client, pending.topic, pending.len ? pending.data : "", pending.len, 1, 0);
+		inflight_commit(index, client, msg_id);
+		if (msg_id < 0) {
+			metrics_count(METRIC_MQTT_DROPPED);
+			continue;
+		}
+		resent++;
+	}
+	ESP_LOGW(TAG, "%d unacknowledged messages published again", resent);
+}
+#endif
 
 static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_t event_id, void *event_data)
 {
@@ -52,7 +206,12 @@ static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_
 			ESP_LOGI(TAG, "MQTT_EVENT_UNSUBSCRIBED, msg_id=%d", event->msg_id);
 			break;
 		case MQTT_EVENT_PUBLISHED:
-			ESP_LOGI(TAG, "MQTT_EVENT_PUBLISHED, msg_id=%d", event->msg_id);
+			ESP_LOGD(TAG, "MQTT_EVENT_PUBLISHED, msg_id=%d", event->msg_id);
+			trace_record(TRACE_PUBACK, event->msg_id, 0, 0);
+			metrics_publish_acked(event->msg_id);
+#if CONFIG_MQTT_BROKER_STANDBY
+			inflight_ack(event->client, event->msg_id);
+#endif
 			break;
 		case MQTT_EVENT_DATA:
 			ESP_LOGI(TAG, "MQTT_EVENT_DATA");
@@ -67,15 +226,60 @@ static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_
 	return;
 }
 
-esp_err_t query_mdns_host(const char * host_name, char *ip);
-void convert_mdns_host(char * from, char * to);
+// Publish a record and account for it in the metrics
+static void publish_record(esp_mqtt_client_handle_t mqtt_client, MQTT_t *mqttBuf, const char *data, int len)
+{
+	EventBits_t EventBits = xEventGroupGetBits(s_mqtt_event_group);
+	ESP_LOGD(TAG, "EventBits=0x%"PRIx32, EventBits);
+	if ((EventBits & MQTT_CONNECTED_BIT) == 0) {
+		ESP_LOGE(TAG, "mqtt broker not connect");
+		metrics_count(METRIC_MQTT_DROPPED);
+		trace_record(TRACE_MQTT_DROPPED, 0, len, 0);
+		return;
+	}
+	// esp_mqtt takes strlen(data) when len is 0, an empty or RTR frame has no payload
+	if (len == 0) data = "";
+	int64_t now = esp_timer_get_time();
+#if CONFIG_MQTT_BROKER_STANDBY
+	// The PUBACK may be handled before esp_mqtt_client_publish returns
+	int slot = inflight_reserve(mqtt_client, mqttBuf->topic, data, len);
+#endif
+	int msg_id = esp_mqtt_client_publish(mqtt_client, mqttBuf->topic, data, len, 1, 0);
+#if CONFIG_MQTT_BROKER_STANDBY
+	inflight_commit(slot, mqtt_client, msg_id);
+#endif
+	if (msg_id < 0) {
+		ESP_LOGE(TAG, "esp_mqtt_client_publish Fail");
+		metrics_count(METRIC_MQTT_DROPPED);
+		trace_record(TRACE_MQTT_DROPPED, 0, len, 0);
+		return;
+	}
+	trace_record(TRACE_PUBLISH, msg_id, len, 0);
+	metrics_count(METRIC_PUBLISHED);
+	metrics_latency(HIST_RX_TO_PUBLISH, now - mqttBuf->timestamp);
+	metrics_publish_sent(msg_id, now);
+}
+
+#if CONFIG_METRICS_ENABLE || CONFIG_PROFILE_ENABLE
+// QoS 0, a lost report is replaced by the next one
+static void publish_report(esp_mqtt_client_handle_t mqtt_client, const char *topic, const char *report, int len)
+{
+	if (len < 0) {
+		ESP_LOGW(TAG, "report for %s is too long", topic);
+		return;
+	}
+	if (xEventGroupGetBits(s_mqtt_event_group) & MQTT_CONNECTED_BIT) {
+		esp_mqtt_client_publish(mqtt_client, topic, report, len, 0, 0);
+	}
+}
+#endif
 
 void mqtt_pub_task(void *pvParameters)
 {
 	ESP_LOGI(TAG, "Start Subscribe Broker:%s", CONFIG_MQTT_BROKER);
 
 	// Create Eventgroup
-	s_mqtt_event_group = xEventGroupCreate();
+	s_mqtt_event_group = xEventGroupCreateStatic(&s_mqtt_event_group_buffer);
 	configASSERT( s_mqtt_event_group );
 	xEventGroupClearBits(s_mqtt_event_group, MQTT_CONNECTED_BIT);
 
@@ -89,29 +293,8 @@ void mqtt_pub_task(void *pvParameters)
 	sprintf(client_id, "pub-%02x%02x%02x%02x%02x%02x", mac[0],mac[1],mac[2],mac[3],mac[4],mac[5]);
 	ESP_LOGI(TAG, "client_id=[%s]", client_id);
 
-	// Resolve mDNS host name
-	char ip[128];
-	char uri[128];
-	ESP_LOGI(TAG, "CONFIG_MQTT_BROKER=[%s]", CONFIG_MQTT_BROKER);
-	convert_mdns_host(CONFIG_MQTT_BROKER, ip);
-	ESP_LOGI(TAG, "ip=[%s]", ip);
-#if CONFIG_MQTT_TRANSPORT_OVER_TCP
-	ESP_LOGI(TAG, "MQTT_TRANSPORT_OVER_TCP");
-	sprintf(uri, "mqtt://%.60s:%d", ip, CONFIG_MQTT_PORT_TCP);
-#elif CONFIG_MQTT_TRANSPORT_OVER_SSL
-	ESP_LOGI(TAG, "MQTT_TRANSPORT_OVER_SSL");
-	sprintf(uri, "mqtts://%.60s:%d", ip, CONFIG_MQTT_PORT_SSL);
-#elif CONFIG_MQTT_TRANSPORT_OVER_WS
-	ESP_LOGI(TAG, "MQTT_TRANSPORT_OVER_WS");
-	sprintf(uri, "ws://%.60s:%d/mqtt", ip, CONFIG_MQTT_PORT_WS);
-#elif CONFIG_MQTT_TRANSPORT_OVER_WSS
-	ESP_LOGI(TAG, "MQTT_TRANSPORT_OVER_WSS");
-	sprintf(uri, "wss://%.60s:%d/mqtt", ip, CONFIG_MQTT_PORT_WSS);
-#endif
-	ESP_LOGI(TAG, "uri=[%s]", uri);
-
+	// The URI is set for each broker by broker_link_start
 	esp_mqtt_client_config_t mqtt_cfg = {
-		.broker.address.uri = uri,
 #if CONFIG_MQTT_TRANSPORT_OVER_TCP
 #elif CONFIG_MQTT_TRANSPORT_OVER_SSL
 		.broker.verification.certificate = (const char *)root_cert_pem_start,
@@ -126,35 +309,106 @@ void mqtt_pub_task(void *pvParameters)
 		.credentials.client_id = client_id
 	};
 
-	esp_mqtt_client_handle_t mqtt_client = esp_mqtt_client_init(&mqtt_cfg);
-	esp_mqtt_client_register_event(mqtt_client, ESP_EVENT_ANY_ID, mqtt_event_handler, NULL);
-
-	esp_mqtt_client_start(mqtt_client);
-	xEventGroupWaitBits(s_mqtt_event_group, MQTT_CONNECTED_BIT, false, true, portMAX_DELAY);
+#if CONFIG_MQTT_BROKER_STANDBY
+	xMutexInflight = xSemaphoreCreateMutexStatic(&inflight_mutex);
+	configASSERT( xMutexInflight );
+#endif
+	link.handler = mqtt_event_handler;
+	ESP_ERROR_CHECK(broker_link_start(&link, &mqtt_cfg));
+	// The link moves to the next broker while the first one does not answer
+	while ((xEventGroupWaitBits(s_mqtt_event_group, MQTT_CONNECTED_BIT, false, true, pdMS_TO_TICKS(100)) & MQTT_CONNECTED_BIT) == 0) {
+		broker_link_poll(&link);
+	}
 	ESP_LOGI(TAG, "Connect to MQTT Server");
+	uint32_t generation = link.generation;
 
 	MQTT_t mqttBuf;
+	// Each frame is encoded into this buffer, only this task publishes frames
+	static char payload[PAYLOAD_MAX_LEN];
+#if CONFIG_METRICS_ENABLE || CONFIG_PROFILE_ENABLE
+	// Periodic reports are built one at a time in this buffer
+	static char report[2048];
+	TickType_t wait = pdMS_TO_TICKS(1000);
+#else
+	TickType_t wait = portMAX_DELAY;
+#endif
+#if CONFIG_MQTT_FAILOVER_ENABLE
+	// Failover is checked between messages
+	wait = pdMS_TO_TICKS(100);
+#endif
+#if CONFIG_METRICS_ENABLE
+	TickType_t last_snapshot = xTaskGetTickCount();
+#endif
+#if CONFIG_PROFILE_ENABLE
+	TickType_t last_profile = xTaskGetTickCount();
+#endif
 	while (1) {
-		xQueueReceive(xQueue_mqtt_tx, &mqttBuf, portMAX_DELAY);
+		broker_link_poll(&link);
+		esp_mqtt_client_handle_t mqtt_client = broker_link_client(&link);
+		if (link.generation != generation) {
+			generation = link.generation;
+#if CONFIG_MQTT_BROKER_STANDBY
+			inflight_resend(mqtt_client);
+#endif
+		}
+#if CONFIG_METRICS_ENABLE
+		if (xTaskGetTickCount() - last_snapshot >= pdMS_TO_TICKS(CONFIG_METRICS_INTERVAL * 1000)) {
+			publish_report(mqtt_client, CONFIG_METRICS_TOPIC, report, metrics_snapshot(report, sizeof(report)));
+			last_snapshot = xTaskGetTickCount();
+		}
+#endif
+#if CONFIG_PROFILE_ENABLE
+		if (xTaskGetTickCount() - last_profile >= pdMS_TO_TICKS(CONFIG_PROFILE_INTERVAL * 1000)) {
+			publish_report(mqtt_client, CONFIG_PROFILE_TOPIC, report, profile_report(report, sizeof(report)));
+			profile_print();
+			last_profile = xTaskGetTickCount();
+		}
+#endif
+		if (mqtt_tx_receive(&mqttBuf, wait) != pdPASS) continue;
 		if (mqttBuf.topic_type == PUBLISH) {
-			//ESP_LOGI(TAG, "TOPIC=%.*s\r", mqttBuf.topic_len, mqttBuf.topic);
-			ESP_LOGI(TAG, "TOPIC=[%s] LEN=%d", mqttBuf.topic, mqttBuf.data_len);
-			//memset(mqttBuf.data, 0, sizeof(mqttBuf.data));
-			for(int i=0;i<mqttBuf.data_len;i++) {
-				ESP_LOGI(TAG, "DATA=0x%x", mqttBuf.data[i]);
+			ESP_LOGD(TAG, "TOPIC=[%s] LEN=%d", mqttBuf.topic, mqttBuf.data_len);
+			ESP_LOG_BUFFER_HEX_LEVEL(TAG, mqttBuf.data, mqttBuf.data_len, ESP_LOG_DEBUG);
+			int payload_len = payload_encode(mqttBuf.encoding, &mqttBuf, payload);
+			publish_record(mqtt_client, &mqttBuf, payload, payload_len);
+#if CONFIG_ISOTP_ENABLE
+		} else if (mqttBuf.topic_type == PUBLISH_PDU) {
+			PDU_t pdu;
+			memcpy(&pdu, mqttBuf.data, sizeof(pdu));
+			ESP_LOGI(TAG, "TOPIC=[%s] LEN=%d", mqttBuf.topic, pdu.length);
+			publish_record(mqtt_client, &mqttBuf, (char *)pdu.buffer, pdu.length);
+			isotp_buffer_free(pdu.buffer);
+#endif
+#if CONFIG_AGGREGATE_ENABLE
+		} else if (mqttBuf.topic_type == PUBLISH_SUMMARY) {
+			AGGREGATE_SUMMARY_t summary;
+			memcpy(&summary, mqttBuf.data, sizeof(summary));
+			char json[192];
+			int json_len = aggregate_json(&summary, json, sizeof(json));
+			ESP_LOGD(TAG, "TOPIC=[%s] %s", mqttBuf.topic, json);
+			publish_record(mqtt_client, &mqttBuf, json, json_len);
+#endif
+		} else if (mqttBuf.topic_type == PUBLISH_STATUS) {
+			// Retained, so a new subscriber sees the current state
+			if (xEventGroupGetBits(s_mqtt_event_group) & MQTT_CONNECTED_BIT) {
+				esp_mqtt_client_publish(mqtt_client, mqttBuf.topic, mqttBuf.data, mqttBuf.data_len, 1, 1);
 			}
-			EventBits_t EventBits = xEventGroupGetBits(s_mqtt_event_group);
-			ESP_LOGI(TAG, "EventBits=0x%"PRIx32, EventBits);
-			if (EventBits & MQTT_CONNECTED_BIT) {
-				esp_mqtt_client_publish(mqtt_client, mqttBuf.topic, mqttBuf.data, mqttBuf.data_len, 1, 0);
-			} else {
-				ESP_LOGE(TAG, "mqtt broker not connect");
+#if CONFIG_TRACE_ENABLE
+		} else if (mqttBuf.topic_type == TRACE_DUMP) {
+			size_t size;
+			const void *ring = trace_freeze(&size);
+			if (mqttBuf.data_len != 0) {
+				trace_print();
+			} else if (xEventGroupGetBits(s_mqtt_event_group) & MQTT_CONNECTED_BIT) {
+				// The ring has been written out when publish returns, so recording can resume
+				esp_mqtt_client_publish(mqtt_client, CONFIG_TRACE_TOPIC "/dump", ring, size, 1, 0);
 			}
+			trace_resume();
+#endif
 		}
 	} // end while
 
 	// Never reach here
 	ESP_LOGI(TAG, "Task Delete");
-	esp_mqtt_client_stop(mqtt_client);
+	esp_mqtt_client_stop(broker_link_client(&link));
 	vTaskDelete(NULL);
 }
@@ -10,17 +10,37 @@
 #include <inttypes.h>
 #include <stdint.h>
 #include <stddef.h>
+#include <stdlib.h>
 #include <string.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/queue.h"
 #include "freertos/event_groups.h"
 #include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_idf_version.h"
 #include "esp_event.h"
 #include "esp_mac.h"
 #include "mqtt_client.h"
+#if CONFIG_MQTT_TRANSPORT_OVER_SN
+#include "mqttsn.h"
+#endif
 
 #include "mqtt.h"
+#include "frame.h"
+#include "bulk.h"
+#include "broker.h"
+#include "metrics.h"
+#include "trace.h"
+#include "arena.h"
+#if CONFIG_CYCLIC_ENABLE
+#include "cyclic.h"
+#endif
+#if CONFIG_ISOTP_ENABLE
+#include "isotp.h"
+extern ISOTP_t *isotp;
+extern int16_t nisotp;
+#endif
 
 static const char *TAG = "SUB";
 
@@ -28,30 +48,185 @@ extern const uint8_t root_cert_pem_start[] asm("_binary_root_cert_pem_start");
 extern const uint8_t root_cert_pem_end[] asm("_binary_root_cert_pem_end");
 
 static EventGroupHandle_t s_mqtt_event_group;
+static StaticEventGroup_t s_mqtt_event_group_buffer;
 #define MQTT_CONNECTED_BIT BIT0
 
-extern QueueHandle_t xQueue_mqtt_tx;
-extern QueueHandle_t xQueue_twai_tx;
-
 extern TOPIC_t *subscribe;
 extern int16_t nsubscribe;
 
 void dump_table(TOPIC_t *topics, int16_t ntopic);
 
 static QueueHandle_t xQueueSubscribe;
+#define	SUBSCRIBE_QUEUE_DEPTH	10
+static uint8_t subscribe_storage[SUBSCRIBE_QUEUE_DEPTH * sizeof(MQTT_t)];
+static StaticQueue_t subscribe_queue;
+
+#if CONFIG_MQTT_PERSISTENT_SESSION
+// The broker only keeps QoS 1 messages for an offline client
+#define	SUBSCRIBE_QOS	1
+#else
+#define	SUBSCRIBE_QOS	0
+#endif
+
+// Topics per SUBSCRIBE packet, the packet has to fit in the client buffer
+#define	SUBSCRIBE_BATCH	32
+
+#if ESP_IDF_VERSION < ESP_IDF_VERSION_VAL(5, 1, 0)
+typedef struct {
+	const char *filter;
+	int qos;
+} esp_mqtt_topic_t;
+#endif
+
+// Every topic filter of the bridge, subscribed again on each connect
+static esp_mqtt_topic_t *topic_list;
+static int ntopic_list;
+
+// Reconnect timing
+static int64_t disconnected_time = 0;
+static int64_t connected_time = 0;
+static bool first_command = false;
+
+// The message being received is a bulk message
+static bool bulk_message = false;
+// ISO-TP session of the message being received, or -1
+static int16_t isotp_message = -1;
+
+#if CONFIG_BULK_ENABLE || CONFIG_CYCLIC_ENABLE || CONFIG_TRACE_ENABLE
+static bool is_topic(const char *topic, int topic_len, const char *name)
+{
+	if (topic_len != strlen(name)) return false;
+	return (strncmp(topic, name, topic_len) == 0);
+}
+#endif
+
+static int8_t hex_digit(char c)
+{
+	if (c >= '0' && c <= '9') return c - '0';
+	if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+	return -1;
+}
+
+/*
+ * Match a received topic against a mqtt2can row.
+ * A wildcard row takes the CAN ID from the + level, parsed in place without allocation.
+ */
+static bool topic_match(TOPIC_t *row, const char *topic, int16_t topic_len, uint32_t *canid)
+{
+	if (row->wildcard < 0) {
+		if (row->topic_len != topic_len || strncmp(row->topic, topic, topic_len) != 0) return false;
+		*canid = row->canid;
+		return true;
+	}
+
+	// Levels before the + level
+	if (topic_len <= row->wildcard || strncmp(row->topic, topic, row->wildcard) != 0) return false;
+	uint32_t id = 0;
+	int16_t pos = row->wildcard;
+	int16_t digits = 0;
+	for (;pos<topic_len && topic[pos]!='/';pos++) {
+		int8_t value = hex_digit(topic[pos]);
+		if (value < 0 || ++digits > 8) return false;
+		id = (id << 4) | value;
+	}
+	if (digits == 0) return false;
 
+	// Levels after the + level
+	int16_t suffix_len = row->topic_len - row->wildcard - 1;
+	if (topic_len - pos != suffix_len) return false;
+	if (strncmp(&row->topic[row->wildcard+1], &topic[pos], suffix_len) != 0) return false;
+
+	uint32_t max_id = row->frame ? 0x1FFFFFFF : 0x7FF;
+	if (id > max_id) {
+		ESP_LOGW(TAG, "CAN ID 0x%"PRIx32" is out of range", id);
+		return false;
+	}
+	if (row->nrange != 0) {
+		int16_t i;
+		for (i=0;i<row->nrange;i++) {
+			if (id >= row->range[i].low && id <= row->range[i].high) break;
+		}
+		if (i == row->nrange) {
+			ESP_LOGW(TAG, "CAN ID 0x%"PRIx32" is not allowed", id);
+			return false;
+		}
+	}
+	*canid = id;
+	return true;
+}
+
+static void add_topic(const char *filter)
+{
+	ESP_LOGI(TAG, "topic_list[%d]=[%s]", ntopic_list, filter);
+	topic_list[ntopic_list].filter = filter;
+	topic_list[ntopic_list].qos = SUBSCRIBE_QOS;
+	ntopic_list++;
+}
+
+static void build_topic_list(void)
+{
+	int count = nsubscribe + 3;
+#if CONFIG_ISOTP_ENABLE
+	count += nisotp;
+#endif
+	topic_list = arena_calloc(count, sizeof(esp_mqtt_topic_t));
+	configASSERT( topic_list );
+	ntopic_list = 0;
+	for(int index=0;index<nsubscribe;index++) {
+		add_topic(subscribe[index].topic);
+	}
+#if CONFIG_ISOTP_ENABLE
+	for(int index=0;index<nisotp;index++) {
+		add_topic(isotp[index].tx_topic);
+	}
+#endif
+#if CONFIG_BULK_ENABLE
+	add_topic(CONFIG_BULK_TOPIC);
+#endif
+#if CONFIG_CYCLIC_ENABLE
+	add_topic(CONFIG_CYCLIC_TOPIC);
+#endif
+#if CONFIG_TRACE_ENABLE
+	add_topic(CONFIG_TRACE_TOPIC);
+#endif
+}
+
+// Called on every connect, a clean session has lost all subscriptions
+static void subscribe_all(esp_mqtt_client_handle_t mqtt_client)
+{
+	for (int index=0;index<ntopic_list;index+=SUBSCRIBE_BATCH) {
+		int count = ntopic_list - index;
+		if (count > SUBSCRIBE_BATCH) count = SUBSCRIBE_BATCH;
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 1, 0) || CONFIG_MQTT_TRANSPORT_OVER_SN
+		int msg_id = esp_mqtt_client_subscribe_multiple(mqtt_client, &topic_list[index], count);
+		ESP_LOGI(TAG, "subscribe %d topics msg_id=%d", count, msg_id);
+#else
+		for (int i=0;i<count;i++) {
+			esp_mqtt_client_subscribe(mqtt_client, topic_list[index+i].filter, topic_list[index+i].qos);
+		}
+#endif
+	}
+}
 
 static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_t event_id, void *event_data)
 {
 	esp_mqtt_event_handle_t event = event_data;
 	switch (event->event_id) {
 		case MQTT_EVENT_CONNECTED:
-			ESP_LOGI(TAG, "MQTT_EVENT_CONNECTED");
+			ESP_LOGI(TAG, "MQTT_EVENT_CONNECTED session_present=%d", event->session_present);
+			connected_time = esp_timer_get_time();
+			if (disconnected_time != 0) {
+				metrics_count(METRIC_RECONNECTS);
+				ESP_LOGW(TAG, "reconnected after %"PRId64" ms", (connected_time - disconnected_time) / 1000);
+			}
+			first_command = true;
+			subscribe_all(event->client);
 			xEventGroupSetBits(s_mqtt_event_group, MQTT_CONNECTED_BIT);
-			//esp_mqtt_client_subscribe(mqtt_client, CONFIG_SUB_TOPIC, 0);
 			break;
 		case MQTT_EVENT_DISCONNECTED:
 			ESP_LOGW(TAG, "MQTT_EVENT_DISCONNECTED");
+			disconnected_time = esp_timer_get_time();
 			xEventGroupClearBits(s_mqtt_event_group, MQTT_CONNECTED_BIT);
 			break;
 		case MQTT_EVENT_SUBSCRIBED:
@@ -64,10 +239,77 @@ static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_
 			ESP_LOGI(TAG, "MQTT_EVENT_PUBLISHED, msg_id=%d", event->msg_id);
 			break;
 		case MQTT_EVENT_DATA:
-			ESP_LOGI(TAG, "MQTT_EVENT_DATA");
+			ESP_LOGD(TAG, "MQTT_EVENT_DATA");
 			//ESP_LOGI(TAG, "TOPIC=%.*s\r", event->topic_len, event->topic);
 			//ESP_LOGI(TAG, "DATA=%.*s\r", event->data_len, event->data);
+			ESP_LOGD(TAG, "current_data_offset=%d data_len=%d total_data_len=%d",
+				event->current_data_offset, event->data_len, event->total_data_len);
+			// Only the first fragment of a message carries the topic
+			if (event->current_data_offset == 0) {
+				if (first_command) {
+					// Includes commands the broker kept for us while we were offline
+					int64_t latency = esp_timer_get_time() - connected_time;
+					ESP_LOGI(TAG, "first command %"PRId64" us after connect", latency);
+					metrics_latency(HIST_CONNECT_TO_COMMAND, latency);
+					first_command = false;
+				}
+				metrics_count(METRIC_MQTT_RX);
+				trace_record(TRACE_MQTT_RX, 0, event->data_len, event->total_data_len);
+				bulk_message = false;
+				isotp_message = -1;
+#if CONFIG_ISOTP_ENABLE
+				isotp_message = isotp_find_topic(event->topic, event->topic_len);
+#endif
+#if CONFIG_BULK_ENABLE
+				if (is_topic(event->topic, event->topic_len, CONFIG_BULK_TOPIC)) {
+					bulk_message = true;
+					bulk_begin();
+				}
+#endif
+			}
+#if CONFIG_BULK_ENABLE
+			if (bulk_message) {
+				bulk_write((uint8_t *)event->data, event->data_len);
+				if (event->current_data_offset + event->data_len >= event->total_data_len) bulk_end();
+				break;
+			}
+#endif
+#if CONFIG_ISOTP_ENABLE
+			if (isotp_message >= 0) {
+				isotp_request(isotp_message, event->data, event->data_len, event->current_data_offset, event->total_data_len);
+				break;
+			}
+#endif
+
+			// Other topics carry a single frame, so the remaining fragments are ignored
+			if (event->current_data_offset != 0) break;
+#if CONFIG_CYCLIC_ENABLE
+			if (is_topic(event->topic, event->topic_len, CONFIG_CYCLIC_TOPIC)) {
+				cyclic_command((uint8_t *)event->data, event->data_len);
+				break;
+			}
+#endif
+#if CONFIG_TRACE_ENABLE
+			if (is_topic(event->topic, event->topic_len, CONFIG_TRACE_TOPIC)) {
+				// mqtt_pub_task dumps the ring, "console" prints it instead of publishing
+				MQTT_t request;
+				request.topic_type = TRACE_DUMP;
+				request.topic_len = 0;
+				request.data_len = 0;
+				if (event->data_len == 7 && strncmp(event->data, "console", 7) == 0) {
+					request.data[0] = 1;
+					request.data_len = 1;
+				}
+				mqtt_tx_send(&request, 0);
+				break;
+			}
+#endif
 			MQTT_t mqttBuf;
+			if (event->topic_len >= sizeof(mqttBuf.topic)) {
+				ESP_LOGW(TAG, "Topic is too long %d", event->topic_len);
+				break;
+			}
+			mqttBuf.timestamp = esp_timer_get_time();
 			mqttBuf.topic_type = SUBSCRIBE;
 			mqttBuf.topic_len = event->topic_len;
 			for(int i=0;i<event->topic_len;i++) {
@@ -75,10 +317,19 @@ static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_
 				mqttBuf.topic[i+1] = 0;
 			}
 			mqttBuf.data_len = event->data_len;
-			for(int i=0;i<event->data_len;i++) {
+			if (mqttBuf.data_len > sizeof(mqttBuf.data)) {
+				ESP_LOGW(TAG, "Data length is reduced to %zu bytes", sizeof(mqttBuf.data));
+				mqttBuf.data_len = sizeof(mqttBuf.data);
+			}
+			for(int i=0;i<mqttBuf.data_len;i++) {
 				mqttBuf.data[i] = event->data[i];
 			}
-			xQueueSend(xQueueSubscribe, &mqttBuf, 0);
+			if (xQueueSend(xQueueSubscribe, &mqttBuf, 0) != pdPASS) {
+				ESP_LOGW(TAG, "xQueueSend Fail");
+				metrics_count(METRIC_SUB_DROPPED);
+				break;
+			}
+			metrics_queue_level(QUEUE_SUBSCRIBE, uxQueueMessagesWaiting(xQueueSubscribe), SUBSCRIBE_QUEUE_DEPTH);
 			break;
 		case MQTT_EVENT_ERROR:
 			ESP_LOGI(TAG, "MQTT_EVENT_ERROR");
@@ -90,21 +341,18 @@ static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_
 	return;
 }
 
-esp_err_t query_mdns_host(const char * host_name, char *ip);
-void convert_mdns_host(char * from, char * to);
-
 void mqtt_sub_task(void *pvParameters)
 {
 	ESP_LOGI(TAG, "Start Subscribe Broker:%s", CONFIG_MQTT_BROKER);
 	dump_table(subscribe, nsubscribe);
 
 	/* Create Eventgroup */
-	s_mqtt_event_group = xEventGroupCreate();
+	s_mqtt_event_group = xEventGroupCreateStatic(&s_mqtt_event_group_buffer);
 	configASSERT( s_mqtt_event_group );
 	xEventGroupClearBits(s_mqtt_event_group, MQTT_CONNECTED_BIT);
 
 	/* Create Queue */
-	xQueueSubscribe = xQueueCreate( 10, sizeof(MQTT_t) );
+	xQueueSubscribe = xQueueCreateStatic( SUBSCRIBE_QUEUE_DEPTH, sizeof(MQTT_t), subscribe_storage, &subscribe_queue );
 	configASSERT( xQueueSubscribe );
 
 	// Set client id from mac
@@ -117,30 +365,8 @@ void mqtt_sub_task(void *pvParameters)
 	sprintf(client_id, "sub-%02x%02x%02x%02x%02x%02x", mac[0],mac[1],mac[2],mac[3],mac[4],mac[5]);
 	ESP_LOGI(TAG, "client_id=[%s]", client_id);
 
-	// Resolve mDNS host name
-	char ip[128];
-	char uri[128];
-	ESP_LOGI(TAG, "CONFIG_MQTT_BROKER=[%s]", CONFIG_MQTT_BROKER);
-	convert_mdns_host(CONFIG_MQTT_BROKER, ip);
-	ESP_LOGI(TAG, "ip=[%s]", ip);
-#if CONFIG_MQTT_TRANSPORT_OVER_TCP
-	ESP_LOGI(TAG, "MQTT_TRANSPORT_OVER_TCP");
-	sprintf(uri, "mqtt://%.60s:%d", ip, CONFIG_MQTT_PORT_TCP);
-#elif CONFIG_MQTT_TRANSPORT_OVER_SSL
-	ESP_LOGI(TAG, "MQTT_TRANSPORT_OVER_SSL");
-	sprintf(uri, "mqtts://%.60s:%d", ip, CONFIG_MQTT_PORT_SSL);
-#elif CONFIG_MQTT_TRANSPORT_OVER_WS
-	ESP_LOGI(TAG, "MQTT_TRANSPORT_OVER_WS");
-	sprintf(uri, "ws://%.60s:%d/mqtt", ip, CONFIG_MQTT_PORT_WS);
-#elif CONFIG_MQTT_TRANSPORT_OVER_WSS
-	ESP_LOGI(TAG, "MQTT_TRANSPORT_OVER_WSS");
-	sprintf(uri, "wss://%.60s:%d/mqtt", ip, CONFIG_MQTT_PORT_WSS);
-#endif
-	ESP_LOGI(TAG, "uri=[%s]", uri);
-
-	// Initialize MQTT configuration structure
+	// Initialize MQTT configuration structure, the URI is set by broker_link_start
 	esp_mqtt_client_config_t mqtt_cfg = {
-		.broker.address.uri = uri,
 #if CONFIG_MQTT_TRANSPORT_OVER_TCP
 #elif CONFIG_MQTT_TRANSPORT_OVER_SSL
 		.broker.verification.certificate = (const char *)root_cert_pem_start,
@@ -152,48 +378,75 @@ void mqtt_sub_task(void *pvParameters)
 		.credentials.username = CONFIG_AUTHENTICATION_USERNAME,
 		.credentials.authentication.password = CONFIG_AUTHENTICATION_PASSWORD,
 #endif
-		.credentials.client_id = client_id
+		.credentials.client_id = client_id,
+#if CONFIG_MQTT_PERSISTENT_SESSION
+		// client_id is derived from the MAC, so the broker finds the session again
+		.session.disable_clean_session = true,
+#endif
+		.network.reconnect_timeout_ms = CONFIG_MQTT_RECONNECT_MS,
 	};
 
-	esp_mqtt_client_handle_t mqtt_client = esp_mqtt_client_init(&mqtt_cfg);
-	esp_mqtt_client_register_event(mqtt_client, ESP_EVENT_ANY_ID, mqtt_event_handler, NULL);
-	esp_mqtt_client_start(mqtt_client);
-	xEventGroupWaitBits(s_mqtt_event_group, MQTT_CONNECTED_BIT, false, true, portMAX_DELAY);
-	ESP_LOGI(TAG, "Connect to MQTT Server");
-	
-	for(int index=0;index<nsubscribe;index++) {
-		ESP_LOGI(TAG, "subscribe[%d] topic=[%s]", index, subscribe[index].topic);
-		esp_mqtt_client_subscribe(mqtt_client, subscribe[index].topic, 0);
+	// Subscribed from the event handler on every connect
+	build_topic_list();
+
+	// No standby here, subscribing on two brokers would deliver every command twice
+	static BROKER_LINK_t link = {
+		.name = "sub",
+		.handler = mqtt_event_handler,
+		.standby = false,
+	};
+	ESP_ERROR_CHECK(broker_link_start(&link, &mqtt_cfg));
+	while ((xEventGroupWaitBits(s_mqtt_event_group, MQTT_CONNECTED_BIT, false, true, pdMS_TO_TICKS(100)) & MQTT_CONNECTED_BIT) == 0) {
+		broker_link_poll(&link);
 	}
+	ESP_LOGI(TAG, "Connect to MQTT Server");
 
 	MQTT_t mqttBuf;
 	while (1) {
-		xQueueReceive(xQueueSubscribe, &mqttBuf, portMAX_DELAY);
-		ESP_LOGI(TAG, "type=%d", mqttBuf.topic_type);
+		broker_link_poll(&link);
+		if (xQueueReceive(xQueueSubscribe, &mqttBuf, pdMS_TO_TICKS(100)) != pdPASS) continue;
+		ESP_LOGD(TAG, "type=%d", mqttBuf.topic_type);
 
 		if (mqttBuf.topic_type != SUBSCRIBE) continue;
-		//ESP_LOGI(TAG, "TOPIC=%.*s\r", mqttBuf.topic_len, mqttBuf.topic);
-		ESP_LOGI(TAG, "TOPIC=[%s]", mqttBuf.topic);
-		for(int i=0;i<mqttBuf.data_len;i++) {
-			ESP_LOGI(TAG, "DATA=0x%x", mqttBuf.data[i]);
-		}
+		ESP_LOGD(TAG, "TOPIC=[%s]", mqttBuf.topic);
+		ESP_LOG_BUFFER_HEX_LEVEL(TAG, mqttBuf.data, mqttBuf.data_len, ESP_LOG_DEBUG);
 
 		for(int index=0;index<nsubscribe;index++) {
-			if (strcmp(subscribe[index].topic, mqttBuf.topic) != 0) continue;
-			ESP_LOGI(TAG, "subscribe[index].frame=%d", subscribe[index].frame);
+			uint32_t canid;
+			if (topic_match(&subscribe[index], mqttBuf.topic, mqttBuf.topic_len, &canid) == false) continue;
+			ESP_LOGD(TAG, "subscribe[index].frame=%d", subscribe[index].frame);
 			FRAME_t tx_msg;
-			tx_msg.canid = subscribe[index].canid;
+			tx_msg.timestamp = mqttBuf.timestamp;
+			tx_msg.canid = canid;
 			tx_msg.extd = subscribe[index].frame;
+			tx_msg.rtr = 0;
+			tx_msg.fdf = subscribe[index].fdf;
+			tx_msg.brs = subscribe[index].brs;
+			tx_msg.esi = 0;
+			tx_msg.priority = subscribe[index].priority;
 			tx_msg.data_len = mqttBuf.data_len;
-			if (mqttBuf.data_len > 8) {
-				ESP_LOGW(TAG, "Data length is reduced to 8 bytes");
-				tx_msg.data_len = 8;
+			if (tx_msg.fdf == 0) {
+				if (mqttBuf.data_len > CAN_MAX_DATA_LEN) {
+					ESP_LOGW(TAG, "Data length is reduced to %d bytes", CAN_MAX_DATA_LEN);
+					tx_msg.data_len = CAN_MAX_DATA_LEN;
+				}
+			} else {
+				if (mqttBuf.data_len > CANFD_MAX_DATA_LEN) {
+					ESP_LOGW(TAG, "Data length is reduced to %d bytes", CANFD_MAX_DATA_LEN);
+					tx_msg.data_len = CANFD_MAX_DATA_LEN;
+				}
 			}
 			for (int i=0;i<tx_msg.data_len;i++) {
 				tx_msg.data[i] = mqttBuf.data[i];
 			}
-			
-			if (xQueueSend(xQueue_twai_tx, &tx_msg, portMAX_DELAY) != pdPASS) {
+			// FD frames can only carry 0-8,12,16,20,24,32,48,64 bytes
+			if (tx_msg.fdf) {
+				int16_t valid_len = canfd_valid_len(tx_msg.data_len);
+				memset(&tx_msg.data[tx_msg.data_len], 0, valid_len - tx_msg.data_len);
+				tx_msg.data_len = valid_len;
+			}
+
+			if (twai_tx_send(&tx_msg, portMAX_DELAY) != pdPASS) {
 				ESP_LOGE(TAG, "xQueueSend Fail");
 			}
 		}
@@ -202,6 +455,6 @@ void mqtt_sub_task(void *pvParameters)
 
 	// Never reach here
 	ESP_LOGI(TAG, "Task Delete");
-	esp_mqtt_client_stop(mqtt_client);
+	esp_mqtt_client_stop(broker_link_client(&link));
 	vTaskDelete(NULL);
 }
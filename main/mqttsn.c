@@ -0,0 +1,613 @@
+/*
+	This code is in the Public Domain (or CC0 licensed, at your option.)
+
+	Unless required by applicable law or agreed to in writing, this
+	software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+	CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "freertos/event_groups.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "lwip/sockets.h"
+#include "lwip/netdb.h"
+
+#include "mqttsn.h"
+
+static const char *TAG = "MQTTSN";
+
+#define	MQTTSN_CONNECTED_BIT	BIT0
+#define	MQTTSN_REGACK_BIT	BIT1
+#define	MQTTSN_STOPPED_BIT	BIT2
+
+// Longest packet received, PUBLISH data beyond this is cut off
+#define	MQTTSN_RX_BUFFER	1500
+// A REGISTER or SUBSCRIBE without answer is sent again after this time
+#define	MQTTSN_RETRY_MS		1000
+#define	MQTTSN_POLL_MS		100
+// PINGREQs sent MQTTSN_RETRY_MS apart without an answer before the gateway is given up
+#define	MQTTSN_PING_TRIES	3
+// mqtt_pub_task and mqtt_sub_task each have a client
+#define	MQTTSN_CLIENTS		2
+// Longer topic names are registered again on every use
+#define	MQTTSN_TOPIC_NAME	64
+#define	MQTTSN_STACK		(1024*4)
+
+// The names live in the table itself, registrations never allocate
+typedef struct {
+	char name[MQTTSN_TOPIC_NAME];
+	uint16_t id;
+} MQTTSN_TOPIC_t;
+
+typedef struct mqttsn_client {
+	char host[64];
+	char port[8];
+	char client_id[24];	// MQTT-SN allows 1 to 23 characters
+	bool clean_session;
+	uint16_t keepalive;	// seconds
+	int reconnect_ms;
+
+	esp_event_handler_t handler;
+	void *handler_args;
+
+	int sock;
+	bool running;
+	bool connected;
+	TaskHandle_t task;
+	EventGroupHandle_t events;
+	SemaphoreHandle_t mutex;	// topic table and message ID
+	SemaphoreHandle_t register_mutex;	// one REGISTER in flight
+	StaticTask_t task_buffer;
+	StaticEventGroup_t events_buffer;
+	StaticSemaphore_t mutex_buffer;
+	StaticSemaphore_t register_mutex_buffer;
+	StackType_t stack[MQTTSN_STACK];
+	uint16_t msg_id;
+
+	// Topic IDs registered by us or by the gateway
+	MQTTSN_TOPIC_t topic[CONFIG_MQTTSN_TOPICS];
+	int16_t ntopic;
+	int16_t evict;		// next slot to reuse when the table is full
+
+	// REGISTER waiting for REGACK
+	uint16_t register_msg_id;
+	uint16_t register_topic_id;
+	uint8_t register_rc;
+
+	// Filters still to subscribe, sent from the receive task one at a time
+	const esp_mqtt_topic_t *subscribe_list;
+	int subscribe_count;
+	int subscribe_next;
+	uint16_t subscribe_msg_id;
+	int64_t subscribe_sent;
+
+	int64_t next_connect;
+	int64_t last_tx;
+	int64_t last_rx;
+	int64_t ping_sent;	// 0 while no PINGREQ waits for an answer
+	int16_t ping_tries;
+	uint8_t rx_buffer[MQTTSN_RX_BUFFER];
+} MQTTSN_CLIENT_t;
+
+static MQTTSN_CLIENT_t clients[MQTTSN_CLIENTS];
+static int nclients;
+
+static uint16_t next_msg_id(MQTTSN_CLIENT_t *client)
+{
+	client->msg_id++;
+	if (client->msg_id == 0) client->msg_id = 1;
+	return client->msg_id;
+}
+
+/*
+ * Send one packet: length, type, fixed part and an optional variable part.
+ * The variable part (topic name or data) is not copied.
+ */
+static int mqttsn_send(MQTTSN_CLIENT_t *client, uint8_t type, const uint8_t *fixed, int fixed_len, const void *variable, int variable_len)
+{
+	uint8_t header[4];
+	int header_len;
+	int length = 2 + fixed_len + variable_len;
+	if (length <= 255) {
+		header[0] = length;
+		header_len = 1;
+	} else {
+		length += 2;
+		if (length > 0xFFFF) return -1;
+		header[0] = 0x01;
+		header[1] = length >> 8;
+		header[2] = length;
+		header_len = 3;
+	}
+	header[header_len++] = type;
+
+	struct iovec iov[3] = {
+		{ .iov_base = header, .iov_len = header_len },
+		{ .iov_base = (void *)fixed, .iov_len = fixed_len },
+		{ .iov_base = (void *)variable, .iov_len = variable_len },
+	};
+	struct msghdr msg = {
+		.msg_iov = iov,
+		.msg_iovlen = (variable_len != 0) ? 3 : 2,
+	};
+	int sent = sendmsg(client->sock, &msg, 0);
+	if (sent < 0) {
+		ESP_LOGD(TAG, "sendmsg Fail errno=%d", errno);
+		return -1;
+	}
+	client->last_tx = esp_timer_get_time();
+	return sent;
+}
+
+static void raise_event(MQTTSN_CLIENT_t *client, esp_mqtt_event_t *event)
+{
+	event->client = (esp_mqtt_client_handle_t)client;
+	if (client->handler) client->handler(client->handler_args, NULL, event->event_id, event);
+}
+
+static int16_t find_topic_name(MQTTSN_CLIENT_t *client, const char *name, int name_len)
+{
+	for (int16_t i=0;i<client->ntopic;i++) {
+		if (strncmp(client->topic[i].name, name, name_len) == 0 && client->topic[i].name[name_len] == 0) return i;
+	}
+	return -1;
+}
+
+static int16_t find_topic_id(MQTTSN_CLIENT_t *client, uint16_t id)
+{
+	for (int16_t i=0;i<client->ntopic;i++) {
+		if (client->topic[i].id == id) return i;
+	}
+	return -1;
+}
+
+// Called with the mutex held
+static void add_topic(MQTTSN_CLIENT_t *client, const char *name, int name_len, uint16_t id)
+{
+	if (name_len >= MQTTSN_TOPIC_NAME) {
+		ESP_LOGD(TAG, "topic name of %d bytes is not kept", name_len);
+		return;
+	}
+	int16_t index = find_topic_name(client, name, name_len);
+	if (index < 0) {
+		if (client->ntopic < CONFIG_MQTTSN_TOPICS) {
+			index = client->ntopic++;
+		} else {
+			index = client->evict;
+			client->evict = (client->evict + 1) % CONFIG_MQTTSN_TOPICS;
+		}
+		memcpy(client->topic[index].name, name, name_len);
+		client->topic[index].name[name_len] = 0;
+	}
+	client->topic[index].id = id;
+}
+
+static void clear_topics(MQTTSN_CLIENT_t *client)
+{
+	xSemaphoreTake(client->mutex, portMAX_DELAY);
+	client->ntopic = 0;
+	client->evict = 0;
+	xSemaphoreGive(client->mutex);
+}
+
+static void send_connect(MQTTSN_CLIENT_t *client)
+{
+	uint8_t fixed[4];
+	fixed[0] = client->clean_session ? MQTTSN_FLAG_CLEAN : 0;
+	fixed[1] = MQTTSN_PROTOCOL_ID;
+	fixed[2] = client->keepalive >> 8;
+	fixed[3] = client->keepalive;
+	ESP_LOGI(TAG, "CONNECT client_id=[%s]", client->client_id);
+	mqttsn_send(client, MQTTSN_CONNECT, fixed, sizeof(fixed), client->client_id, strlen(client->client_id));
+}
+
+static void send_subscribe(MQTTSN_CLIENT_t *client)
+{
+	const esp_mqtt_topic_t *topic = &client->subscribe_list[client->subscribe_next];
+	uint8_t fixed[3];
+	client->subscribe_msg_id = next_msg_id(client);
+	fixed[0] = ((topic->qos > 0) ? MQTTSN_FLAG_QOS1 : 0) | MQTTSN_TOPIC_NORMAL;
+	fixed[1] = client->subscribe_msg_id >> 8;
+	fixed[2] = client->subscribe_msg_id;
+	ESP_LOGD(TAG, "SUBSCRIBE [%s] msg_id=%d", topic->filter, client->subscribe_msg_id);
+	mqttsn_send(client, MQTTSN_SUBSCRIBE, fixed, sizeof(fixed), topic->filter, strlen(topic->filter));
+	client->subscribe_sent = esp_timer_get_time();
+}
+
+static void set_disconnected(MQTTSN_CLIENT_t *client)
+{
+	if (client->connected == false) return;
+	client->connected = false;
+	xEventGroupClearBits(client->events, MQTTSN_CONNECTED_BIT);
+	client->subscribe_list = NULL;
+	client->next_connect = esp_timer_get_time() + client->reconnect_ms * 1000LL;
+	esp_mqtt_event_t event = { .event_id = MQTT_EVENT_DISCONNECTED };
+	raise_event(client, &event);
+}
+
+static void handle_publish(MQTTSN_CLIENT_t *client, const uint8_t *body, int body_len)
+{
+	if (body_len < 5) return;
+	uint8_t flags = body[0];
+	uint16_t topic_id = (body[1] << 8) | body[2];
+	uint16_t msg_id = (body[3] << 8) | body[4];
+
+	// Copied, so the table may change while the handler runs
+	char topic[128];
+	int topic_len = -1;
+	if ((flags & MQTTSN_TOPIC_MASK) == MQTTSN_TOPIC_SHORT) {
+		topic[0] = body[1];
+		topic[1] = body[2];
+		topic_len = 2;
+	} else {
+		xSemaphoreTake(client->mutex, portMAX_DELAY);
+		int16_t index = find_topic_id(client, topic_id);
+		if (index >= 0) {
+			strncpy(topic, client->topic[index].name, sizeof(topic) - 1);
+			topic[sizeof(topic) - 1] = 0;
+			topic_len = strlen(topic);
+		}
+		xSemaphoreGive(client->mutex);
+	}
+
+	if (flags & MQTTSN_FLAG_QOS1) {
+		// Return code 0x02 is "invalid topic ID"
+		uint8_t fixed[5] = { body[1], body[2], body[3], body[4], (topic_len >= 0) ? MQTTSN_ACCEPTED : 0x02 };
+		mqttsn_send(client, MQTTSN_PUBACK, fixed, sizeof(fixed), NULL, 0);
+	}
+	if (topic_len < 0) {
+		ESP_LOGW(TAG, "PUBLISH for unknown topic id %d", topic_id);
+		return;
+	}
+
+	esp_mqtt_event_t event = {
+		.event_id = MQTT_EVENT_DATA,
+		.topic = topic,
+		.topic_len = topic_len,
+		.data = (char *)&body[5],
+		.data_len = body_len - 5,
+		.total_data_len = body_len - 5,
+		.current_data_offset = 0,
+		.msg_id = msg_id,
+		.qos = (flags & MQTTSN_FLAG_QOS1) ? 1 : 0,
+		.retain = (flags & MQTTSN_FLAG_RETAIN) ? true : false,
+	};
+	raise_event(client, &event);
+}
+
+static void handle_packet(MQTTSN_CLIENT_t *client, const uint8_t *packet, int received)
+{
+	int length;
+	int header_len;
+	if (received < 2) return;
+	if (packet[0] == 0x01) {
+		if (received < 4) return;
+		length = (packet[1] << 8) | packet[2];
+		header_len = 3;
+	} else {
+		length = packet[0];
+		header_len = 1;
+	}
+	if (length > received || length < header_len + 1) {
+		ESP_LOGW(TAG, "Invalid packet length %d received %d", length, received);
+		return;
+	}
+	uint8_t type = packet[header_len];
+	const uint8_t *body = &packet[header_len+1];
+	int body_len = length - header_len - 1;
+	// Any packet shows the gateway is alive, not only PINGRESP
+	client->last_rx = esp_timer_get_time();
+	client->ping_sent = 0;
+
+	switch (type) {
+		case MQTTSN_CONNACK: {
+			if (body_len < 1) break;
+			if (body[0] != MQTTSN_ACCEPTED) {
+				ESP_LOGE(TAG, "CONNACK rejected %d", body[0]);
+				break;
+			}
+			ESP_LOGI(TAG, "CONNACK");
+			if (client->connected) break;
+			// Registrations of the last connection are not kept by every gateway
+			clear_topics(client);
+			client->connected = true;
+			xEventGroupSetBits(client->events, MQTTSN_CONNECTED_BIT);
+			esp_mqtt_event_t event = { .event_id = MQTT_EVENT_CONNECTED, .session_present = 0 };
+			raise_event(client, &event);
+			break;
+		}
+		case MQTTSN_REGACK:
+			if (body_len < 5) break;
+			if (((body[2] << 8) | body[3]) != client->register_msg_id) break;
+			client->register_topic_id = (body[0] << 8) | body[1];
+			client->register_rc = body[4];
+			xEventGroupSetBits(client->events, MQTTSN_REGACK_BIT);
+			break;
+		case MQTTSN_REGISTER: {
+			// The gateway names a topic before publishing to a wildcard subscription
+			if (body_len < 5) break;
+			xSemaphoreTake(client->mutex, portMAX_DELAY);
+			add_topic(client, (const char *)&body[4], body_len - 4, (body[0] << 8) | body[1]);
+			xSemaphoreGive(client->mutex);
+			uint8_t regack[5] = { body[0], body[1], body[2], body[3], MQTTSN_ACCEPTED };
+			mqttsn_send(client, MQTTSN_REGACK, regack, sizeof(regack), NULL, 0);
+			break;
+		}
+		case MQTTSN_PUBLISH:
+			handle_publish(client, body, body_len);
+			break;
+		case MQTTSN_PUBACK:
+			if (body_len < 5) break;
+			if (body[4] != MQTTSN_ACCEPTED) {
+				ESP_LOGW(TAG, "PUBACK topic id %d rejected %d", (body[0] << 8) | body[1], body[4]);
+			}
+			break;
+		case MQTTSN_SUBACK: {
+			if (body_len < 6 || client->subscribe_list == NULL) break;
+			if (((body[3] << 8) | body[4]) != client->subscribe_msg_id) break;
+			const esp_mqtt_topic_t *topic = &client->subscribe_list[client->subscribe_next];
+			uint16_t topic_id = (body[1] << 8) | body[2];
+			ESP_LOGI(TAG, "SUBACK [%s] topic_id=%d rc=%d", topic->filter, topic_id, body[5]);
+			// A wildcard filter gets topic id 0, the gateway registers each match later
+			if (body[5] == MQTTSN_ACCEPTED && topic_id != 0) {
+				xSemaphoreTake(client->mutex, portMAX_DELAY);
+				add_topic(client, topic->filter, strlen(topic->filter), topic_id);
+				xSemaphoreGive(client->mutex);
+			}
+			client->subscribe_msg_id = 0;
+			client->subscribe_next++;
+			if (client->subscribe_next == client->subscribe_count) {
+				client->subscribe_list = NULL;
+				esp_mqtt_event_t event = { .event_id = MQTT_EVENT_SUBSCRIBED };
+				raise_event(client, &event);
+			}
+			break;
+		}
+		case MQTTSN_PINGREQ:
+			mqttsn_send(client, MQTTSN_PINGRESP, NULL, 0, NULL, 0);
+			break;
+		case MQTTSN_PINGRESP:
+			break;
+		case MQTTSN_DISCONNECT:
+			ESP_LOGW(TAG, "DISCONNECT from gateway");
+			set_disconnected(client);
+			break;
+		default:
+			ESP_LOGD(TAG, "Unhandled packet type 0x%02x", type);
+			break;
+	}
+}
+
+static void mqttsn_task(void *pvParameters)
+{
+	MQTTSN_CLIENT_t *client = pvParameters;
+	while (client->running) {
+		int64_t now = esp_timer_get_time();
+		if (client->connected == false && now >= client->next_connect) {
+			send_connect(client);
+			client->next_connect = now + client->reconnect_ms * 1000LL;
+		}
+
+		int received = recv(client->sock, client->rx_buffer, sizeof(client->rx_buffer), 0);
+		if (received > 0) handle_packet(client, client->rx_buffer, received);
+
+		if (client->connected == false) continue;
+		now = esp_timer_get_time();
+		/*
+		 * The gateway drops us after 1.5 keep alive periods without a packet, so ping at half the period.
+		 * The publisher only sends QoS 0 frames and gets nothing back, so a quiet receive side
+		 * also starts a ping. The gateway is only given up when its PINGRESP does not come.
+		 */
+		if (client->ping_sent != 0) {
+			if (now - client->ping_sent > MQTTSN_RETRY_MS * 1000LL) {
+				if (client->ping_tries == MQTTSN_PING_TRIES) {
+					ESP_LOGW(TAG, "gateway does not answer");
+					set_disconnected(client);
+					continue;
+				}
+				mqttsn_send(client, MQTTSN_PINGREQ, NULL, 0, NULL, 0);
+				client->ping_sent = now;
+				client->ping_tries++;
+			}
+		} else if (now - client->last_tx > client->keepalive * 500000LL || now - client->last_rx > client->keepalive * 500000LL) {
+			mqttsn_send(client, MQTTSN_PINGREQ, NULL, 0, NULL, 0);
+			client->ping_sent = now;
+			client->ping_tries = 1;
+		}
+		if (client->subscribe_list != NULL) {
+			if (client->subscribe_msg_id == 0 || now - client->subscribe_sent > MQTTSN_RETRY_MS * 1000LL) {
+				send_subscribe(client);
+			}
+		}
+	}
+	// Nobody else reads the socket, so it is closed here once the loop has ended
+	close(client->sock);
+	client->sock = -1;
+	xEventGroupSetBits(client->events, MQTTSN_STOPPED_BIT);
+	vTaskDelete(NULL);
+}
+
+esp_mqtt_client_handle_t mqttsn_client_init(const esp_mqtt_client_config_t *config)
+{
+	if (nclients == MQTTSN_CLIENTS) {
+		ESP_LOGE(TAG, "No more than %d clients", MQTTSN_CLIENTS);
+		return NULL;
+	}
+	MQTTSN_CLIENT_t *client = &clients[nclients];
+	memset(client, 0, sizeof(MQTTSN_CLIENT_t));
+
+	// mqttsn://host:port
+	const char *uri = config->broker.address.uri;
+	const char *host = strstr(uri, "://");
+	host = (host != NULL) ? host + 3 : uri;
+	const char *port = strrchr(host, ':');
+	if (port == NULL || port - host >= (int)sizeof(client->host)) {
+		ESP_LOGE(TAG, "Invalid uri [%s]", uri);
+		return NULL;
+	}
+	strncpy(client->host, host, port - host);
+	strncpy(client->port, port + 1, sizeof(client->port) - 1);
+	strncpy(client->client_id, config->credentials.client_id, sizeof(client->client_id) - 1);
+	if (config->credentials.username != NULL) {
+		ESP_LOGW(TAG, "MQTT-SN has no username and password, they are ignored");
+	}
+	client->clean_session = !config->session.disable_clean_session;
+	client->keepalive = (config->session.keepalive > 0) ? config->session.keepalive : 60;
+	client->reconnect_ms = (config->network.reconnect_timeout_ms > 0) ? config->network.reconnect_timeout_ms : 10000;
+	client->events = xEventGroupCreateStatic(&client->events_buffer);
+	client->mutex = xSemaphoreCreateMutexStatic(&client->mutex_buffer);
+	client->register_mutex = xSemaphoreCreateMutexStatic(&client->register_mutex_buffer);
+	configASSERT( client->events && client->mutex && client->register_mutex );
+	client->sock = -1;
+	nclients++;
+	return (esp_mqtt_client_handle_t)client;
+}
+
+esp_err_t mqttsn_client_register_event(esp_mqtt_client_handle_t handle, int32_t event, esp_event_handler_t handler, void *handler_args)
+{
+	MQTTSN_CLIENT_t *client = (MQTTSN_CLIENT_t *)handle;
+	client->handler = handler;
+	client->handler_args = handler_args;
+	return ESP_OK;
+}
+
+esp_err_t mqttsn_client_start(esp_mqtt_client_handle_t handle)
+{
+	MQTTSN_CLIENT_t *client = (MQTTSN_CLIENT_t *)handle;
+	ESP_LOGI(TAG, "gateway host=[%s] port=[%s]", client->host, client->port);
+
+	struct addrinfo hints = { .ai_family = AF_INET, .ai_socktype = SOCK_DGRAM };
+	struct addrinfo *res;
+	int err = getaddrinfo(client->host, client->port, &hints, &res);
+	if (err != 0 || res == NULL) {
+		ESP_LOGE(TAG, "getaddrinfo Fail %d", err);
+		return ESP_FAIL;
+	}
+	client->sock = socket(res->ai_family, res->ai_socktype, 0);
+	if (client->sock < 0) {
+		ESP_LOGE(TAG, "socket Fail errno=%d", errno);
+		freeaddrinfo(res);
+		return ESP_FAIL;
+	}
+	// A connected UDP socket only receives from the gateway
+	err = connect(client->sock, res->ai_addr, res->ai_addrlen);
+	freeaddrinfo(res);
+	if (err != 0) {
+		ESP_LOGE(TAG, "connect Fail errno=%d", errno);
+		close(client->sock);
+		client->sock = -1;
+		return ESP_FAIL;
+	}
+	struct timeval timeout = { .tv_sec = 0, .tv_usec = MQTTSN_POLL_MS * 1000 };
+	setsockopt(client->sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+	client->running = true;
+	client->next_connect = 0;
+	xEventGroupClearBits(client->events, MQTTSN_STOPPED_BIT);
+	client->task = xTaskCreateStatic(mqttsn_task, "mqttsn", sizeof(client->stack), client, 5, client->stack, &client->task_buffer);
+	if (client->task == NULL) {
+		ESP_LOGE(TAG, "xTaskCreate Fail");
+		client->running = false;
+		return ESP_FAIL;
+	}
+	return ESP_OK;
+}
+
+esp_err_t mqttsn_client_stop(esp_mqtt_client_handle_t handle)
+{
+	MQTTSN_CLIENT_t *client = (MQTTSN_CLIENT_t *)handle;
+	if (client->connected) {
+		mqttsn_send(client, MQTTSN_DISCONNECT, NULL, 0, NULL, 0);
+	}
+	client->running = false;
+	client->connected = false;
+	xEventGroupClearBits(client->events, MQTTSN_CONNECTED_BIT);
+	// The task ends within one receive timeout and closes the socket, unless stop is called from its event handler
+	if (client->task != NULL && client->task != xTaskGetCurrentTaskHandle()) {
+		xEventGroupWaitBits(client->events, MQTTSN_STOPPED_BIT, pdFALSE, pdTRUE, portMAX_DELAY);
+	}
+	client->task = NULL;
+	return ESP_OK;
+}
+
+// Returns the topic id, registering the topic on first use, or -1
+static int register_topic(MQTTSN_CLIENT_t *client, const char *topic)
+{
+	int topic_len = strlen(topic);
+	xSemaphoreTake(client->mutex, portMAX_DELAY);
+	int16_t index = find_topic_name(client, topic, topic_len);
+	int id = (index >= 0) ? client->topic[index].id : -1;
+	xSemaphoreGive(client->mutex);
+	if (id >= 0) return id;
+
+	xSemaphoreTake(client->register_mutex, portMAX_DELAY);
+	for (int retry=0;retry<3 && id<0;retry++) {
+		if (client->connected == false) break;
+		uint8_t fixed[4];
+		xSemaphoreTake(client->mutex, portMAX_DELAY);
+		client->register_msg_id = next_msg_id(client);
+		xSemaphoreGive(client->mutex);
+		fixed[0] = 0;
+		fixed[1] = 0;
+		fixed[2] = client->register_msg_id >> 8;
+		fixed[3] = client->register_msg_id;
+		xEventGroupClearBits(client->events, MQTTSN_REGACK_BIT);
+		mqttsn_send(client, MQTTSN_REGISTER, fixed, sizeof(fixed), topic, topic_len);
+		EventBits_t bits = xEventGroupWaitBits(client->events, MQTTSN_REGACK_BIT, pdTRUE, pdTRUE, pdMS_TO_TICKS(MQTTSN_RETRY_MS));
+		if ((bits & MQTTSN_REGACK_BIT) == 0) continue;
+		if (client->register_rc != MQTTSN_ACCEPTED) {
+			ESP_LOGE(TAG, "REGISTER [%s] rejected %d", topic, client->register_rc);
+			break;
+		}
+		id = client->register_topic_id;
+		ESP_LOGI(TAG, "REGISTER [%s] topic_id=%d", topic, id);
+		xSemaphoreTake(client->mutex, portMAX_DELAY);
+		add_topic(client, topic, topic_len, id);
+		xSemaphoreGive(client->mutex);
+	}
+	xSemaphoreGive(client->register_mutex);
+	return id;
+}
+
+/*
+ * QoS 0 only: a lost datagram is not sent again, the next frame replaces it.
+ * Returns 0 like esp_mqtt_client_publish does for QoS 0, or -1.
+ */
+int mqttsn_client_publish(esp_mqtt_client_handle_t handle, const char *topic, const char *data, int len, int qos, int retain)
+{
+	MQTTSN_CLIENT_t *client = (MQTTSN_CLIENT_t *)handle;
+	if (client->connected == false) return -1;
+	int id = register_topic(client, topic);
+	if (id < 0) return -1;
+	uint8_t fixed[5];
+	fixed[0] = (retain ? MQTTSN_FLAG_RETAIN : 0) | MQTTSN_TOPIC_NORMAL;
+	fixed[1] = id >> 8;
+	fixed[2] = id;
+	fixed[3] = 0;
+	fixed[4] = 0;
+	if (mqttsn_send(client, MQTTSN_PUBLISH, fixed, sizeof(fixed), data, len) < 0) return -1;
+	return 0;
+}
+
+int mqttsn_client_subscribe_multiple(esp_mqtt_client_handle_t handle, const esp_mqtt_topic_t *topic_list, int size)
+{
+	MQTTSN_CLIENT_t *client = (MQTTSN_CLIENT_t *)handle;
+	if (client->connected == false || size <= 0) return -1;
+	// subscribe_all passes one list in consecutive batches, a batch following the running one extends it
+	if (client->subscribe_list != NULL && client->subscribe_list + client->subscribe_count == topic_list) {
+		client->subscribe_count += size;
+		return 0;
+	}
+	client->subscribe_list = topic_list;
+	client->subscribe_count = size;
+	client->subscribe_next = 0;
+	client->subscribe_msg_id = 0;
+	return 0;
+}
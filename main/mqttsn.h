@@ -0,0 +1,62 @@
+#ifndef MQTTSN_H_
+#define MQTTSN_H_
+
+#include <stdint.h>
+#include "esp_idf_version.h"
+#include "mqtt_client.h"
+
+#if ESP_IDF_VERSION < ESP_IDF_VERSION_VAL(5, 1, 0)
+#error "MQTT-SN transport requires ESP-IDF V5.1 or later"
+#endif
+
+/*
+ * MQTT-SN(v1.2) client over UDP.
+ * It takes the esp_mqtt_client configuration and raises the same events,
+ * so mqtt_pub.c and mqtt_sub.c run unchanged on top of it.
+ * PUBLISH packets use QoS 0 with topic IDs registered on first use.
+ */
+
+// Packet types
+#define	MQTTSN_CONNECT		0x04
+#define	MQTTSN_CONNACK		0x05
+#define	MQTTSN_REGISTER		0x0A
+#define	MQTTSN_REGACK		0x0B
+#define	MQTTSN_PUBLISH		0x0C
+#define	MQTTSN_PUBACK		0x0D
+#define	MQTTSN_SUBSCRIBE	0x12
+#define	MQTTSN_SUBACK		0x13
+#define	MQTTSN_PINGREQ		0x16
+#define	MQTTSN_PINGRESP		0x17
+#define	MQTTSN_DISCONNECT	0x18
+
+// Flags
+#define	MQTTSN_FLAG_QOS1	0x20
+#define	MQTTSN_FLAG_QOS_MASK	0x60
+#define	MQTTSN_FLAG_RETAIN	0x10
+#define	MQTTSN_FLAG_CLEAN	0x04
+#define	MQTTSN_TOPIC_NORMAL	0x00
+#define	MQTTSN_TOPIC_PREDEFINED	0x01
+#define	MQTTSN_TOPIC_SHORT	0x02
+#define	MQTTSN_TOPIC_MASK	0x03
+
+#define	MQTTSN_PROTOCOL_ID	0x01
+#define	MQTTSN_ACCEPTED		0x00
+
+esp_mqtt_client_handle_t mqttsn_client_init(const esp_mqtt_client_config_t *config);
+esp_err_t mqttsn_client_register_event(esp_mqtt_client_handle_t client, int32_t event, esp_event_handler_t handler, void *handler_args);
+esp_err_t mqttsn_client_start(esp_mqtt_client_handle_t client);
+esp_err_t mqttsn_client_stop(esp_mqtt_client_handle_t client);
+int mqttsn_client_publish(esp_mqtt_client_handle_t client, const char *topic, const char *data, int len, int qos, int retain);
+// The list must stay valid, the filters are subscribed one at a time
+int mqttsn_client_subscribe_multiple(esp_mqtt_client_handle_t client, const esp_mqtt_topic_t *topic_list, int size);
+
+#if CONFIG_MQTT_TRANSPORT_OVER_SN
+#define	esp_mqtt_client_init		mqttsn_client_init
+#define	esp_mqtt_client_register_event	mqttsn_client_register_event
+#define	esp_mqtt_client_start		mqttsn_client_start
+#define	esp_mqtt_client_stop		mqttsn_client_stop
+#define	esp_mqtt_client_publish		mqttsn_client_publish
+#define	esp_mqtt_client_subscribe_multiple	mqttsn_client_subscribe_multiple
+#endif
+
+#endif /* MQTTSN_H_ */
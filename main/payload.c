@@ -0,0 +1,169 @@
+/*
+	This code is in the Public Domain (or CC0 licensed, at your option.)
+
+	Unless required by applicable law or agreed to in writing, this
+	software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+	CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <stdint.h>
+#include <string.h>
+#include "esp_err.h"
+
+#include "mqtt.h"
+#include "payload.h"
+#if CONFIG_ENVELOPE_ENABLE
+#include "envelope.h"
+#endif
+
+/*
+ * The encoders run in mqtt_pub_task for every published frame.
+ * They write into the buffer of the caller with table lookups only,
+ * printf would parse its format string again for every field.
+ */
+
+static const char hex_digit[16] = "0123456789ABCDEF";
+
+static char *put_text(char *buf, const char *text, int len)
+{
+	memcpy(buf, text, len);
+	return buf + len;
+}
+
+#define	PUT_TEXT(buf, text)	put_text(buf, text, sizeof(text) - 1)
+
+static char *put_hex(char *buf, const char *data, int len)
+{
+	for (int i=0;i<len;i++) {
+		uint8_t byte = data[i];
+		*buf++ = hex_digit[byte >> 4];
+		*buf++ = hex_digit[byte & 0x0F];
+	}
+	return buf;
+}
+
+static char *put_decimal(char *buf, uint64_t value)
+{
+	char digits[20];
+	int n = 0;
+	do {
+		digits[n++] = '0' + value % 10;
+		value /= 10;
+	} while (value != 0);
+	while (n > 0) *buf++ = digits[--n];
+	return buf;
+}
+
+static int encode_raw(const MQTT_t *mqttBuf, char *buf)
+{
+#if CONFIG_ENVELOPE_ENABLE
+	return envelope_pack((uint8_t *)buf, mqttBuf);
+#else
+	memcpy(buf, mqttBuf->data, mqttBuf->data_len);
+	return mqttBuf->data_len;
+#endif
+}
+
+static int encode_hex(const MQTT_t *mqttBuf, char *buf)
+{
+	return put_hex(buf, mqttBuf->data, mqttBuf->data_len) - buf;
+}
+
+static int encode_json(const MQTT_t *mqttBuf, char *buf)
+{
+	char *sp = buf;
+	sp = PUT_TEXT(sp, "{\"id\":");
+	sp = put_decimal(sp, mqttBuf->canid);
+	sp = PUT_TEXT(sp, ",\"dlc\":");
+	sp = put_decimal(sp, mqttBuf->data_len);
+	sp = PUT_TEXT(sp, ",\"data\":\"");
+	sp = put_hex(sp, mqttBuf->data, mqttBuf->data_len);
+	sp = PUT_TEXT(sp, "\",\"ts\":");
+	sp = put_decimal(sp, mqttBuf->timestamp);
+	*sp++ = '}';
+	return sp - buf;
+}
+
+// CBOR head (RFC 8949): major type and the shortest argument
+static char *put_cbor(char *buf, uint8_t major, uint64_t value)
+{
+	major <<= 5;
+	int bytes;
+	if (value < 24) {
+		*buf++ = major | value;
+		return buf;
+	} else if (value <= 0xFF) {
+		*buf++ = major | 24;
+		bytes = 1;
+	} else if (value <= 0xFFFF) {
+		*buf++ = major | 25;
+		bytes = 2;
+	} else if (value <= 0xFFFFFFFF) {
+		*buf++ = major | 26;
+		bytes = 4;
+	} else {
+		*buf++ = major | 27;
+		bytes = 8;
+	}
+	for (int i=bytes-1;i>=0;i--) *buf++ = value >> (i * 8);
+	return buf;
+}
+
+#define	CBOR_UINT	0
+#define	CBOR_BYTES	2
+#define	CBOR_MAP	5
+
+// Keys as text strings with their CBOR head (major type 3)
+#define	CBOR_KEY_ID	"\x62" "id"
+#define	CBOR_KEY_DLC	"\x63" "dlc"
+#define	CBOR_KEY_DATA	"\x64" "data"
+#define	CBOR_KEY_TS	"\x62" "ts"
+
+static int encode_cbor(const MQTT_t *mqttBuf, char *buf)
+{
+	char *sp = put_cbor(buf, CBOR_MAP, 4);
+	sp = PUT_TEXT(sp, CBOR_KEY_ID);
+	sp = put_cbor(sp, CBOR_UINT, mqttBuf->canid);
+	sp = PUT_TEXT(sp, CBOR_KEY_DLC);
+	sp = put_cbor(sp, CBOR_UINT, mqttBuf->data_len);
+	sp = PUT_TEXT(sp, CBOR_KEY_DATA);
+	sp = put_cbor(sp, CBOR_BYTES, mqttBuf->data_len);
+	sp = put_text(sp, mqttBuf->data, mqttBuf->data_len);
+	sp = PUT_TEXT(sp, CBOR_KEY_TS);
+	sp = put_cbor(sp, CBOR_UINT, mqttBuf->timestamp);
+	return sp - buf;
+}
+
+typedef struct {
+	const char *name;
+	int (*encode)(const MQTT_t *mqttBuf, char *buf);
+} PAYLOAD_ENCODER_t;
+
+static const PAYLOAD_ENCODER_t encoders[PAYLOAD_ENCODINGS] = {
+	[PAYLOAD_RAW] = { "raw", encode_raw },
+	[PAYLOAD_HEX] = { "hex", encode_hex },
+	[PAYLOAD_JSON] = { "json", encode_json },
+	[PAYLOAD_CBOR] = { "cbor", encode_cbor },
+};
+
+esp_err_t payload_parse(const char *name, uint8_t *encoding)
+{
+	for (int i=0;i<PAYLOAD_ENCODINGS;i++) {
+		if (strcmp(name, encoders[i].name) == 0) {
+			*encoding = i;
+			return ESP_OK;
+		}
+	}
+	return ESP_FAIL;
+}
+
+const char *payload_name(uint8_t encoding)
+{
+	if (encoding >= PAYLOAD_ENCODINGS) return "?";
+	return encoders[encoding].name;
+}
+
+int payload_encode(uint8_t encoding, const MQTT_t *mqttBuf, char *buf)
+{
+	return encoders[encoding].encode(mqttBuf, buf);
+}
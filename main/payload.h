@@ -0,0 +1,29 @@
+#ifndef PAYLOAD_H_
+#define PAYLOAD_H_
+
+#include <stdint.h>
+#include "esp_err.h"
+#include "mqtt.h"
+
+// Payload encoding of a can2mqtt.csv row
+typedef enum {
+	PAYLOAD_RAW = 0,	// data bytes, or the envelope when it is enabled
+	PAYLOAD_HEX,		// data as upper case hex digits
+	PAYLOAD_JSON,		// {"id":257,"dlc":8,"data":"0102..","ts":123}
+	PAYLOAD_CBOR,		// map with the keys of the JSON object, data as a byte string
+	PAYLOAD_ENCODINGS
+} payload_t;
+
+/*
+ * Longest payload of any encoding, a JSON record of a 64-byte CAN FD frame:
+ * {"id":4294967295,"dlc":64,"data":"<128 digits>","ts":<up to 20 digits>}
+ */
+#define	PAYLOAD_MAX_LEN		192
+
+esp_err_t payload_parse(const char *name, uint8_t *encoding);
+const char *payload_name(uint8_t encoding);
+
+// Returns the payload length, buf must hold PAYLOAD_MAX_LEN bytes. No heap and no printf.
+int payload_encode(uint8_t encoding, const MQTT_t *mqttBuf, char *buf);
+
+#endif /* PAYLOAD_H_ */
@@ -0,0 +1,116 @@
+/*
+	This code is in the Public Domain (or CC0 licensed, at your option.)
+
+	Unless required by applicable law or agreed to in writing, this
+	software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+	CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
+
+#include "profile.h"
+
+static const char *TAG = "PROFILE";
+
+#ifndef configRUN_TIME_COUNTER_TYPE
+#define configRUN_TIME_COUNTER_TYPE uint32_t
+#endif
+
+#define	PROFILE_MAX_TASKS	24
+
+// Sample taken by the last report, CPU usage is the difference to the one before
+static TaskStatus_t tasks[PROFILE_MAX_TASKS];
+static UBaseType_t ntasks;
+static configRUN_TIME_COUNTER_TYPE total_runtime;
+
+typedef struct {
+	TaskHandle_t handle;
+	configRUN_TIME_COUNTER_TYPE runtime;
+} PREVIOUS_t;
+static PREVIOUS_t previous[PROFILE_MAX_TASKS];
+static UBaseType_t nprevious;
+static configRUN_TIME_COUNTER_TYPE previous_total;
+
+typedef struct {
+	const char *name;
+	uint32_t caps;
+} HEAP_t;
+
+static const HEAP_t heaps[] = {
+	{"internal", MALLOC_CAP_INTERNAL},
+	{"dma", MALLOC_CAP_DMA},
+	{"psram", MALLOC_CAP_SPIRAM},
+};
+
+static void profile_sample(void)
+{
+	nprevious = 0;
+	for (int i=0;i<ntasks;i++) {
+		previous[nprevious].handle = tasks[i].xHandle;
+		previous[nprevious].runtime = tasks[i].ulRunTimeCounter;
+		nprevious++;
+	}
+	previous_total = total_runtime;
+	ntasks = uxTaskGetSystemState(tasks, PROFILE_MAX_TASKS, &total_runtime);
+	if (ntasks == 0) ESP_LOGW(TAG, "More than %d tasks", PROFILE_MAX_TASKS);
+}
+
+// Share of all cores since the previous sample, in 0.1%
+static uint32_t cpu_permille(TaskStatus_t *task)
+{
+	configRUN_TIME_COUNTER_TYPE runtime = task->ulRunTimeCounter;
+	for (int i=0;i<nprevious;i++) {
+		if (previous[i].handle == task->xHandle) {
+			runtime -= previous[i].runtime;
+			break;
+		}
+	}
+	uint64_t elapsed = (uint64_t)(configRUN_TIME_COUNTER_TYPE)(total_runtime - previous_total) * portNUM_PROCESSORS;
+	if (elapsed == 0) return 0;
+	return (uint64_t)runtime * 1000 / elapsed;
+}
+
+// Compact JSON, returns the length or -1 if buf is too small
+int profile_report(char *buf, size_t size)
+{
+	profile_sample();
+	int len = snprintf(buf, size, "{\"uptime\":%"PRId64",\"tasks\":[", esp_timer_get_time() / 1000000);
+	for (int i=0;i<ntasks && len<size;i++) {
+		uint32_t cpu = cpu_permille(&tasks[i]);
+		len += snprintf(&buf[len], size-len, "%s{\"name\":\"%s\",\"prio\":%u,\"cpu\":%"PRIu32".%"PRIu32",\"stack_free\":%u}",
+			i ? "," : "", tasks[i].pcTaskName, tasks[i].uxCurrentPriority, cpu / 10, cpu % 10,
+			(unsigned)(tasks[i].usStackHighWaterMark * sizeof(StackType_t)));
+	}
+	if (len < size) len += snprintf(&buf[len], size-len, "]");
+	for (int i=0;i<sizeof(heaps)/sizeof(heaps[0]) && len<size;i++) {
+		len += snprintf(&buf[len], size-len, ",\"%s\":{\"free\":%zu,\"min_free\":%zu,\"largest\":%zu}", heaps[i].name,
+			heap_caps_get_free_size(heaps[i].caps), heap_caps_get_minimum_free_size(heaps[i].caps),
+			heap_caps_get_largest_free_block(heaps[i].caps));
+	}
+	if (len < size) len += snprintf(&buf[len], size-len, "}");
+	if (len >= size) return -1;
+	return len;
+}
+
+// Print the sample taken by the last profile_report
+void profile_print(void)
+{
+	printf("%-16s %4s %6s %10s\n", "task", "prio", "cpu%", "stack_free");
+	for (int i=0;i<ntasks;i++) {
+		uint32_t cpu = cpu_permille(&tasks[i]);
+		printf("%-16s %4u %4"PRIu32".%"PRIu32" %10u\n", tasks[i].pcTaskName, tasks[i].uxCurrentPriority,
+			cpu / 10, cpu % 10, (unsigned)(tasks[i].usStackHighWaterMark * sizeof(StackType_t)));
+	}
+	for (int i=0;i<sizeof(heaps)/sizeof(heaps[0]);i++) {
+		printf("heap %-8s free=%zu min_free=%zu largest=%zu\n", heaps[i].name,
+			heap_caps_get_free_size(heaps[i].caps), heap_caps_get_minimum_free_size(heaps[i].caps),
+			heap_caps_get_largest_free_block(heaps[i].caps));
+	}
+}
@@ -0,0 +1,9 @@
+#ifndef PROFILE_H_
+#define PROFILE_H_
+
+#include <stddef.h>
+
+int profile_report(char *buf, size_t size);
+void profile_print(void);
+
+#endif /* PROFILE_H_ */
@@ -0,0 +1,233 @@
+/*
+	This code is in the Public Domain (or CC0 licensed, at your option.)
+
+	Unless required by applicable law or agreed to in writing, this
+	software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+	CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+
+#include "mqtt.h"
+#include "frame.h"
+#include "metrics.h"
+#include "route.h"
+#include "arena.h"
+
+static const char *TAG = "ROUTE";
+
+ROUTE_t *route;
+int16_t nroute;
+
+/*
+ * Byte map column
+ * * = copy the data unchanged
+ * 3;2;1;0 = output byte n is source byte map[n], - gives 0x00
+ */
+static esp_err_t parse_byte_map(char *ptr, ROUTE_t *entry)
+{
+	entry->nmap = 0;
+	if (strcmp(ptr, "*") == 0) return ESP_OK;
+	char *end = ptr;
+	while (*end) {
+		if (entry->nmap == CANFD_MAX_DATA_LEN) return ESP_FAIL;
+		char *start = end;
+		if (*start == '-') {
+			entry->map[entry->nmap] = ROUTE_MAP_ZERO;
+			end++;
+		} else {
+			long index = strtol(start, &end, 10);
+			if (end == start || index < 0 || index >= CANFD_MAX_DATA_LEN) return ESP_FAIL;
+			entry->map[entry->nmap] = index;
+		}
+		entry->nmap++;
+		if (*end == ';') {
+			end++;
+		} else if (*end != 0) {
+			return ESP_FAIL;
+		}
+	}
+	return (entry->nmap == 0) ? ESP_FAIL : ESP_OK;
+}
+
+esp_err_t build_route_table(ROUTE_t **routes, char *file, int16_t *nroute)
+{
+	ESP_LOGI(TAG, "build_route_table file=%s", file);
+	char line[256];
+	int _nroute = 0;
+
+	FILE* f = fopen(file, "r");
+	if (f == NULL) {
+		ESP_LOGE(TAG, "Failed to open file for reading");
+		return ESP_FAIL;
+	}
+	while (1){
+		if ( fgets(line, sizeof(line) ,f) == 0 ) break;
+		char* pos = strchr(line, '\n');
+		if (pos) *pos = '\0';
+		if (strlen(line) == 0) continue;
+		if (line[0] == '#') continue;
+		_nroute++;
+	}
+	fclose(f);
+	ESP_LOGI(TAG, "build_route_table _nroute=%d", _nroute);
+
+	*routes = arena_calloc(_nroute, sizeof(ROUTE_t));
+	if (*routes == NULL) {
+		ESP_LOGE(TAG, "Error allocating memory for route");
+		return ESP_ERR_NO_MEM;
+	}
+
+	f = fopen(file, "r");
+	if (f == NULL) {
+		ESP_LOGE(TAG, "Failed to open file for reading");
+		return ESP_FAIL;
+	}
+
+	char *ptr;
+	int index = 0;
+	while (1){
+		if ( fgets(line, sizeof(line) ,f) == 0 ) break;
+		char* pos = strchr(line, '\n');
+		if (pos) *pos = '\0';
+		ESP_LOGD(TAG, "line=[%s]", line);
+		if (strlen(line) == 0) continue;
+		if (line[0] == '#') continue;
+		ROUTE_t *entry = (*routes+index);
+		memset(entry, 0, sizeof(ROUTE_t));
+
+		// Received frame type and CAN ID
+		uint16_t brs;
+		ptr = strtok(line, ",");
+		if (can_parse_frame_type(ptr, &entry->src_extd, &entry->src_fdf, &brs) != ESP_OK) {
+			ESP_LOGE(TAG, "This line is invalid [%s]", line);
+			continue;
+		}
+		ptr = strtok(NULL, ",");
+		if (ptr == NULL) continue;
+		entry->src_id = strtol(ptr, NULL, 16);
+
+		// Transmitted frame type and CAN ID
+		ptr = strtok(NULL, ",");
+		if (ptr == NULL || can_parse_frame_type(ptr, &entry->dst_extd, &entry->dst_fdf, &entry->dst_brs) != ESP_OK) {
+			ESP_LOGE(TAG, "This line is invalid [%s]", line);
+			continue;
+		}
+		ptr = strtok(NULL, ",");
+		if (ptr == NULL) continue;
+		entry->dst_id = strtol(ptr, NULL, 16);
+		if (entry->src_id == 0 || entry->dst_id == 0) {
+			ESP_LOGE(TAG, "This line is invalid [%s]", line);
+			continue;
+		}
+
+		// Optional byte map, mirror flag and TX priority class
+		entry->mirror = true;
+		entry->priority = TX_PRIORITY_NORMAL;
+		ptr = strtok(NULL, ",");
+		if (ptr != NULL && parse_byte_map(ptr, entry) != ESP_OK) {
+			ESP_LOGE(TAG, "This line is invalid [%s]", line);
+			continue;
+		}
+		ptr = strtok(NULL, ",");
+		if (ptr != NULL) {
+			if (strcmp(ptr, "0") == 0) {
+				entry->mirror = false;
+			} else if (strcmp(ptr, "1") != 0) {
+				ESP_LOGE(TAG, "This line is invalid [%s]", line);
+				continue;
+			}
+		}
+		ptr = strtok(NULL, ",");
+		if (ptr != NULL) {
+			int priority = strtol(ptr, NULL, 10);
+			if (priority < 0 || priority >= TX_PRIORITY_CLASSES) {
+				ESP_LOGE(TAG, "This line is invalid [%s]", line);
+				continue;
+			}
+			entry->priority = priority;
+		}
+
+		// A classic frame can not carry more than 8 mapped bytes
+		if (entry->dst_fdf == 0 && entry->nmap > CAN_MAX_DATA_LEN) {
+			ESP_LOGE(TAG, "This line is invalid [%s]", line);
+			continue;
+		}
+		index++;
+	}
+	fclose(f);
+	*nroute = index;
+	return ESP_OK;
+}
+
+void dump_route_table(ROUTE_t *routes, int16_t nroute)
+{
+	for(int i=0;i<nroute;i++) {
+		ESP_LOGI(TAG, "route=[%d] extd=%d fdf=%d canid=0x%"PRIx32" -> extd=%d fdf=%d brs=%d canid=0x%"PRIx32" nmap=%d mirror=%d priority=%d",
+		i, (routes+i)->src_extd, (routes+i)->src_fdf, (routes+i)->src_id,
+		(routes+i)->dst_extd, (routes+i)->dst_fdf, (routes+i)->dst_brs, (routes+i)->dst_id,
+		(routes+i)->nmap, (routes+i)->mirror, (routes+i)->priority);
+	}
+}
+
+/*
+ * Called from the TWAI task for every received frame.
+ * Matching routes are queued for transmission without blocking.
+ * Returns false when a matching route does not mirror the frame to MQTT.
+ */
+bool route_rx_frame(uint32_t canid, int16_t extd, int16_t rtr, int16_t fdf, const char *data, int16_t data_len, int64_t timestamp)
+{
+	bool mirror = true;
+	for(int index=0;index<nroute;index++) {
+		ROUTE_t *entry = &route[index];
+		if (entry->src_id != canid) continue;
+		if (entry->src_extd != extd) continue;
+		if (entry->src_fdf != fdf) continue;
+		if (entry->mirror == false) mirror = false;
+
+		FRAME_t frame;
+		// The TX task measures the latency from the CAN receive
+		frame.timestamp = timestamp;
+		frame.canid = entry->dst_id;
+		frame.extd = entry->dst_extd;
+		frame.rtr = rtr;
+		frame.fdf = entry->dst_fdf;
+		frame.brs = entry->dst_brs;
+		frame.esi = 0;
+		frame.priority = entry->priority;
+		if (rtr) {
+			frame.data_len = 0;
+		} else if (entry->nmap == 0) {
+			frame.data_len = data_len;
+			memcpy(frame.data, data, data_len);
+		} else {
+			frame.data_len = entry->nmap;
+			for(int i=0;i<entry->nmap;i++) {
+				uint8_t from = entry->map[i];
+				frame.data[i] = (from < data_len) ? data[from] : 0;
+			}
+		}
+		if (frame.fdf == 0 && frame.data_len > CAN_MAX_DATA_LEN) {
+			ESP_LOGW(TAG, "route[%d] %d bytes do not fit a classic frame", index, frame.data_len);
+			entry->dropped++;
+			continue;
+		}
+		if (frame.fdf) {
+			int16_t len = canfd_valid_len(frame.data_len);
+			memset(&frame.data[frame.data_len], 0, len - frame.data_len);
+			frame.data_len = len;
+		}
+		if (twai_tx_send(&frame, 0) != pdPASS) {
+			entry->dropped++;
+			continue;
+		}
+		entry->routed++;
+		metrics_count(METRIC_ROUTED);
+	}
+	return mirror;
+}
@@ -0,0 +1,34 @@
+#ifndef ROUTE_H_
+#define ROUTE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "mqtt.h"
+
+// Local CAN to CAN routing, frames never leave the device
+typedef struct {
+	// Received frame
+	uint32_t src_id;
+	uint16_t src_extd;
+	uint16_t src_fdf;
+	// Transmitted frame
+	uint32_t dst_id;
+	uint16_t dst_extd;
+	uint16_t dst_fdf;
+	uint16_t dst_brs;
+	int16_t priority;	// TX priority class
+	bool mirror;		// publish the received frame according to can2mqtt.csv as well
+	int16_t nmap;		// 0 copies the data unchanged
+	uint8_t map[CANFD_MAX_DATA_LEN];	// source byte of each output byte, ROUTE_MAP_ZERO = 0x00
+	uint32_t routed;
+	uint32_t dropped;	// frames refused by the CAN TX queue
+} ROUTE_t;
+
+#define	ROUTE_MAP_ZERO	0xFF
+
+esp_err_t build_route_table(ROUTE_t **routes, char *file, int16_t *nroute);
+void dump_route_table(ROUTE_t *routes, int16_t nroute);
+bool route_rx_frame(uint32_t canid, int16_t extd, int16_t rtr, int16_t fdf, const char *data, int16_t data_len, int64_t timestamp);
+
+#endif /* ROUTE_H_ */
@@ -0,0 +1,208 @@
+/*
+	This code is in the Public Domain (or CC0 licensed, at your option.)
+
+	Unless required by applicable law or agreed to in writing, this
+	software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+	CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <string.h>
+#include "esp_err.h"
+#include "esp_log.h"
+
+#include "mqtt.h"
+#include "frame.h"
+#include "arena.h"
+#include "payload.h"
+
+static const char *TAG = "TABLE";
+
+/*
+ * CAN ID column of a wildcard row
+ * * = any CAN ID of the frame type
+ * 100-1FF;300 = allow-list of ranges and single IDs
+ */
+static esp_err_t parse_canid_ranges(char *ptr, TOPIC_t *topic)
+{
+	topic->canid = 0;
+	topic->nrange = 0;
+	topic->range = NULL;
+	if (strcmp(ptr, "*") == 0) return ESP_OK;
+
+	int16_t nrange = 1;
+	for (char *sp=ptr;*sp;sp++) {
+		if (*sp == ';') nrange++;
+	}
+	topic->range = arena_calloc(nrange, sizeof(CANID_RANGE_t));
+	if (topic->range == NULL) return ESP_ERR_NO_MEM;
+	char *end = ptr;
+	for (int i=0;i<nrange;i++) {
+		char *start = end;
+		topic->range[i].low = strtoul(start, &end, 16);
+		if (end == start) return ESP_FAIL;
+		topic->range[i].high = topic->range[i].low;
+		if (*end == '-') {
+			start = end + 1;
+			topic->range[i].high = strtoul(start, &end, 16);
+			if (end == start || topic->range[i].high < topic->range[i].low) return ESP_FAIL;
+		}
+		if (*end == ';') end++;
+	}
+	if (*end != 0) return ESP_FAIL;
+	topic->nrange = nrange;
+	return ESP_OK;
+}
+
+esp_err_t build_table(TOPIC_t **topics, char *file, int16_t *ntopic, bool allow_wildcard)
+{
+	ESP_LOGI(TAG, "build_table file=%s", file);
+	char line[128];
+	int _ntopic = 0;
+
+	FILE* f = fopen(file, "r");
+	if (f == NULL) {
+		ESP_LOGE(TAG, "Failed to open file for reading");
+		return ESP_FAIL;
+	}
+	while (1){
+		if ( fgets(line, sizeof(line) ,f) == 0 ) break;
+		// strip newline
+		char* pos = strchr(line, '\n');
+		if (pos) {
+			*pos = '\0';
+		}
+		ESP_LOGD(TAG, "line=[%s]", line);
+		if (strlen(line) == 0) continue;
+		if (line[0] == '#') continue;
+		_ntopic++;
+	}
+	fclose(f);
+	ESP_LOGI(TAG, "build_table _ntopic=%d", _ntopic);
+	
+	*topics = arena_calloc(_ntopic, sizeof(TOPIC_t));
+	if (*topics == NULL) {
+		ESP_LOGE(TAG, "Error allocating memory for topic");
+		return ESP_ERR_NO_MEM;
+	}
+
+	f = fopen(file, "r");
+	if (f == NULL) {
+		ESP_LOGE(TAG, "Failed to open file for reading");
+		return ESP_FAIL;
+	}
+
+	char *ptr;
+	int index = 0;
+	while (1){
+		if ( fgets(line, sizeof(line) ,f) == 0 ) break;
+		// strip newline
+		char* pos = strchr(line, '\n');
+		if (pos) {
+			*pos = '\0';
+		}
+		ESP_LOGD(TAG, "line=[%s]", line);
+		if (strlen(line) == 0) continue;
+		if (line[0] == '#') continue;
+
+		// Frame type
+		ptr = strtok(line, ",");
+		ESP_LOGD(TAG, "ptr=%s", ptr);
+		if (can_parse_frame_type(ptr, &(*topics+index)->frame, &(*topics+index)->fdf, &(*topics+index)->brs) != ESP_OK) {
+			ESP_LOGE(TAG, "This line is invalid [%s]", line);
+			continue;
+		}
+
+		// CAN ID
+		uint32_t canid;
+		ptr = strtok(NULL, ",");
+		if(ptr == NULL) continue;
+		ESP_LOGD(TAG, "ptr=%s", ptr);
+		bool wildcard = (strchr(ptr, '*') != NULL || strchr(ptr, '-') != NULL || strchr(ptr, ';') != NULL);
+		if (wildcard) {
+			if (allow_wildcard == false || parse_canid_ranges(ptr, (*topics+index)) != ESP_OK) {
+				ESP_LOGE(TAG, "This line is invalid [%s]", line);
+				continue;
+			}
+		} else {
+			canid = strtol(ptr, NULL, 16);
+			if (canid == 0) {
+				ESP_LOGE(TAG, "This line is invalid [%s]", line);
+				continue;
+			}
+			(*topics+index)->canid = canid;
+			(*topics+index)->nrange = 0;
+		}
+
+		// mqtt topic
+		char *sp;
+		ptr = strtok(NULL, ",");
+		if(ptr == NULL) {
+			ESP_LOGE(TAG, "This line is invalid [%s]", line);
+			continue;
+		}
+		ESP_LOGD(TAG, "ptr=[%s] strlen=%zu", ptr, strlen(ptr));
+		sp = strstr(ptr,"#");
+		if (sp != NULL) {
+			ESP_LOGE(TAG, "This line is invalid [%s]", line);
+			continue;
+		}
+		// A wildcard row needs exactly one + level, a plain row none
+		(*topics+index)->wildcard = -1;
+		sp = strstr(ptr,"+");
+		if (wildcard) {
+			if (sp == NULL || strchr(sp+1, '+') != NULL || (sp != ptr && sp[-1] != '/') || (sp[1] != '/' && sp[1] != 0)) {
+				ESP_LOGE(TAG, "This line is invalid [%s]", line);
+				continue;
+			}
+			(*topics+index)->wildcard = sp - ptr;
+		} else if (sp != NULL) {
+			ESP_LOGE(TAG, "This line is invalid [%s]", line);
+			continue;
+		}
+		(*topics+index)->topic = arena_strdup(ptr);
+		if ((*topics+index)->topic == NULL) {
+			fclose(f);
+			return ESP_ERR_NO_MEM;
+		}
+		(*topics+index)->topic_len = strlen(ptr);
+
+		// Optional TX priority class and payload encoding, in any order
+		(*topics+index)->priority = TX_PRIORITY_NORMAL;
+		(*topics+index)->encoding = PAYLOAD_RAW;
+		bool valid = true;
+		while ((ptr = strtok(NULL, ",")) != NULL) {
+			if (payload_parse(ptr, &(*topics+index)->encoding) == ESP_OK) continue;
+			char *end;
+			int priority = strtol(ptr, &end, 10);
+			if (end == ptr || *end != 0 || priority < 0 || priority >= TX_PRIORITY_CLASSES) {
+				valid = false;
+				break;
+			}
+			(*topics+index)->priority = priority;
+		}
+		if (valid == false) {
+			ESP_LOGE(TAG, "This line is invalid [%s]", line);
+			continue;
+		}
+		index++;
+	}
+	fclose(f);
+	*ntopic = index;
+	return ESP_OK;
+}
+
+void dump_table(TOPIC_t *topics, int16_t ntopic)
+{
+	for(int i=0;i<ntopic;i++) {
+		ESP_LOGI(TAG, "topics=[%d] frame=%d fdf=%d brs=%d canid=0x%"PRIx32" topic=[%s] topic_len=%d priority=%d encoding=%s",
+		i, (topics+i)->frame, (topics+i)->fdf, (topics+i)->brs, (topics+i)->canid, (topics+i)->topic, (topics+i)->topic_len, (topics+i)->priority,
+		payload_name((topics+i)->encoding));
+		for(int j=0;j<(topics+i)->nrange;j++) {
+			ESP_LOGI(TAG, "  allow 0x%"PRIx32"-0x%"PRIx32, (topics+i)->range[j].low, (topics+i)->range[j].high);
+		}
+	}
+}
@@ -0,0 +1,173 @@
+/*
+	This code is in the Public Domain (or CC0 licensed, at your option.)
+
+	Unless required by applicable law or agreed to in writing, this
+	software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+	CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <string.h>
+#include <sys/select.h>
+#include "esp_err.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_tls.h"
+#include "esp_transport.h"
+
+#include "tls_resume.h"
+#include "metrics.h"
+
+static const char *TAG = "TLS_RESUME";
+
+// The publisher with its standby and the subscriber
+#define	TLS_RESUME_CLIENTS	3
+
+typedef struct {
+	esp_tls_t *tls;
+	const char *cert;
+	esp_tls_client_session_t *session;	// of the last handshake, kept across reconnects
+	char host[64];		// broker the session belongs to
+	int port;
+	uint32_t full;
+	uint32_t resumed;
+} TLS_RESUME_t;
+
+static TLS_RESUME_t resume[TLS_RESUME_CLIENTS];
+static int16_t nresume;
+
+static void session_free(TLS_RESUME_t *ctx)
+{
+	if (ctx->session != NULL) esp_tls_free_client_session(ctx->session);
+	ctx->session = NULL;
+}
+
+static int tls_poll(TLS_RESUME_t *ctx, int timeout_ms, bool write)
+{
+	if (ctx->tls == NULL) return -1;
+	// Records already decrypted by mbedTLS are not seen by select
+	if (write == false && esp_tls_get_bytes_avail(ctx->tls) > 0) return 1;
+	int sock;
+	if (esp_tls_get_conn_sockfd(ctx->tls, &sock) != ESP_OK) return -1;
+	fd_set set;
+	fd_set errset;
+	FD_ZERO(&set);
+	FD_ZERO(&errset);
+	FD_SET(sock, &set);
+	FD_SET(sock, &errset);
+	struct timeval timeout = { .tv_sec = timeout_ms / 1000, .tv_usec = (timeout_ms % 1000) * 1000 };
+	int ret = select(sock + 1, write ? NULL : &set, write ? &set : NULL, &errset, (timeout_ms < 0) ? NULL : &timeout);
+	if (ret > 0 && FD_ISSET(sock, &errset)) return -1;
+	return ret;
+}
+
+static int tls_poll_read(esp_transport_handle_t t, int timeout_ms)
+{
+	return tls_poll(esp_transport_get_context_data(t), timeout_ms, false);
+}
+
+static int tls_poll_write(esp_transport_handle_t t, int timeout_ms)
+{
+	return tls_poll(esp_transport_get_context_data(t), timeout_ms, true);
+}
+
+static int tls_connect(esp_transport_handle_t t, const char *host, int port, int timeout_ms)
+{
+	TLS_RESUME_t *ctx = esp_transport_get_context_data(t);
+	// A session is only offered to the broker it came from
+	if (ctx->session != NULL && (ctx->port != port || strcmp(ctx->host, host) != 0)) session_free(ctx);
+
+	esp_tls_cfg_t cfg = {
+		.cacert_buf = (const unsigned char *)ctx->cert,
+		.cacert_bytes = strlen(ctx->cert) + 1,
+		.timeout_ms = timeout_ms,
+		.client_session = ctx->session,
+	};
+	ctx->tls = esp_tls_init();
+	if (ctx->tls == NULL) return -1;
+	bool resumed = (ctx->session != NULL);
+	int64_t start = esp_timer_get_time();
+	if (esp_tls_conn_new_sync(host, strlen(host), port, &cfg, ctx->tls) != 1) {
+		ESP_LOGE(TAG, "handshake with %s:%d Fail", host, port);
+		esp_tls_conn_destroy(ctx->tls);
+		ctx->tls = NULL;
+		// The next attempt is a full handshake, in case the broker has dropped the session
+		session_free(ctx);
+		return -1;
+	}
+	int64_t elapsed = esp_timer_get_time() - start;
+	metrics_latency(resumed ? HIST_TLS_RESUMED : HIST_TLS_FULL, elapsed);
+	if (resumed) {
+		ctx->resumed++;
+	} else {
+		ctx->full++;
+	}
+	ESP_LOGI(TAG, "%s handshake with %s:%d %"PRId64" ms (full=%"PRIu32" resumed=%"PRIu32")",
+		resumed ? "resumed" : "full", host, port, elapsed / 1000, ctx->full, ctx->resumed);
+
+	esp_tls_client_session_t *session = esp_tls_get_client_session(ctx->tls);
+	if (session != NULL) {
+		session_free(ctx);
+		ctx->session = session;
+		snprintf(ctx->host, sizeof(ctx->host), "%s", host);
+		ctx->port = port;
+	}
+	return 0;
+}
+
+static int tls_read(esp_transport_handle_t t, char *buffer, int len, int timeout_ms)
+{
+	TLS_RESUME_t *ctx = esp_transport_get_context_data(t);
+	int poll = tls_poll(ctx, timeout_ms, false);
+	if (poll <= 0) return poll;
+	int ret = esp_tls_conn_read(ctx->tls, buffer, len);
+	if (ret == ESP_TLS_ERR_SSL_WANT_READ || ret == ESP_TLS_ERR_SSL_WANT_WRITE) return ERR_TCP_TRANSPORT_CONNECTION_TIMEOUT;
+	if (ret == 0) return ERR_TCP_TRANSPORT_CONNECTION_CLOSED_BY_FIN;
+	if (ret < 0) ESP_LOGE(TAG, "esp_tls_conn_read Fail -0x%x", -ret);
+	return ret;
+}
+
+static int tls_write(esp_transport_handle_t t, const char *buffer, int len, int timeout_ms)
+{
+	TLS_RESUME_t *ctx = esp_transport_get_context_data(t);
+	int poll = tls_poll(ctx, timeout_ms, true);
+	if (poll <= 0) return poll;
+	int ret = esp_tls_conn_write(ctx->tls, buffer, len);
+	if (ret < 0) ESP_LOGE(TAG, "esp_tls_conn_write Fail -0x%x", -ret);
+	return ret;
+}
+
+// The session stays for the next connect
+static int tls_close(esp_transport_handle_t t)
+{
+	TLS_RESUME_t *ctx = esp_transport_get_context_data(t);
+	if (ctx->tls != NULL) esp_tls_conn_destroy(ctx->tls);
+	ctx->tls = NULL;
+	return 0;
+}
+
+static int tls_destroy(esp_transport_handle_t t)
+{
+	TLS_RESUME_t *ctx = esp_transport_get_context_data(t);
+	tls_close(t);
+	session_free(ctx);
+	return 0;
+}
+
+esp_transport_handle_t tls_resume_transport(const char *cert)
+{
+	if (nresume == TLS_RESUME_CLIENTS) {
+		ESP_LOGE(TAG, "Only %d clients are supported", TLS_RESUME_CLIENTS);
+		return NULL;
+	}
+	esp_transport_handle_t t = esp_transport_init();
+	if (t == NULL) return NULL;
+	TLS_RESUME_t *ctx = &resume[nresume++];
+	memset(ctx, 0, sizeof(TLS_RESUME_t));
+	ctx->cert = cert;
+	esp_transport_set_context_data(t, ctx);
+	esp_transport_set_func(t, tls_connect, tls_read, tls_write, tls_close, tls_poll_read, tls_poll_write, tls_destroy);
+	esp_transport_set_default_port(t, CONFIG_MQTT_PORT_SSL);
+	return t;
+}
@@ -0,0 +1,14 @@
+#ifndef TLS_RESUME_H_
+#define TLS_RESUME_H_
+
+#include "esp_transport.h"
+
+/*
+ * MQTTS transport for esp_mqtt that keeps the TLS session of the last
+ * handshake and offers it on the next connect, so a reconnect to the same
+ * broker is a resumed handshake (session ticket or session ID).
+ * Each MQTT client needs its own transport.
+ */
+esp_transport_handle_t tls_resume_transport(const char *cert);
+
+#endif /* TLS_RESUME_H_ */
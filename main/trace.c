@@ -0,0 +1,77 @@
+/*
+	This code is in the Public Domain (or CC0 licensed, at your option.)
+
+	Unless required by applicable law or agreed to in writing, this
+	software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+	CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include "esp_timer.h"
+
+#include "trace.h"
+
+_Static_assert((CONFIG_TRACE_ENTRIES & (CONFIG_TRACE_ENTRIES - 1)) == 0, "CONFIG_TRACE_ENTRIES must be a power of two");
+
+/*
+ * The header and the records are kept together,
+ * so a dump is published straight from the ring without a copy.
+ * Writers claim a slot with an atomic add and never wait.
+ */
+static struct {
+	TRACE_HEADER_t header;
+	TRACE_t records[CONFIG_TRACE_ENTRIES];
+} ring = {
+	.header = {
+		.magic = {'T', 'R', 'C', '1'},
+		.entries = CONFIG_TRACE_ENTRIES,
+		.record_size = sizeof(TRACE_t),
+	},
+};
+
+static volatile bool frozen = false;
+
+static const char *event_name[] = {
+	"", "CAN_RX", "MQTT_QUEUED", "PUBLISH", "PUBACK", "MQTT_RX",
+	"TWAI_QUEUED", "CAN_TX", "MQTT_DROPPED", "TWAI_DROPPED",
+};
+
+void trace_record(uint16_t event, uint32_t id, uint16_t len, uint32_t arg)
+{
+	if (frozen) return;
+	uint32_t head = __atomic_fetch_add(&ring.header.head, 1, __ATOMIC_RELAXED);
+	TRACE_t *record = &ring.records[head & (CONFIG_TRACE_ENTRIES - 1)];
+	record->timestamp = (uint32_t)esp_timer_get_time();
+	record->event = event;
+	record->len = len;
+	record->id = id;
+	record->arg = arg;
+}
+
+// Stop recording and return the ring, a record being written at this moment may be incomplete
+const void *trace_freeze(size_t *size)
+{
+	frozen = true;
+	*size = sizeof(ring);
+	return &ring;
+}
+
+void trace_resume(void)
+{
+	frozen = false;
+}
+
+// Print the frozen ring oldest first
+void trace_print(void)
+{
+	uint32_t head = ring.header.head;
+	uint32_t count = (head < CONFIG_TRACE_ENTRIES) ? head : CONFIG_TRACE_ENTRIES;
+	for (uint32_t i=head-count;i!=head;i++) {
+		TRACE_t *record = &ring.records[i & (CONFIG_TRACE_ENTRIES - 1)];
+		const char *name = (record->event < sizeof(event_name)/sizeof(event_name[0])) ? event_name[record->event] : "?";
+		printf("%10"PRIu32" %-12s id=0x%08"PRIx32" len=%-2d arg=%"PRId32"\n",
+			record->timestamp, name, record->id, record->len, (int32_t)record->arg);
+	}
+}
@@ -0,0 +1,46 @@
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Trace events, the meaning of id/len/arg is given for each event
+typedef enum {
+	TRACE_CAN_RX = 1,	// id=canid len=data_len arg=extd|rtr<<1|fdf<<2
+	TRACE_MQTT_QUEUED,	// id=canid len=data_len arg=can2mqtt index
+	TRACE_PUBLISH,		// id=msg_id len=data_len
+	TRACE_PUBACK,		// id=msg_id
+	TRACE_MQTT_RX,		// len=data_len arg=total_data_len
+	TRACE_TWAI_QUEUED,	// id=canid len=data_len arg=priority
+	TRACE_CAN_TX,		// id=canid len=data_len arg=esp_err_t
+	TRACE_MQTT_DROPPED,	// id=canid len=data_len
+	TRACE_TWAI_DROPPED,	// id=canid len=data_len arg=priority
+} trace_event_t;
+
+// One fixed-size record, no formatting is done when it is written
+typedef struct {
+	uint32_t timestamp;	// low 32 bits of esp_timer_get_time()
+	uint16_t event;
+	uint16_t len;
+	uint32_t id;
+	uint32_t arg;
+} TRACE_t;
+
+// Precedes the records in a dump
+typedef struct {
+	char magic[4];		// "TRC1"
+	uint16_t entries;	// ring size in records
+	uint16_t record_size;
+	uint32_t head;		// number of records written since boot
+} TRACE_HEADER_t;
+
+#if CONFIG_TRACE_ENABLE
+void trace_record(uint16_t event, uint32_t id, uint16_t len, uint32_t arg);
+const void *trace_freeze(size_t *size);
+void trace_resume(void);
+void trace_print(void);
+#else
+static inline void trace_record(uint16_t event, uint32_t id, uint16_t len, uint32_t arg) { }
+#endif
+
+#endif /* TRACE_H_ */
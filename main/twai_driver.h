@@ -0,0 +1,38 @@
+#ifndef TWAI_DRIVER_H_
+#define TWAI_DRIVER_H_
+
+#include <stdint.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_err.h"
+#include "mqtt.h"
+
+/*
+ * Driver interface under the bridging loop of twai_task.c.
+ * One backend is linked in, twai_driver_v5.c for the legacy driver of
+ * ESP-IDF V5 (also used by the host build on top of its simulated bus)
+ * and twai_driver_v6.c for the node API of ESP-IDF V6.
+ * Frames are moved in batches so locks, queues and waits are paid once
+ * per batch instead of once per frame.
+ */
+
+// Frames taken from the driver per receive call
+#define	TWAI_RX_BATCH	8
+// Frames handed to the driver per transmit call
+#define	TWAI_TX_BATCH	4
+
+esp_err_t twai_driver_start(void);
+void twai_driver_stop(void);
+
+// Waits up to xTicksToWait for the first frame, then takes what is already there.
+// Returns the number of frames stored, 0 on timeout.
+int twai_driver_receive_many(FRAME_t *frames, int max, TickType_t xTicksToWait);
+
+// Returns the number of frames the driver took, result holds the outcome of each.
+// Frames after the returned count were not taken because the bus is not running
+// or the driver queue stayed full, the caller offers them again.
+int twai_driver_transmit_many(FRAME_t *frames, int count, esp_err_t *result);
+
+// Follow the error state of the controller and recover from bus-off
+void twai_driver_poll(void);
+
+#endif /* TWAI_DRIVER_H_ */
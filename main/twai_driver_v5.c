@@ -0,0 +1,202 @@
+/*	TWAI Network Example
+
+	This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+	Unless required by applicable law or agreed to in writing, this
+	software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+	CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_err.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "driver/twai.h" // Update from V4.2
+
+#include "mqtt.h"
+#include "frame.h"
+#include "bus.h"
+#include "twai_driver.h"
+
+static const char *TAG = "TWAI_V5";
+
+static const twai_filter_config_t f_config = TWAI_FILTER_CONFIG_ACCEPT_ALL();
+
+#if CONFIG_CAN_BITRATE_25
+static const twai_timing_config_t t_config = TWAI_TIMING_CONFIG_25KBITS();
+#define BITRATE "Bitrate is 25 Kbit/s"
+#elif CONFIG_CAN_BITRATE_50
+static const twai_timing_config_t t_config = TWAI_TIMING_CONFIG_50KBITS();
+#define BITRATE "Bitrate is 50 Kbit/s"
+#elif CONFIG_CAN_BITRATE_100
+static const twai_timing_config_t t_config = TWAI_TIMING_CONFIG_100KBITS();
+#define BITRATE "Bitrate is 100 Kbit/s"
+#elif CONFIG_CAN_BITRATE_125
+static const twai_timing_config_t t_config = TWAI_TIMING_CONFIG_125KBITS();
+#define BITRATE "Bitrate is 125 Kbit/s"
+#elif CONFIG_CAN_BITRATE_250
+static const twai_timing_config_t t_config = TWAI_TIMING_CONFIG_250KBITS();
+#define BITRATE "Bitrate is 250 Kbit/s"
+#elif CONFIG_CAN_BITRATE_500
+static const twai_timing_config_t t_config = TWAI_TIMING_CONFIG_500KBITS();
+#define BITRATE "Bitrate is 500 Kbit/s"
+#elif CONFIG_CAN_BITRATE_800
+static const twai_timing_config_t t_config = TWAI_TIMING_CONFIG_800KBITS();
+#define BITRATE "Bitrate is 800 Kbit/s"
+#elif CONFIG_CAN_BITRATE_1000
+static const twai_timing_config_t t_config = TWAI_TIMING_CONFIG_1MBITS();
+#define BITRATE "Bitrate is 1 Mbit/s"
+#endif
+
+static const twai_general_config_t g_config =
+	TWAI_GENERAL_CONFIG_DEFAULT(CONFIG_CTX_GPIO, CONFIG_CRX_GPIO, TWAI_MODE_NORMAL);
+
+// Error state changes polled by twai_driver_poll
+#define BUS_ALERTS (TWAI_ALERT_ERR_ACTIVE | TWAI_ALERT_ABOVE_ERR_WARN | TWAI_ALERT_BELOW_ERR_WARN \
+	| TWAI_ALERT_ERR_PASS | TWAI_ALERT_BUS_OFF | TWAI_ALERT_BUS_RECOVERED)
+
+static esp_err_t twai_send_frame(FRAME_t *sendFrame)
+{
+	ESP_LOGD(TAG, "sendFrame.canid=[0x%"PRIx32"] sendFrame.extd=%d", sendFrame->canid, sendFrame->extd);
+	if (sendFrame->fdf) {
+		ESP_LOGW(TAG, "CAN FD frame is not supported by this driver");
+		return ESP_ERR_NOT_SUPPORTED;
+	}
+	twai_message_t tx_msg;
+	tx_msg.extd = sendFrame->extd;
+	tx_msg.rtr = sendFrame->rtr;
+	tx_msg.ss = 1;
+	tx_msg.self = 0;
+	tx_msg.dlc_non_comp = 0;
+	tx_msg.identifier = sendFrame->canid;
+	tx_msg.data_length_code = sendFrame->data_len;
+	for (int i=0;i<tx_msg.data_length_code;i++) {
+		tx_msg.data[i] = sendFrame->data[i];
+	}
+
+	// Wait for room in the driver queue during a burst
+	esp_err_t ret = twai_transmit(&tx_msg, pdMS_TO_TICKS(100));
+	if (ret == ESP_OK) {
+		ESP_LOGD(TAG, "twai_transmit success");
+	} else if (ret == ESP_ERR_TIMEOUT) {
+		ESP_LOGD(TAG, "twai_transmit queue full");
+	} else {
+		ESP_LOGE(TAG, "twai_transmit Fail %s", esp_err_to_name(ret));
+	}
+	return ret;
+}
+
+// Follow the error state of the controller and recover from bus-off
+void twai_driver_poll(void)
+{
+	uint32_t alerts;
+	if (twai_read_alerts(&alerts, 0) == ESP_OK) {
+		if (alerts & TWAI_ALERT_BUS_OFF) {
+			bus_set_state(BUS_OFF);
+		} else if (alerts & TWAI_ALERT_BUS_RECOVERED) {
+			// Recovery leaves the driver stopped
+			esp_err_t ret = twai_start();
+			if (ret == ESP_OK) {
+				bus_set_state(BUS_ERROR_ACTIVE);
+			} else {
+				ESP_LOGE(TAG, "twai_start Fail %s", esp_err_to_name(ret));
+				bus_set_state(BUS_OFF);
+			}
+		} else if (alerts & TWAI_ALERT_ERR_PASS) {
+			bus_set_state(BUS_ERROR_PASSIVE);
+		} else if (alerts & TWAI_ALERT_ABOVE_ERR_WARN) {
+			bus_set_state(BUS_ERROR_WARNING);
+		} else if (alerts & (TWAI_ALERT_ERR_ACTIVE | TWAI_ALERT_BELOW_ERR_WARN)) {
+			bus_set_state(BUS_ERROR_ACTIVE);
+		}
+	}
+	if (bus_recovery_due()) {
+		bus_set_state(BUS_RECOVERING);
+		twai_status_info_t status_info;
+		twai_get_status_info(&status_info);
+		// Stopped when an earlier recovery finished but twai_start failed
+		bool stopped = (status_info.state == TWAI_STATE_STOPPED);
+		esp_err_t ret = stopped ? twai_start() : twai_initiate_recovery();
+		if (ret != ESP_OK) {
+			ESP_LOGE(TAG, "recovery Fail %s", esp_err_to_name(ret));
+			bus_set_state(BUS_OFF);
+		} else if (stopped) {
+			bus_set_state(BUS_ERROR_ACTIVE);
+		}
+	}
+}
+
+esp_err_t twai_driver_start(void)
+{
+	esp_err_t ret = twai_driver_install(&g_config, &t_config, &f_config);
+	if (ret != ESP_OK) return ret;
+	ESP_LOGI(TAG, "Driver installed");
+	ret = twai_reconfigure_alerts(BUS_ALERTS, NULL);
+	if (ret != ESP_OK) return ret;
+	ret = twai_start();
+	if (ret != ESP_OK) return ret;
+	ESP_LOGI(TAG, "Driver started");
+	return ESP_OK;
+}
+
+void twai_driver_stop(void)
+{
+	ESP_ERROR_CHECK(twai_stop());
+	ESP_ERROR_CHECK(twai_driver_uninstall());
+}
+
+int twai_driver_receive_many(FRAME_t *frames, int max, TickType_t xTicksToWait)
+{
+	int received = 0;
+	while (received < max) {
+		twai_message_t rx_msg;
+		esp_err_t ret = twai_receive(&rx_msg, (received == 0) ? xTicksToWait : 0);
+		if (ret == ESP_ERR_TIMEOUT) break;
+		if (ret != ESP_OK) {
+			// The bus state is handled by twai_driver_poll, so keep receiving
+			ESP_LOGE(TAG, "twai_receive Fail %s", esp_err_to_name(ret));
+			if (received == 0) vTaskDelay(pdMS_TO_TICKS(10));
+			break;
+		}
+		FRAME_t *frame = &frames[received++];
+		// The legacy driver keeps no receive time, so stamp the frame as soon as it is handed over
+		frame->timestamp = esp_timer_get_time();
+		frame->canid = rx_msg.identifier;
+		frame->extd = rx_msg.extd;
+		frame->rtr = rx_msg.rtr;
+		// This driver only receives classic frames
+		frame->fdf = 0;
+		frame->brs = 0;
+		frame->esi = 0;
+		frame->priority = 0;
+		frame->data_len = rx_msg.rtr ? 0 : can_dlc_to_len(rx_msg.data_length_code, 0);
+		memcpy(frame->data, rx_msg.data, frame->data_len);
+	}
+	return received;
+}
+
+int twai_driver_transmit_many(FRAME_t *frames, int count, esp_err_t *result)
+{
+	// The state is checked once per batch, a bus-off in between fails twai_transmit
+	twai_status_info_t status_info;
+	twai_get_status_info(&status_info);
+	ESP_LOGD(TAG, "status_info.state=%d",status_info.state);
+	if (status_info.state != TWAI_STATE_RUNNING) {
+		ESP_LOGE(TAG, "TWAI driver not running %d", status_info.state);
+		return 0;
+	}
+	ESP_LOGD(TAG, "status_info.msgs_to_tx=%"PRIu32, status_info.msgs_to_tx);
+	ESP_LOGD(TAG, "status_info.msgs_to_rx=%"PRIu32, status_info.msgs_to_rx);
+
+	// The legacy driver takes one frame per call
+	for (int i=0;i<count;i++) {
+		result[i] = twai_send_frame(&frames[i]);
+		// Bus-off, or a queue that stayed full on a congested bus: the frame stays with the caller
+		if (result[i] == ESP_ERR_INVALID_STATE || result[i] == ESP_ERR_TIMEOUT) return i;
+	}
+	return count;
+}
@@ -0,0 +1,277 @@
+/*	TWAI Network Example
+
+	This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+	Unless required by applicable law or agreed to in writing, this
+	software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+	CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/message_buffer.h"
+#include "freertos/semphr.h"
+#include "esp_err.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_twai.h"
+#include "esp_twai_onchip.h"
+
+#include "mqtt.h"
+#include "frame.h"
+#include "bus.h"
+#include "twai_driver.h"
+
+#define TWAI_LISTENER_TX_GPIO	CONFIG_CTX_GPIO
+#define TWAI_LISTENER_RX_GPIO	CONFIG_CRX_GPIO
+#define TWAI_QUEUE_DEPTH		10
+// Longest wait for a free transmit slot while the bus is congested
+#define TWAI_TX_WAIT_MS			100
+
+static const char *TAG = "TWAI_V6";
+
+static twai_node_handle_t node_hdl;
+
+// Received frames, filled by twai_rx_done_callback
+static MessageBufferHandle_t xMessageBufferDevice;
+static uint8_t device_storage[TWAI_QUEUE_DEPTH * (sizeof(FRAME_t) + sizeof(size_t)) + 1];
+static StaticMessageBuffer_t device_buffer;
+
+/*
+ * The node keeps a pointer to each frame and its data until on_tx_done,
+ * so they live in static slots instead of the stack of the caller.
+ * A slot is only freed by twai_tx_done_callback, never by a timeout.
+ */
+typedef struct {
+	twai_frame_t frame;	// first, so done_tx_frame points to the slot
+	uint8_t data[CANFD_MAX_DATA_LEN];
+	volatile bool busy;
+} TX_SLOT_t;
+
+static TX_SLOT_t tx_slots[TWAI_QUEUE_DEPTH];
+static int16_t tx_next;
+// Counts the free slots
+static SemaphoreHandle_t xSemaphoreSlots;
+static StaticSemaphore_t slots_semaphore;
+
+// Error callback
+static bool IRAM_ATTR twai_on_error_callback(twai_node_handle_t handle, const twai_error_event_data_t *edata, void *user_ctx)
+{
+	ESP_EARLY_LOGW(TAG, "bus error: 0x%x", edata->err_flags.val);
+	return false;
+}
+
+// Latest node state, handed to the bus module by twai_driver_poll
+static volatile twai_error_state_t node_state = TWAI_ERROR_ACTIVE;
+static volatile bool node_state_changed = false;
+
+// Node state
+static bool IRAM_ATTR twai_on_state_change_callback(twai_node_handle_t handle, const twai_state_change_event_data_t *edata, void *user_ctx)
+{
+	const char *twai_state_name[] = {"error_active", "error_warning", "error_passive", "bus_off"};
+	ESP_EARLY_LOGI(TAG, "state changed: %s -> %s", twai_state_name[edata->old_sta], twai_state_name[edata->new_sta]);
+	node_state = edata->new_sta;
+	node_state_changed = true;
+	return false;
+}
+
+// Follow the error state of the node and recover from bus-off
+void twai_driver_poll(void)
+{
+	if (node_state_changed) {
+		node_state_changed = false;
+		// bus_state_t uses the same order as twai_error_state_t
+		bus_set_state((bus_state_t)node_state);
+	}
+	if (bus_recovery_due()) {
+		bus_set_state(BUS_RECOVERING);
+		// The node returns to error active by itself when the recovery is done
+		esp_err_t ret = twai_node_recover(node_hdl);
+		if (ret != ESP_OK) {
+			ESP_LOGE(TAG, "twai_node_recover Fail %s", esp_err_to_name(ret));
+			bus_set_state(BUS_OFF);
+		}
+	}
+}
+
+// TWAI receive callback - store data and signal
+// The frame data is copied into the message buffer, so no buffer outlives the ISR
+static bool IRAM_ATTR twai_rx_done_callback(twai_node_handle_t handle, const twai_rx_done_event_data_t *edata, void *user_ctx)
+{
+	MessageBufferHandle_t xMessageBufferDevice = (MessageBufferHandle_t)user_ctx;
+
+	uint8_t recv_buff[CANFD_MAX_DATA_LEN];
+	twai_frame_t rx_frame = {
+		.buffer = recv_buff,
+		.buffer_len = sizeof(recv_buff),
+	};
+	if (twai_node_receive_from_isr(handle, &rx_frame) != ESP_OK) return false;
+
+	FRAME_t frame;
+	frame.timestamp = esp_timer_get_time();
+	frame.canid = rx_frame.header.id;
+	frame.extd = rx_frame.header.ide;
+	frame.rtr = rx_frame.header.rtr;
+	frame.fdf = rx_frame.header.fdf;
+	frame.brs = rx_frame.header.brs;
+	frame.esi = rx_frame.header.esi;
+	frame.priority = 0;
+	frame.data_len = 0;
+	if (frame.rtr == 0) frame.data_len = can_dlc_to_len(rx_frame.header.dlc, frame.fdf);
+	memcpy(frame.data, recv_buff, frame.data_len);
+
+	BaseType_t xHigherPriorityTaskWoken = pdFALSE;
+	size_t ret = xMessageBufferSendFromISR(xMessageBufferDevice, &frame, FRAME_SIZE(&frame), &xHigherPriorityTaskWoken);
+	ESP_EARLY_LOGD(TAG, "xMessageBufferSendFromISR ret=%zu", ret);
+	return (xHigherPriorityTaskWoken == pdTRUE);
+}
+
+// Transmission completion callback
+static IRAM_ATTR bool twai_tx_done_callback(twai_node_handle_t handle, const twai_tx_done_event_data_t *edata, void *user_ctx)
+{
+	if (!edata->is_tx_success) {
+		ESP_EARLY_LOGW(TAG, "Failed to transmit message, ID: 0x%X", edata->done_tx_frame->header.id);
+	}
+	TX_SLOT_t *slot = (TX_SLOT_t *)edata->done_tx_frame;
+	slot->busy = false;
+	BaseType_t xHigherPriorityTaskWoken = pdFALSE;
+	xSemaphoreGiveFromISR(xSemaphoreSlots, &xHigherPriorityTaskWoken);
+	return (xHigherPriorityTaskWoken == pdTRUE);
+}
+
+// Takes a free slot, NULL when the node still holds all of them after the wait
+static TX_SLOT_t *slot_take(TickType_t xTicksToWait)
+{
+	if (xSemaphoreTake(xSemaphoreSlots, xTicksToWait) != pdTRUE) return NULL;
+	for (int i=0;i<TWAI_QUEUE_DEPTH;i++) {
+		TX_SLOT_t *slot = &tx_slots[tx_next];
+		tx_next = (tx_next + 1) % TWAI_QUEUE_DEPTH;
+		if (slot->busy) continue;
+		slot->busy = true;
+		return slot;
+	}
+	// Not reached, the semaphore counts the free slots
+	xSemaphoreGive(xSemaphoreSlots);
+	return NULL;
+}
+
+static void slot_give(TX_SLOT_t *slot)
+{
+	slot->busy = false;
+	xSemaphoreGive(xSemaphoreSlots);
+}
+
+esp_err_t twai_driver_start(void)
+{
+	// Create message buffer for received frames
+	xMessageBufferDevice = xMessageBufferCreateStatic(sizeof(device_storage) - 1, device_storage, &device_buffer);
+	configASSERT(xMessageBufferDevice);
+	ESP_LOGD(TAG, "xMessageBufferDevice=%p", xMessageBufferDevice);
+	xSemaphoreSlots = xSemaphoreCreateCountingStatic(TWAI_QUEUE_DEPTH, TWAI_QUEUE_DEPTH, &slots_semaphore);
+	configASSERT(xSemaphoreSlots);
+
+	// Configure TWAI node
+	twai_onchip_node_config_t node_config = {
+		.io_cfg = {
+			.tx = TWAI_LISTENER_TX_GPIO,
+			.rx = TWAI_LISTENER_RX_GPIO,
+			.quanta_clk_out = -1,
+			.bus_off_indicator = -1,
+		},
+		.bit_timing.bitrate = CONFIG_TWAI_BITRATE,
+#if CONFIG_CAN_FD_ENABLE
+		.data_timing.bitrate = CONFIG_CAN_FD_DATA_BITRATE,
+#endif
+		.fail_retry_cnt = 3,
+		.tx_queue_depth = TWAI_QUEUE_DEPTH,
+	};
+
+	// Create TWAI node
+	esp_err_t ret = twai_new_node_onchip(&node_config, &node_hdl);
+	if (ret != ESP_OK) return ret;
+	ESP_LOGI(TAG, "TWAI node created");
+
+	// Register callbacks
+	twai_event_callbacks_t callbacks = {
+		.on_rx_done = twai_rx_done_callback,
+		.on_error = twai_on_error_callback,
+		.on_state_change = twai_on_state_change_callback,
+		.on_tx_done = twai_tx_done_callback,
+	};
+	ret = twai_node_register_event_callbacks(node_hdl, &callbacks, xMessageBufferDevice);
+	if (ret != ESP_OK) return ret;
+
+	// Enable TWAI node
+	ret = twai_node_enable(node_hdl);
+	if (ret != ESP_OK) return ret;
+	ESP_LOGI(TAG, "TWAI started successfully");
+	return ESP_OK;
+}
+
+void twai_driver_stop(void)
+{
+	ESP_ERROR_CHECK(twai_node_disable(node_hdl));
+	ESP_ERROR_CHECK(twai_node_delete(node_hdl));
+}
+
+int twai_driver_receive_many(FRAME_t *frames, int max, TickType_t xTicksToWait)
+{
+	int received = 0;
+	while (received < max) {
+		// Time stamped in the receive callback
+		size_t length = xMessageBufferReceive(xMessageBufferDevice, &frames[received], sizeof(FRAME_t), (received == 0) ? xTicksToWait : 0);
+		if (length == 0) break;
+		received++;
+	}
+	return received;
+}
+
+int twai_driver_transmit_many(FRAME_t *frames, int count, esp_err_t *result)
+{
+	twai_node_status_t status_ret;
+	twai_node_record_t statistics_ret;
+	esp_err_t ret = twai_node_get_info(node_hdl, &status_ret, &statistics_ret);
+	ESP_LOGD(TAG, "twai_node_get_info ret=%d", ret);
+	if (ret != ESP_OK) {
+		ESP_LOGE(TAG, "twai_node_get_info Fail %s", esp_err_to_name(ret));
+		for (int i=0;i<count;i++) result[i] = ret;
+		return count;
+	}
+	ESP_LOGD(TAG, "status_ret.state=%d", status_ret.state);
+
+	// Frames are only queued here, twai_tx_done_callback reports the outcome on the bus
+	int taken = 0;
+	for (int i=0;i<count;i++) {
+		FRAME_t *sendFrame = &frames[i];
+		ESP_LOGD(TAG, "sendFrame.canid=[0x%"PRIx32"] sendFrame.extd=%d", sendFrame->canid, sendFrame->extd);
+		// The node holds every slot while the bus is congested, the rest of the batch stays with the caller
+		TX_SLOT_t *slot = slot_take((i == 0) ? pdMS_TO_TICKS(TWAI_TX_WAIT_MS) : 0);
+		if (slot == NULL) break;
+		twai_frame_t *tx_frame = &slot->frame;
+		memset(tx_frame, 0, sizeof(twai_frame_t));
+		tx_frame->header.id = sendFrame->canid;
+		tx_frame->header.ide = sendFrame->extd;
+		tx_frame->header.rtr = sendFrame->rtr;
+		tx_frame->header.fdf = sendFrame->fdf;
+		tx_frame->header.brs = sendFrame->brs;
+		tx_frame->header.dlc = sendFrame->fdf ? can_len_to_dlc(sendFrame->data_len) : sendFrame->data_len;
+		memcpy(slot->data, sendFrame->data, sendFrame->data_len);
+		tx_frame->buffer = slot->data;
+		tx_frame->buffer_len = sendFrame->data_len;
+
+		// Timeout = 0: the slot guarantees room in the queue of the node
+		result[i] = twai_node_transmit(node_hdl, tx_frame, 0);
+		ESP_LOGD(TAG, "twai_node_transmit ret=%d", result[i]);
+		if (result[i] != ESP_OK) slot_give(slot);
+		// Bus-off, the rest of the batch stays with the caller
+		if (result[i] == ESP_ERR_INVALID_STATE) break;
+		taken++;
+		if (result[i] != ESP_OK) {
+			ESP_LOGE(TAG, "twai_node_transmit Fail %s", esp_err_to_name(result[i]));
+		}
+	}
+	return taken;
+}
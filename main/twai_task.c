@@ -0,0 +1,232 @@
+/*	TWAI Network Example
+
+	This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+	Unless required by applicable law or agreed to in writing, this
+	software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+	CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_err.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "mqtt.h"
+#include "frame.h"
+#include "metrics.h"
+#include "trace.h"
+#include "envelope.h"
+#include "bus.h"
+#include "twai_driver.h"
+#if CONFIG_ISOTP_ENABLE
+#include "isotp.h"
+#endif
+#if CONFIG_ROUTE_ENABLE
+#include "route.h"
+#endif
+#if CONFIG_AGGREGATE_ENABLE
+#include "aggregate.h"
+#endif
+
+static const char *TAG = "TWAI";
+
+extern TOPIC_t *publish;
+extern int16_t npublish;
+
+void dump_table(TOPIC_t *topics, int16_t ntopic);
+
+// Cleared by either task to stop the driver
+static volatile bool running = true;
+
+static StackType_t twai_tx_stack[1024*3];
+static StaticTask_t twai_tx_tcb;
+
+// Only used by twai_task, kept off its stack
+static FRAME_t rx_frames[TWAI_RX_BATCH];
+static MQTT_t records[TWAI_RX_BATCH];
+static int16_t record_index[TWAI_RX_BATCH];	// publish row of each record
+static int nrecord;
+
+// Format and print the twai message
+void twai_print_frame(FRAME_t frame) {
+	if (frame.extd == 0) {
+		printf("Standard ID: 0x%03"PRIx32"%*s", frame.canid, 5, "");
+	} else {
+		printf("Extended ID: 0x%08"PRIx32, frame.canid);
+	}
+	if (frame.fdf) {
+		printf("  FD%s%s", frame.brs ? " BRS" : "", frame.esi ? " ESI" : "");
+	}
+	printf("  DLC: %d Data: ", frame.data_len);
+
+	if (frame.rtr == 0) {
+		for (int i = 0; i < frame.data_len; i++) {
+			printf("0x%02x ", frame.data[i]);
+		}
+	} else {
+		printf("REMOTE REQUEST FRAME");
+	}
+	printf("\n");
+}
+
+// Hand the records of a batch to mqtt_pub_task under one lock
+static void flush_records(void)
+{
+	if (nrecord == 0) return;
+	int sent = mqtt_tx_send_many(records, nrecord, portMAX_DELAY);
+	for (int i=0;i<nrecord;i++) {
+		if (i < sent) {
+			trace_record(TRACE_MQTT_QUEUED, records[i].canid, records[i].data_len, record_index[i]);
+		} else {
+			trace_record(TRACE_MQTT_DROPPED, records[i].canid, records[i].data_len, 0);
+		}
+	}
+	if (sent != nrecord) {
+		ESP_LOGE(TAG, "mqtt_tx_send_many Fail %d of %d", sent, nrecord);
+		running = false;
+	}
+	nrecord = 0;
+}
+
+static void publish_frame(FRAME_t *frame, uint32_t *sequence)
+{
+	for(int index=0;index<npublish;index++) {
+		if (publish[index].frame != frame->extd) continue;
+		if (publish[index].fdf != frame->fdf) continue;
+		if (publish[index].canid != frame->canid) continue;
+		metrics_count(METRIC_MATCHED);
+		ESP_LOGD(TAG, "publish[%d] frame=%d canid=0x%"PRIx32" topic=[%s] topic_len=%d",
+		index, publish[index].frame, publish[index].canid, publish[index].topic, publish[index].topic_len);
+		if (nrecord == TWAI_RX_BATCH) flush_records();
+		record_index[nrecord] = index;
+		MQTT_t *mqttBuf = &records[nrecord++];
+		mqttBuf->topic_type = PUBLISH;
+		// Time stamped by the driver backend
+		mqttBuf->timestamp = frame->timestamp;
+		mqttBuf->canid = frame->canid;
+		mqttBuf->flags = (frame->extd ? ENVELOPE_FLAG_EXTD : 0) | (frame->rtr ? ENVELOPE_FLAG_RTR : 0)
+			| (frame->fdf ? ENVELOPE_FLAG_FDF : 0) | (frame->brs ? ENVELOPE_FLAG_BRS : 0) | (frame->esi ? ENVELOPE_FLAG_ESI : 0);
+		mqttBuf->encoding = publish[index].encoding;
+		mqttBuf->topic_len = publish[index].topic_len;
+		memcpy(mqttBuf->topic, publish[index].topic, mqttBuf->topic_len);
+		mqttBuf->topic[mqttBuf->topic_len] = 0;
+		mqttBuf->data_len = frame->data_len;
+		memset(mqttBuf->data, 0, sizeof(mqttBuf->data));
+		memcpy(mqttBuf->data, frame->data, mqttBuf->data_len);
+		ESP_LOG_BUFFER_HEX_LEVEL(TAG, mqttBuf->data, mqttBuf->data_len, ESP_LOG_DEBUG);
+		// Lets subscribers using the envelope detect lost frames
+		mqttBuf->sequence = (*sequence)++;
+	}
+}
+
+// Transmit runs in its own task, so a queued frame goes out without waiting for the receive timeout
+static void twai_tx_task(void *pvParameters)
+{
+	FRAME_t frames[TWAI_TX_BATCH];
+	esp_err_t result[TWAI_TX_BATCH];
+	// Frames taken from the queue but not sent yet because the bus went down
+	int first = 0;
+	int count = 0;
+	TickType_t last_dump = xTaskGetTickCount();
+	while (running) {
+		if (xTaskGetTickCount() - last_dump >= pdMS_TO_TICKS(10000)) {
+			twai_tx_dump_stats();
+			last_dump = xTaskGetTickCount();
+		}
+		// Frames stay queued while the bus recovers
+		if (bus_available() == false) {
+			vTaskDelay(pdMS_TO_TICKS(10));
+			continue;
+		}
+		if (first == count) {
+			first = count = 0;
+			if (twai_tx_receive(&frames[0], pdMS_TO_TICKS(1000)) != pdPASS) continue;
+			count = 1;
+			// Take what is already queued, bulk_task paces its frames before they get here
+			while (count < TWAI_TX_BATCH) {
+				if (twai_tx_receive(&frames[count], 0) != pdPASS) break;
+				count++;
+			}
+		}
+		int taken = twai_driver_transmit_many(&frames[first], count - first, &result[first]);
+		for (int i=first;i<first+taken;i++) {
+			trace_record(TRACE_CAN_TX, frames[i].canid, frames[i].data_len, result[i]);
+			if (result[i] == ESP_OK) {
+				metrics_count(METRIC_CAN_TX);
+				metrics_latency(HIST_TO_CAN_TX, esp_timer_get_time() - frames[i].timestamp);
+			} else {
+				metrics_count(METRIC_CAN_TX_FAILED);
+			}
+		}
+		first += taken;
+		if (taken == 0) {
+			// The driver is not running or its queue is full, the frames are offered again
+			vTaskDelay(pdMS_TO_TICKS(10));
+		}
+	}
+	// twai_task stops the driver and deletes this task
+	while(1) { vTaskDelay(portMAX_DELAY); }
+}
+
+void twai_task(void *pvParameters)
+{
+	ESP_LOGI(TAG, "Start");
+	ESP_LOGI(TAG, "TWAI_BITRATE=%d",CONFIG_TWAI_BITRATE);
+	ESP_LOGI(TAG, "CTX_GPIO=%d",CONFIG_CTX_GPIO);
+	ESP_LOGI(TAG, "CRX_GPIO=%d",CONFIG_CRX_GPIO);
+
+	ESP_ERROR_CHECK(twai_driver_start());
+
+	dump_table(publish, npublish);
+
+	TaskHandle_t tx_task = xTaskCreateStatic(twai_tx_task, "twai_tx", sizeof(twai_tx_stack), NULL, 3, twai_tx_stack, &twai_tx_tcb);
+
+	uint32_t sequence = 0;
+	while (running) {
+		twai_driver_poll();
+#if CONFIG_AGGREGATE_ENABLE
+		aggregate_poll();
+#endif
+		int received = twai_driver_receive_many(rx_frames, TWAI_RX_BATCH, pdMS_TO_TICKS(10));
+		if (received == 0) continue;
+		metrics_add(METRIC_CAN_RX, received);
+		for (int n=0;n<received;n++) {
+			FRAME_t *frame = &rx_frames[n];
+			trace_record(TRACE_CAN_RX, frame->canid, frame->data_len, frame->extd | frame->rtr << 1 | frame->fdf << 2);
+			ESP_LOGD(TAG, "twai_receive canid=0x%"PRIx32" data_len=%d extd=%x rtr=%x fdf=%x",
+				frame->canid, frame->data_len, frame->extd, frame->rtr, frame->fdf);
+
+#if CONFIG_ENABLE_PRINT
+			twai_print_frame(*frame);
+#endif
+
+#if CONFIG_ISOTP_ENABLE
+			// Frames of an ISO-TP session go to the ISO-TP task as well
+			isotp_rx_frame(frame->canid, frame->extd, frame->data, frame->data_len);
+#endif
+
+#if CONFIG_AGGREGATE_ENABLE
+			// Summaries are published by aggregate_poll when the window ends
+			if (frame->rtr == 0) aggregate_rx_frame(frame->canid, frame->extd, frame->fdf, frame->data, frame->data_len);
+#endif
+
+#if CONFIG_ROUTE_ENABLE
+			// Routed frames skip MQTT unless the route mirrors them
+			if (route_rx_frame(frame->canid, frame->extd, frame->rtr, frame->fdf, frame->data, frame->data_len, frame->timestamp) == false) continue;
+#endif
+
+			publish_frame(frame, &sequence);
+		}
+		flush_records();
+	} // end while
+
+	// twai_tx_task may be waiting for a frame
+	vTaskDelete(tx_task);
+	twai_driver_stop();
+	vTaskDelete(NULL);
+}
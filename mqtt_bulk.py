@@ -0,0 +1,69 @@
+#!/usr/bin/env python
+# -*- coding: utf-8 -*-
+#
+# python3 -m pip install -U paho-mqtt
+# python3 -m pip install -U argparse
+#
+# Send many CAN frames in one MQTT message using the bulk topic.
+# Each frame is given as ID#DATA (candump style), for example:
+# python3 mqtt_bulk.py 201#0102 12345678#11223344 --delay 500
+
+import argparse
+import struct
+import random
+import paho.mqtt.client as mqtt
+
+FLAG_EXTD = 0x01
+FLAG_RTR = 0x02
+FLAG_FDF = 0x04
+FLAG_BRS = 0x08
+FLAG_DELAY = 0x80
+
+FD_LENGTH = [0, 1, 2, 3, 4, 5, 6, 7, 8, 12, 16, 20, 24, 32, 48, 64]
+
+def pack_record(canid, data, extd=False, fd=False, brs=False, delay=0):
+	# A classic frame carries 8 bytes, the bridge drops a message with a larger DLC
+	if not fd and len(data) > 8:
+		raise ValueError('0x{:x}: {} data bytes need --fd'.format(canid, len(data)))
+	flags = 0
+	if extd: flags |= FLAG_EXTD
+	if fd: flags |= FLAG_FDF
+	if brs: flags |= FLAG_BRS
+	if delay: flags |= FLAG_DELAY
+	dlc = [i for i, n in enumerate(FD_LENGTH) if n >= len(data)][0]
+	data = data + bytes(FD_LENGTH[dlc] - len(data))
+	record = struct.pack('>IBB', canid, flags, dlc) + data
+	if delay: record += struct.pack('>H', delay)
+	return record
+
+def parse_frame(text):
+	canid, data = text.split('#')
+	return int(canid, 16), bytes.fromhex(data), len(canid) > 3
+
+if __name__=='__main__':
+	parser = argparse.ArgumentParser()
+	parser.add_argument('frames', nargs='+', help='CAN frames as ID#DATA')
+	parser.add_argument('--host', help='mqtt broker', default='broker.emqx.io')
+	parser.add_argument('--port', type=int, help='mqtt port', default=1883)
+	parser.add_argument('--topic', help='mqtt bulk topic', default='/can/bulk')
+	parser.add_argument('--delay', type=int, help='inter-frame delay in microseconds', default=0)
+	parser.add_argument('--fd', action='store_true', help='send CAN FD frames')
+	parser.add_argument('--brs', action='store_true', help='use bit rate switch')
+	args = parser.parse_args()
+
+	payload = b''
+	for text in args.frames:
+		canid, data, extd = parse_frame(text)
+		try:
+			payload += pack_record(canid, data, extd, args.fd, args.brs, args.delay)
+		except ValueError as e:
+			parser.error(e)
+	print("frames={} bytes={}".format(len(args.frames), len(payload)))
+
+	client_id = f'python-mqtt-{random.randint(0, 1000)}'
+	client = mqtt.Client(mqtt.CallbackAPIVersion.VERSION2, client_id)
+	client.connect(args.host, port=args.port, keepalive=60)
+	client.loop_start()
+	client.publish(args.topic, payload, qos=1).wait_for_publish()
+	client.loop_stop()
+	client.disconnect()
@@ -0,0 +1,63 @@
+#!/usr/bin/env python
+# -*- coding: utf-8 -*-
+#
+# python3 -m pip install -U paho-mqtt
+# python3 -m pip install -U argparse
+#
+# Register, update or cancel a cyclic CAN frame.
+# python3 mqtt_cyclic.py set 123#0011223344556677 --period 10 --counter 0 --checksum 7
+# python3 mqtt_cyclic.py cancel 123
+# python3 mqtt_cyclic.py cancel-all
+
+import argparse
+import struct
+import random
+import paho.mqtt.client as mqtt
+
+CMD_SET = 0x01
+CMD_CANCEL = 0x02
+CMD_CANCEL_ALL = 0x03
+NONE = 0xFF
+
+FLAG_EXTD = 0x01
+FLAG_FDF = 0x04
+FLAG_BRS = 0x08
+
+FD_LENGTH = [0, 1, 2, 3, 4, 5, 6, 7, 8, 12, 16, 20, 24, 32, 48, 64]
+
+if __name__=='__main__':
+	parser = argparse.ArgumentParser()
+	parser.add_argument('command', choices=['set', 'cancel', 'cancel-all'])
+	parser.add_argument('frame', nargs='?', help='ID#DATA for set, ID for cancel')
+	parser.add_argument('--host', help='mqtt broker', default='broker.emqx.io')
+	parser.add_argument('--port', type=int, help='mqtt port', default=1883)
+	parser.add_argument('--topic', help='mqtt cyclic topic', default='/can/cyclic')
+	parser.add_argument('--period', type=int, help='period in milliseconds', default=100)
+	parser.add_argument('--counter', type=int, help='counter byte position', default=NONE)
+	parser.add_argument('--checksum', type=int, help='checksum byte position', default=NONE)
+	parser.add_argument('--fd', action='store_true', help='send CAN FD frames')
+	parser.add_argument('--brs', action='store_true', help='use bit rate switch')
+	args = parser.parse_args()
+
+	if args.command == 'cancel-all':
+		payload = struct.pack('>B', CMD_CANCEL_ALL)
+	else:
+		canid, _, data = args.frame.partition('#')
+		flags = FLAG_EXTD if len(canid) > 3 else 0
+		if args.fd: flags |= FLAG_FDF
+		if args.brs: flags |= FLAG_BRS
+		if args.command == 'cancel':
+			payload = struct.pack('>BIB', CMD_CANCEL, int(canid, 16), flags)
+		else:
+			data = bytes.fromhex(data)
+			dlc = [i for i, n in enumerate(FD_LENGTH) if n >= len(data)][0]
+			data = data + bytes(FD_LENGTH[dlc] - len(data))
+			payload = struct.pack('>BIBHBBB', CMD_SET, int(canid, 16), flags, args.period, args.counter, args.checksum, dlc) + data
+
+	client_id = f'python-mqtt-{random.randint(0, 1000)}'
+	client = mqtt.Client(mqtt.CallbackAPIVersion.VERSION2, client_id)
+	client.connect(args.host, port=args.port, keepalive=60)
+	client.loop_start()
+	client.publish(args.topic, payload, qos=1).wait_for_publish()
+	client.loop_stop()
+	client.disconnect()
@@ -5,22 +5,42 @@
 # python3 -m pip install -U argparse
 
 import argparse
+import struct
 import random
 import paho.mqtt.client as mqtt
 
+# Envelope header, see main/envelope.h
+ENVELOPE = struct.Struct('>BBBBIQI')
+FLAGS = {0x01: 'EXT', 0x02: 'RTR', 0x04: 'FD', 0x08: 'BRS', 0x10: 'ESI'}
+last_sequence = None
+
 def on_connect(client, userdata, flags, respons_code, properties):
 	print('connect {0} status {1}'.format(args.host, respons_code))
 	client.subscribe(args.topic)
 
 def on_message(client, userdata, msg):
+	global last_sequence
 	print('topic={}'.format(msg.topic))
-	print('payload={}'.format(msg.payload))
+	if not args.envelope or len(msg.payload) < ENVELOPE.size:
+		print('payload={}'.format(msg.payload))
+		return
+	version, flags, length, _, sequence, timestamp, canid = ENVELOPE.unpack_from(msg.payload, 0)
+	if version != 1:
+		print('payload={}'.format(msg.payload))
+		return
+	data = msg.payload[ENVELOPE.size:ENVELOPE.size+length]
+	names = ' '.join(name for bit, name in FLAGS.items() if flags & bit)
+	print('seq={} time={:.6f} id=0x{:X} {} data={}'.format(sequence, timestamp / 1e6, canid, names, data.hex()))
+	if last_sequence is not None and sequence != (last_sequence + 1) & 0xFFFFFFFF:
+		print('{} frames lost'.format((sequence - last_sequence - 1) & 0xFFFFFFFF))
+	last_sequence = sequence
 
 if __name__=='__main__':
 	parser = argparse.ArgumentParser()
 	parser.add_argument('--host', help='mqtt broker', default='broker.emqx.io')
 	parser.add_argument('--port', type=int, help='mqtt port', default=1883)
 	parser.add_argument('--topic', help='mqtt topic', default='/can/#')
+	parser.add_argument('--envelope', action='store_true', help='decode the envelope header')
 	args = parser.parse_args() 
 	print("args.host={}".format(args.host))
 	print("args.port={}".format(args.port))
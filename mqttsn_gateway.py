@@ -0,0 +1,188 @@
+#!/usr/bin/env python
+# -*- coding: utf-8 -*-
+#
+# Minimal MQTT-SN gateway for testing the MQTT-SN transport on a local network.
+# It prints every PUBLISH with its size and, with --broker, forwards messages to and from an MQTT broker.
+#
+# python3 -m pip install -U paho-mqtt
+# python3 -m pip install -U argparse
+
+import argparse
+import random
+import socket
+import struct
+import threading
+import time
+
+CONNECT = 0x04
+CONNACK = 0x05
+REGISTER = 0x0A
+REGACK = 0x0B
+PUBLISH = 0x0C
+PUBACK = 0x0D
+SUBSCRIBE = 0x12
+SUBACK = 0x13
+PINGREQ = 0x16
+PINGRESP = 0x17
+DISCONNECT = 0x18
+
+# UDP and IPv4 headers of each datagram
+UDP_OVERHEAD = 28
+
+class Client:
+	def __init__(self, address):
+		self.address = address
+		self.client_id = ''
+		self.topics = {}	# topic id -> name
+		self.filters = []	# subscribed topic filters
+		self.msg_id = 0
+		self.publish_count = 0
+		self.publish_bytes = 0
+		self.first_publish = None
+
+lock = threading.Lock()
+clients = {}
+topic_ids = {}	# topic name -> id, shared by all clients
+
+def packet(type, body):
+	length = len(body) + 2
+	if length <= 255:
+		return bytes([length, type]) + body
+	return struct.pack('>BHB', 0x01, length + 2, type) + body
+
+def topic_id(name):
+	if name not in topic_ids:
+		topic_ids[name] = len(topic_ids) + 1
+	return topic_ids[name]
+
+def matches(filter, topic):
+	filter_levels = filter.split('/')
+	topic_levels = topic.split('/')
+	for i, level in enumerate(filter_levels):
+		if level == '#':
+			return True
+		if i >= len(topic_levels):
+			return False
+		if level != '+' and level != topic_levels[i]:
+			return False
+	return len(filter_levels) == len(topic_levels)
+
+def send_publish(client, topic, payload):
+	if topic not in client.topics.values():
+		id = topic_id(topic)
+		client.topics[id] = topic
+		client.msg_id = (client.msg_id + 1) & 0xFFFF
+		sock.sendto(packet(REGISTER, struct.pack('>HH', id, client.msg_id) + topic.encode()), client.address)
+	id = topic_id(topic)
+	sock.sendto(packet(PUBLISH, struct.pack('>BHH', 0x00, id, 0) + payload), client.address)
+
+def on_publish(client, flags, id, msg_id, data, size):
+	topic = client.topics.get(id)
+	if topic is None:
+		print('{} unknown topic id {}'.format(client.client_id, id))
+		return
+	now = time.time()
+	if client.first_publish is None:
+		client.first_publish = now
+	client.publish_count += 1
+	client.publish_bytes += size + UDP_OVERHEAD
+	if args.verbose:
+		print('{:.6f} {} topic={} data={} packet={} bytes on air={} bytes'.format(now, client.client_id, topic, data.hex(), size, size + UDP_OVERHEAD))
+	if flags & 0x60 == 0x20:
+		sock.sendto(packet(PUBACK, struct.pack('>HHB', id, msg_id, 0)), client.address)
+	if broker is not None:
+		broker.publish(topic, data, qos=0, retain=bool(flags & 0x10))
+
+def handle(data, address):
+	if data[0] == 0x01:
+		length, type = struct.unpack_from('>HB', data, 1)
+		body = data[4:length]
+	else:
+		length, type = data[0], data[1]
+		body = data[2:length]
+	with lock:
+		client = clients.setdefault(address, Client(address))
+		if type == CONNECT:
+			client.client_id = body[4:].decode()
+			client.filters = []
+			print('CONNECT {} from {}'.format(client.client_id, address))
+			sock.sendto(packet(CONNACK, bytes([0])), address)
+		elif type == REGISTER:
+			_, msg_id = struct.unpack_from('>HH', body, 0)
+			name = body[4:].decode()
+			id = topic_id(name)
+			client.topics[id] = name
+			sock.sendto(packet(REGACK, struct.pack('>HHB', id, msg_id, 0)), address)
+		elif type == PUBLISH:
+			flags, id, msg_id = struct.unpack_from('>BHH', body, 0)
+			on_publish(client, flags, id, msg_id, body[5:], length)
+		elif type == SUBSCRIBE:
+			flags, msg_id = struct.unpack_from('>BH', body, 0)
+			filter = body[3:].decode()
+			client.filters.append(filter)
+			# A wildcard filter has no topic id, each match is registered before publishing
+			id = 0 if '+' in filter or '#' in filter else topic_id(filter)
+			if id != 0:
+				client.topics[id] = filter
+			print('SUBSCRIBE {} [{}] topic_id={}'.format(client.client_id, filter, id))
+			if broker is not None:
+				broker.subscribe(filter)
+			sock.sendto(packet(SUBACK, struct.pack('>BHHB', flags & 0x60, id, msg_id, 0)), address)
+		elif type == PINGREQ:
+			sock.sendto(packet(PINGRESP, b''), address)
+		elif type == DISCONNECT:
+			print('DISCONNECT {}'.format(client.client_id))
+			sock.sendto(packet(DISCONNECT, b''), address)
+
+def on_message(mqtt_client, userdata, msg):
+	with lock:
+		forward(msg.topic, msg.payload)
+
+def forward(topic, payload):
+	for client in clients.values():
+		if any(matches(filter, topic) for filter in client.filters):
+			send_publish(client, topic, payload)
+
+def report():
+	while True:
+		time.sleep(args.interval)
+		with lock:
+			if args.command is not None:
+				# Stands in for a command from the broker
+				topic, payload = args.command.split('=', 1)
+				forward(topic, bytes.fromhex(payload))
+			for client in clients.values():
+				if client.publish_count == 0:
+					continue
+				elapsed = max(time.time() - client.first_publish, 1e-6)
+				print('{} publish={} avg={:.1f} bytes on air rate={:.1f}/s'.format(client.client_id,
+					client.publish_count, client.publish_bytes / client.publish_count, client.publish_count / elapsed))
+
+if __name__=='__main__':
+	parser = argparse.ArgumentParser()
+	parser.add_argument('--port', type=int, help='udp port', default=1884)
+	parser.add_argument('--broker', help='forward to this mqtt broker')
+	parser.add_argument('--broker_port', type=int, help='mqtt port', default=1883)
+	parser.add_argument('--interval', type=int, help='statistics interval in seconds', default=10)
+	parser.add_argument('--command', help='send TOPIC=HEXDATA to matching subscribers every interval')
+	parser.add_argument('--verbose', action='store_true', help='print every PUBLISH')
+	args = parser.parse_args()
+	print("args.port={}".format(args.port))
+	print("args.broker={}".format(args.broker))
+
+	broker = None
+	if args.broker is not None:
+		import paho.mqtt.client as mqtt
+		client_id = f'python-mqttsn-{random.randint(0, 1000)}'
+		broker = mqtt.Client(mqtt.CallbackAPIVersion.VERSION2, client_id)
+		broker.on_message = on_message
+		broker.connect(args.broker, port=args.broker_port, keepalive=60)
+		broker.loop_start()
+
+	sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+	sock.bind(('0.0.0.0', args.port))
+	threading.Thread(target=report, daemon=True).start()
+	while True:
+		data, address = sock.recvfrom(65535)
+		if len(data) >= 2:
+			handle(data, address)
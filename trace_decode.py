@@ -0,0 +1,68 @@
+#!/usr/bin/env python
+# -*- coding: utf-8 -*-
+#
+# python3 -m pip install -U paho-mqtt
+# python3 -m pip install -U argparse
+#
+# Request a trace dump from the bridge and print it.
+# python3 trace_decode.py
+# python3 trace_decode.py --save trace.bin
+# python3 trace_decode.py --file trace.bin
+
+import argparse
+import struct
+import random
+import paho.mqtt.client as mqtt
+
+HEADER = struct.Struct('<4sHHI')
+RECORD = struct.Struct('<IHHII')
+
+EVENTS = ['', 'CAN_RX', 'MQTT_QUEUED', 'PUBLISH', 'PUBACK', 'MQTT_RX',
+	'TWAI_QUEUED', 'CAN_TX', 'MQTT_DROPPED', 'TWAI_DROPPED']
+
+def decode(payload):
+	magic, entries, record_size, head = HEADER.unpack_from(payload, 0)
+	if magic != b'TRC1' or record_size != RECORD.size:
+		print('not a trace dump')
+		return
+	count = min(head, entries)
+	print('{} records written, showing the last {}'.format(head, count))
+	first = None
+	for i in range(head - count, head):
+		offset = HEADER.size + (i % entries) * record_size
+		timestamp, event, length, canid, arg = RECORD.unpack_from(payload, offset)
+		if first is None: first = timestamp
+		# timestamp is the low 32 bits of the microsecond clock
+		delta = (timestamp - first) & 0xFFFFFFFF
+		name = EVENTS[event] if event < len(EVENTS) else str(event)
+		if arg >= 0x80000000: arg -= 0x100000000
+		print('{:12.6f} {:<12} id=0x{:08X} len={:<2} arg={}'.format(delta / 1e6, name, canid, length, arg))
+
+def on_connect(client, userdata, flags, respons_code, properties):
+	client.subscribe(args.topic + '/dump')
+	client.publish(args.topic, b'')
+
+def on_message(client, userdata, msg):
+	if args.save:
+		with open(args.save, 'wb') as f: f.write(msg.payload)
+	decode(msg.payload)
+	client.disconnect()
+
+if __name__=='__main__':
+	parser = argparse.ArgumentParser()
+	parser.add_argument('--host', help='mqtt broker', default='broker.emqx.io')
+	parser.add_argument('--port', type=int, help='mqtt port', default=1883)
+	parser.add_argument('--topic', help='mqtt trace topic', default='/can/trace')
+	parser.add_argument('--file', help='decode a saved dump')
+	parser.add_argument('--save', help='save the dump to a file')
+	args = parser.parse_args()
+
+	if args.file:
+		with open(args.file, 'rb') as f: decode(f.read())
+	else:
+		client_id = f'python-mqtt-{random.randint(0, 1000)}'
+		client = mqtt.Client(mqtt.CallbackAPIVersion.VERSION2, client_id)
+		client.on_connect = on_connect
+		client.on_message = on_message
+		client.connect(args.host, port=args.port, keepalive=60)
+		client.loop_forever()